@@ -0,0 +1,298 @@
+// Times the control path of usb_driver.c against the simulated amp and
+// compares the results with a stored baseline, like the on-device
+// benchmark in main/benchmark.c. Each metric is printed as a BENCH {...}
+// JSON line, followed by BENCH_RESULT {...}. Exits with 1 if a metric is
+// more than BENCHMARK_TOLERANCE_PERCENT slower than its baseline, or if
+// it has no baseline. --store-baseline writes the results to FILE
+// instead.
+//
+//   control_path_bench --baseline FILE [--store-baseline]
+//
+// Built with BENCHMARK_JSON, which CMakeLists.txt defines if it finds
+// cJSON, the state serialization and command parsing of web_server.c are
+// timed as well.
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "benchmark.h"
+#include "driver_harness.h"
+#include "esp_timer.h"
+#include "fake_amp.h"
+#include "freertos/task.h"
+#ifdef BENCHMARK_JSON
+#include "web_server.h"
+#endif
+
+// Looser than on the device, the host shares its cores with other work.
+#define BENCHMARK_TOLERANCE_PERCENT 50
+// The best of the rounds counts, the others had interruptions.
+#define MICRO_ROUNDS 10
+// Commands at a fixed rate, each waits for the previous round trip.
+#define LOAD_COMMANDS 200
+#define LOAD_INTERVAL_US 10000
+#define ROUND_TRIP_TIMEOUT_US 1000000
+
+typedef enum {
+  BENCH_STATE_DECODE,
+  BENCH_PACKET_ENCODE,
+#ifdef BENCHMARK_JSON
+  BENCH_STATE_SERIALIZE,
+  BENCH_COMMAND_PARSE,
+#endif
+  // From enqueue_command until the amp applied the packet, through the
+  // command queue and the driver task.
+  BENCH_COMMAND_HANDOFF,
+  // From enqueue_command until the state acknowledges the command.
+  BENCH_ROUND_TRIP,
+  BENCH_ROUND_TRIP_P95,
+  BENCH_METRIC_COUNT
+} bench_metric_t;
+
+static const char *metric_names[BENCH_METRIC_COUNT] = {
+    "state_decode",
+    "packet_encode",
+#ifdef BENCHMARK_JSON
+    "state_serialize",
+    "command_parse",
+#endif
+    "command_handoff",
+    "round_trip",
+    "round_trip_p95",
+};
+
+#ifdef BENCHMARK_JSON
+static const char *bench_command =
+    "{\"action\":\"set_volume\",\"value\":-30,\"client\":1,\"seq\":2}";
+static StaticTask_t web_server_task_buffer;
+#endif
+
+typedef struct {
+  uint32_t client;
+  uint32_t seq;
+} ack_wait_t;
+
+static uint32_t micro_ns_per_op(bench_metric_t metric) {
+  state_delta_t delta = {.actions = (1 << ACTION_SET_VOLUME) |
+                                    (1 << ACTION_SET_MUTE)};
+  delta.values[ACTION_SET_VOLUME] = -30;
+  uint8_t packet[64];
+  state_t state;
+  get_state(&state);
+  // Each round takes about as long for every metric.
+  int iterations = metric == BENCH_STATE_DECODE ||
+                           metric == BENCH_PACKET_ENCODE
+                       ? 1000000
+                       : 10000;
+  uint32_t best_ns = UINT32_MAX;
+  for (int round = 0; round < MICRO_ROUNDS; round++) {
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < iterations; i++) {
+      switch (metric) {
+        case BENCH_STATE_DECODE:
+          get_state(&state);
+          break;
+#ifdef BENCHMARK_JSON
+        case BENCH_STATE_SERIALIZE:
+          benchmark_serialize_state(&state);
+          break;
+        case BENCH_COMMAND_PARSE:
+          benchmark_parse_command(bench_command);
+          break;
+#endif
+        default:
+          benchmark_encode_packet(packet, &delta);
+          break;
+      }
+    }
+    int64_t elapsed_us = esp_timer_get_time() - start;
+    uint32_t ns = (uint32_t)(elapsed_us * 1000 / iterations);
+    if (ns < best_ns) best_ns = ns;
+  }
+  return best_ns;
+}
+
+#ifdef BENCHMARK_JSON
+// The hooks use the mutexes and arenas web_server_task sets up. Without a
+// network its server doesn't start and it ends right away.
+static bool start_web_server(void) {
+  TaskHandle_t task = xTaskCreateStatic(
+      web_server_task, "web_server", WEB_SERVER_TASK_STACK_SIZE, NULL, 5,
+      NULL, &web_server_task_buffer);
+  if (task == NULL) return false;
+  for (int i = 0; i < 500 && eTaskGetState(task) != eDeleted; i++) {
+    vTaskDelay(1);
+  }
+  if (eTaskGetState(task) != eDeleted) {
+    printf("FAIL web_server_task didn't finish.\n");
+    return false;
+  }
+  if (!benchmark_parse_command(bench_command)) {
+    printf("FAIL the benchmark command doesn't parse.\n");
+    return false;
+  }
+  return true;
+}
+#endif
+
+static bool is_acked(const state_t *state, void *arg) {
+  const ack_wait_t *wait = arg;
+  command_tag_t ack = state->acks[ACTION_SET_VOLUME];
+  return ack.client == wait->client && ack.seq == wait->seq;
+}
+
+static int compare_int64(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a;
+  int64_t y = *(const int64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static void sleep_until(int64_t time_us) {
+  int64_t wait_us = time_us - esp_timer_get_time();
+  if (wait_us <= 0) return;
+  struct timespec delay = {.tv_sec = wait_us / 1000000,
+                           .tv_nsec = (wait_us % 1000000) * 1000};
+  nanosleep(&delay, NULL);
+}
+
+// Sends volume commands at a fixed rate. False if one got lost.
+static bool measure_load(int subscriber, uint32_t *results) {
+  static int64_t handoff_us[LOAD_COMMANDS];
+  static int64_t round_trip_us[LOAD_COMMANDS];
+  int64_t next_us = esp_timer_get_time();
+  for (int i = 0; i < LOAD_COMMANDS; i++) {
+    sleep_until(next_us);
+    next_us += LOAD_INTERVAL_US;
+    ack_wait_t wait = {.client = 1, .seq = i + 1};
+    // The firmware origin is never throttled.
+    control_action_t command = {
+        .action = ACTION_SET_VOLUME,
+        .value = i % 2 ? -31 : -30,
+        .tag = {.client = wait.client, .seq = wait.seq},
+        .origin = {.type = ORIGIN_FIRMWARE},
+    };
+    uint32_t sets = fake_amp_sets();
+    int64_t start = esp_timer_get_time();
+    if (enqueue_command(command) != COMMAND_QUEUED ||
+        !fake_amp_wait_sets(sets + 1, ROUND_TRIP_TIMEOUT_US)) {
+      printf("FAIL command %d never reached the amp.\n", i);
+      return false;
+    }
+    handoff_us[i] = esp_timer_get_time() - start;
+    if (!driver_harness_wait(subscriber, is_acked, &wait,
+                             ROUND_TRIP_TIMEOUT_US)) {
+      printf("FAIL command %d never acknowledged.\n", i);
+      return false;
+    }
+    round_trip_us[i] = esp_timer_get_time() - start;
+  }
+  qsort(handoff_us, LOAD_COMMANDS, sizeof(int64_t), compare_int64);
+  qsort(round_trip_us, LOAD_COMMANDS, sizeof(int64_t), compare_int64);
+  results[BENCH_COMMAND_HANDOFF] = handoff_us[LOAD_COMMANDS / 2] * 1000;
+  results[BENCH_ROUND_TRIP] = round_trip_us[LOAD_COMMANDS / 2] * 1000;
+  results[BENCH_ROUND_TRIP_P95] =
+      round_trip_us[LOAD_COMMANDS * 95 / 100] * 1000;
+  return true;
+}
+
+// One "name ns_per_op" line per metric, false if there is no file.
+static bool load_baseline(const char *path, uint32_t *baseline) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) return false;
+  for (int i = 0; i < BENCH_METRIC_COUNT; i++) baseline[i] = 0;
+  char name[32];
+  uint32_t ns;
+  while (fscanf(file, "%31s %" SCNu32, name, &ns) == 2) {
+    for (int i = 0; i < BENCH_METRIC_COUNT; i++) {
+      if (strcmp(name, metric_names[i]) == 0) baseline[i] = ns;
+    }
+  }
+  fclose(file);
+  return true;
+}
+
+static bool store_baseline(const char *path, const uint32_t *results) {
+  FILE *file = fopen(path, "w");
+  if (file == NULL) return false;
+  for (int i = 0; i < BENCH_METRIC_COUNT; i++) {
+    fprintf(file, "%s %" PRIu32 "\n", metric_names[i], results[i]);
+  }
+  return fclose(file) == 0;
+}
+
+int main(int argc, char **argv) {
+  const char *baseline_path = NULL;
+  bool store = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+      baseline_path = argv[++i];
+    } else if (strcmp(argv[i], "--store-baseline") == 0) {
+      store = true;
+    } else {
+      fprintf(stderr, "Usage: %s --baseline FILE [--store-baseline]\n",
+              argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (baseline_path == NULL) {
+    fprintf(stderr, "No baseline file given.\n");
+    return EXIT_FAILURE;
+  }
+
+  uint32_t baseline[BENCH_METRIC_COUNT] = {0};
+  if (!store && !load_baseline(baseline_path, baseline)) {
+    fprintf(stderr, "No baseline in %s, store one with --store-baseline.\n",
+            baseline_path);
+    return EXIT_FAILURE;
+  }
+
+  int subscriber = driver_harness_start();
+  if (subscriber < 0) return EXIT_FAILURE;
+  // Only the firmware is timed, not the link.
+  fake_amp_set_latency_us(0);
+  uint32_t results[BENCH_METRIC_COUNT];
+  results[BENCH_STATE_DECODE] = micro_ns_per_op(BENCH_STATE_DECODE);
+  results[BENCH_PACKET_ENCODE] = micro_ns_per_op(BENCH_PACKET_ENCODE);
+  if (!measure_load(subscriber, results)) return EXIT_FAILURE;
+#ifdef BENCHMARK_JSON
+  // Started after the load, its idle workers would add wakeups to every
+  // queue change of the port.
+  if (!start_web_server()) return EXIT_FAILURE;
+  results[BENCH_STATE_SERIALIZE] = micro_ns_per_op(BENCH_STATE_SERIALIZE);
+  results[BENCH_COMMAND_PARSE] = micro_ns_per_op(BENCH_COMMAND_PARSE);
+#endif
+
+  int regressions = 0;
+  int missing = 0;
+  for (int i = 0; i < BENCH_METRIC_COUNT; i++) {
+    bool regressed = !store && baseline[i] > 0 &&
+                     (uint64_t)results[i] * 100 >
+                         (uint64_t)baseline[i] *
+                             (100 + BENCHMARK_TOLERANCE_PERCENT);
+    if (regressed) regressions++;
+    if (!store && baseline[i] == 0) {
+      fprintf(stderr, "No baseline for %s in %s.\n", metric_names[i],
+              baseline_path);
+      missing++;
+    }
+    printf("BENCH {\"name\":\"%s\",\"ns_per_op\":%" PRIu32
+           ",\"baseline_ns\":%" PRIu32 ",\"regressed\":%s}\n",
+           metric_names[i], results[i], baseline[i],
+           regressed ? "true" : "false");
+  }
+  if (store) {
+    if (!store_baseline(baseline_path, results)) {
+      fprintf(stderr, "Can't write %s.\n", baseline_path);
+      return EXIT_FAILURE;
+    }
+    fprintf(stderr, "Stored results as new baseline in %s.\n",
+            baseline_path);
+  }
+  bool pass = regressions == 0 && missing == 0;
+  printf("BENCH_RESULT {\"regressions\":%d,\"missing\":%d,\"pass\":%s}\n",
+         regressions, missing, pass ? "true" : "false");
+  return pass ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,315 @@
+// Detaches the amp in the middle of command bursts and attaches it again,
+// with the first opens of the device failing. Commands sent before the
+// detach are lost in flight, the ones after it are deferred. After the
+// reconnect:
+// - The amp and the driver's state must have the last value of every field.
+// - Each lost intent is replayed exactly once: one set packet per replayed
+//   command, at least one per field the amp missed, and nothing replayed
+//   again later. A volume before a preset change isn't replayed after it.
+// - The failed opens were retried with backoff, without giving up.
+// - The time from attach to the first amp state was recorded, including the
+//   backoff.
+//
+//   disconnect_replay_test [rounds] [seed]
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "driver_harness.h"
+#include "esp_timer.h"
+#include "fake_amp.h"
+
+#define AMP_LATENCY_US 2000
+// While the burst is sent before the detach, so its packets are still in
+// flight when the amp goes away.
+#define SLOW_LATENCY_US 50000
+// One command per field: mute, volume and preset.
+#define MAX_COMMANDS 3
+// Like OPEN_MAX_ATTEMPTS - 1 and OPEN_RETRY_BASE_MS in usb_driver.c.
+#define MAX_FAILED_OPENS 2
+#define OPEN_RETRY_BASE_US 100000
+#define TIMEOUT_US 5000000
+// Anything sent after the amp matched would have landed by then.
+#define QUIET_US 200000
+#define PRESET_VOLUME_DB -3
+
+typedef struct {
+  int preset;
+  int volume_db;
+  bool muted;
+} fields_t;
+
+static uint32_t seed;
+static int round_index;
+
+static uint32_t next_random(uint32_t *state) {
+  // xorshift32
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+static void sleep_us(int64_t us) {
+  struct timespec delay = {.tv_sec = us / 1000000,
+                           .tv_nsec = (us % 1000000) * 1000};
+  nanosleep(&delay, NULL);
+}
+
+// The layout of the amp's state packet, see state_confirms().
+static fields_t amp_fields(void) {
+  uint8_t state[FAKE_AMP_PACKET_SIZE];
+  fake_amp_get_state(state);
+  return (fields_t){
+      .preset = state[2],
+      .volume_db = (int16_t)((state[4] << 8) | state[3]) / 100,
+      .muted = state[6] & 0x80,
+  };
+}
+
+static bool fields_equal(fields_t a, fields_t b) {
+  return a.preset == b.preset && a.volume_db == b.volume_db &&
+         a.muted == b.muted;
+}
+
+static bool amp_matches(const state_t *state, void *arg) {
+  const fields_t *expected = arg;
+  fields_t reported = {.preset = state->preset,
+                       .volume_db = (int)state->volume_db,
+                       .muted = state->is_muted};
+  return is_device_connected() && fields_equal(amp_fields(), *expected) &&
+         fields_equal(reported, *expected);
+}
+
+static bool is_disconnected(const state_t *state, void *arg) {
+  (void)state;
+  (void)arg;
+  return !is_device_connected();
+}
+
+static bool fail(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+static bool fail(const char *format, ...) {
+  printf("FAIL round %d (seed 0x%" PRIx32 "): ", round_index, seed);
+  va_list args;
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+  printf("\n");
+  return false;
+}
+
+// Each field once at most, so every lost command is a separate intent.
+static control_action_t random_command(uint32_t *rng, uint32_t *used) {
+  static const control_action_t commands[] = {
+      {.action = ACTION_SET_MUTE},
+      {.action = ACTION_SET_VOLUME},
+      {.action = ACTION_SET_PRESET},
+  };
+  control_action_t command;
+  do {
+    command = commands[next_random(rng) % 3];
+  } while (*used & (1 << command.action));
+  *used |= 1 << command.action;
+  command.origin.type = ORIGIN_FIRMWARE;
+  switch (command.action) {
+    case ACTION_SET_MUTE:
+      command.value = next_random(rng) % 2;
+      break;
+    case ACTION_SET_VOLUME:
+      command.value = -10 - (int)(next_random(rng) % 50);
+      break;
+    default:
+      command.value = 1 + next_random(rng) % 3;
+      break;
+  }
+  return command;
+}
+
+// Applies an accepted command like the amp does.
+static void apply(fields_t *fields, control_action_t command) {
+  switch (command.action) {
+    case ACTION_SET_MUTE:
+      fields->muted = command.value != 0;
+      break;
+    case ACTION_SET_VOLUME:
+      fields->volume_db = command.value;
+      break;
+    default:
+      fields->preset = command.value;
+      fields->volume_db = PRESET_VOLUME_DB;
+      break;
+  }
+}
+
+// Whether the amp already has what the command asked for.
+static bool amp_has(fields_t amp, control_action_t command) {
+  switch (command.action) {
+    case ACTION_SET_MUTE:
+      return amp.muted == (command.value != 0);
+    case ACTION_SET_VOLUME:
+      return amp.volume_db == command.value;
+    default:
+      return amp.preset == command.value;
+  }
+}
+
+static bool superseded(const control_action_t *sent, int length, int i) {
+  if (sent[i].action != ACTION_SET_VOLUME) return false;
+  for (int j = i + 1; j < length; j++) {
+    if (sent[j].action == ACTION_SET_PRESET) return true;
+  }
+  return false;
+}
+
+static bool run_round(int subscriber, uint32_t *rng, fields_t *expected) {
+  usb_stats_t before;
+  get_usb_stats(&before);
+  uint32_t used = 0;
+  int length = 2 + next_random(rng) % (MAX_COMMANDS - 1);
+  int detach_after = 1 + next_random(rng) % (length - 1);
+  control_action_t sent[MAX_COMMANDS];
+
+  fake_amp_set_latency_us(SLOW_LATENCY_US);
+  for (int i = 0; i < length; i++) {
+    if (i == detach_after) {
+      fake_amp_detach();
+      if (!driver_harness_wait(subscriber, is_disconnected, NULL,
+                               TIMEOUT_US)) {
+        return fail("driver didn't notice the detach.");
+      }
+    }
+    sent[i] = random_command(rng, &used);
+    command_result_t result = enqueue_command(sent[i]);
+    command_result_t wanted = i < detach_after ? COMMAND_QUEUED
+                                               : COMMAND_DEFERRED;
+    if (result != wanted) {
+      return fail("command %d got result %d, not %d.", i, result, wanted);
+    }
+    apply(expected, sent[i]);
+  }
+  fields_t at_detach = amp_fields();
+  fake_amp_set_latency_us(AMP_LATENCY_US);
+
+  // At least one of the commands. A volume before a preset change isn't
+  // missed, the preset change resets it.
+  int missed = 0;
+  for (int i = 0; i < length; i++) {
+    if (!amp_has(at_detach, sent[i]) && !superseded(sent, length, i)) {
+      missed++;
+    }
+  }
+  int failed_opens = 1 + round_index % MAX_FAILED_OPENS;
+  int64_t backoff_us = 0;
+  for (int i = 0; i < failed_opens; i++) backoff_us += OPEN_RETRY_BASE_US << i;
+  fake_amp_fail_opens(failed_opens);
+  uint32_t sets = fake_amp_sets();
+  int64_t attach_us = esp_timer_get_time();
+  fake_amp_attach();
+  if (!driver_harness_wait(subscriber, amp_matches, expected, TIMEOUT_US)) {
+    fields_t amp = amp_fields();
+    return fail("amp has preset %d, %d dB, %s, expected preset %d, %d dB, "
+                "%s.",
+                amp.preset, amp.volume_db, amp.muted ? "muted" : "unmuted",
+                expected->preset, expected->volume_db,
+                expected->muted ? "muted" : "unmuted");
+  }
+  int64_t synced_us = esp_timer_get_time() - attach_us;
+  sleep_us(QUIET_US);
+
+  usb_stats_t after;
+  get_usb_stats(&after);
+  uint32_t replayed = after.replayed_commands - before.replayed_commands;
+  uint32_t replay_sets = fake_amp_sets() - sets;
+  if (replayed < (uint32_t)missed || replayed > (uint32_t)length) {
+    return fail("%" PRIu32 " commands replayed, the amp missed %d of %d.",
+                replayed, missed, length);
+  }
+  if (replay_sets != replayed) {
+    return fail("%" PRIu32 " set packets for %" PRIu32 " replayed commands.",
+                replay_sets, replayed);
+  }
+  if (after.open_retries - before.open_retries != (uint32_t)failed_opens ||
+      after.open_failures != before.open_failures ||
+      after.reconnects - before.reconnects != 1) {
+    return fail("%" PRIu32 " open retries, %" PRIu32 " failures and %" PRIu32
+                " reconnects, expected %d, 0 and 1.",
+                after.open_retries - before.open_retries,
+                after.open_failures - before.open_failures,
+                after.reconnects - before.reconnects, failed_opens);
+  }
+  if (after.last_resync_us < backoff_us || after.last_resync_us > synced_us ||
+      after.max_resync_us < after.last_resync_us) {
+    return fail("resynced after %lld ms, the backoff took %lld ms and the "
+                "state matched after %lld ms.",
+                (long long)after.last_resync_us / 1000,
+                (long long)backoff_us / 1000, (long long)synced_us / 1000);
+  }
+  return true;
+}
+
+// With nothing pending, neither time nor a reconnect replays anything.
+static bool check_no_replays(int subscriber, const fields_t *expected) {
+  usb_stats_t before;
+  get_usb_stats(&before);
+  uint32_t sets = fake_amp_sets();
+  sleep_us(QUIET_US);
+  fake_amp_detach();
+  if (!driver_harness_wait(subscriber, is_disconnected, NULL, TIMEOUT_US)) {
+    return fail("driver didn't notice the detach.");
+  }
+  fake_amp_attach();
+  if (!driver_harness_wait(subscriber, amp_matches, (void *)expected,
+                           TIMEOUT_US)) {
+    return fail("amp state changed over a reconnect.");
+  }
+  sleep_us(QUIET_US);
+  usb_stats_t after;
+  get_usb_stats(&after);
+  if (after.replayed_commands != before.replayed_commands ||
+      fake_amp_sets() != sets) {
+    return fail("%" PRIu32 " commands replayed again, %" PRIu32
+                " set packets.",
+                after.replayed_commands - before.replayed_commands,
+                fake_amp_sets() - sets);
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  int rounds = argc > 1 ? atoi(argv[1]) : 20;
+  seed = argc > 2 ? strtoul(argv[2], NULL, 0) : 0x5eed;
+  uint32_t rng = seed != 0 ? seed : 1;
+  int subscriber = driver_harness_start();
+  if (subscriber < 0) return EXIT_FAILURE;
+  fake_amp_set_latency_us(AMP_LATENCY_US);
+
+  fields_t expected = amp_fields();
+  int failed = 0;
+  for (round_index = 0; round_index < rounds; round_index++) {
+    if (!run_round(subscriber, &rng, &expected)) {
+      failed++;
+      // Go on from what the amp has, once the driver has it too.
+      expected = amp_fields();
+      if (!driver_harness_wait(subscriber, amp_matches, &expected,
+                               TIMEOUT_US)) {
+        break;
+      }
+    }
+  }
+  if (!check_no_replays(subscriber, &expected)) failed++;
+
+  usb_stats_t stats;
+  get_usb_stats(&stats);
+  printf("%" PRIu32 " commands replayed over %" PRIu32 " reconnects, "
+         "resync up to %lld ms.\n",
+         stats.replayed_commands, stats.reconnects,
+         (long long)stats.max_resync_us / 1000);
+  printf("%d of %d rounds failed.\n", failed, rounds);
+  bool passed = failed == 0;
+  if (!driver_harness_check_stack()) passed = false;
+  return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,74 @@
+#include "driver_harness.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "esp_timer.h"
+#include "fake_amp.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "power.h"
+#include "state_bus.h"
+
+#define START_TIMEOUT_US 2000000
+
+static StaticTask_t driver_task;
+
+bool driver_harness_wait(int subscriber,
+                         bool (*done)(const state_t *state, void *arg),
+                         void *arg, int64_t timeout_us) {
+  int64_t deadline_us = esp_timer_get_time() + timeout_us;
+  while (true) {
+    state_t state;
+    get_state(&state);
+    if (done(&state, arg)) return true;
+    int64_t wait_us = deadline_us - esp_timer_get_time();
+    if (wait_us <= 0) return false;
+    // At least one tick, the state is checked again after it.
+    state_event_t event;
+    TickType_t wait = pdMS_TO_TICKS(wait_us / 1000);
+    state_bus_receive(subscriber, &event, wait > 0 ? wait : 1);
+  }
+}
+
+static bool is_synced(const state_t *state, void *arg) {
+  (void)arg;
+  // The amp never reports preset 0.
+  return is_device_connected() && state->preset != 0;
+}
+
+bool driver_harness_wait_connected(int subscriber, int64_t timeout_us) {
+  return driver_harness_wait(subscriber, is_synced, NULL, timeout_us);
+}
+
+int driver_harness_start(void) {
+  power_init();
+  state_bus_init();
+  // Before the driver starts, to not miss the first state.
+  int subscriber = state_bus_subscribe("driver_harness");
+  usb_driver_init();
+  if (xTaskCreateStatic(usb_driver_task, "driver", USB_DRIVER_TASK_STACK_SIZE,
+                        NULL, 5, NULL, &driver_task) == NULL) {
+    return -1;
+  }
+  fake_amp_attach();
+  if (!driver_harness_wait_connected(subscriber, START_TIMEOUT_US)) {
+    printf("FAIL amp state not received after %d ms.\n",
+           START_TIMEOUT_US / 1000);
+    return -1;
+  }
+  return subscriber;
+}
+
+bool driver_harness_check_stack(void) {
+  uint32_t peak = port_task_stack_peak(&driver_task);
+  uint32_t needed = USB_DRIVER_TASK_STACK_HEADROOM(peak);
+  printf("Driver stack peak %" PRIu32 " bytes, %" PRIu32
+         " with headroom, of %d.\n",
+         peak, needed, USB_DRIVER_TASK_STACK_SIZE);
+  if (needed > USB_DRIVER_TASK_STACK_SIZE) {
+    printf("FAIL USB_DRIVER_TASK_STACK_SIZE is too small.\n");
+    return false;
+  }
+  return true;
+}
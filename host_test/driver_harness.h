@@ -0,0 +1,27 @@
+#ifndef DRIVER_HARNESS_H
+#define DRIVER_HARNESS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "usb_driver.h"
+
+// Runs usb_driver_task as a task against the simulated amp, like
+// main.c does on the device. The driver's state is global, so once per
+// process.
+
+// Returns the state bus subscriber, -1 if the driver didn't get the amp's
+// state in time.
+int driver_harness_start(void);
+// Waits for state events until done returns true for the driver's state,
+// false on timeout.
+bool driver_harness_wait(int subscriber,
+                         bool (*done)(const state_t *state, void *arg),
+                         void *arg, int64_t timeout_us);
+// Waits until the amp is attached and its state received again.
+bool driver_harness_wait_connected(int subscriber, int64_t timeout_us);
+// False if the driver task's stack peak so far plus its headroom is over
+// USB_DRIVER_TASK_STACK_SIZE. Call at the end of a test.
+bool driver_harness_check_stack(void);
+
+#endif  // DRIVER_HARNESS_H
@@ -0,0 +1,97 @@
+// Leaves the driver idle against the simulated amp, without commands or
+// state changes, and counts the wakeups of its task:
+// - No wakeup may time out with nothing to do. Its event timeout must be
+//   the next refresh, not a poll interval.
+// - The refreshes must follow the backoff towards REFRESH_IDLE_MS, doubling
+//   the interval after each unchanged state.
+// - Each refresh may cost a few wakeups for its transfers, nothing else may
+//   wake the task.
+//
+//   idle_wakeup_test [seconds]
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "driver_harness.h"
+#include "fake_amp.h"
+#include "power.h"
+
+#define AMP_LATENCY_US 2000
+// Like REFRESH_IDLE_MS in usb_driver.c.
+#define REFRESH_IDLE_MS 10000
+// Sending the request, its OUT callback and the state it is answered with.
+#define WAKEUPS_PER_REFRESH 3
+
+static void sleep_us(int64_t us) {
+  struct timespec delay = {.tv_sec = us / 1000000,
+                           .tv_nsec = (us % 1000000) * 1000};
+  nanosleep(&delay, NULL);
+}
+
+// The most refreshes the backoff allows within idle_ms, starting from the
+// interval scheduled when the driver went idle.
+static uint32_t max_refreshes(uint32_t interval_ms, int64_t idle_ms) {
+  uint32_t refreshes = 0;
+  for (int64_t at_ms = interval_ms; at_ms <= idle_ms; at_ms += interval_ms) {
+    refreshes++;
+    interval_ms = interval_ms * 2 > REFRESH_IDLE_MS ? REFRESH_IDLE_MS
+                                                    : interval_ms * 2;
+  }
+  return refreshes;
+}
+
+int main(int argc, char **argv) {
+  int seconds = argc > 1 ? atoi(argv[1]) : 5;
+  int subscriber = driver_harness_start();
+  if (subscriber < 0) return EXIT_FAILURE;
+  fake_amp_set_latency_us(AMP_LATENCY_US);
+
+  usb_stats_t before;
+  get_usb_stats(&before);
+  wakeup_stats_t wakeups_before[WAKEUP_TASK_COUNT];
+  wakeup_stats(wakeups_before);
+  sleep_us((int64_t)seconds * 1000000);
+  usb_stats_t after;
+  get_usb_stats(&after);
+  wakeup_stats_t wakeups_after[WAKEUP_TASK_COUNT];
+  wakeup_stats(wakeups_after);
+
+  uint32_t wakeups = wakeups_after[WAKEUP_USB_DRIVER].wakeups -
+                     wakeups_before[WAKEUP_USB_DRIVER].wakeups;
+  uint32_t idle = wakeups_after[WAKEUP_USB_DRIVER].idle -
+                  wakeups_before[WAKEUP_USB_DRIVER].idle;
+  uint32_t refreshes = after.refreshes - before.refreshes;
+  // The first refresh may be due right away.
+  uint32_t allowed_refreshes =
+      max_refreshes(before.refresh_interval_ms, seconds * 1000) + 1;
+  printf("%" PRIu32 " wakeups in %d s, %" PRIu32 " of them idle, for %" PRIu32
+         " refreshes, up to %" PRIu32 " ms apart.\n",
+         wakeups, seconds, idle, refreshes, after.refresh_interval_ms);
+
+  bool passed = true;
+  if (idle > 0) {
+    printf("FAIL %" PRIu32 " wakeups timed out with nothing to do.\n", idle);
+    passed = false;
+  }
+  if (refreshes > allowed_refreshes ||
+      after.refresh_interval_ms > REFRESH_IDLE_MS) {
+    printf("FAIL %" PRIu32 " refreshes, the backoff from %" PRIu32
+           " ms to %d ms allows %" PRIu32 ".\n",
+           refreshes, before.refresh_interval_ms, REFRESH_IDLE_MS,
+           allowed_refreshes);
+    passed = false;
+  }
+  if (wakeups > refreshes * WAKEUPS_PER_REFRESH) {
+    printf("FAIL %" PRIu32 " wakeups, more than %d per refresh.\n", wakeups,
+           WAKEUPS_PER_REFRESH);
+    passed = false;
+  }
+  if (after.refresh_changes != before.refresh_changes) {
+    printf("FAIL the amp state changed while idle.\n");
+    passed = false;
+  }
+  if (!driver_harness_check_stack()) passed = false;
+  return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
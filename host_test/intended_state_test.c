@@ -0,0 +1,192 @@
+// Fires bursts of interleaved mute, volume and preset commands at the
+// driver, faster than the simulated amp echoes them, so several packets are
+// built before the amp confirmed the previous ones. After each burst, the
+// amp and the driver's state must end up with the last accepted value of
+// every field:
+// - A packet must not revert a field of an earlier command the amp didn't
+//   echo yet.
+// - A mute which overtook queued commands must not be undone by an older
+//   unmute.
+// - A preset change resets the volume, a later volume command wins.
+//
+//   intended_state_test [bursts] [seed]
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "driver_harness.h"
+#include "esp_timer.h"
+#include "fake_amp.h"
+
+// Each packet takes this long on the link and its echo comes later, so the
+// next packets are built before it.
+#define AMP_LATENCY_US 2000
+#define ECHO_DELAY_US 5000
+#define MAX_BURST 8
+// The amp must match within the hold time of the intended state.
+#define SETTLE_TIMEOUT_US 1000000
+// Anything still in flight would have landed by then.
+#define QUIET_US (MAX_BURST * AMP_LATENCY_US * 2 + ECHO_DELAY_US)
+#define PRESET_VOLUME_DB -3
+
+typedef struct {
+  int preset;
+  int volume_db;
+  bool muted;
+} fields_t;
+
+static uint32_t seed;
+static int burst_index;
+
+static uint32_t next_random(uint32_t *state) {
+  // xorshift32
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+static void sleep_us(int64_t us) {
+  struct timespec delay = {.tv_sec = us / 1000000,
+                           .tv_nsec = (us % 1000000) * 1000};
+  nanosleep(&delay, NULL);
+}
+
+// The layout of the amp's state packet, see state_confirms().
+static fields_t amp_fields(void) {
+  uint8_t state[FAKE_AMP_PACKET_SIZE];
+  fake_amp_get_state(state);
+  return (fields_t){
+      .preset = state[2],
+      .volume_db = (int16_t)((state[4] << 8) | state[3]) / 100,
+      .muted = state[6] & 0x80,
+  };
+}
+
+static fields_t driver_fields(const state_t *state) {
+  return (fields_t){.preset = state->preset,
+                    .volume_db = (int)state->volume_db,
+                    .muted = state->is_muted};
+}
+
+static bool fields_equal(fields_t a, fields_t b) {
+  return a.preset == b.preset && a.volume_db == b.volume_db &&
+         a.muted == b.muted;
+}
+
+static bool amp_matches(const state_t *state, void *arg) {
+  const fields_t *expected = arg;
+  return fields_equal(amp_fields(), *expected) &&
+         fields_equal(driver_fields(state), *expected);
+}
+
+static void report(const char *what, fields_t actual, fields_t expected) {
+  printf("FAIL burst %d (seed 0x%" PRIx32 "): %s preset %d, %d dB, %s, "
+         "expected preset %d, %d dB, %s.\n",
+         burst_index, seed, what, actual.preset, actual.volume_db,
+         actual.muted ? "muted" : "unmuted", expected.preset,
+         expected.volume_db, expected.muted ? "muted" : "unmuted");
+}
+
+static control_action_t random_command(uint32_t *rng) {
+  control_action_t command = {.origin = {.type = ORIGIN_FIRMWARE}};
+  switch (next_random(rng) % 3) {
+    case 0:
+      command.action = ACTION_SET_MUTE;
+      command.value = next_random(rng) % 2;
+      break;
+    case 1:
+      command.action = ACTION_SET_VOLUME;
+      command.value = -10 - (int)(next_random(rng) % 50);
+      break;
+    default:
+      command.action = ACTION_SET_PRESET;
+      command.value = 1 + next_random(rng) % 3;
+      break;
+  }
+  return command;
+}
+
+// Applies an accepted command like the amp does.
+static void apply(fields_t *fields, control_action_t command) {
+  switch (command.action) {
+    case ACTION_SET_MUTE:
+      fields->muted = command.value != 0;
+      break;
+    case ACTION_SET_VOLUME:
+      fields->volume_db = command.value;
+      break;
+    default:
+      fields->preset = command.value;
+      fields->volume_db = PRESET_VOLUME_DB;
+      break;
+  }
+}
+
+static bool run_burst(int subscriber, uint32_t *rng, fields_t *expected) {
+  int length = 2 + next_random(rng) % (MAX_BURST - 1);
+  for (int i = 0; i < length; i++) {
+    control_action_t command = random_command(rng);
+    // A full queue rejects the command, it must not show up on the amp.
+    if (enqueue_command(command) == COMMAND_QUEUED) apply(expected, command);
+    // Sometimes the driver gets to send in between.
+    if (next_random(rng) % 4 == 0) sleep_us(next_random(rng) % 1000);
+  }
+  bool matched =
+      driver_harness_wait(subscriber, amp_matches, expected, SETTLE_TIMEOUT_US);
+  sleep_us(QUIET_US);
+  state_t state;
+  get_state(&state);
+  if (!matched || !fields_equal(amp_fields(), *expected)) {
+    report("amp has", amp_fields(), *expected);
+    return false;
+  }
+  if (!fields_equal(driver_fields(&state), *expected)) {
+    report("driver reports", driver_fields(&state), *expected);
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  int bursts = argc > 1 ? atoi(argv[1]) : 200;
+  seed = argc > 2 ? strtoul(argv[2], NULL, 0) : 0x5eed;
+  uint32_t rng = seed != 0 ? seed : 1;
+  int subscriber = driver_harness_start();
+  if (subscriber < 0) return EXIT_FAILURE;
+  fake_amp_set_latency_us(AMP_LATENCY_US);
+  fake_amp_set_reply_delay_us(ECHO_DELAY_US);
+
+  state_t state;
+  get_state(&state);
+  fields_t expected = driver_fields(&state);
+  int failed = 0;
+  for (burst_index = 0; burst_index < bursts; burst_index++) {
+    if (!run_burst(subscriber, &rng, &expected)) {
+      failed++;
+      // Go on from what the amp has.
+      expected = amp_fields();
+      if (!driver_harness_wait(subscriber, amp_matches, &expected,
+                               SETTLE_TIMEOUT_US)) {
+        break;
+      }
+    }
+  }
+
+  usb_stats_t stats;
+  get_usb_stats(&stats);
+  printf("%" PRIu32 " fields held over an older echo, up to %" PRIu32
+         " packets in flight.\n",
+         stats.intended_fields_held, stats.max_out_in_flight);
+  printf("%d of %d bursts failed.\n", failed, bursts);
+  bool passed = failed == 0;
+  // Otherwise the bursts didn't overlap and tested nothing.
+  if (stats.intended_fields_held == 0 || stats.max_out_in_flight < 2) {
+    printf("FAIL commands never overlapped on the link.\n");
+    passed = false;
+  }
+  if (!driver_harness_check_stack()) passed = false;
+  return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
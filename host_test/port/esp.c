@@ -0,0 +1,275 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "esp_err.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+
+static const char log_levels[] = "EWIDV";
+
+static int64_t monotonic_us(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int64_t start_us;
+
+// Like on the device, the time is counted from the start.
+__attribute__((constructor)) static void init_start_time(void) {
+  start_us = monotonic_us();
+}
+
+int64_t esp_timer_get_time(void) { return monotonic_us() - start_us; }
+
+struct esp_timer {
+  esp_timer_cb_t callback;
+  void *arg;
+  // -1 while stopped.
+  int64_t alarm_us;
+  // 0 for a one-shot timer.
+  int64_t period_us;
+  struct esp_timer *next;
+};
+
+// Guards the timers, the timer thread is woken on any change.
+static pthread_mutex_t timers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timers_changed;
+static pthread_once_t timers_once = PTHREAD_ONCE_INIT;
+static struct esp_timer *timers;
+
+static struct esp_timer *next_due(void) {
+  struct esp_timer *due = NULL;
+  for (struct esp_timer *timer = timers; timer != NULL; timer = timer->next) {
+    if (timer->alarm_us >= 0 &&
+        (due == NULL || timer->alarm_us < due->alarm_us)) {
+      due = timer;
+    }
+  }
+  return due;
+}
+
+static void *timer_thread(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&timers_lock);
+  while (true) {
+    struct esp_timer *due = next_due();
+    if (due == NULL) {
+      pthread_cond_wait(&timers_changed, &timers_lock);
+      continue;
+    }
+    int64_t wake_us = start_us + due->alarm_us;
+    if (esp_timer_get_time() < due->alarm_us) {
+      struct timespec deadline = {.tv_sec = wake_us / 1000000,
+                                  .tv_nsec = (wake_us % 1000000) * 1000};
+      pthread_cond_timedwait(&timers_changed, &timers_lock, &deadline);
+      continue;
+    }
+    due->alarm_us = due->period_us > 0 ? due->alarm_us + due->period_us : -1;
+    esp_timer_cb_t callback = due->callback;
+    void *callback_arg = due->arg;
+    pthread_mutex_unlock(&timers_lock);
+    callback(callback_arg);
+    pthread_mutex_lock(&timers_lock);
+  }
+  return NULL;
+}
+
+static void init_timers(void) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&timers_changed, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_t thread;
+  pthread_create(&thread, NULL, timer_thread, NULL);
+  pthread_detach(thread);
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args,
+                           esp_timer_handle_t *timer) {
+  pthread_once(&timers_once, init_timers);
+  struct esp_timer *created = calloc(1, sizeof(struct esp_timer));
+  if (created == NULL) return ESP_ERR_NO_MEM;
+  created->callback = args->callback;
+  created->arg = args->arg;
+  created->alarm_us = -1;
+  pthread_mutex_lock(&timers_lock);
+  created->next = timers;
+  timers = created;
+  pthread_mutex_unlock(&timers_lock);
+  *timer = created;
+  return ESP_OK;
+}
+
+static esp_err_t start_timer(esp_timer_handle_t timer, uint64_t timeout_us,
+                             uint64_t period_us) {
+  pthread_mutex_lock(&timers_lock);
+  // Like on the device, a running timer must be stopped first.
+  bool running = timer->alarm_us >= 0;
+  if (!running) {
+    timer->alarm_us = esp_timer_get_time() + (int64_t)timeout_us;
+    timer->period_us = (int64_t)period_us;
+    pthread_cond_broadcast(&timers_changed);
+  }
+  pthread_mutex_unlock(&timers_lock);
+  return running ? ESP_ERR_INVALID_STATE : ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+  return start_timer(timer, timeout_us, 0);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer,
+                                   uint64_t period_us) {
+  return start_timer(timer, period_us, period_us);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+  pthread_mutex_lock(&timers_lock);
+  bool running = timer->alarm_us >= 0;
+  timer->alarm_us = -1;
+  pthread_cond_broadcast(&timers_changed);
+  pthread_mutex_unlock(&timers_lock);
+  return running ? ESP_OK : ESP_ERR_INVALID_STATE;
+}
+
+const char *esp_err_to_name(esp_err_t err) {
+  switch (err) {
+    case ESP_OK:
+      return "ESP_OK";
+    case ESP_FAIL:
+      return "ESP_FAIL";
+    case ESP_ERR_NO_MEM:
+      return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG:
+      return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE:
+      return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_NOT_FOUND:
+      return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_NOT_SUPPORTED:
+      return "ESP_ERR_NOT_SUPPORTED";
+    case ESP_ERR_TIMEOUT:
+      return "ESP_ERR_TIMEOUT";
+    case ESP_ERR_NVS_NOT_FOUND:
+      return "ESP_ERR_NVS_NOT_FOUND";
+  }
+  return "UNKNOWN ERROR";
+}
+
+static int log_level(char level) {
+  const char *found = strchr(log_levels, level);
+  return found != NULL ? found - log_levels : 0;
+}
+
+static bool log_enabled(char level) {
+  static int max_level = -1;
+  if (max_level < 0) {
+    const char *env = getenv("ESP_LOG_LEVEL");
+    max_level = log_level(env != NULL && env[0] != '\0' ? env[0] : 'W');
+  }
+  return log_level(level) <= max_level;
+}
+
+// Lines up to the device's default level are formatted even if they aren't
+// printed, so the stack peaks of tasks include their logging. Each line is
+// written at once: fprintf to the unbuffered stderr would put an 8 KB
+// buffer on the stack.
+#define DEVICE_LOG_LEVEL 'I'
+#define LOG_LINE_SIZE 256
+
+void port_log(char level, const char *tag, const char *format, ...) {
+  bool enabled = log_enabled(level);
+  if (!enabled && log_level(level) > log_level(DEVICE_LOG_LEVEL)) return;
+  char line[LOG_LINE_SIZE];
+  int len = snprintf(line, sizeof(line), "%c (%lld) %s: ", level,
+                     (long long)(esp_timer_get_time() / 1000), tag);
+  if (len >= LOG_LINE_SIZE) len = LOG_LINE_SIZE - 1;
+  va_list args;
+  va_start(args, format);
+  vsnprintf(line + len, sizeof(line) - len, format, args);
+  va_end(args);
+  if (enabled) {
+    fputs(line, stderr);
+    fputc('\n', stderr);
+  }
+}
+
+void port_log_buffer_hex(const char *tag, const void *buffer, size_t len) {
+  bool enabled = log_enabled('I');
+  const uint8_t *bytes = buffer;
+  char line[LOG_LINE_SIZE];
+  int used = snprintf(line, sizeof(line), "I %s:", tag);
+  for (size_t i = 0; i < len && used + 4 < (int)sizeof(line); i++) {
+    used += snprintf(line + used, sizeof(line) - used, " %02x", bytes[i]);
+  }
+  if (enabled) {
+    fputs(line, stderr);
+    fputc('\n', stderr);
+  }
+}
+
+struct esp_pm_lock {
+  int holders;
+};
+
+esp_err_t esp_pm_configure(const void *config) {
+  (void)config;
+  return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_create(esp_pm_lock_type_t lock_type, int arg,
+                             const char *name, esp_pm_lock_handle_t *handle) {
+  (void)lock_type;
+  (void)arg;
+  (void)name;
+  *handle = calloc(1, sizeof(struct esp_pm_lock));
+  return *handle != NULL ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+esp_err_t esp_pm_lock_acquire(esp_pm_lock_handle_t handle) {
+  __atomic_add_fetch(&handle->holders, 1, __ATOMIC_RELAXED);
+  return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_release(esp_pm_lock_handle_t handle) {
+  // Like on the device, more releases than acquires are an error.
+  if (__atomic_sub_fetch(&handle->holders, 1, __ATOMIC_RELAXED) < 0) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  return ESP_OK;
+}
+
+uint32_t esp_random(void) {
+  // Not seeded, runs are reproducible.
+  static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  static unsigned short state[3] = {0x1234, 0xabcd, 0x330e};
+  pthread_mutex_lock(&lock);
+  uint32_t value = (uint32_t)jrand48(state);
+  pthread_mutex_unlock(&lock);
+  return value;
+}
+
+size_t heap_caps_get_free_size(uint32_t caps) {
+  (void)caps;
+  return 0;
+}
+
+size_t heap_caps_get_minimum_free_size(uint32_t caps) {
+  (void)caps;
+  return 0;
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t caps) {
+  (void)caps;
+  return 0;
+}
@@ -0,0 +1,449 @@
+#include "fake_amp.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "esp_timer.h"
+#include "usb/usb_host.h"
+
+#define DEVICE_ADDRESS 1
+#define ENDPOINT_DIR_IN 0x80
+#define MAX_OUT_TRANSFERS 8
+#define MAX_REPLIES 16
+#define MAX_CLIENT_EVENTS 4
+#define MAX_WAIT_US 1000000
+
+typedef struct {
+  usb_transfer_t *transfer;
+  int64_t due_us;
+  usb_transfer_status_t status;
+} out_entry_t;
+
+struct usb_host_client {
+  int unused;
+};
+struct usb_device {
+  int unused;
+};
+
+// Guards everything below, callbacks run without it.
+static pthread_mutex_t amp_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t amp_changed;
+static pthread_once_t amp_once = PTHREAD_ONCE_INIT;
+
+static struct usb_host_client client;
+static struct usb_device device;
+static usb_host_client_config_t client_config;
+static usb_host_client_event_msg_t client_events[MAX_CLIENT_EVENTS];
+static int client_event_count = 0;
+static bool unblocked = false;
+
+static bool attached = false;
+static bool opened = false;
+static int failing_opens = 0;
+static int64_t latency_us = 1000;
+static int64_t reply_delay_us = 0;
+// Sent in order, the head finishes first.
+static out_entry_t out_fifo[MAX_OUT_TRANSFERS];
+static int out_count = 0;
+static int64_t last_out_due_us = 0;
+static usb_transfer_t *in_transfer = NULL;
+// Anything but completed finishes the IN transfer without a reply.
+static usb_transfer_status_t in_status;
+static uint8_t replies[MAX_REPLIES][FAKE_AMP_PACKET_SIZE];
+static int64_t reply_due_us[MAX_REPLIES];
+static int reply_head = 0;
+static int reply_count = 0;
+
+// Preset 1 at -20 dB, unmuted, sources XLR, RCA and SPDIF.
+static uint8_t amp_state[FAKE_AMP_PACKET_SIZE] = {
+    [0] = 0x05, [2] = 1,     [3] = 0x30,  [4] = 0xF8,
+    [12] = 1,   [13] = 2,    [14] = 4,    [50] = 1,
+};
+static uint32_t sets = 0;
+
+static void init_amp_changed(void) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&amp_changed, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+static void lock_amp(void) {
+  pthread_once(&amp_once, init_amp_changed);
+  pthread_mutex_lock(&amp_lock);
+}
+
+static void changed_and_unlock(void) {
+  pthread_cond_broadcast(&amp_changed);
+  pthread_mutex_unlock(&amp_lock);
+}
+
+// Waits for a change until the esp_timer time, false once it passed.
+static bool wait_until(int64_t deadline_us) {
+  int64_t wait_us = deadline_us - esp_timer_get_time();
+  if (wait_us <= 0) return false;
+  // Waiting forever, until the next change anyway.
+  if (wait_us > MAX_WAIT_US) wait_us = MAX_WAIT_US;
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  int64_t ns = deadline.tv_nsec + wait_us * 1000;
+  deadline.tv_sec += ns / 1000000000;
+  deadline.tv_nsec = ns % 1000000000;
+  pthread_cond_timedwait(&amp_changed, &amp_lock, &deadline);
+  return true;
+}
+
+static void push_reply(const uint8_t *reply) {
+  if (reply_count == MAX_REPLIES) {
+    // Nobody polls, the oldest one is lost.
+    reply_head = (reply_head + 1) % MAX_REPLIES;
+    reply_count--;
+  }
+  int tail = (reply_head + reply_count) % MAX_REPLIES;
+  memcpy(replies[tail], reply, FAKE_AMP_PACKET_SIZE);
+  reply_due_us[tail] = esp_timer_get_time() + reply_delay_us;
+  reply_count++;
+}
+
+static void apply_set_packet(const uint8_t *packet) {
+  if (packet[2] >= 1 && packet[2] <= 3) amp_state[2] = packet[2];
+  amp_state[3] = packet[3];
+  amp_state[4] = packet[4];
+  amp_state[6] = (amp_state[6] & ~0x80) | (packet[6] & 0x80);
+  for (int i = 12; i <= 14; i++) {
+    amp_state[i] = (amp_state[i] & ~0x1F) | (packet[i] & 0x1F);
+  }
+  amp_state[50] = amp_state[12 + amp_state[2] - 1] & 0x0F;
+  sets++;
+}
+
+static void receive_packet(const uint8_t *packet) {
+  uint8_t reply[FAKE_AMP_PACKET_SIZE] = {0};
+  switch (packet[0]) {
+    case 0x06:
+      push_reply(amp_state);
+      break;
+    case 0x03:
+      reply[0] = 0x03;
+      // Not snprintf, this runs on the driver task and would count towards
+      // its stack peak.
+      memcpy(&reply[2], "Filter ", 7);
+      reply[9] = '0' + amp_state[2];
+      push_reply(reply);
+      break;
+    case 0x05:
+      apply_set_packet(packet);
+      push_reply(amp_state);
+      break;
+  }
+}
+
+// Runs the next callback which is due, false if none. Called with amp_lock
+// held, which is released during the callback.
+static bool run_next_callback(void) {
+  if (client_event_count > 0) {
+    usb_host_client_event_msg_t event = client_events[0];
+    client_event_count--;
+    memmove(client_events, client_events + 1,
+            client_event_count * sizeof(client_events[0]));
+    pthread_mutex_unlock(&amp_lock);
+    client_config.async.client_event_callback(
+        &event, client_config.async.callback_arg);
+    lock_amp();
+    return true;
+  }
+  usb_transfer_t *transfer = NULL;
+  if (out_count > 0 && out_fifo[0].due_us <= esp_timer_get_time()) {
+    out_entry_t entry = out_fifo[0];
+    out_count--;
+    memmove(out_fifo, out_fifo + 1, out_count * sizeof(out_fifo[0]));
+    if (entry.status == USB_TRANSFER_STATUS_COMPLETED) {
+      receive_packet(entry.transfer->data_buffer);
+    }
+    transfer = entry.transfer;
+    transfer->status = entry.status;
+    transfer->actual_num_bytes =
+        entry.status == USB_TRANSFER_STATUS_COMPLETED ? transfer->num_bytes
+                                                      : 0;
+  } else if (in_transfer != NULL &&
+             (in_status != USB_TRANSFER_STATUS_COMPLETED ||
+              (reply_count > 0 &&
+               reply_due_us[reply_head] <= esp_timer_get_time()))) {
+    transfer = in_transfer;
+    in_transfer = NULL;
+    transfer->status = in_status;
+    transfer->actual_num_bytes = 0;
+    if (in_status == USB_TRANSFER_STATUS_COMPLETED) {
+      memcpy(transfer->data_buffer, replies[reply_head],
+             FAKE_AMP_PACKET_SIZE);
+      transfer->actual_num_bytes = FAKE_AMP_PACKET_SIZE;
+      reply_head = (reply_head + 1) % MAX_REPLIES;
+      reply_count--;
+    }
+  }
+  if (transfer == NULL) return false;
+  pthread_mutex_unlock(&amp_lock);
+  transfer->callback(transfer);
+  lock_amp();
+  return true;
+}
+
+esp_err_t usb_host_client_register(const usb_host_client_config_t *config,
+                                   usb_host_client_handle_t *client_hdl) {
+  lock_amp();
+  client_config = *config;
+  *client_hdl = &client;
+  pthread_mutex_unlock(&amp_lock);
+  return ESP_OK;
+}
+
+esp_err_t usb_host_client_deregister(usb_host_client_handle_t client_hdl) {
+  (void)client_hdl;
+  return ESP_OK;
+}
+
+esp_err_t usb_host_client_handle_events(usb_host_client_handle_t client_hdl,
+                                        TickType_t timeout_ticks) {
+  (void)client_hdl;
+  int64_t deadline_us =
+      timeout_ticks == portMAX_DELAY
+          ? INT64_MAX
+          : esp_timer_get_time() +
+                (int64_t)pdTICKS_TO_MS(timeout_ticks) * 1000;
+  lock_amp();
+  bool handled = false;
+  while (true) {
+    if (run_next_callback()) {
+      handled = true;
+      continue;
+    }
+    if (handled || unblocked) break;
+    int64_t wake_us = deadline_us;
+    if (out_count > 0 && out_fifo[0].due_us < wake_us) {
+      wake_us = out_fifo[0].due_us;
+    }
+    if (in_transfer != NULL && reply_count > 0 &&
+        reply_due_us[reply_head] < wake_us) {
+      wake_us = reply_due_us[reply_head];
+    }
+    if (!wait_until(wake_us) && wake_us == deadline_us) break;
+  }
+  bool woken = handled || unblocked;
+  unblocked = false;
+  pthread_mutex_unlock(&amp_lock);
+  return woken ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+esp_err_t usb_host_client_unblock(usb_host_client_handle_t client_hdl) {
+  (void)client_hdl;
+  lock_amp();
+  unblocked = true;
+  changed_and_unlock();
+  return ESP_OK;
+}
+
+esp_err_t usb_host_device_open(usb_host_client_handle_t client_hdl,
+                               uint8_t dev_addr,
+                               usb_device_handle_t *dev_hdl) {
+  (void)client_hdl;
+  lock_amp();
+  bool found = attached && dev_addr == DEVICE_ADDRESS;
+  bool failed = found && failing_opens > 0;
+  if (failed) {
+    failing_opens--;
+  } else if (found) {
+    opened = true;
+    *dev_hdl = &device;
+  }
+  pthread_mutex_unlock(&amp_lock);
+  if (failed) return ESP_ERR_INVALID_STATE;
+  return found ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t usb_host_device_close(usb_host_client_handle_t client_hdl,
+                                usb_device_handle_t dev_hdl) {
+  (void)client_hdl;
+  (void)dev_hdl;
+  lock_amp();
+  opened = false;
+  pthread_mutex_unlock(&amp_lock);
+  return ESP_OK;
+}
+
+esp_err_t usb_host_interface_claim(usb_host_client_handle_t client_hdl,
+                                   usb_device_handle_t dev_hdl,
+                                   uint8_t interface, uint8_t alt_setting) {
+  (void)client_hdl;
+  (void)dev_hdl;
+  (void)interface;
+  (void)alt_setting;
+  return ESP_OK;
+}
+
+esp_err_t usb_host_interface_release(usb_host_client_handle_t client_hdl,
+                                     usb_device_handle_t dev_hdl,
+                                     uint8_t interface) {
+  (void)client_hdl;
+  (void)dev_hdl;
+  (void)interface;
+  return ESP_OK;
+}
+
+esp_err_t usb_host_endpoint_halt(usb_device_handle_t dev_hdl,
+                                 uint8_t endpoint) {
+  (void)dev_hdl;
+  (void)endpoint;
+  return ESP_OK;
+}
+
+// Transfers of the endpoint come back as canceled.
+esp_err_t usb_host_endpoint_flush(usb_device_handle_t dev_hdl,
+                                  uint8_t endpoint) {
+  (void)dev_hdl;
+  lock_amp();
+  if (endpoint & ENDPOINT_DIR_IN) {
+    if (in_transfer != NULL) in_status = USB_TRANSFER_STATUS_CANCELED;
+  } else {
+    int64_t now = esp_timer_get_time();
+    for (int i = 0; i < out_count; i++) {
+      out_fifo[i].status = USB_TRANSFER_STATUS_CANCELED;
+      out_fifo[i].due_us = now;
+    }
+    last_out_due_us = now;
+  }
+  changed_and_unlock();
+  return ESP_OK;
+}
+
+esp_err_t usb_host_endpoint_clear(usb_device_handle_t dev_hdl,
+                                  uint8_t endpoint) {
+  (void)dev_hdl;
+  (void)endpoint;
+  return ESP_OK;
+}
+
+esp_err_t usb_host_transfer_alloc(size_t data_buffer_size, int num_isoc,
+                                  usb_transfer_t **transfer) {
+  (void)num_isoc;
+  usb_transfer_t *allocated = calloc(1, sizeof(usb_transfer_t) +
+                                            data_buffer_size);
+  if (allocated == NULL) return ESP_ERR_NO_MEM;
+  // The buffer fields are const.
+  usb_transfer_t init = {.data_buffer = (uint8_t *)(allocated + 1),
+                         .data_buffer_size = data_buffer_size};
+  memcpy(allocated, &init, sizeof(init));
+  *transfer = allocated;
+  return ESP_OK;
+}
+
+esp_err_t usb_host_transfer_free(usb_transfer_t *transfer) {
+  free(transfer);
+  return ESP_OK;
+}
+
+esp_err_t usb_host_transfer_submit(usb_transfer_t *transfer) {
+  lock_amp();
+  esp_err_t err = ESP_OK;
+  if (!opened) {
+    err = ESP_ERR_INVALID_STATE;
+  } else if (transfer->bEndpointAddress & ENDPOINT_DIR_IN) {
+    if (in_transfer != NULL) {
+      err = ESP_ERR_INVALID_STATE;
+    } else {
+      in_transfer = transfer;
+      in_status = USB_TRANSFER_STATUS_COMPLETED;
+    }
+  } else if (out_count == MAX_OUT_TRANSFERS) {
+    err = ESP_ERR_NO_MEM;
+  } else {
+    int64_t now = esp_timer_get_time();
+    int64_t start_us = last_out_due_us > now ? last_out_due_us : now;
+    last_out_due_us = start_us + latency_us;
+    out_fifo[out_count++] = (out_entry_t){
+        .transfer = transfer,
+        .due_us = last_out_due_us,
+        .status = USB_TRANSFER_STATUS_COMPLETED,
+    };
+  }
+  changed_and_unlock();
+  return err;
+}
+
+void fake_amp_attach(void) {
+  lock_amp();
+  attached = true;
+  reply_count = 0;
+  if (client_event_count < MAX_CLIENT_EVENTS) {
+    client_events[client_event_count++] = (usb_host_client_event_msg_t){
+        .event = USB_HOST_CLIENT_EVENT_NEW_DEV,
+        .new_dev.address = DEVICE_ADDRESS,
+    };
+  }
+  changed_and_unlock();
+}
+
+void fake_amp_detach(void) {
+  lock_amp();
+  attached = false;
+  opened = false;
+  int64_t now = esp_timer_get_time();
+  for (int i = 0; i < out_count; i++) {
+    out_fifo[i].status = USB_TRANSFER_STATUS_NO_DEVICE;
+    out_fifo[i].due_us = now;
+  }
+  last_out_due_us = now;
+  if (in_transfer != NULL) in_status = USB_TRANSFER_STATUS_NO_DEVICE;
+  if (client_event_count < MAX_CLIENT_EVENTS) {
+    client_events[client_event_count++] = (usb_host_client_event_msg_t){
+        .event = USB_HOST_CLIENT_EVENT_DEV_GONE,
+        .dev_gone.dev_hdl = &device,
+    };
+  }
+  changed_and_unlock();
+}
+
+void fake_amp_fail_opens(int count) {
+  lock_amp();
+  failing_opens = count;
+  pthread_mutex_unlock(&amp_lock);
+}
+
+void fake_amp_set_latency_us(int64_t latency) {
+  lock_amp();
+  latency_us = latency;
+  pthread_mutex_unlock(&amp_lock);
+}
+
+void fake_amp_set_reply_delay_us(int64_t delay_us) {
+  lock_amp();
+  reply_delay_us = delay_us;
+  pthread_mutex_unlock(&amp_lock);
+}
+
+void fake_amp_get_state(uint8_t *state) {
+  lock_amp();
+  memcpy(state, amp_state, FAKE_AMP_PACKET_SIZE);
+  pthread_mutex_unlock(&amp_lock);
+}
+
+uint32_t fake_amp_sets(void) {
+  lock_amp();
+  uint32_t count = sets;
+  pthread_mutex_unlock(&amp_lock);
+  return count;
+}
+
+bool fake_amp_wait_sets(uint32_t count, int64_t timeout_us) {
+  int64_t deadline_us = esp_timer_get_time() + timeout_us;
+  lock_amp();
+  while (sets < count && wait_until(deadline_us)) {
+  }
+  bool reached = sets >= count;
+  pthread_mutex_unlock(&amp_lock);
+  return reached;
+}
@@ -0,0 +1,272 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+// Fills the stacks of tasks, see uxTaskGetStackHighWaterMark.
+#define STACK_FILL 0xa5
+
+// Guards all queues and task notifications, waiters are woken on any
+// change.
+static pthread_mutex_t queues_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queues_changed;
+static pthread_once_t queues_once = PTHREAD_ONCE_INIT;
+// Recursive, like nested critical sections on the device.
+static pthread_mutex_t critical_lock;
+
+__attribute__((constructor)) static void init_critical_lock(void) {
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&critical_lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+static void init_queues_changed(void) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&queues_changed, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+void port_enter_critical(portMUX_TYPE *mux) {
+  (void)mux;
+  pthread_mutex_lock(&critical_lock);
+}
+
+void port_exit_critical(portMUX_TYPE *mux) {
+  (void)mux;
+  pthread_mutex_unlock(&critical_lock);
+}
+
+TickType_t xTaskGetTickCount(void) {
+  return (TickType_t)(esp_timer_get_time() * configTICK_RATE_HZ / 1000000);
+}
+
+void vTaskDelay(TickType_t ticks) {
+  int64_t us = (int64_t)pdTICKS_TO_MS(ticks) * 1000;
+  struct timespec delay = {.tv_sec = us / 1000000,
+                           .tv_nsec = (us % 1000000) * 1000};
+  while (nanosleep(&delay, &delay) != 0 && errno == EINTR) {
+  }
+}
+
+// Waits for a change of any queue, false once the wait is over.
+static bool wait_for_change(const struct timespec *deadline) {
+  if (deadline == NULL) {
+    pthread_cond_wait(&queues_changed, &queues_lock);
+    return true;
+  }
+  return pthread_cond_timedwait(&queues_changed, &queues_lock, deadline) !=
+         ETIMEDOUT;
+}
+
+static const struct timespec *deadline_after(TickType_t wait,
+                                             struct timespec *deadline) {
+  if (wait == portMAX_DELAY) return NULL;
+  clock_gettime(CLOCK_MONOTONIC, deadline);
+  int64_t ns = deadline->tv_nsec + (int64_t)pdTICKS_TO_MS(wait) * 1000000;
+  deadline->tv_sec += ns / 1000000000;
+  deadline->tv_nsec = ns % 1000000000;
+  return deadline;
+}
+
+QueueHandle_t xQueueCreateStatic(UBaseType_t length, UBaseType_t item_size,
+                                 uint8_t *storage, StaticQueue_t *buffer) {
+  pthread_once(&queues_once, init_queues_changed);
+  *buffer = (StaticQueue_t){
+      .storage = storage, .item_size = item_size, .length = length};
+  return buffer;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *buffer) {
+  xQueueCreateStatic(1, 0, NULL, buffer);
+  // A mutex starts out given.
+  buffer->count = 1;
+  return buffer;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t *buffer) {
+  return xQueueCreateStatic(1, 0, NULL, buffer);
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t wait) {
+  struct timespec deadline_buffer;
+  const struct timespec *deadline = deadline_after(wait, &deadline_buffer);
+  pthread_mutex_lock(&queues_lock);
+  bool waiting = wait > 0;
+  while (queue->count == queue->length && waiting) {
+    waiting = wait_for_change(deadline);
+  }
+  bool sent = queue->count < queue->length;
+  if (sent) {
+    if (queue->item_size > 0) {
+      UBaseType_t tail = (queue->head + queue->count) % queue->length;
+      memcpy(queue->storage + tail * queue->item_size, item, queue->item_size);
+    }
+    queue->count++;
+    pthread_cond_broadcast(&queues_changed);
+  }
+  pthread_mutex_unlock(&queues_lock);
+  return sent ? pdPASS : pdFAIL;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t wait) {
+  struct timespec deadline_buffer;
+  const struct timespec *deadline = deadline_after(wait, &deadline_buffer);
+  pthread_mutex_lock(&queues_lock);
+  bool waiting = wait > 0;
+  while (queue->count == 0 && waiting) waiting = wait_for_change(deadline);
+  bool received = queue->count > 0;
+  if (received) {
+    if (queue->item_size > 0) {
+      memcpy(item, queue->storage + queue->head * queue->item_size,
+             queue->item_size);
+    }
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    pthread_cond_broadcast(&queues_changed);
+  }
+  pthread_mutex_unlock(&queues_lock);
+  return received ? pdPASS : pdFAIL;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+  pthread_mutex_lock(&queues_lock);
+  UBaseType_t count = queue->count;
+  pthread_mutex_unlock(&queues_lock);
+  return count;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue) {
+  pthread_mutex_lock(&queues_lock);
+  UBaseType_t spaces = queue->length - queue->count;
+  pthread_mutex_unlock(&queues_lock);
+  return spaces;
+}
+
+BaseType_t xQueueReset(QueueHandle_t queue) {
+  pthread_mutex_lock(&queues_lock);
+  queue->count = 0;
+  queue->head = 0;
+  pthread_cond_broadcast(&queues_changed);
+  pthread_mutex_unlock(&queues_lock);
+  return pdPASS;
+}
+
+static __thread TaskHandle_t current_task;
+
+static void *task_thread(void *arg) {
+  TaskHandle_t task = arg;
+  current_task = task;
+  // pthreads keep their thread data at the top of the stack, only what the
+  // task uses from here on counts.
+  task->stack_start = __builtin_frame_address(0);
+  task->function(task->arg);
+  fprintf(stderr, "Task %s returned, tasks must delete themselves.\n",
+          task->name);
+  abort();
+}
+
+TaskHandle_t xTaskCreateStatic(TaskFunction_t function, const char *name,
+                               uint32_t stack_depth, void *arg,
+                               UBaseType_t priority, StackType_t *stack,
+                               StaticTask_t *task) {
+  (void)priority;
+  (void)stack;
+  pthread_once(&queues_once, init_queues_changed);
+  *task = (StaticTask_t){
+      .function = function, .arg = arg, .stack_depth = stack_depth};
+  strncpy(task->name, name, configMAX_TASK_NAME_LEN - 1);
+  task->stack = malloc(PORT_TASK_STACK_SIZE);
+  if (task->stack == NULL) return NULL;
+  memset(task->stack, STACK_FILL, PORT_TASK_STACK_SIZE);
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstack(&attr, task->stack, PORT_TASK_STACK_SIZE);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_t thread;
+  int err = pthread_create(&thread, &attr, task_thread, task);
+  pthread_attr_destroy(&attr);
+  return err == 0 ? task : NULL;
+}
+
+void vTaskDelete(TaskHandle_t task) {
+  if (task != NULL && task != xTaskGetCurrentTaskHandle()) {
+    fprintf(stderr, "vTaskDelete of another task isn't supported.\n");
+    abort();
+  }
+  // The stack stays allocated, its high-water mark can still be read.
+  __atomic_store_n(&xTaskGetCurrentTaskHandle()->deleted, true,
+                   __ATOMIC_RELEASE);
+  pthread_exit(NULL);
+}
+
+eTaskState eTaskGetState(TaskHandle_t task) {
+  return __atomic_load_n(&task->deleted, __ATOMIC_ACQUIRE) ? eDeleted : eReady;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+  if (current_task == NULL) {
+    current_task = calloc(1, sizeof(StaticTask_t));
+    strncpy(current_task->name, "thread", configMAX_TASK_NAME_LEN - 1);
+  }
+  return current_task;
+}
+
+const char *pcTaskGetName(TaskHandle_t task) {
+  if (task == NULL) task = xTaskGetCurrentTaskHandle();
+  return task->name;
+}
+
+uint32_t port_task_stack_peak(TaskHandle_t task) {
+  if (task == NULL) task = xTaskGetCurrentTaskHandle();
+  if (task->stack == NULL) return 0;
+  // The stack grows down, the lowest changed byte is the deepest.
+  size_t unused = 0;
+  while (unused < PORT_TASK_STACK_SIZE && task->stack[unused] == STACK_FILL) {
+    unused++;
+  }
+  if (task->stack_start == NULL) return 0;
+  return task->stack_start - (task->stack + unused);
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) {
+  if (task == NULL) task = xTaskGetCurrentTaskHandle();
+  uint32_t peak = port_task_stack_peak(task);
+  return peak < task->stack_depth ? task->stack_depth - peak : 0;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+  pthread_mutex_lock(&queues_lock);
+  task->notifications++;
+  pthread_cond_broadcast(&queues_changed);
+  pthread_mutex_unlock(&queues_lock);
+  return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t wait) {
+  TaskHandle_t task = xTaskGetCurrentTaskHandle();
+  struct timespec deadline_buffer;
+  const struct timespec *deadline = deadline_after(wait, &deadline_buffer);
+  pthread_mutex_lock(&queues_lock);
+  bool waiting = wait > 0;
+  while (task->notifications == 0 && waiting) {
+    waiting = wait_for_change(deadline);
+  }
+  uint32_t notifications = task->notifications;
+  if (notifications > 0) {
+    task->notifications = clear_on_exit ? 0 : notifications - 1;
+  }
+  pthread_mutex_unlock(&queues_lock);
+  return notifications;
+}
@@ -0,0 +1,20 @@
+#ifndef ESP_LOG_H
+#define ESP_LOG_H
+
+#include <stddef.h>
+
+// Printed up to the level in the ESP_LOG_LEVEL environment variable, one
+// of E, W, I, D, V. Warnings by default.
+void port_log(char level, const char *tag, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+void port_log_buffer_hex(const char *tag, const void *buffer, size_t len);
+
+#define ESP_LOGE(tag, ...) port_log('E', tag, __VA_ARGS__)
+#define ESP_LOGW(tag, ...) port_log('W', tag, __VA_ARGS__)
+#define ESP_LOGI(tag, ...) port_log('I', tag, __VA_ARGS__)
+#define ESP_LOGD(tag, ...) port_log('D', tag, __VA_ARGS__)
+#define ESP_LOGV(tag, ...) port_log('V', tag, __VA_ARGS__)
+#define ESP_LOG_BUFFER_HEX(tag, buffer, len) \
+  port_log_buffer_hex(tag, buffer, len)
+
+#endif  // ESP_LOG_H
@@ -0,0 +1,22 @@
+#ifndef ESP_SPIFFS_H
+#define ESP_SPIFFS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "esp_err.h"
+
+// There is no UI partition on the host, the embedded UI is served.
+
+typedef struct {
+  const char *base_path;
+  const char *partition_label;
+  size_t max_files;
+  bool format_if_mount_failed;
+} esp_vfs_spiffs_conf_t;
+
+esp_err_t esp_vfs_spiffs_register(const esp_vfs_spiffs_conf_t *conf);
+esp_err_t esp_spiffs_info(const char *partition_label, size_t *total,
+                          size_t *used);
+
+#endif  // ESP_SPIFFS_H
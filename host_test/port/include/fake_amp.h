@@ -0,0 +1,32 @@
+#ifndef FAKE_AMP_H
+#define FAKE_AMP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// A Hypex amp behind the USB host library of the port. OUT packets reach
+// it one after another, each after the link latency. It answers state
+// requests (0x06) and filter name requests (0x03), applies set packets
+// (0x05) and echoes its state after them.
+
+#define FAKE_AMP_PACKET_SIZE 64
+
+// Reported to the client as a new device.
+void fake_amp_attach(void);
+// Transfers in flight fail and the client is told the device is gone. The
+// amp keeps its state.
+void fake_amp_detach(void);
+// The next count opens of the device fail, like a flaky enumeration.
+void fake_amp_fail_opens(int count);
+// Per OUT packet, 1 ms by default like a full speed interrupt endpoint.
+void fake_amp_set_latency_us(int64_t latency_us);
+// From applying a packet until its answer can be read, 0 by default.
+void fake_amp_set_reply_delay_us(int64_t delay_us);
+// Copies the state packet the amp would answer with.
+void fake_amp_get_state(uint8_t *state);
+// Set packets applied so far.
+uint32_t fake_amp_sets(void);
+// Waits until at least count set packets were applied, false on timeout.
+bool fake_amp_wait_sets(uint32_t count, int64_t timeout_us);
+
+#endif  // FAKE_AMP_H
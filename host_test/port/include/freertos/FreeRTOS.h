@@ -0,0 +1,45 @@
+#ifndef FREERTOS_H
+#define FREERTOS_H
+
+// The parts of the FreeRTOS API the firmware modules use, on top of
+// pthreads, so they run unchanged in the host tests.
+
+// Like the ESP-IDF one, which the firmware gets assert() from.
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Like CONFIG_FREERTOS_HZ and CONFIG_FREERTOS_MAX_TASK_NAME_LEN in sdkconfig.
+#define configTICK_RATE_HZ 100
+#define configMAX_TASK_NAME_LEN 16
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint8_t StackType_t;
+
+#define portMAX_DELAY UINT32_MAX
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+#define pdMS_TO_TICKS(ms) \
+  ((TickType_t)((uint64_t)(ms) * configTICK_RATE_HZ / 1000))
+#define pdTICKS_TO_MS(ticks) \
+  ((TickType_t)((uint64_t)(ticks) * 1000 / configTICK_RATE_HZ))
+#define IRAM_ATTR
+
+// All critical sections share one lock, like interrupts disabled on a
+// single core.
+typedef struct {
+  int unused;
+} portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED {0}
+
+void port_enter_critical(portMUX_TYPE *mux);
+void port_exit_critical(portMUX_TYPE *mux);
+#define taskENTER_CRITICAL(mux) port_enter_critical(mux)
+#define taskEXIT_CRITICAL(mux) port_exit_critical(mux)
+
+#endif  // FREERTOS_H
@@ -0,0 +1,17 @@
+#ifndef SEMPHR_H
+#define SEMPHR_H
+
+#include "freertos/queue.h"
+
+typedef StaticQueue_t StaticSemaphore_t;
+typedef QueueHandle_t SemaphoreHandle_t;
+
+// Not recursive and without priority inheritance.
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *buffer);
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t *buffer);
+
+#define xSemaphoreTake(semaphore, wait) xQueueReceive(semaphore, NULL, wait)
+#define xSemaphoreGive(semaphore) xQueueSend(semaphore, NULL, 0)
+#define uxSemaphoreGetCount(semaphore) uxQueueMessagesWaiting(semaphore)
+
+#endif  // SEMPHR_H
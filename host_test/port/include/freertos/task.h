@@ -0,0 +1,57 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include "freertos/FreeRTOS.h"
+
+// Tasks are threads on a stack of PORT_TASK_STACK_SIZE bytes, whatever size
+// the firmware asks for. The stack is filled with a pattern first, so the
+// high-water mark tells how much of it the task used. Threads not created
+// as tasks, e.g. the main thread, get a handle on first use without one.
+#define PORT_TASK_STACK_SIZE (256 * 1024)
+
+typedef struct port_task {
+  char name[configMAX_TASK_NAME_LEN];
+  void (*function)(void *arg);
+  void *arg;
+  // NULL for threads not created as tasks.
+  uint8_t *stack;
+  // Where the task function started, NULL until it did.
+  uint8_t *stack_start;
+  // What the firmware asked for, in bytes.
+  uint32_t stack_depth;
+  uint32_t notifications;
+  bool deleted;
+} StaticTask_t;
+typedef StaticTask_t *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *arg);
+// Only eDeleted and eReady are reported.
+typedef enum { eRunning, eReady, eBlocked, eSuspended, eDeleted } eTaskState;
+
+// The stack buffer of the firmware is left unused.
+TaskHandle_t xTaskCreateStatic(TaskFunction_t function, const char *name,
+                               uint32_t stack_depth, void *arg,
+                               UBaseType_t priority, StackType_t *stack,
+                               StaticTask_t *task);
+#define xTaskCreateStaticPinnedToCore(function, name, stack_depth, arg,     \
+                                      priority, stack, task, core)          \
+  xTaskCreateStatic(function, name, stack_depth, arg, priority, stack, task)
+// Only a task deleting itself is supported.
+void vTaskDelete(TaskHandle_t task);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+// Unlike on the device, a deleted task's handle stays valid.
+eTaskState eTaskGetState(TaskHandle_t task);
+const char *pcTaskGetName(TaskHandle_t task);
+// Bytes of stack_depth never used, 0 if the task used more than it asked
+// for. NULL for the calling task.
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
+// Bytes of the host stack the task used so far, 0 for threads not created
+// as tasks.
+uint32_t port_task_stack_peak(TaskHandle_t task);
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t wait);
+
+TickType_t xTaskGetTickCount(void);
+void vTaskDelay(TickType_t ticks);
+
+#endif  // TASK_H
@@ -0,0 +1,10 @@
+#ifndef MDNS_H
+#define MDNS_H
+
+#include "esp_err.h"
+
+esp_err_t mdns_init(void);
+esp_err_t mdns_hostname_set(const char *hostname);
+esp_err_t mdns_instance_name_set(const char *instance_name);
+
+#endif  // MDNS_H
@@ -0,0 +1,8 @@
+#ifndef SECRETS_H
+#define SECRETS_H
+
+// main/secrets.h isn't checked in, the host has no WiFi to join anyway.
+#define WIFI_SSID "host_test"
+#define WIFI_PASS "host_test"
+
+#endif  // SECRETS_H
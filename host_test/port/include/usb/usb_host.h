@@ -0,0 +1,108 @@
+#ifndef USB_HOST_H
+#define USB_HOST_H
+
+// The client side of the ESP-IDF USB host library, served by the simulated
+// amp in fake_amp.c.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+typedef struct usb_host_client *usb_host_client_handle_t;
+typedef struct usb_device *usb_device_handle_t;
+
+typedef enum {
+  USB_TRANSFER_STATUS_COMPLETED,
+  USB_TRANSFER_STATUS_ERROR,
+  USB_TRANSFER_STATUS_TIMED_OUT,
+  USB_TRANSFER_STATUS_CANCELED,
+  USB_TRANSFER_STATUS_STALL,
+  USB_TRANSFER_STATUS_OVERFLOW,
+  USB_TRANSFER_STATUS_SKIPPED,
+  USB_TRANSFER_STATUS_NO_DEVICE,
+} usb_transfer_status_t;
+
+typedef struct usb_transfer_s usb_transfer_t;
+typedef void (*usb_transfer_cb_t)(usb_transfer_t *transfer);
+
+struct usb_transfer_s {
+  uint8_t *const data_buffer;
+  const size_t data_buffer_size;
+  int num_bytes;
+  int actual_num_bytes;
+  uint32_t flags;
+  usb_device_handle_t device_handle;
+  uint8_t bEndpointAddress;
+  usb_transfer_status_t status;
+  uint32_t timeout_ms;
+  usb_transfer_cb_t callback;
+  void *context;
+};
+
+typedef enum {
+  USB_HOST_CLIENT_EVENT_NEW_DEV,
+  USB_HOST_CLIENT_EVENT_DEV_GONE,
+} usb_host_client_event_t;
+
+typedef struct {
+  usb_host_client_event_t event;
+  union {
+    struct {
+      uint8_t address;
+    } new_dev;
+    struct {
+      usb_device_handle_t dev_hdl;
+    } dev_gone;
+  };
+} usb_host_client_event_msg_t;
+
+typedef void (*usb_host_client_event_cb_t)(
+    const usb_host_client_event_msg_t *event_msg, void *arg);
+
+typedef struct {
+  bool is_synchronous;
+  int max_num_event_msg;
+  union {
+    struct {
+      usb_host_client_event_cb_t client_event_callback;
+      void *callback_arg;
+    } async;
+  };
+} usb_host_client_config_t;
+
+esp_err_t usb_host_client_register(const usb_host_client_config_t *config,
+                                   usb_host_client_handle_t *client_hdl);
+esp_err_t usb_host_client_deregister(usb_host_client_handle_t client_hdl);
+// Runs the callbacks of client events and finished transfers. Returns
+// ESP_ERR_TIMEOUT if there were none.
+esp_err_t usb_host_client_handle_events(usb_host_client_handle_t client_hdl,
+                                        TickType_t timeout_ticks);
+esp_err_t usb_host_client_unblock(usb_host_client_handle_t client_hdl);
+
+esp_err_t usb_host_device_open(usb_host_client_handle_t client_hdl,
+                               uint8_t dev_addr,
+                               usb_device_handle_t *dev_hdl);
+esp_err_t usb_host_device_close(usb_host_client_handle_t client_hdl,
+                                usb_device_handle_t dev_hdl);
+esp_err_t usb_host_interface_claim(usb_host_client_handle_t client_hdl,
+                                   usb_device_handle_t dev_hdl,
+                                   uint8_t interface, uint8_t alt_setting);
+esp_err_t usb_host_interface_release(usb_host_client_handle_t client_hdl,
+                                     usb_device_handle_t dev_hdl,
+                                     uint8_t interface);
+
+esp_err_t usb_host_endpoint_halt(usb_device_handle_t dev_hdl,
+                                 uint8_t endpoint);
+esp_err_t usb_host_endpoint_flush(usb_device_handle_t dev_hdl,
+                                  uint8_t endpoint);
+esp_err_t usb_host_endpoint_clear(usb_device_handle_t dev_hdl,
+                                  uint8_t endpoint);
+
+esp_err_t usb_host_transfer_alloc(size_t data_buffer_size, int num_isoc,
+                                  usb_transfer_t **transfer);
+esp_err_t usb_host_transfer_free(usb_transfer_t *transfer);
+esp_err_t usb_host_transfer_submit(usb_transfer_t *transfer);
+
+#endif  // USB_HOST_H
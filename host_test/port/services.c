@@ -0,0 +1,291 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "esp_event.h"
+#include "esp_http_server.h"
+#include "esp_spiffs.h"
+#include "esp_wifi.h"
+#include "mdns.h"
+#include "nvs.h"
+#include "nvs_flash.h"
+
+// The network and storage services of ESP-IDF, absent on the host. Setting
+// them up succeeds where the firmware treats a failure as fatal, everything
+// else fails like a missing peripheral would.
+
+esp_event_base_t WIFI_EVENT = "WIFI_EVENT";
+esp_event_base_t IP_EVENT = "IP_EVENT";
+
+esp_err_t esp_event_loop_create_default(void) { return ESP_OK; }
+
+esp_err_t esp_event_handler_register(esp_event_base_t base, int32_t id,
+                                     esp_event_handler_t handler, void *arg) {
+  (void)base;
+  (void)id;
+  (void)handler;
+  (void)arg;
+  return ESP_OK;
+}
+
+esp_err_t esp_netif_init(void) { return ESP_OK; }
+
+void *esp_netif_create_default_wifi_sta(void) { return NULL; }
+
+esp_err_t esp_wifi_init(const wifi_init_config_t *config) {
+  (void)config;
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_mode(wifi_mode_t mode) {
+  (void)mode;
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_config(wifi_interface_t interface,
+                              wifi_config_t *config) {
+  (void)interface;
+  (void)config;
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_start(void) { return ESP_OK; }
+
+esp_err_t esp_wifi_connect(void) { return ESP_OK; }
+
+esp_err_t mdns_init(void) { return ESP_ERR_NOT_SUPPORTED; }
+
+esp_err_t mdns_hostname_set(const char *hostname) {
+  (void)hostname;
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t mdns_instance_name_set(const char *instance_name) {
+  (void)instance_name;
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t nvs_flash_init(void) { return ESP_OK; }
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t mode,
+                   nvs_handle_t *handle) {
+  (void)name;
+  (void)mode;
+  (void)handle;
+  return ESP_ERR_NVS_NOT_FOUND;
+}
+
+void nvs_close(nvs_handle_t handle) { (void)handle; }
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *value,
+                       size_t *length) {
+  (void)handle;
+  (void)key;
+  (void)value;
+  (void)length;
+  return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key,
+                       const void *value, size_t length) {
+  (void)handle;
+  (void)key;
+  (void)value;
+  (void)length;
+  return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key) {
+  (void)handle;
+  (void)key;
+  return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle) {
+  (void)handle;
+  return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t esp_vfs_spiffs_register(const esp_vfs_spiffs_conf_t *conf) {
+  (void)conf;
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t esp_spiffs_info(const char *partition_label, size_t *total,
+                          size_t *used) {
+  (void)partition_label;
+  *total = 0;
+  *used = 0;
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t httpd_start(httpd_handle_t *handle, const httpd_config_t *config) {
+  (void)config;
+  *handle = NULL;
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle,
+                                     const httpd_uri_t *uri_handler) {
+  (void)handle;
+  (void)uri_handler;
+  return ESP_FAIL;
+}
+
+bool httpd_uri_match_wildcard(const char *reference_uri,
+                              const char *uri_to_match, size_t match_upto) {
+  (void)reference_uri;
+  (void)uri_to_match;
+  (void)match_upto;
+  return false;
+}
+
+esp_err_t httpd_queue_work(httpd_handle_t handle, httpd_work_fn_t work,
+                           void *arg) {
+  (void)handle;
+  (void)work;
+  (void)arg;
+  return ESP_FAIL;
+}
+
+esp_err_t httpd_sess_trigger_close(httpd_handle_t handle, int sockfd) {
+  (void)handle;
+  (void)sockfd;
+  return ESP_FAIL;
+}
+
+// Without a server there are no requests, the handlers taking one are never
+// called.
+
+int httpd_req_to_sockfd(httpd_req_t *req) {
+  (void)req;
+  return -1;
+}
+
+int httpd_req_recv(httpd_req_t *req, char *buf, size_t buf_len) {
+  (void)req;
+  (void)buf;
+  (void)buf_len;
+  return -1;
+}
+
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t *req, const char *field,
+                                      char *val, size_t val_size) {
+  (void)req;
+  (void)field;
+  (void)val;
+  (void)val_size;
+  return ESP_FAIL;
+}
+
+esp_err_t httpd_req_get_url_query_str(httpd_req_t *req, char *buf,
+                                      size_t buf_len) {
+  (void)req;
+  (void)buf;
+  (void)buf_len;
+  return ESP_FAIL;
+}
+
+esp_err_t httpd_query_key_value(const char *qry, const char *key, char *val,
+                                size_t val_size) {
+  (void)qry;
+  (void)key;
+  (void)val;
+  (void)val_size;
+  return ESP_FAIL;
+}
+
+esp_err_t httpd_req_async_handler_begin(httpd_req_t *req,
+                                        httpd_req_t **copy) {
+  (void)req;
+  *copy = NULL;
+  return ESP_FAIL;
+}
+
+esp_err_t httpd_req_async_handler_complete(httpd_req_t *req) {
+  (void)req;
+  return ESP_FAIL;
+}
+
+esp_err_t httpd_resp_set_status(httpd_req_t *req, const char *status) {
+  (void)req;
+  (void)status;
+  return ESP_FAIL;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t *req, const char *type) {
+  (void)req;
+  (void)type;
+  return ESP_FAIL;
+}
+
+esp_err_t httpd_resp_set_hdr(httpd_req_t *req, const char *field,
+                             const char *value) {
+  (void)req;
+  (void)field;
+  (void)value;
+  return ESP_FAIL;
+}
+
+esp_err_t httpd_resp_send(httpd_req_t *req, const char *buf, ssize_t len) {
+  (void)req;
+  (void)buf;
+  (void)len;
+  return ESP_FAIL;
+}
+
+esp_err_t httpd_resp_send_chunk(httpd_req_t *req, const char *buf,
+                                ssize_t len) {
+  (void)req;
+  (void)buf;
+  (void)len;
+  return ESP_FAIL;
+}
+
+esp_err_t httpd_resp_sendstr(httpd_req_t *req, const char *str) {
+  (void)req;
+  (void)str;
+  return ESP_FAIL;
+}
+
+esp_err_t httpd_resp_sendstr_chunk(httpd_req_t *req, const char *str) {
+  (void)req;
+  (void)str;
+  return ESP_FAIL;
+}
+
+esp_err_t httpd_resp_send_err(httpd_req_t *req, httpd_err_code_t error,
+                              const char *message) {
+  (void)req;
+  (void)error;
+  (void)message;
+  return ESP_FAIL;
+}
+
+esp_err_t httpd_ws_recv_frame(httpd_req_t *req, httpd_ws_frame_t *frame,
+                              size_t max_len) {
+  (void)req;
+  (void)frame;
+  (void)max_len;
+  return ESP_FAIL;
+}
+
+esp_err_t httpd_ws_send_frame(httpd_req_t *req, httpd_ws_frame_t *frame) {
+  (void)req;
+  (void)frame;
+  return ESP_FAIL;
+}
+
+esp_err_t httpd_ws_send_frame_async(httpd_handle_t handle, int sockfd,
+                                    httpd_ws_frame_t *frame) {
+  (void)handle;
+  (void)sockfd;
+  (void)frame;
+  return ESP_FAIL;
+}
+
+httpd_ws_client_info_t httpd_ws_get_fd_info(httpd_handle_t handle,
+                                            int sockfd) {
+  (void)handle;
+  (void)sockfd;
+  return HTTPD_WS_CLIENT_INVALID;
+}
@@ -0,0 +1,176 @@
+// Feeds the amp commands of a recorded WebSocket trace to enqueue_command(),
+// like the WebSocket handler does, with the simulated amp behind the driver.
+// tools/ws_replay.py --host-replay writes the commands to stdin, one per
+// line, due in ms since the start and ordered by it:
+//
+//   <due ms> <origin id> <client> <seq> <action> <value>
+//
+// and reads the events from stdout, times in us since the start:
+//
+//   sent <t> <line> <result>
+//   acks <t> <version> [<action>=<client>,<seq> ...]
+//
+// The replay ends once the last command of every action was confirmed, or
+// timeout ms after the last one was sent.
+//
+//   trace_replay [timeout ms] < commands
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "driver_harness.h"
+#include "esp_timer.h"
+#include "fake_amp.h"
+
+#define AMP_LATENCY_US 2000
+#define MAX_ACTION_NAME 16
+
+typedef struct {
+  int64_t due_us;
+  control_action_t command;
+} trace_command_t;
+
+typedef struct {
+  int64_t start_us;
+  uint32_t version;
+  // Last queued command per action, zero client if none.
+  command_tag_t last[NUM_CONTROL_ACTIONS];
+} replay_t;
+
+// Like amp_commands in web_server.c, the names are the acks' keys.
+static const char *action_names[NUM_CONTROL_ACTIONS] = {
+    [ACTION_SET_PRESET] = "set_preset",
+    [ACTION_SET_VOLUME] = "set_volume",
+    [ACTION_SET_SOURCE_P1] = "set_source_p1",
+    [ACTION_SET_SOURCE_P2] = "set_source_p2",
+    [ACTION_SET_SOURCE_P3] = "set_source_p3",
+    [ACTION_SET_MUTE] = "set_mute",
+    [ACTION_SET_EQ_P1] = "set_eq_p1",
+    [ACTION_SET_EQ_P2] = "set_eq_p2",
+    [ACTION_SET_EQ_P3] = "set_eq_p3",
+};
+
+// Like command_result_name() in web_server.c.
+static const char *result_names[] = {
+    [COMMAND_QUEUED] = "queued",       [COMMAND_DEFERRED] = "deferred",
+    [COMMAND_REJECTED] = "rejected",   [COMMAND_BUSY] = "busy",
+    [COMMAND_THROTTLED] = "throttled",
+};
+
+static int find_action(const char *name) {
+  for (int i = 0; i < NUM_CONTROL_ACTIONS; i++) {
+    if (strcmp(action_names[i], name) == 0) return i;
+  }
+  return -1;
+}
+
+// Returns the number of commands, -1 on a malformed line.
+static int read_commands(trace_command_t **commands) {
+  int count = 0;
+  int capacity = 0;
+  long long due_ms;
+  int origin_id;
+  unsigned client;
+  unsigned seq;
+  char name[MAX_ACTION_NAME];
+  int value;
+  int fields;
+  while ((fields = scanf("%lld %d %u %u %15s %d", &due_ms, &origin_id,
+                         &client, &seq, name, &value)) == 6) {
+    int action = find_action(name);
+    if (action < 0) {
+      printf("FAIL unknown action %s in line %d.\n", name, count + 1);
+      return -1;
+    }
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 256;
+      *commands = realloc(*commands, capacity * sizeof(trace_command_t));
+      if (*commands == NULL) return -1;
+    }
+    (*commands)[count++] = (trace_command_t){
+        .due_us = due_ms * 1000,
+        .command = {.action = action,
+                    .value = (int8_t)value,
+                    .tag = {.client = client, .seq = seq},
+                    .origin = {.type = ORIGIN_WEBSOCKET, .id = origin_id}},
+    };
+  }
+  if (fields != EOF) {
+    printf("FAIL malformed line %d.\n", count + 1);
+    return -1;
+  }
+  return count;
+}
+
+static int64_t since_start(const replay_t *replay) {
+  return esp_timer_get_time() - replay->start_us;
+}
+
+// Prints the acks whenever the state changed.
+static void print_acks(const state_t *state, replay_t *replay) {
+  if (state->version == replay->version) return;
+  replay->version = state->version;
+  printf("acks %" PRId64 " %" PRIu32, since_start(replay), state->version);
+  for (int i = 0; i < NUM_CONTROL_ACTIONS; i++) {
+    const command_tag_t *ack = &state->acks[i];
+    if (ack->client == 0) continue;
+    printf(" %s=%" PRIu32 ",%" PRIu32, action_names[i], ack->client,
+           ack->seq);
+  }
+  printf("\n");
+}
+
+// Never done, the wait times out when the next command is due.
+static bool print_until_due(const state_t *state, void *arg) {
+  print_acks(state, arg);
+  return false;
+}
+
+static bool all_confirmed(const state_t *state, void *arg) {
+  replay_t *replay = arg;
+  print_acks(state, replay);
+  for (int i = 0; i < NUM_CONTROL_ACTIONS; i++) {
+    const command_tag_t *last = &replay->last[i];
+    if (last->client == 0) continue;
+    if (state->acks[i].client != last->client ||
+        state->acks[i].seq < last->seq) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  int64_t timeout_us = (argc > 1 ? atoll(argv[1]) : 5000) * 1000;
+  trace_command_t *commands = NULL;
+  int count = read_commands(&commands);
+  if (count < 0) return EXIT_FAILURE;
+  int subscriber = driver_harness_start();
+  if (subscriber < 0) return EXIT_FAILURE;
+  fake_amp_set_latency_us(AMP_LATENCY_US);
+
+  replay_t replay = {.start_us = esp_timer_get_time()};
+  for (int i = 0; i < count; i++) {
+    int64_t wait_us = commands[i].due_us - since_start(&replay);
+    if (wait_us > 0) {
+      driver_harness_wait(subscriber, print_until_due, &replay, wait_us);
+    }
+    command_result_t result = enqueue_command(commands[i].command);
+    if (result == COMMAND_QUEUED || result == COMMAND_DEFERRED) {
+      replay.last[commands[i].command.action] = commands[i].command.tag;
+    }
+    printf("sent %" PRId64 " %d %s\n", since_start(&replay), i + 1,
+           result_names[result]);
+  }
+  bool confirmed =
+      driver_harness_wait(subscriber, all_confirmed, &replay, timeout_us);
+  free(commands);
+  fflush(stdout);
+  if (!confirmed) {
+    fprintf(stderr, "Not every last command was confirmed in %" PRId64
+                    " ms.\n", timeout_us / 1000);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,470 @@
+// Runs the trigger sequencer like trigger_monitor_task in main.c, against a
+// simulated relay and amp under a virtual clock. Each scenario is a random
+// schedule of trigger changes and bounces, USB enumeration times and
+// presets the driver doesn't queue. Checked on every tick:
+// - The relay is never turned on within the cooldown after turning it off.
+// - The relay stays on for the power off delay after the last trigger.
+// - The relay follows the trigger once the delays are over, within the
+//   latency of the monitor.
+// - Once the trigger has been stable long enough, the requested preset
+//   reached the amp.
+// Every scenario also runs with the former monitor, which stepped every
+// 100 ms, as a reference. The event driven monitor must not wake up before
+// a deadline and needs a fraction of the reference's wakeups.
+//
+//   trigger_sequencer_test [scenarios] [seed]
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "trigger_sequencer.h"
+
+// CONFIG_FREERTOS_HZ is 100, the monitor only sees whole ticks.
+#define TICK_MS 10
+// TRIGGER_SETTLE_MS in main.c.
+#define SETTLE_MS 20
+#define POLL_MS 100
+
+// Cooldown, the slowest amp enumeration and plenty of retries.
+#define SETTLED_MS 30000
+#define MAX_STEPS_PER_WAKEUP 16
+#define MAX_TRIGGER_CHANGES 40
+// Of the reference's wakeups, over all scenarios.
+#define MAX_WAKEUP_PERCENT 10
+
+typedef struct {
+  uint32_t duration_ticks;
+  uint8_t trigger;
+} trigger_change_t;
+
+typedef struct {
+  trigger_change_t changes[MAX_TRIGGER_CHANGES];
+  int change_count;
+  uint32_t start_tick;
+  int busy_percent;
+  uint32_t world_seed;
+} scenario_t;
+
+typedef struct {
+  trigger_sequencer_t sequencer;
+  // Steps every POLL_MS instead of waiting for edges and deadlines.
+  bool polling;
+  // A trigger lasting longer is seen by the monitor.
+  uint32_t min_seen_ticks;
+  // Max time from an input change or deadline to the step handling it.
+  uint32_t latency_ms;
+
+  bool notified;
+  // Sleeping after an edge until the inputs settled.
+  bool settling;
+  uint32_t settle_end_tick;
+  bool wait_forever;
+  uint32_t wake_tick;
+  // The last wait was for a preset retry.
+  bool retrying;
+
+  uint32_t wakeups;
+  // Deadline wakeups which found nothing to do.
+  uint32_t early_wakeups;
+} monitor_t;
+
+typedef struct {
+  uint32_t rng_state;
+  uint32_t tick;
+  uint8_t trigger;
+  uint32_t trigger_since_tick;
+  // End of the last trigger which the monitor must have seen.
+  bool has_seen_trigger;
+  uint32_t seen_trigger_end_tick;
+
+  bool relay_on;
+  uint32_t relay_on_tick;
+  bool has_powered_off;
+  uint32_t relay_off_tick;
+  // Since turning the relay on, -1 if the amp doesn't enumerate.
+  int32_t usb_delay_ticks;
+  bool usb_connected;
+  // 0 while not connected.
+  uint8_t amp_preset;
+  // Sent while not connected, the driver applies it once the amp is.
+  uint8_t pending_preset;
+  int busy_percent;
+  monitor_t *monitor;
+} world_t;
+
+static int scenario_index;
+static uint32_t seed;
+
+static uint32_t rng_next(uint32_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+// Inclusive.
+static uint32_t rng_range(uint32_t *state, uint32_t min, uint32_t max) {
+  return min + rng_next(state) % (max - min + 1);
+}
+
+static uint32_t ms_to_ticks(uint32_t ms) { return ms / TICK_MS; }
+
+static uint32_t elapsed_ms(const world_t *world, uint32_t since_tick) {
+  return (world->tick - since_tick) * TICK_MS;
+}
+
+static bool fail(const world_t *world, const char *format, ...) {
+  printf("FAIL scenario %d (seed %" PRIu32 "), %s monitor, tick %" PRIu32
+         ": ",
+         scenario_index, seed,
+         world->monitor->polling ? "polling" : "event driven", world->tick);
+  va_list args;
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+  printf(" (trigger %d since %" PRIu32 " ms, relay %s, amp preset %d)\n",
+         world->trigger, elapsed_ms(world, world->trigger_since_tick),
+         world->relay_on ? "on" : "off", world->amp_preset);
+  return false;
+}
+
+static uint32_t trigger_duration_ticks(uint32_t *rng) {
+  uint32_t kind = rng_range(rng, 0, 99);
+  if (kind < 30) return rng_range(rng, 1, ms_to_ticks(POLL_MS));
+  if (kind < 70) return rng_range(rng, ms_to_ticks(POLL_MS) + 1, 500);
+  if (kind < 95) return rng_range(rng, 500, 3500);
+  return rng_range(rng, ms_to_ticks(SETTLED_MS),
+                   ms_to_ticks(SETTLED_MS) + 1000);
+}
+
+static void generate_scenario(uint32_t *rng, scenario_t *scenario) {
+  scenario->change_count = rng_range(rng, 1, MAX_TRIGGER_CHANGES);
+  for (int i = 0; i < scenario->change_count; i++) {
+    scenario->changes[i].duration_ticks = trigger_duration_ticks(rng);
+    scenario->changes[i].trigger = rng_range(rng, 0, 3);
+  }
+  // Some scenarios run over the wrap around of the ms and tick counters.
+  switch (rng_range(rng, 0, 3)) {
+    case 0:
+      scenario->start_tick = UINT32_MAX / TICK_MS - rng_range(rng, 0, 20000);
+      break;
+    case 1:
+      scenario->start_tick = UINT32_MAX - rng_range(rng, 0, 20000);
+      break;
+    default:
+      scenario->start_tick = rng_range(rng, 0, 100000);
+      break;
+  }
+  scenario->busy_percent = rng_range(rng, 0, 60);
+  scenario->world_seed = rng_next(rng);
+}
+
+static void set_trigger(world_t *world, uint8_t trigger) {
+  if (trigger == world->trigger) return;
+  if (world->trigger != 0 && world->tick - world->trigger_since_tick >
+                                 world->monitor->min_seen_ticks) {
+    world->has_seen_trigger = true;
+    world->seen_trigger_end_tick = world->tick;
+  }
+  world->trigger = trigger;
+  world->trigger_since_tick = world->tick;
+  // The GPIO edge interrupt.
+  world->monitor->notified = true;
+}
+
+static void turn_on_relay(world_t *world) {
+  world->relay_on = true;
+  world->relay_on_tick = world->tick;
+  uint32_t kind = rng_range(&world->rng_state, 0, 9);
+  if (kind < 8) {
+    world->usb_delay_ticks = rng_range(&world->rng_state, 50, 300);
+  } else if (kind < 9) {
+    world->usb_delay_ticks = rng_range(
+        &world->rng_state, ms_to_ticks(TRIGGER_USB_WAIT_MS), 1500);
+  } else {
+    world->usb_delay_ticks = -1;
+  }
+}
+
+static void turn_off_relay(world_t *world) {
+  world->relay_on = false;
+  world->has_powered_off = true;
+  world->relay_off_tick = world->tick;
+  world->usb_connected = false;
+  world->amp_preset = 0;
+  world->pending_preset = 0;
+}
+
+static void update_usb(world_t *world) {
+  if (!world->relay_on || world->usb_connected ||
+      world->usb_delay_ticks < 0 ||
+      world->tick - world->relay_on_tick < (uint32_t)world->usb_delay_ticks) {
+    return;
+  }
+  world->usb_connected = true;
+  // The amp starts with its own preset.
+  world->amp_preset = world->pending_preset != 0
+                          ? world->pending_preset
+                          : rng_range(&world->rng_state, 1, 3);
+  world->pending_preset = 0;
+}
+
+// set_trigger_preset in main.c, false if the driver didn't queue it.
+static bool send_preset(world_t *world, uint8_t preset) {
+  if ((int)rng_range(&world->rng_state, 0, 99) < world->busy_percent) {
+    return false;
+  }
+  if (world->usb_connected) {
+    world->amp_preset = preset;
+  } else {
+    world->pending_preset = preset;
+  }
+  return true;
+}
+
+static bool check_power_on(const world_t *world) {
+  if (world->relay_on) return fail(world, "relay turned on twice");
+  if (world->trigger == 0) return fail(world, "relay on without trigger");
+  if (world->has_powered_off &&
+      elapsed_ms(world, world->relay_off_tick) <=
+          TRIGGER_POWER_OFF_COOLDOWN_MS) {
+    return fail(world, "relay on %" PRIu32 " ms after turning it off",
+                elapsed_ms(world, world->relay_off_tick));
+  }
+  return true;
+}
+
+static bool check_power_off(const world_t *world) {
+  if (!world->relay_on) return fail(world, "relay turned off twice");
+  if (world->trigger != 0) return fail(world, "relay off with trigger");
+  if (world->has_seen_trigger &&
+      elapsed_ms(world, world->seen_trigger_end_tick) <=
+          TRIGGER_POWER_OFF_DELAY_MS) {
+    return fail(world, "relay off %" PRIu32 " ms after the last trigger",
+                elapsed_ms(world, world->seen_trigger_end_tick));
+  }
+  return true;
+}
+
+// The relay follows the trigger once the delays are over. A trigger
+// shorter than the latency may be missed, after it the delay can start
+// over once.
+static bool check_relay_in_time(const world_t *world) {
+  uint32_t latency_ms = world->monitor->latency_ms;
+  uint32_t trigger_ms = elapsed_ms(world, world->trigger_since_tick);
+  if (trigger_ms <= latency_ms) return true;
+  if (world->trigger == 0) {
+    if (world->relay_on &&
+        trigger_ms > TRIGGER_POWER_OFF_DELAY_MS + 2 * latency_ms) {
+      return fail(world, "relay still on");
+    }
+    return true;
+  }
+  if (!world->relay_on && (!world->has_powered_off ||
+                           elapsed_ms(world, world->relay_off_tick) >
+                               TRIGGER_POWER_OFF_COOLDOWN_MS + latency_ms)) {
+    return fail(world, "relay still off");
+  }
+  return true;
+}
+
+static bool check_settled(const world_t *world) {
+  if (world->trigger == 0 ||
+      elapsed_ms(world, world->trigger_since_tick) < SETTLED_MS) {
+    return true;
+  }
+  uint8_t preset = world->usb_delay_ticks < 0 ? world->pending_preset
+                                              : world->amp_preset;
+  if (preset != world->trigger) {
+    return fail(world, "preset %d never landed", world->trigger);
+  }
+  return true;
+}
+
+// Applies the event of a step like trigger_monitor_task, false on a
+// failed check. Sets retry if the preset wasn't queued.
+static bool apply_event(world_t *world, trigger_output_t output,
+                        bool *retry) {
+  trigger_sequencer_t *sequencer = &world->monitor->sequencer;
+  *retry = false;
+  switch (output.event) {
+    case TRIGGER_EVENT_POWER_OFF:
+      if (!check_power_off(world)) return false;
+      turn_off_relay(world);
+      break;
+    case TRIGGER_EVENT_POWER_ON:
+      if (!check_power_on(world)) return false;
+      turn_on_relay(world);
+      break;
+    case TRIGGER_EVENT_SET_PRESET:
+      if (send_preset(world, output.preset)) {
+        trigger_sequencer_preset_sent(sequencer, output.preset);
+      } else {
+        *retry = true;
+      }
+      break;
+    default:
+      break;
+  }
+  return true;
+}
+
+static trigger_input_t sample_input(const world_t *world) {
+  trigger_input_t input = {
+      .now_ms = world->tick * TICK_MS,
+      .trigger_preset = world->trigger,
+      .relay_on = world->relay_on,
+      .usb_connected = world->usb_connected,
+  };
+  return input;
+}
+
+// The loop of trigger_monitor_task after it woke up, until it waits again.
+// edge if not woken by a deadline.
+static bool monitor_run(world_t *world, bool edge) {
+  monitor_t *monitor = world->monitor;
+  monitor->wakeups++;
+  bool waited_for_usb = monitor->sequencer.waiting_for_usb;
+  for (int steps = 0; steps < MAX_STEPS_PER_WAKEUP; steps++) {
+    trigger_input_t input = sample_input(world);
+    trigger_output_t output =
+        trigger_sequencer_step(&monitor->sequencer, &input);
+    if (steps == 0 && !edge && !waited_for_usb && !monitor->retrying &&
+        (output.event == TRIGGER_EVENT_NONE ||
+         output.event == TRIGGER_EVENT_COOLDOWN)) {
+      monitor->early_wakeups++;
+    }
+    bool retry;
+    if (!apply_event(world, output, &retry)) return false;
+    uint32_t wait_ms = trigger_sequencer_wait_ms(&monitor->sequencer, &input,
+                                                 output.event, retry);
+    if (wait_ms == 0) {
+      // An edge in the meantime is taken right away.
+      if (monitor->notified) return true;
+      continue;
+    }
+    monitor->retrying = retry;
+    monitor->wait_forever = wait_ms == TRIGGER_NO_DEADLINE;
+    monitor->wake_tick = world->tick + ms_to_ticks(wait_ms) + 1;
+    return true;
+  }
+  return fail(world, "no wait after %d steps", MAX_STEPS_PER_WAKEUP);
+}
+
+// The former monitor, one step every POLL_MS.
+static bool monitor_poll(world_t *world) {
+  monitor_t *monitor = world->monitor;
+  if (world->tick != monitor->wake_tick) return true;
+  monitor->wakeups++;
+  monitor->wake_tick = world->tick + ms_to_ticks(POLL_MS);
+  trigger_input_t input = sample_input(world);
+  bool retry;
+  return apply_event(
+      world, trigger_sequencer_step(&monitor->sequencer, &input), &retry);
+}
+
+static bool monitor_tick(world_t *world) {
+  monitor_t *monitor = world->monitor;
+  if (monitor->polling) return monitor_poll(world);
+  if (monitor->settling) {
+    if (world->tick != monitor->settle_end_tick) return true;
+    // Bounces only cause one step.
+    monitor->settling = false;
+    monitor->notified = false;
+    return monitor_run(world, true);
+  }
+  if (monitor->notified) {
+    monitor->notified = false;
+    monitor->settling = true;
+    monitor->settle_end_tick = world->tick + ms_to_ticks(SETTLE_MS);
+    return true;
+  }
+  if (monitor->wait_forever || world->tick != monitor->wake_tick) return true;
+  // The first pass doesn't wait for a deadline either.
+  return monitor_run(world, monitor->wakeups == 0);
+}
+
+static bool run_scenario(const scenario_t *scenario, monitor_t *monitor) {
+  world_t world = {
+      .rng_state = scenario->world_seed != 0 ? scenario->world_seed : 1,
+      .tick = scenario->start_tick,
+      .trigger_since_tick = scenario->start_tick,
+      .busy_percent = scenario->busy_percent,
+      .monitor = monitor,
+  };
+  // The first step follows right away.
+  monitor->wake_tick = world.tick + 1;
+  trigger_sequencer_init(&monitor->sequencer);
+
+  int change = 0;
+  uint32_t next_change_tick =
+      world.tick + scenario->changes[0].duration_ticks;
+  while (change < scenario->change_count ||
+         elapsed_ms(&world, world.trigger_since_tick) <= SETTLED_MS + 1000) {
+    world.tick++;
+    if (change < scenario->change_count && world.tick == next_change_tick) {
+      set_trigger(&world, scenario->changes[change].trigger);
+      // The last one is held until everything settled.
+      if (++change < scenario->change_count) {
+        next_change_tick =
+            world.tick + scenario->changes[change].duration_ticks;
+      }
+    }
+    update_usb(&world);
+    if (!monitor_tick(&world) || !check_relay_in_time(&world) ||
+        !check_settled(&world)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  int scenarios = argc > 1 ? atoi(argv[1]) : 2000;
+  seed = argc > 2 ? strtoul(argv[2], NULL, 0) : 0x5eed;
+  uint32_t rng = seed != 0 ? seed : 1;
+  int failed = 0;
+  uint64_t wakeups = 0;
+  uint64_t early_wakeups = 0;
+  uint64_t polling_wakeups = 0;
+  for (scenario_index = 0; scenario_index < scenarios; scenario_index++) {
+    scenario_t scenario;
+    generate_scenario(&rng, &scenario);
+    // Settling only hides triggers up to the settle time from the monitor.
+    monitor_t monitor = {
+        .min_seen_ticks = ms_to_ticks(SETTLE_MS),
+        .latency_ms = SETTLE_MS + 2 * TICK_MS,
+    };
+    monitor_t reference = {
+        .polling = true,
+        .min_seen_ticks = ms_to_ticks(POLL_MS),
+        .latency_ms = POLL_MS + TICK_MS,
+    };
+    bool passed = run_scenario(&scenario, &monitor);
+    passed = run_scenario(&scenario, &reference) && passed;
+    if (!passed) failed++;
+    wakeups += monitor.wakeups;
+    early_wakeups += monitor.early_wakeups;
+    polling_wakeups += reference.wakeups;
+  }
+  printf("Wakeups: %" PRIu64 " event driven, %" PRIu64
+         " of them early, %" PRIu64 " polling.\n",
+         wakeups, early_wakeups, polling_wakeups);
+  printf("%d of %d scenarios failed.\n", failed, scenarios);
+  bool passed = failed == 0;
+  if (early_wakeups > 0) {
+    printf("FAIL event driven monitor woke up before a deadline.\n");
+    passed = false;
+  }
+  if (wakeups * 100 > polling_wakeups * MAX_WAKEUP_PERCENT) {
+    printf("FAIL event driven monitor woke up more than %d%% as often as the "
+           "polling one.\n",
+           MAX_WAKEUP_PERCENT);
+    passed = false;
+  }
+  return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
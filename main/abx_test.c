@@ -0,0 +1,281 @@
+#include "abx_test.h"
+
+#include <math.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "usb_driver.h"
+#include "web_server.h"
+
+// Time the amp stays muted after a switch, hides switching between presets
+// with and without FIR.
+#define ABX_UNMUTE_DELAY_US (1000 * 1000)
+#define ABX_UNMUTE_RETRY_US (50 * 1000)
+// A switch the client can't repeat is retried until it was queued.
+#define ABX_SWITCH_RETRY_US (50 * 1000)
+#define ABX_MAX_TRIALS 100000
+// Tail terms below this fraction of the sum no longer change a double.
+#define ABX_P_VALUE_EPSILON 1e-17
+
+typedef struct {
+  abx_status_t status;
+  // Never leaves this file while the test is running.
+  uint8_t preset_x;
+} abx_session_t;
+
+static const char *TAG_ABX = "ABX";
+static abx_session_t session = {0};
+// Counts the sessions, a finished one stores its p-value only if no new
+// session started while it was computed.
+static uint32_t session_id;
+static SemaphoreHandle_t abx_mutex;
+static StaticSemaphore_t abx_mutex_buffer;
+static esp_timer_handle_t unmute_timer;
+static esp_timer_handle_t switch_retry_timer;
+static const command_origin_t abx_origin = {.type = ORIGIN_AB_TEST};
+
+// The command was not queued but may be sent again later.
+static bool is_retryable(command_result_t result) {
+  return result == COMMAND_BUSY || result == COMMAND_THROTTLED;
+}
+
+static void unmute_timer_cb(void *arg) {
+  control_action_t cmd = {
+      .action = ACTION_SET_MUTE, .value = 0, .origin = abx_origin};
+  command_result_t result = enqueue_command(cmd);
+  if (is_retryable(result)) {
+    // Never leave the amp muted.
+    esp_timer_start_once(unmute_timer, ABX_UNMUTE_RETRY_US);
+  }
+}
+
+static uint8_t draw_preset_x(void) {
+  return (esp_random() & 1) ? session.status.preset_a
+                            : session.status.preset_b;
+}
+
+static uint8_t selection_to_preset(abx_selection_t selection) {
+  switch (selection) {
+    case ABX_SELECT_A:
+      return session.status.preset_a;
+    case ABX_SELECT_B:
+      return session.status.preset_b;
+    case ABX_SELECT_X:
+      return session.preset_x;
+  }
+  return 0;
+}
+
+// Called with the mutex held.
+static command_result_t switch_preset(abx_selection_t selection) {
+  control_action_t preset_cmd = {.action = ACTION_SET_PRESET,
+                                 .value = selection_to_preset(selection),
+                                 .origin = abx_origin};
+  command_result_t result;
+  if (!session.status.muted_switch) {
+    result = enqueue_command(preset_cmd);
+  } else {
+    // Mute and preset are queued back to back, the unmute follows after a
+    // fixed delay, independent of the client or network timing.
+    control_action_t mute_cmd = {
+        .action = ACTION_SET_MUTE, .value = 1, .origin = abx_origin};
+    result = enqueue_command(mute_cmd);
+    if (is_retryable(result)) return result;
+    esp_timer_stop(unmute_timer);
+    result = enqueue_command(preset_cmd);
+    esp_timer_start_once(unmute_timer, ABX_UNMUTE_DELAY_US);
+  }
+  if (!is_retryable(result)) {
+    session.status.selected = selection;
+    esp_timer_stop(switch_retry_timer);
+  }
+  return result;
+}
+
+// Called with the mutex held. The selection is shown right away, the
+// switch is retried in the background if it couldn't be queued.
+static void switch_preset_retrying(abx_selection_t selection) {
+  if (!is_retryable(switch_preset(selection))) return;
+  ESP_LOGW(TAG_ABX, "Switch busy, retrying.");
+  session.status.selected = selection;
+  esp_timer_stop(switch_retry_timer);
+  esp_timer_start_once(switch_retry_timer, ABX_SWITCH_RETRY_US);
+}
+
+static void switch_retry_timer_cb(void *arg) {
+  xSemaphoreTake(abx_mutex, portMAX_DELAY);
+  if (session.status.is_running) {
+    switch_preset_retrying(session.status.selected);
+  }
+  xSemaphoreGive(abx_mutex);
+}
+
+void abx_init(void) {
+  abx_mutex = xSemaphoreCreateMutexStatic(&abx_mutex_buffer);
+  const esp_timer_create_args_t timer_args = {.callback = unmute_timer_cb,
+                                              .name = "abx_unmute"};
+  ESP_ERROR_CHECK(esp_timer_create(&timer_args, &unmute_timer));
+  const esp_timer_create_args_t retry_args = {
+      .callback = switch_retry_timer_cb, .name = "abx_switch_retry"};
+  ESP_ERROR_CHECK(esp_timer_create(&retry_args, &switch_retry_timer));
+}
+
+esp_err_t abx_start(uint8_t preset_a, uint8_t preset_b, uint32_t trials,
+                    bool muted_switch) {
+  if (preset_a < 1 || preset_a > 3 || preset_b < 1 || preset_b > 3 ||
+      preset_a == preset_b || trials == 0 || trials > ABX_MAX_TRIALS) {
+    ESP_LOGE(TAG_ABX, "Invalid ABX config %d/%d with %lu trials.", preset_a,
+             preset_b, (unsigned long)trials);
+    return ESP_ERR_INVALID_ARG;
+  }
+  xSemaphoreTake(abx_mutex, portMAX_DELAY);
+  memset(&session, 0, sizeof(abx_session_t));
+  session_id++;
+  session.status.is_active = true;
+  session.status.is_running = true;
+  session.status.muted_switch = muted_switch;
+  session.status.preset_a = preset_a;
+  session.status.preset_b = preset_b;
+  session.status.trials = trials;
+  session.preset_x = draw_preset_x();
+  esp_timer_stop(switch_retry_timer);
+  switch_preset_retrying(ABX_SELECT_A);
+  xSemaphoreGive(abx_mutex);
+  ESP_LOGI(TAG_ABX, "ABX started, %d vs %d, %lu trials.", preset_a, preset_b,
+           (unsigned long)trials);
+  notify_state_changed(NULL);
+  return ESP_OK;
+}
+
+// Stores the result of a session which stopped running. The p-value is
+// computed without abx_mutex, broadcasts read the status meanwhile.
+static void finish_session(uint32_t id, uint32_t trials, uint32_t correct) {
+  double p_value = abx_p_value(trials, correct);
+  xSemaphoreTake(abx_mutex, portMAX_DELAY);
+  if (session_id == id && session.status.is_active) {
+    session.status.is_finished = true;
+    session.status.p_value = p_value;
+  }
+  xSemaphoreGive(abx_mutex);
+}
+
+esp_err_t abx_select(abx_selection_t selection) {
+  xSemaphoreTake(abx_mutex, portMAX_DELAY);
+  if (!session.status.is_running) {
+    xSemaphoreGive(abx_mutex);
+    return ESP_ERR_INVALID_STATE;
+  }
+  command_result_t result = switch_preset(selection);
+  xSemaphoreGive(abx_mutex);
+  if (is_retryable(result)) return ESP_ERR_TIMEOUT;
+  notify_state_changed(NULL);
+  return ESP_OK;
+}
+
+esp_err_t abx_answer(abx_selection_t x_is) {
+  if (x_is == ABX_SELECT_X) return ESP_ERR_INVALID_ARG;
+  xSemaphoreTake(abx_mutex, portMAX_DELAY);
+  if (!session.status.is_running) {
+    xSemaphoreGive(abx_mutex);
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (selection_to_preset(x_is) == session.preset_x) {
+    session.status.correct++;
+  }
+  session.status.iteration++;
+  uint32_t id = session_id;
+  uint32_t iteration = session.status.iteration;
+  uint32_t correct = session.status.correct;
+  bool finished = iteration >= session.status.trials;
+  if (finished) {
+    session.status.is_running = false;
+  } else {
+    session.preset_x = draw_preset_x();
+    // A new X is playing if X was selected, switch so the old one doesn't
+    // keep playing.
+    if (session.status.selected == ABX_SELECT_X) {
+      switch_preset_retrying(ABX_SELECT_X);
+    }
+  }
+  xSemaphoreGive(abx_mutex);
+  if (finished) {
+    finish_session(id, iteration, correct);
+    ESP_LOGI(TAG_ABX, "ABX finished, %lu of %lu correct.",
+             (unsigned long)correct, (unsigned long)iteration);
+  }
+  notify_state_changed(NULL);
+  return ESP_OK;
+}
+
+void abx_stop(void) {
+  xSemaphoreTake(abx_mutex, portMAX_DELAY);
+  bool stopped = session.status.is_running;
+  uint32_t id = session_id;
+  uint32_t iteration = session.status.iteration;
+  uint32_t correct = session.status.correct;
+  session.status.is_running = false;
+  xSemaphoreGive(abx_mutex);
+  if (stopped) {
+    finish_session(id, iteration, correct);
+    ESP_LOGI(TAG_ABX, "ABX stopped after %lu trials.",
+             (unsigned long)iteration);
+  }
+  notify_state_changed(NULL);
+}
+
+void abx_reset(void) {
+  xSemaphoreTake(abx_mutex, portMAX_DELAY);
+  bool was_active = session.status.is_active;
+  memset(&session, 0, sizeof(abx_session_t));
+  xSemaphoreGive(abx_mutex);
+  if (was_active) notify_state_changed(NULL);
+}
+
+bool abx_is_blind(void) {
+  xSemaphoreTake(abx_mutex, portMAX_DELAY);
+  bool blind = session.status.is_running;
+  xSemaphoreGive(abx_mutex);
+  return blind;
+}
+
+void abx_get_status(abx_status_t *status) {
+  xSemaphoreTake(abx_mutex, portMAX_DELAY);
+  memcpy(status, &session.status, sizeof(abx_status_t));
+  xSemaphoreGive(abx_mutex);
+}
+
+double abx_p_value(uint32_t trials, uint32_t correct) {
+  if (correct > trials) return NAN;
+  if (correct == 0) return 1.0;
+  // P(X >= correct) for X ~ B(trials, 0.5). Below the mode the lower tail
+  // is summed instead, so the sum always starts at its largest term and
+  // runs away from the mode. Only that term is computed in the log domain,
+  // the others relative to it with C(n, k + 1) = C(n, k) (n - k) / (k + 1),
+  // so nothing overflows and the loop ends after a few standard deviations.
+  const double n = trials;
+  bool upper = correct > trials / 2;
+  uint32_t k = upper ? correct : correct - 1;
+  double log_first =
+      lgamma(n + 1.0) - lgamma(k + 1.0) - lgamma(n - k + 1.0) - n * M_LN2;
+  double term = 1.0;
+  double sum = 0.0;
+  while (term >= sum * ABX_P_VALUE_EPSILON) {
+    sum += term;
+    if (upper ? k == trials : k == 0) break;
+    if (upper) {
+      term = term * (trials - k) / (k + 1);
+      k++;
+    } else {
+      term = term * k / (trials - k + 1);
+      k--;
+    }
+  }
+  double tail = exp(log_first + log(sum));
+  double p_value = upper ? tail : 1.0 - tail;
+  if (p_value < 0.0) return 0.0;
+  return p_value > 1.0 ? 1.0 : p_value;
+}
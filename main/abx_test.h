@@ -0,0 +1,57 @@
+#ifndef ABX_TEST_H
+#define ABX_TEST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <esp_err.h>
+
+#include "state_bus.h"
+
+// State fields which tell the preset. While the test is blind, changes of
+// only these are not broadcast, whether a switch to X changed the preset
+// must not show.
+#define ABX_HIDDEN_FIELDS \
+  (STATE_FIELD_PRESET | STATE_FIELD_CURRENT_SOURCE | STATE_FIELD_FILTER_NAME)
+
+typedef enum {
+  ABX_SELECT_A,
+  ABX_SELECT_B,
+  ABX_SELECT_X,
+} abx_selection_t;
+
+// Public part of the session, X is only revealed through the result once
+// the test is finished.
+typedef struct {
+  bool is_active;
+  bool is_running;
+  bool is_finished;
+  bool muted_switch;
+  uint8_t preset_a;
+  uint8_t preset_b;
+  abx_selection_t selected;
+  uint32_t trials;
+  uint32_t iteration;
+  uint32_t correct;
+  double p_value;
+} abx_status_t;
+
+void abx_init(void);
+
+esp_err_t abx_start(uint8_t preset_a, uint8_t preset_b, uint32_t trials,
+                    bool muted_switch);
+// Switches to A, B or X, muted if enabled for the session.
+esp_err_t abx_select(abx_selection_t selection);
+// Answers the current trial with A or B and draws a new X.
+esp_err_t abx_answer(abx_selection_t x_is);
+void abx_stop(void);
+void abx_reset(void);
+
+// True while the amp state must not reveal which preset is playing.
+bool abx_is_blind(void);
+void abx_get_status(abx_status_t *status);
+
+// Probability to get at least `correct` of `trials` right by guessing.
+double abx_p_value(uint32_t trials, uint32_t correct);
+
+#endif  // ABX_TEST_H
@@ -0,0 +1,190 @@
+#include "benchmark.h"
+
+#ifdef CONTROL_PATH_BENCHMARK
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "boot_profile.h"
+#include "memory_budget.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "nvs.h"
+
+#define BENCHMARK_NVS_NAMESPACE "bench"
+#define BENCHMARK_NVS_KEY_BASELINE "baseline"
+// A metric regressed if it is this much slower than its baseline.
+#define BENCHMARK_TOLERANCE_PERCENT 25
+
+typedef enum {
+  BENCH_STATE_DECODE,
+  BENCH_PACKET_ENCODE,
+  BENCH_STATE_SERIALIZE,
+  BENCH_COMMAND_PARSE,
+  BENCH_QUEUE_HANDOFF,
+  // Parse, encode, decode and serialize, the path of one command without
+  // the USB transfer.
+  BENCH_CONTROL_PATH,
+  BENCH_METRIC_COUNT
+} bench_metric_t;
+
+static const char *metric_names[BENCH_METRIC_COUNT] = {
+    "state_decode",  "packet_encode", "state_serialize",
+    "command_parse", "queue_handoff", "control_path",
+};
+static const uint32_t metric_iterations[BENCH_METRIC_COUNT] = {
+    10000, 10000, 1000, 1000, 1000, 500,
+};
+
+static const char *TAG_BENCH = "BENCHMARK";
+static const char *bench_command =
+    "{\"action\":\"set_volume\",\"value\":-30,\"client\":1,\"seq\":2}";
+static QueueHandle_t ping_queue;
+static StaticQueue_t ping_queue_buffer;
+static uint8_t ping_queue_storage[sizeof(control_action_t)];
+static QueueHandle_t pong_queue;
+static StaticQueue_t pong_queue_buffer;
+static uint8_t pong_queue_storage[sizeof(control_action_t)];
+static StackType_t echo_task_stack[BENCHMARK_ECHO_STACK_SIZE];
+static StaticTask_t echo_task_buffer;
+
+static void echo_task(void *arg) {
+  control_action_t command;
+  while (1) {
+    xQueueReceive(ping_queue, &command, portMAX_DELAY);
+    xQueueSend(pong_queue, &command, portMAX_DELAY);
+  }
+}
+
+static void run_once(bench_metric_t metric, const state_delta_t *delta) {
+  static uint8_t packet[64];
+  state_t state;
+  control_action_t command = {.action = ACTION_SET_VOLUME, .value = -30};
+  switch (metric) {
+    case BENCH_STATE_DECODE:
+      get_state(&state);
+      break;
+    case BENCH_PACKET_ENCODE:
+      benchmark_encode_packet(packet, delta);
+      break;
+    case BENCH_STATE_SERIALIZE:
+      get_state(&state);
+      benchmark_serialize_state(&state);
+      break;
+    case BENCH_COMMAND_PARSE:
+      benchmark_parse_command(bench_command);
+      break;
+    case BENCH_QUEUE_HANDOFF:
+      xQueueSend(ping_queue, &command, portMAX_DELAY);
+      xQueueReceive(pong_queue, &command, portMAX_DELAY);
+      break;
+    case BENCH_CONTROL_PATH:
+      benchmark_parse_command(bench_command);
+      benchmark_encode_packet(packet, delta);
+      get_state(&state);
+      benchmark_serialize_state(&state);
+      break;
+    case BENCH_METRIC_COUNT:
+      break;
+  }
+}
+
+static uint32_t measure(bench_metric_t metric) {
+  state_delta_t delta = {.actions = (1 << ACTION_SET_VOLUME) |
+                                    (1 << ACTION_SET_MUTE)};
+  delta.values[ACTION_SET_VOLUME] = -30;
+  // Warm up caches and arenas.
+  for (int i = 0; i < 10; i++) run_once(metric, &delta);
+  uint32_t iterations = metric_iterations[metric];
+  int64_t start = esp_timer_get_time();
+  for (uint32_t i = 0; i < iterations; i++) run_once(metric, &delta);
+  int64_t elapsed_us = esp_timer_get_time() - start;
+  uint32_t ns_per_op = (uint32_t)(elapsed_us * 1000 / iterations);
+  // One round trip is two handoffs.
+  if (metric == BENCH_QUEUE_HANDOFF) ns_per_op /= 2;
+  return ns_per_op;
+}
+
+static bool load_baseline(uint32_t *baseline) {
+  nvs_handle_t nvs;
+  if (nvs_open(BENCHMARK_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+    return false;
+  }
+  size_t len = sizeof(uint32_t) * BENCH_METRIC_COUNT;
+  esp_err_t err = nvs_get_blob(nvs, BENCHMARK_NVS_KEY_BASELINE, baseline, &len);
+  nvs_close(nvs);
+  return err == ESP_OK && len == sizeof(uint32_t) * BENCH_METRIC_COUNT;
+}
+
+static void store_baseline(const uint32_t *baseline) {
+  nvs_handle_t nvs;
+  if (nvs_open(BENCHMARK_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+    return;
+  }
+  nvs_set_blob(nvs, BENCHMARK_NVS_KEY_BASELINE, baseline,
+               sizeof(uint32_t) * BENCH_METRIC_COUNT);
+  nvs_commit(nvs);
+  nvs_close(nvs);
+}
+
+void benchmark_task(void *arg) {
+  // Added here, the task may end before its creator gets to it.
+  memory_budget_add_task(xTaskGetCurrentTaskHandle(),
+                         BENCHMARK_TASK_STACK_SIZE);
+  // Serialization needs the web server's arenas and frame pool.
+  while (boot_milestone_us(BOOT_HTTP_SERVER_STARTED) < 0) {
+    vTaskDelay(pdMS_TO_TICKS(100));
+  }
+  ping_queue = xQueueCreateStatic(1, sizeof(control_action_t),
+                                  ping_queue_storage, &ping_queue_buffer);
+  pong_queue = xQueueCreateStatic(1, sizeof(control_action_t),
+                                  pong_queue_storage, &pong_queue_buffer);
+  // The benchmark task runs on core 1, so handoffs cross cores like the
+  // ones between the web server and the USB task.
+  TaskHandle_t echo_task_hdl = xTaskCreateStaticPinnedToCore(
+      echo_task, "bench_echo", BENCHMARK_ECHO_STACK_SIZE, NULL, 1,
+      echo_task_stack, &echo_task_buffer, 0);
+
+  uint32_t baseline[BENCH_METRIC_COUNT];
+  bool has_baseline = load_baseline(baseline);
+#ifdef BENCHMARK_STORE_BASELINE
+  has_baseline = false;
+#endif  // BENCHMARK_STORE_BASELINE
+  uint32_t results[BENCH_METRIC_COUNT];
+  int regressions = 0;
+  ESP_LOGI(TAG_BENCH, "Running control path benchmark.");
+  for (int i = 0; i < BENCH_METRIC_COUNT; i++) {
+    results[i] = measure(i);
+    bool regressed =
+        has_baseline && (uint64_t)results[i] * 100 >
+                            (uint64_t)baseline[i] *
+                                (100 + BENCHMARK_TOLERANCE_PERCENT);
+    if (regressed) regressions++;
+    // Plain printf, one JSON object per line without the log prefix.
+    printf("BENCH {\"name\":\"%s\",\"iterations\":%" PRIu32
+           ",\"ns_per_op\":%" PRIu32 ",\"baseline_ns\":%" PRIu32
+           ",\"regressed\":%s}\n",
+           metric_names[i], metric_iterations[i], results[i],
+           has_baseline ? baseline[i] : 0, regressed ? "true" : "false");
+  }
+  if (!has_baseline) {
+    store_baseline(results);
+    ESP_LOGI(TAG_BENCH, "Stored results as new baseline.");
+  }
+  printf("BENCH_RESULT {\"regressions\":%d,\"pass\":%s}\n", regressions,
+         regressions ? "false" : "true");
+  if (regressions) {
+    ESP_LOGE(TAG_BENCH, "%d metrics regressed by more than %d%%.",
+             regressions, BENCHMARK_TOLERANCE_PERCENT);
+  }
+  vTaskDelete(echo_task_hdl);
+  vQueueDelete(ping_queue);
+  vQueueDelete(pong_queue);
+  memory_budget_task_done();
+  vTaskDelete(NULL);
+}
+
+#endif  // CONTROL_PATH_BENCHMARK
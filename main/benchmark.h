@@ -0,0 +1,29 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "usb_driver.h"
+
+// Runs the control path benchmark once after boot. Results are logged as
+// one "BENCH {json}" line per metric and compared against the baseline in
+// NVS, which the first run stores.
+// #define CONTROL_PATH_BENCHMARK
+// Replaces the stored baseline with the results of this run.
+// #define BENCHMARK_STORE_BASELINE
+
+#ifdef CONTROL_PATH_BENCHMARK
+#define BENCHMARK_TASK_STACK_SIZE 4096
+#define BENCHMARK_ECHO_STACK_SIZE 2048
+
+void benchmark_task(void *arg);
+
+// Hooks into the measured modules.
+void benchmark_encode_packet(uint8_t *packet, const state_delta_t *delta);
+size_t benchmark_serialize_state(const state_t *state);
+bool benchmark_parse_command(const char *message);
+#endif  // CONTROL_PATH_BENCHMARK
+
+#endif  // BENCHMARK_H
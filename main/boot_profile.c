@@ -0,0 +1,67 @@
+#include "boot_profile.h"
+
+#include <stdbool.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+static const char *TAG_BOOT = "BOOT";
+
+static const char *milestone_names[BOOT_MILESTONE_COUNT] = {
+    [BOOT_APP_MAIN] = "app_main",
+    [BOOT_USB_HOST_INSTALLED] = "usb_host_installed",
+    [BOOT_WIFI_STARTED] = "wifi_started",
+    [BOOT_HTTP_SERVER_STARTED] = "http_server_started",
+    [BOOT_WIFI_CONNECTED] = "wifi_connected",
+    [BOOT_GOT_IP] = "got_ip",
+    [BOOT_USB_DEVICE_OPENED] = "usb_device_opened",
+    [BOOT_AMP_STATE_RECEIVED] = "amp_state_received",
+    [BOOT_FIRST_WS_CLIENT] = "first_ws_client",
+    [BOOT_CONTROLLABLE] = "controllable",
+};
+
+static int64_t milestone_us[BOOT_MILESTONE_COUNT] = {0};
+static bool milestone_reached[BOOT_MILESTONE_COUNT] = {false};
+static portMUX_TYPE boot_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static bool set_milestone(boot_milestone_t milestone, int64_t now) {
+  if (milestone_reached[milestone]) return false;
+  milestone_reached[milestone] = true;
+  milestone_us[milestone] = now;
+  return true;
+}
+
+void boot_mark(boot_milestone_t milestone) {
+  int64_t now = esp_timer_get_time();
+  bool first = false;
+  bool controllable = false;
+  taskENTER_CRITICAL(&boot_lock);
+  first = set_milestone(milestone, now);
+  if (first && milestone_reached[BOOT_HTTP_SERVER_STARTED] &&
+      milestone_reached[BOOT_GOT_IP] &&
+      milestone_reached[BOOT_AMP_STATE_RECEIVED]) {
+    controllable = set_milestone(BOOT_CONTROLLABLE, now);
+  }
+  taskEXIT_CRITICAL(&boot_lock);
+
+  if (first) {
+    ESP_LOGI(TAG_BOOT, "%s after %lld ms", milestone_names[milestone],
+             now / 1000);
+  }
+  if (controllable) {
+    ESP_LOGI(TAG_BOOT, "%s after %lld ms", milestone_names[BOOT_CONTROLLABLE],
+             now / 1000);
+  }
+}
+
+int64_t boot_milestone_us(boot_milestone_t milestone) {
+  taskENTER_CRITICAL(&boot_lock);
+  int64_t us = milestone_reached[milestone] ? milestone_us[milestone] : -1;
+  taskEXIT_CRITICAL(&boot_lock);
+  return us;
+}
+
+const char *boot_milestone_name(boot_milestone_t milestone) {
+  return milestone_names[milestone];
+}
@@ -0,0 +1,28 @@
+#ifndef BOOT_PROFILE_H
+#define BOOT_PROFILE_H
+
+#include <stdint.h>
+
+typedef enum {
+  BOOT_APP_MAIN,
+  BOOT_USB_HOST_INSTALLED,
+  BOOT_WIFI_STARTED,
+  BOOT_HTTP_SERVER_STARTED,
+  BOOT_WIFI_CONNECTED,
+  BOOT_GOT_IP,
+  BOOT_USB_DEVICE_OPENED,
+  BOOT_AMP_STATE_RECEIVED,
+  BOOT_FIRST_WS_CLIENT,
+  // Server reachable and amp state known.
+  BOOT_CONTROLLABLE,
+  BOOT_MILESTONE_COUNT
+} boot_milestone_t;
+
+// Records the time since boot of the first occurrence of the milestone.
+void boot_mark(boot_milestone_t milestone);
+
+// Time in us since boot, -1 if not reached yet.
+int64_t boot_milestone_us(boot_milestone_t milestone);
+const char *boot_milestone_name(boot_milestone_t milestone);
+
+#endif  // BOOT_PROFILE_H
@@ -1,4 +1,6 @@
-var gateway = `ws://${window.location.hostname}/ws`;
+// Open as http://amp.local/?readonly to only display the state.
+const readOnly = new URLSearchParams(window.location.search).has('readonly');
+var gateway = `ws://${window.location.hostname}/ws${readOnly ? '/subscribe' : ''}`;
 var websocket;
 
 // AB
@@ -9,16 +11,20 @@ const abData = {
     likesB: 0,
 };
 
-// ABX
-const abxData = {
-    mutedSwitch: false,
-    presetA: 0,
-    presetB: 0,
-    trials: 0,
-    correct: 0,
-    iteration: 1,
-    presetX: 0,
-};
+// ABX, the session itself runs on the amp controller.
+var abxFinished = false;
+
+// Optimistic updates. Controls show the user's value right away and the
+// amp state only overrides them once the amp confirmed the latest command
+// (the firmware echoes [client, seq] per action in amp_state.acks).
+const clientId = Math.floor(Math.random() * 0xFFFFFFFE) + 1;
+const PENDING_TIMEOUT_MS = 3000;
+var commandSeq = 0;
+const pendingCommands = {};
+// Slider value not sent yet, null if none.
+var volumeTarget = null;
+var lastSentVolume = null;
+var volumeFrameRequested = false;
 
 // websocket
 window.addEventListener('load', onLoad);
@@ -43,7 +49,15 @@ function initWebSocket() {
 
 function onOpen(event) {
     console.log('Connection opened');
-    sendCommand('get_state', 0);
+    if (lastAmpState && lastAmpState.version !== undefined) {
+        // Only fetch what changed while disconnected.
+        sendCommand('resume', { epoch: lastAmpState.epoch, version: lastAmpState.version });
+    } else {
+        sendCommand('get_state', 0);
+    }
+    if (!readOnly) {
+        sendCommand('get_scenes', 0);
+    }
 }
 
 function onClose(event) {
@@ -55,9 +69,45 @@ function onClose(event) {
 function onMessage(event) {
     console.log('Received: ', event.data);
     const state = JSON.parse(event.data);
+    if (state.journal) {
+        applyJournal(state.journal);
+        return;
+    }
+    if (state.scenes) {
+        updateScenes(state.scenes);
+        return;
+    }
+    if (state.command_result) {
+        // Not queued, the amp state is right again.
+        delete pendingCommands[state.command_result.action];
+        if (state.command_result.action === 'set_volume') {
+            lastSentVolume = null;
+        }
+        showCommandResult(state.command_result);
+        return;
+    }
     updateUI(state);
 }
 
+var commandStatusTimer = null;
+
+// Only commands which were not queued right away are reported.
+function showCommandResult(commandResult) {
+    const messages = {
+        busy: 'busy, try again',
+        throttled: 'too many commands, try again',
+        rejected: 'rejected',
+        deferred: 'sent once the amp is connected'
+    };
+    document.getElementById('commandStatus').textContent =
+        commandResult.action + ' ' + (messages[commandResult.result] || commandResult.result);
+    document.getElementById('commandStatusItem').style.display = 'flex';
+    clearTimeout(commandStatusTimer);
+    commandStatusTimer = setTimeout(function () {
+        document.getElementById('commandStatusItem').style.display = 'none';
+    }, 2000);
+}
+
 var wsSendMock = function (jsonString) {
     const data = JSON.parse(jsonString);
     const action = data.action;
@@ -83,6 +133,19 @@ var wsSendMock = function (jsonString) {
                 }
             };
             break;
+        case 'start_abx':
+            response = {
+                abx_test: {
+                    preset_a: value.preset_a,
+                    preset_b: value.preset_b,
+                    trials: value.trials,
+                    iteration: 0,
+                    selected: 'A',
+                    is_running: true,
+                    is_finished: false
+                }
+            };
+            break;
         case 'get_state':
             response = {
                 amp_state: {
@@ -102,8 +165,35 @@ var wsSendMock = function (jsonString) {
     onMessage({ data: JSON.stringify(response) });
 }
 
+function isPending(action) {
+    const pending = pendingCommands[action];
+    if (!pending) {
+        return false;
+    }
+    if (Date.now() - pending.sentAt > PENDING_TIMEOUT_MS) {
+        delete pendingCommands[action];
+        return false;
+    }
+    return true;
+}
+
+function reconcile(acks) {
+    Object.entries(acks || {}).forEach(([action, [client, seq]]) => {
+        const pending = pendingCommands[action];
+        // Confirmed, or another client changed it later.
+        if (pending && (client !== clientId || seq >= pending.seq)) {
+            delete pendingCommands[action];
+        }
+    });
+}
+
 function sendCommand(action, value) {
     const data = { action: action, value: value };
+    if (action.startsWith('set_')) {
+        data.client = clientId;
+        data.seq = ++commandSeq;
+        pendingCommands[action] = { seq: data.seq, sentAt: Date.now() };
+    }
     const jsonString = JSON.stringify(data);
     if (websocket && websocket.readyState === WebSocket.OPEN) {
         websocket.send(jsonString);
@@ -118,9 +208,33 @@ function setPreset(preset) {
     sendCommand('set_preset', preset);
 }
 
+// Sends at most once per frame and only one volume command at a time, the
+// newest value follows once the amp confirmed the previous one.
 function setVolume() {
-    var volume = document.getElementById('volumeSlider').value;
-    sendCommand('set_volume', parseInt(volume));
+    volumeTarget = parseInt(document.getElementById('volumeSlider').value);
+    updateVolumeLabel();
+    requestVolumeFlush();
+}
+
+function requestVolumeFlush() {
+    if (volumeFrameRequested) {
+        return;
+    }
+    volumeFrameRequested = true;
+    requestAnimationFrame(flushVolume);
+}
+
+function flushVolume() {
+    volumeFrameRequested = false;
+    if (volumeTarget === null || isPending('set_volume')) {
+        return;
+    }
+    if (volumeTarget === lastSentVolume) {
+        volumeTarget = null;
+        return;
+    }
+    lastSentVolume = volumeTarget;
+    sendCommand('set_volume', volumeTarget);
 }
 
 function updateVolumeLabel() {
@@ -144,126 +258,115 @@ function setSource(preset) {
 }
 
 
-// ABX tests
-
-// p-value
-// Function to calculate factorial
-function factorial(n) {
-    if (n < 0) return NaN;
-    if (n === 0 || n === 1) return 1;
-    let result = 1;
-    for (let i = 2; i <= n; i++) {
-        result *= i;
+// Changes missed while disconnected, each entry only has the changed fields.
+function applyJournal(journal) {
+    if (!lastAmpState) {
+        sendCommand('get_state', 0);
+        return;
     }
-    return result;
+    var amp = Object.assign({}, lastAmpState);
+    journal.entries.forEach(entry => {
+        Object.assign(amp, entry.amp_state);
+        amp.version = entry.version;
+    });
+    updateUI({ amp_state: amp });
+}
+
+// Scenes, recalled by the firmware with a single packet.
+var lastAmpState = null;
+
+function updateScenes(scenes) {
+    const container = document.getElementById('sceneButtons');
+    container.innerHTML = '';
+    scenes.forEach(scene => {
+        const button = document.createElement('button');
+        button.textContent = scene.name;
+        button.title = 'Right click to delete';
+        button.disabled = currentPreset == 0 || readOnly;
+        button.onclick = () => sendCommand('recall_scene', scene.name);
+        button.oncontextmenu = (event) => {
+            event.preventDefault();
+            if (confirm(`Delete scene ${scene.name}?`)) {
+                sendCommand('delete_scene', scene.name);
+            }
+        };
+        container.appendChild(button);
+    });
 }
 
-// Function to calculate binomial coefficient C(n, k)
-function combinations(n, k) {
-    if (k < 0 || k > n) {
-        return 0;
-    }
-    if (k === 0 || k === n) {
-        return 1;
-    }
-    if (k > n / 2) {
-        k = n - k;
+function saveScene() {
+    const name = document.getElementById('sceneName').value.trim();
+    if (!name || !lastAmpState || lastAmpState.preset === undefined) {
+        return;
     }
-    let res = 1;
-    for (let i = 1; i <= k; i++) {
-        res = res * (n - i + 1) / i;
+    const actions = {
+        set_preset: lastAmpState.preset,
+        set_volume: Math.round(lastAmpState.volume_db),
+        set_mute: lastAmpState.is_muted,
+    };
+    for (let i = 0; i < 3; i++) {
+        actions[`set_source_p${i + 1}`] = lastAmpState.preset_source[i];
+        actions[`set_eq_p${i + 1}`] = lastAmpState.eq_on[i];
     }
-    return res;
-}
-
-// Function to calculate binomial probability mass function P(X=k)
-function binomialPMF(n, k) {
-    const p = 0.5; // Probability of success for ABX test
-    const C_nk = combinations(n, k);
-    return C_nk * Math.pow(p, k) * Math.pow(1 - p, n - k);
+    sendCommand('save_scene', { name: name, actions: actions });
 }
 
-// Function to calculate the p-value for an ABX test
-// This is the cumulative probability of getting k or more correct answers
-function calculateABXPValue(totalTrials, correctAnswers) {
-    if (totalTrials < 0 || correctAnswers < 0 || correctAnswers > totalTrials) {
-        return NaN; // Invalid input
-    }
-
-    let pValue = 0;
-    for (let i = correctAnswers; i <= totalTrials; i++) {
-        pValue += binomialPMF(totalTrials, i);
-    }
-    return pValue;
-}
+// ABX tests
+const abxButtonIds = { A: 'abxPresetABtn', B: 'abxPresetBBtn', X: 'abxPresetXBtn' };
 
-function updateABXPresetButtons(enabledPresetBtnId) {
-    ['abxPresetABtn', 'abxPresetBBtn', 'abxPresetXBtn'].forEach((id) => {
-        document.getElementById(id).className = (enabledPresetBtnId === id) ? 'active' : '';
+function updateABXPresetButtons(selected) {
+    Object.entries(abxButtonIds).forEach(([selection, id]) => {
+        document.getElementById(id).className = (selection === selected) ? 'active' : '';
     });
 }
 
-function presetABX(presetBtnId) {
-    updateABXPresetButtons(presetBtnId);
-    if (abxData.mutedSwitch) {
-        sendCommand('set_mute', true);
-    }
-    switch (presetBtnId) {
-        case 'abxPresetABtn':
-            setPreset(abxData.presetA);
-            break;
-        case 'abxPresetBBtn':
-            setPreset(abxData.presetB);
-            break;
-        case 'abxPresetXBtn':
-            setPreset(abxData.presetX);
-            break;
-    }
-    if (abxData.mutedSwitch) {
-        setTimeout(sendCommand, 1000, 'set_mute', false);
-    }
+function presetABX(selection) {
+    updateABXPresetButtons(selection);
+    sendCommand('abx_select', selection);
 }
 
 function startAbxTest() {
-    abxData.mutedSwitch = document.getElementById('abx_mute').checked;
-    abxData.presetA = parseInt(document.getElementById('abxPresetA').value);
-    abxData.presetB = parseInt(document.getElementById('abxPresetB').value);
-    abxData.trials = parseInt(document.getElementById('abxTrials').value);
-    abxData.correct = 0;
-    abxData.iteration = 0;
-    abxData.presetX = Math.random() < 0.5 ? abxData.presetA : abxData.presetB;
-
-    document.getElementById('abxOverallTrials').textContent = abxData.trials;
-
-    // start with A
-    presetABX('abxPresetABtn');
+    const config = {
+        preset_a: parseInt(document.getElementById('abxPresetA').value),
+        preset_b: parseInt(document.getElementById('abxPresetB').value),
+        trials: parseInt(document.getElementById('abxTrials').value),
+        muted_switch: document.getElementById('abx_mute').checked,
+    };
+    abxFinished = false;
+    sendCommand('start_abx', config);
     switchView('abxActiveView');
 }
 
 function resetABXTest() {
+    sendCommand('reset_abx', 0);
     switchView('abxControlView');
 }
 
 function stopABXTest() {
-    const pValue = calculateABXPValue(abxData.trials, abxData.correct);
-    document.getElementById('abxResultPresetA').textContent = abxData.presetA;
-    document.getElementById('abxResultPresetB').textContent = abxData.presetB;
-    document.getElementById('abxResultTrials').textContent = abxData.iteration;
-    document.getElementById('abxResultCorrect').textContent = abxData.correct;
+    sendCommand('stop_abx', 0);
+}
+
+function showABXResults(abx) {
+    const pValue = abx.p_value;
+    document.getElementById('abxResultPresetA').textContent = abx.preset_a;
+    document.getElementById('abxResultPresetB').textContent = abx.preset_b;
+    document.getElementById('abxResultTrials').textContent = abx.iteration;
+    document.getElementById('abxResultCorrect').textContent = abx.correct;
 
     const abxResultPValue = document.getElementById('abxResultPValue');
     abxResultPValue.textContent = pValue.toFixed(4);
     const interpretationDisplay = document.getElementById('interpretation');
+    const percent = (pValue * 100).toFixed(2);
     // Interpretation (common significance level alpha = 0.05)
     const alpha = 0.05;
     if (pValue <= alpha) {
         interpretationDisplay.textContent =
-            `Since the chance of the results being random is very low (${pValue.toFixed(4) * 100}%) — well below the 5% cutoff — we can conclude there is a real, significant difference.`;
+            `Since the chance of the results being random is very low (${percent}%) — well below the 5% cutoff — we can conclude there is a real, significant difference.`;
         abxResultPValue.classList.remove('abx-fail');
         abxResultPValue.classList.add('abx-success');
     } else {
         interpretationDisplay.textContent =
-            `Since the ${pValue.toFixed(4) * 100}% chance of the results being random is well above the 5% cutoff, we cannot conclude there's a real difference.`;
+            `Since the ${percent}% chance of the results being random is well above the 5% cutoff, we cannot conclude there's a real difference.`;
         abxResultPValue.classList.remove('abx-success');
         abxResultPValue.classList.add('abx-fail');
     }
@@ -271,27 +374,22 @@ function stopABXTest() {
     switchView('abxResultsView');
 }
 
-function getAbxPresetNumber(preset) {
-    switch (preset) {
-        case 'presetA':
-            return abxData.presetA;
-        case 'presetB':
-            return abxData.presetB;
-    }
+function xIs(selection) {
+    sendCommand('abx_answer', selection);
 }
 
-function xIs(preset) {
-    if (abxData.presetX === getAbxPresetNumber(preset)) {
-        abxData.correct++;
-    }
-    abxData.iteration++;
-    if (abxData.iteration >= abxData.trials) {
-        stopABXTest();
+function updateABX(abx) {
+    document.getElementById('abxIteration').textContent = abx.iteration;
+    document.getElementById('abxOverallTrials').textContent = abx.trials;
+    updateABXPresetButtons(abx.selected);
+    if (abx.is_running) {
+        switchView('abxActiveView');
+    } else if (abx.is_finished && !abxFinished) {
+        abxFinished = true;
+        showABXResults(abx);
+        // The playing preset is hidden during the test, fetch it again.
+        sendCommand('get_state', 0);
     }
-    // New X
-    abxData.presetX = Math.random() < 0.5 ? abxData.presetA : abxData.presetB;
-    document.getElementById('abxIteration').textContent = abxData.iteration;
-    console.log(abxData.presetX);
 }
 
 // AB tests
@@ -451,20 +549,42 @@ function getScanLabel(source) {
 function updateUI(state) {
     if (state.amp_state) {
         const amp = state.amp_state;
-        currentPreset = amp.preset ? amp.preset : 0;
-        document.getElementById('filterName').innerHTML = amp.filter_name != "" ? amp.filter_name : "NOT CONNECTED";
-        document.getElementById('muteBtn').className = amp.is_muted ? 'active' : '';
-        updatePresetButtons(amp.preset);
+        lastAmpState = amp;
+        reconcile(amp.acks);
+        // The playing preset is left out during an ABX test.
+        const presetKnown = amp.preset !== undefined;
+        if (presetKnown) {
+            currentPreset = amp.preset ? amp.preset : 0;
+            document.getElementById('filterName').innerHTML = amp.filter_name != "" ? amp.filter_name : "NOT CONNECTED";
+            if (!isPending('set_preset')) {
+                updatePresetButtons(amp.preset);
+            }
+        }
+        if (!isPending('set_mute')) {
+            document.getElementById('muteBtn').className = amp.is_muted ? 'active' : '';
+        }
         for (let i = 0; i < 3; i++) {
             const eqBtn = document.getElementById(`eqBtn${i + 1}`);
-            eqBtn.classList.toggle('active', amp.eq_on[i]);
+            if (!isPending(`set_eq_p${i + 1}`)) {
+                eqBtn.classList.toggle('active', amp.eq_on[i]);
+            }
             const source = document.getElementById(`source${i + 1}`);
-            source.value = amp.preset_source[i];
+            if (!isPending(`set_source_p${i + 1}`)) {
+                source.value = amp.preset_source[i];
+            }
             // If current presets source is SCAN update auto dected source
-            source[0].label = getScanLabel(amp.preset_source[i] == 0 && amp.preset == i + 1 ? amp.current_source : 0);
+            if (presetKnown) {
+                source[0].label = getScanLabel(amp.preset_source[i] == 0 && amp.preset == i + 1 ? amp.current_source : 0);
+            }
+        }
+        if (volumeTarget !== null) {
+            // The user is still moving the slider.
+            requestVolumeFlush();
+        } else if (!isPending('set_volume')) {
+            document.getElementById('volumeSlider').value = amp.volume_db;
+            lastSentVolume = null;
+            updateVolumeLabel();
         }
-        document.getElementById('volumeSlider').value = amp.volume_db;
-        updateVolumeLabel();
     }
     if (state.ab_test) {
         const ab_state = state.ab_test;
@@ -482,5 +602,8 @@ function updateUI(state) {
             switchView('abControlView');
         }
     }
-    disableUI(currentPreset == 0);
+    if (state.abx_test) {
+        updateABX(state.abx_test);
+    }
+    disableUI(currentPreset == 0 || readOnly);
 }
@@ -0,0 +1,80 @@
+#include "json_arena.h"
+
+#include <stdlib.h>
+
+#include "cJSON.h"
+#include "esp_log.h"
+#include "freertos/task.h"
+
+#define JSON_ARENA_ALIGN 8
+
+static const char *TAG_ARENA = "JSON_ARENA";
+static json_arena_t *arenas[JSON_ARENA_MAX] = {NULL};
+static int num_arenas = 0;
+static uint32_t take_counter = 0;
+
+static json_arena_t *current_arena(void) {
+  TaskHandle_t task = xTaskGetCurrentTaskHandle();
+  json_arena_t *current = NULL;
+  for (int i = 0; i < num_arenas; i++) {
+    if (arenas[i]->owner == task &&
+        (current == NULL || arenas[i]->take_seq > current->take_seq)) {
+      current = arenas[i];
+    }
+  }
+  return current;
+}
+
+static void *arena_malloc(size_t size) {
+  json_arena_t *arena = current_arena();
+  if (arena != NULL) {
+    size_t aligned = (size + JSON_ARENA_ALIGN - 1) & ~(JSON_ARENA_ALIGN - 1);
+    if (arena->size - arena->used >= aligned) {
+      void *ptr = &arena->buffer[arena->used];
+      arena->used += aligned;
+      if (arena->used > arena->peak) arena->peak = arena->used;
+      return ptr;
+    }
+    arena->overflows++;
+  }
+  return malloc(size);
+}
+
+static void arena_free(void *ptr) {
+  for (int i = 0; i < num_arenas; i++) {
+    const uint8_t *buffer = arenas[i]->buffer;
+    if ((const uint8_t *)ptr >= buffer &&
+        (const uint8_t *)ptr < buffer + arenas[i]->size) {
+      // Released all at once.
+      return;
+    }
+  }
+  free(ptr);
+}
+
+void json_arena_init(json_arena_t *arena) {
+  assert(num_arenas < JSON_ARENA_MAX);
+  arena->mutex = xSemaphoreCreateMutexStatic(&arena->mutex_buffer);
+  arena->owner = NULL;
+  arena->used = 0;
+  arenas[num_arenas++] = arena;
+  if (num_arenas == 1) {
+    cJSON_Hooks hooks = {.malloc_fn = arena_malloc, .free_fn = arena_free};
+    cJSON_InitHooks(&hooks);
+  }
+  ESP_LOGI(TAG_ARENA, "Arena %s with %u bytes", arena->name,
+           (unsigned int)arena->size);
+}
+
+void json_arena_take(json_arena_t *arena) {
+  xSemaphoreTake(arena->mutex, portMAX_DELAY);
+  arena->used = 0;
+  arena->take_seq = ++take_counter;
+  arena->owner = xTaskGetCurrentTaskHandle();
+}
+
+void json_arena_release(json_arena_t *arena) {
+  arena->owner = NULL;
+  arena->used = 0;
+  xSemaphoreGive(arena->mutex);
+}
@@ -0,0 +1,43 @@
+#ifndef JSON_ARENA_H
+#define JSON_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+// Bump allocator for cJSON. While a task holds an arena all cJSON
+// allocations of that task come from it, freeing is a no-op and the whole
+// arena is reset when it is released. Allocations of other tasks, or once
+// the arena is full, fall back to the heap.
+typedef struct {
+  const char *name;
+  uint8_t *buffer;
+  size_t size;
+  size_t used;
+  size_t peak;
+  uint32_t overflows;
+  volatile TaskHandle_t owner;
+  // Order in which the owner took its arenas, the latest one is used.
+  uint32_t take_seq;
+  SemaphoreHandle_t mutex;
+  StaticSemaphore_t mutex_buffer;
+} json_arena_t;
+
+#define JSON_ARENA_INIT(arena_name, arena_buffer) \
+  {.name = (arena_name),                          \
+   .buffer = (arena_buffer),                      \
+   .size = sizeof(arena_buffer)}
+
+#define JSON_ARENA_MAX 2
+
+// Registers the arena, the first call installs the cJSON hooks.
+void json_arena_init(json_arena_t *arena);
+
+// Blocks until the arena is free. Arenas taken by the same task must be
+// released in reverse order.
+void json_arena_take(json_arena_t *arena);
+void json_arena_release(json_arena_t *arena);
+
+#endif  // JSON_ARENA_H
@@ -1,12 +1,23 @@
 #include <assert.h>
+#include <stdio.h>
 
+#include "benchmark.h"
+#include "boot_profile.h"
+#include "memory_budget.h"
+#include "power.h"
+#include "scenes.h"
+#include "state_bus.h"
+#include "state_journal.h"
+#include "trigger_sequencer.h"
 #include "usb_driver.h"
 #include "web_server.h"
 #include "driver/gpio.h"
+#include "esp_attr.h"
 #include "esp_log.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
 #include "freertos/task.h"
+#include "nvs_flash.h"
 #include "usb/usb_host.h"
 
 #define USB_LIB_TASK_PRIORITY 2
@@ -14,21 +25,79 @@
 #define TRIGGER_TASK_PRIORITY 3
 #define WEB_SERVER_TASK_PRIORITY 4
 
+// In bytes. Not measured yet, these run on the device only: see "Task
+// stacks" in README.md. The driver's stack is in usb_driver.h.
+#define USB_LIB_TASK_STACK_SIZE 4096
+#define TRIGGER_TASK_STACK_SIZE 4096
+
 // *** IO PIN CONFIGURATION ***
 #define TRIGGER_PIN_PRESET_1 GPIO_NUM_4
 #define TRIGGER_PIN_PRESET_2 GPIO_NUM_5
 #define TRIGGER_PIN_PRESET_3 GPIO_NUM_6
 #define RELAY_PIN GPIO_NUM_14
+// Trigger edges wake the monitor, which samples the inputs once they settled.
+#define TRIGGER_SETTLE_MS 20
 
 static const char *TAG = "TRIGGER_TASK";
 
+// Static, so they show up per module in the linker map.
+static StackType_t usb_host_lib_task_stack[USB_LIB_TASK_STACK_SIZE];
+static StaticTask_t usb_host_lib_task_buffer;
+static StackType_t class_driver_task_stack[USB_DRIVER_TASK_STACK_SIZE];
+static StaticTask_t class_driver_task_buffer;
+static StackType_t trigger_task_stack[TRIGGER_TASK_STACK_SIZE];
+static StaticTask_t trigger_task_buffer;
+static StackType_t web_server_task_stack[WEB_SERVER_TASK_STACK_SIZE];
+static StaticTask_t web_server_task_buffer;
+#ifdef CONTROL_PATH_BENCHMARK
+static StackType_t benchmark_task_stack[BENCHMARK_TASK_STACK_SIZE];
+static StaticTask_t benchmark_task_buffer;
+#endif  // CONTROL_PATH_BENCHMARK
+static StaticSemaphore_t host_lib_installed_buffer;
+static TaskHandle_t trigger_task;
+
 static bool is_amp_powered_on(void) { return (bool)gpio_get_level(RELAY_PIN); }
 
 static void turn_on_relay(void) { gpio_set_level(RELAY_PIN, 1); }
 static void turn_off_relay(void) { gpio_set_level(RELAY_PIN, 0); }
 
+static uint8_t read_trigger_preset(void) {
+  // Triggers are active low, the lowest preset wins.
+  if (!gpio_get_level(TRIGGER_PIN_PRESET_1)) return 1;
+  if (!gpio_get_level(TRIGGER_PIN_PRESET_2)) return 2;
+  if (!gpio_get_level(TRIGGER_PIN_PRESET_3)) return 3;
+  return 0;
+}
+
+// A scene named "trigger1" to "trigger3" is recalled together with the
+// preset, e.g. to also select the source and volume.
+static command_result_t set_trigger_preset(uint8_t preset) {
+  const command_origin_t trigger_origin = {.type = ORIGIN_TRIGGER};
+  char name[SCENE_NAME_MAX_LEN];
+  snprintf(name, sizeof(name), "trigger%d", preset);
+  scene_t scene;
+  if (scenes_find(name, &scene)) {
+    ESP_LOGI(TAG, "Set Preset %d with scene %s.", preset, name);
+    scene.delta.actions |= 1 << ACTION_SET_PRESET;
+    scene.delta.values[ACTION_SET_PRESET] = preset;
+    return enqueue_state_delta(&scene.delta, trigger_origin);
+  }
+  ESP_LOGI(TAG, "Set Preset %d.", preset);
+  control_action_t cmd = {.action = ACTION_SET_PRESET,
+                          .value = preset,
+                          .origin = trigger_origin};
+  return enqueue_command(cmd);
+}
+
+static void IRAM_ATTR trigger_edge_isr(void *arg) {
+  BaseType_t woken = pdFALSE;
+  vTaskNotifyGiveFromISR(trigger_task, &woken);
+  portYIELD_FROM_ISR(woken);
+}
+
 static void trigger_monitor_task(void *arg) {
   ESP_LOGI(TAG, "Trigger-Monitor-Task started.");
+  trigger_task = xTaskGetCurrentTaskHandle();
 
   const uint64_t trigger_pin_mask = (1ULL << TRIGGER_PIN_PRESET_1) |
                                     (1ULL << TRIGGER_PIN_PRESET_2) |
@@ -38,9 +107,17 @@ static void trigger_monitor_task(void *arg) {
       .mode = GPIO_MODE_INPUT,
       .pull_up_en = GPIO_PULLUP_DISABLE,
       .pull_down_en = GPIO_PULLDOWN_DISABLE,
-      .intr_type = GPIO_INTR_DISABLE,
+      .intr_type = GPIO_INTR_ANYEDGE,
   };
   gpio_config(&trigger_io_conf);
+  // Already installed by another component, its handlers keep working.
+  esp_err_t isr_err = gpio_install_isr_service(0);
+  if (isr_err != ESP_ERR_INVALID_STATE) ESP_ERROR_CHECK(isr_err);
+  const gpio_num_t trigger_pins[] = {TRIGGER_PIN_PRESET_1, TRIGGER_PIN_PRESET_2,
+                                     TRIGGER_PIN_PRESET_3};
+  for (int i = 0; i < 3; i++) {
+    gpio_isr_handler_add(trigger_pins[i], trigger_edge_isr, NULL);
+  }
 
   gpio_config_t relay_io_conf = {
       .pin_bit_mask = (1ULL << RELAY_PIN),
@@ -50,82 +127,71 @@ static void trigger_monitor_task(void *arg) {
   turn_off_relay();
 
   // TODO: reset to actual state if we're not on ab compare mode
-  uint8_t current_preset = 0;
-  TickType_t no_trigger_start_time = 0;
-  TickType_t last_power_off_time = -10001;
-  const TickType_t POWER_OFF_COOLDOWN_TICKS = pdMS_TO_TICKS(10000);
-  const TickType_t POWER_OFF_DELAY_TICKS = pdMS_TO_TICKS(10000);
+  trigger_sequencer_t sequencer;
+  trigger_sequencer_init(&sequencer);
 
+  TickType_t wait = 0;
   while (1) {
-    vTaskDelay(pdMS_TO_TICKS(100));
-
-    int8_t new_preset = 0;
-    if (!gpio_get_level(TRIGGER_PIN_PRESET_1))
-      new_preset = 1;
-    else if (!gpio_get_level(TRIGGER_PIN_PRESET_2))
-      new_preset = 2;
-    else if (!gpio_get_level(TRIGGER_PIN_PRESET_3))
-      new_preset = 3;
-
-    if (new_preset == current_preset) {
-      no_trigger_start_time = 0;
-      continue;
+    // Sleeps until a trigger changes or the sequencer has a deadline.
+    bool edge = ulTaskNotifyTake(pdTRUE, wait) > 0;
+    if (edge) {
+      // Bounces only cause one step.
+      vTaskDelay(pdMS_TO_TICKS(TRIGGER_SETTLE_MS));
+      ulTaskNotifyTake(pdTRUE, 0);
     }
+    bool retry = false;
 
-    if (new_preset == 0) {
-      // Shutdown
-      if (!is_amp_powered_on()) {
-        ESP_LOGW(TAG, "Already off fix internal state");
-        current_preset = 0;
-        continue;
-      }
-      if (no_trigger_start_time == 0) {
+    trigger_input_t input = {
+        .now_ms = pdTICKS_TO_MS(xTaskGetTickCount()),
+        .trigger_preset = read_trigger_preset(),
+        .relay_on = is_amp_powered_on(),
+        .usb_connected = is_device_connected(),
+    };
+    trigger_output_t output = trigger_sequencer_step(&sequencer, &input);
+    switch (output.event) {
+      case TRIGGER_EVENT_NONE:
+        break;
+      case TRIGGER_EVENT_POWER_OFF_SCHEDULED:
         ESP_LOGI(TAG, "No trigger present. Starting power off sequence.");
-        no_trigger_start_time = xTaskGetTickCount();
-        continue;
-      }
-      if ((xTaskGetTickCount() - no_trigger_start_time) >
-          POWER_OFF_DELAY_TICKS) {
+        break;
+      case TRIGGER_EVENT_POWER_OFF:
         ESP_LOGI(TAG, "Turning off amp");
         turn_off_relay();
-        current_preset = 0;
-        last_power_off_time = xTaskGetTickCount();
-        no_trigger_start_time = 0;
-      }
-      continue;
-    } else {
-      if (!is_amp_powered_on()) {
-        // Turn on amp first
-        TickType_t time_since_last_off =
-            xTaskGetTickCount() - last_power_off_time;
-        if (time_since_last_off > POWER_OFF_COOLDOWN_TICKS) {
-          ESP_LOGI(TAG, "Turning on AMP. Trigger %d active.", new_preset);
-          turn_on_relay();
-
-          ESP_LOGI(TAG, "Wait for USB-Connection...");
-          int wait_cycles = 100;
-          while (!is_device_connected() && wait_cycles > 0) {
-            vTaskDelay(pdMS_TO_TICKS(100));
-            wait_cycles--;
-          }
-
-          // Check if connected or timeout occured.
-          if (is_device_connected()) {
-            ESP_LOGI(TAG, "AMP connected.");
-          } else {
-            ESP_LOGE(TAG, "AMP not detected via USB!");
-            // continue;
-          }
+        break;
+      case TRIGGER_EVENT_COOLDOWN:
+        ESP_LOGW(TAG, "Turn on not allowed still in cooldown.");
+        break;
+      case TRIGGER_EVENT_POWER_ON:
+        ESP_LOGI(TAG, "Turning on AMP. Trigger %d active.",
+                 input.trigger_preset);
+        turn_on_relay();
+        ESP_LOGI(TAG, "Wait for USB-Connection...");
+        break;
+      case TRIGGER_EVENT_USB_CONNECTED:
+        ESP_LOGI(TAG, "AMP connected.");
+        break;
+      case TRIGGER_EVENT_USB_TIMEOUT:
+        ESP_LOGE(TAG, "AMP not detected via USB!");
+        break;
+      case TRIGGER_EVENT_SET_PRESET: {
+        // If not queued, the next step asks again.
+        command_result_t result = set_trigger_preset(output.preset);
+        if (result == COMMAND_BUSY || result == COMMAND_THROTTLED) {
+          retry = true;
         } else {
-          ESP_LOGW(TAG, "Turn on not allowed still in cooldown.");
-          continue;
+          trigger_sequencer_preset_sent(&sequencer, output.preset);
         }
+        break;
       }
-      ESP_LOGI(TAG, "Set Preset %d.", new_preset);
-      control_action_t cmd = {.action = ACTION_SET_PRESET,
-                              .value = new_preset};
-      enqueue_command(cmd);
-      current_preset = new_preset;
+    }
+    wakeup_record(WAKEUP_TRIGGER,
+                  !edge && output.event == TRIGGER_EVENT_NONE);
+    uint32_t wait_ms =
+        trigger_sequencer_wait_ms(&sequencer, &input, output.event, retry);
+    if (wait_ms == TRIGGER_NO_DEADLINE) {
+      wait = portMAX_DELAY;
+    } else {
+      wait = wait_ms == 0 ? 0 : pdMS_TO_TICKS(wait_ms) + 1;
     }
   }
 }
@@ -137,6 +203,7 @@ static void usb_host_lib_task(void *arg) {
   usb_host_config_t host_config = {.skip_phy_setup = false,
                                    .intr_flags = ESP_INTR_FLAG_LEVEL1};
   ESP_ERROR_CHECK(usb_host_install(&host_config));
+  boot_mark(BOOT_USB_HOST_INSTALLED);
 
   // Signal that the host library is installed
   xSemaphoreGive(installed);
@@ -155,42 +222,80 @@ static void usb_host_lib_task(void *arg) {
 }
 
 void app_main(void) {
+  boot_mark(BOOT_APP_MAIN);
   ESP_LOGI("APP_MAIN", "Starting app main...");
-  SemaphoreHandle_t host_lib_installed = xSemaphoreCreateBinary();
-  SemaphoreHandle_t hypex_state_updated = xSemaphoreCreateBinary();
+  power_init();
+  SemaphoreHandle_t host_lib_installed =
+      xSemaphoreCreateBinaryStatic(&host_lib_installed_buffer);
 
   TaskHandle_t host_lib_task_hdl, class_driver_task_hdl, trigger_task_hdl,
       web_server_task_hdl;
-  BaseType_t task_created;
+  // The broadcast loop below runs on the main task.
+  memory_budget_add_task(xTaskGetCurrentTaskHandle(),
+                         CONFIG_ESP_MAIN_TASK_STACK_SIZE);
+
+  usb_driver_init();
+  state_bus_init();
+  // Subscribed before the driver starts, so the first state isn't missed.
+  int web_subscriber = state_bus_subscribe("web");
+  ESP_ERROR_CHECK(nvs_flash_init());
+  scenes_init();
+  state_journal_init();
 
+  // Create web server task first, WiFi association takes longest and runs
+  // while the USB host is installed and the amp enumerates on core 1.
+  web_server_task_hdl = xTaskCreateStaticPinnedToCore(
+      web_server_task, "web_server_task", WEB_SERVER_TASK_STACK_SIZE, NULL,
+      WEB_SERVER_TASK_PRIORITY, web_server_task_stack, &web_server_task_buffer,
+      0);
+  assert(web_server_task_hdl != NULL);
   // Create host lib task
-  task_created = xTaskCreatePinnedToCore(
-      usb_host_lib_task, "usb_host", 4096, (void *)host_lib_installed,
-      USB_LIB_TASK_PRIORITY, &host_lib_task_hdl, 1);
-  assert(task_created == pdTRUE);
+  host_lib_task_hdl = xTaskCreateStaticPinnedToCore(
+      usb_host_lib_task, "usb_host", USB_LIB_TASK_STACK_SIZE,
+      (void *)host_lib_installed, USB_LIB_TASK_PRIORITY,
+      usb_host_lib_task_stack, &usb_host_lib_task_buffer, 1);
+  assert(host_lib_task_hdl != NULL);
+  memory_budget_add_task(host_lib_task_hdl, USB_LIB_TASK_STACK_SIZE);
   xSemaphoreTake(host_lib_installed, portMAX_DELAY);
   // Create client task
-  task_created = xTaskCreatePinnedToCore(
-      usb_driver_task, "driver", 4096, (void *)hypex_state_updated,
-      CLASS_TASK_PRIORITY, &class_driver_task_hdl, 1);
-  assert(task_created == pdTRUE);
+  class_driver_task_hdl = xTaskCreateStaticPinnedToCore(
+      usb_driver_task, "driver", USB_DRIVER_TASK_STACK_SIZE, NULL,
+      CLASS_TASK_PRIORITY, class_driver_task_stack, &class_driver_task_buffer,
+      1);
+  assert(class_driver_task_hdl != NULL);
+  memory_budget_add_task(class_driver_task_hdl, USB_DRIVER_TASK_STACK_SIZE);
   // Create trigger monitor task
-  task_created = xTaskCreatePinnedToCore(
-      trigger_monitor_task, "trigger_monitor", 4096, NULL,
-      TRIGGER_TASK_PRIORITY, &trigger_task_hdl, 0);
-  assert(task_created == pdTRUE);
-  // Create web server task
-  task_created = xTaskCreatePinnedToCore(web_server_task, "web_server_task",
-                                         4096, NULL, WEB_SERVER_TASK_PRIORITY,
-                                         &web_server_task_hdl, 0);
-  assert(task_created == pdTRUE);
+  trigger_task_hdl = xTaskCreateStaticPinnedToCore(
+      trigger_monitor_task, "trigger_monitor", TRIGGER_TASK_STACK_SIZE, NULL,
+      TRIGGER_TASK_PRIORITY, trigger_task_stack, &trigger_task_buffer, 0);
+  assert(trigger_task_hdl != NULL);
+  memory_budget_add_task(trigger_task_hdl, TRIGGER_TASK_STACK_SIZE);
+#ifdef CONTROL_PATH_BENCHMARK
+  TaskHandle_t benchmark_task_hdl = xTaskCreateStaticPinnedToCore(
+      benchmark_task, "benchmark", BENCHMARK_TASK_STACK_SIZE, NULL, 1,
+      benchmark_task_stack, &benchmark_task_buffer, 1);
+  assert(benchmark_task_hdl != NULL);
+#endif  // CONTROL_PATH_BENCHMARK
+  bool has_sent = false;
+  uint32_t sent_version = 0;
+  // Fields changed since the last broadcast.
+  uint16_t changed = 0;
   while (1) {
-    if (xSemaphoreTake(hypex_state_updated, portMAX_DELAY) == pdTRUE) {
-      ESP_LOGI(TAG, "New data inform web server");
+    state_event_t event;
+    if (state_bus_receive(web_subscriber, &event, portMAX_DELAY)) {
       state_t current_state;
       get_state(&current_state);
-      // TODO should I use a queue here?
-      notify_state_changed(&current_state);
+      // A burst of events is broadcast once, with the latest state.
+      if (has_sent && current_state.version == sent_version) continue;
+      changed |= event.changed;
+      ESP_LOGI(TAG, "New data 0x%x inform web server", changed);
+      power_acquire(POWER_LOCK_WEB);
+      bool sent = notify_state_event(&current_state, changed);
+      power_release(POWER_LOCK_WEB);
+      if (!sent) continue;
+      has_sent = true;
+      sent_version = current_state.version;
+      changed = 0;
     }
   }
 }
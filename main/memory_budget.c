@@ -0,0 +1,69 @@
+#include "memory_budget.h"
+
+#include <string.h>
+
+#include "esp_log.h"
+
+typedef struct {
+  // NULL once the task finished.
+  TaskHandle_t task;
+  task_budget_t budget;
+} tracked_task_t;
+
+static const char *TAG_MEMORY = "MEMORY_BUDGET";
+static tracked_task_t tracked_tasks[MEMORY_BUDGET_MAX_TASKS];
+static int tracked_count = 0;
+static portMUX_TYPE tasks_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static uint32_t stack_peak(TaskHandle_t task, uint32_t stack_size) {
+  return stack_size - uxTaskGetStackHighWaterMark(task);
+}
+
+void memory_budget_add_task(TaskHandle_t task, uint32_t stack_size) {
+  if (task == NULL) return;
+  tracked_task_t tracked = {.task = task,
+                            .budget = {.stack_size = stack_size}};
+  strncpy(tracked.budget.name, pcTaskGetName(task),
+          configMAX_TASK_NAME_LEN - 1);
+  taskENTER_CRITICAL(&tasks_lock);
+  bool added = tracked_count < MEMORY_BUDGET_MAX_TASKS;
+  if (added) tracked_tasks[tracked_count++] = tracked;
+  taskEXIT_CRITICAL(&tasks_lock);
+  if (!added) {
+    ESP_LOGW(TAG_MEMORY, "Too many tasks, not tracking %s.",
+             tracked.budget.name);
+  }
+}
+
+void memory_budget_task_done(void) {
+  TaskHandle_t current = xTaskGetCurrentTaskHandle();
+  taskENTER_CRITICAL(&tasks_lock);
+  for (int i = 0; i < tracked_count; i++) {
+    tracked_task_t *tracked = &tracked_tasks[i];
+    if (tracked->task != current) continue;
+    tracked->budget.stack_peak =
+        stack_peak(current, tracked->budget.stack_size);
+    tracked->budget.finished = true;
+    tracked->task = NULL;
+  }
+  taskEXIT_CRITICAL(&tasks_lock);
+}
+
+int memory_budget_tasks(task_budget_t *tasks) {
+  TaskHandle_t handles[MEMORY_BUDGET_MAX_TASKS];
+  taskENTER_CRITICAL(&tasks_lock);
+  int count = tracked_count;
+  for (int i = 0; i < count; i++) {
+    handles[i] = tracked_tasks[i].task;
+    tasks[i] = tracked_tasks[i].budget;
+  }
+  taskEXIT_CRITICAL(&tasks_lock);
+  for (int i = 0; i < count; i++) {
+    // Walks the stack, so not in the critical section. Tasks are only
+    // deleted after memory_budget_task_done.
+    if (handles[i] != NULL) {
+      tasks[i].stack_peak = stack_peak(handles[i], tasks[i].stack_size);
+    }
+  }
+  return count;
+}
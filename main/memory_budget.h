@@ -0,0 +1,30 @@
+#ifndef MEMORY_BUDGET_H
+#define MEMORY_BUDGET_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#define MEMORY_BUDGET_MAX_TASKS 12
+
+typedef struct {
+  char name[configMAX_TASK_NAME_LEN];
+  // In bytes, like all stack sizes in ESP-IDF.
+  uint32_t stack_size;
+  // Most of the stack ever used, from the high-water mark.
+  uint32_t stack_peak;
+  // The task deleted itself, the peak is final.
+  bool finished;
+} task_budget_t;
+
+// Tracks the stack usage of the task, call right after creating it.
+void memory_budget_add_task(TaskHandle_t task, uint32_t stack_size);
+// Keeps the peak of the calling task, call right before it deletes itself.
+void memory_budget_task_done(void);
+
+// Copies the tracked tasks with their current peaks, returns their number.
+int memory_budget_tasks(task_budget_t *tasks);
+
+#endif  // MEMORY_BUDGET_H
@@ -0,0 +1,70 @@
+#include "power.h"
+
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "freertos/FreeRTOS.h"
+
+// Lowest CPU clock while idle. Below it the APB clock, which USB and WiFi
+// run on, would drop too.
+#define POWER_MIN_FREQ_MHZ 80
+
+static const char *TAG_POWER = "POWER";
+static const char *wakeup_task_names[WAKEUP_TASK_COUNT] = {
+    [WAKEUP_USB_DRIVER] = "usb_driver",
+    [WAKEUP_TRIGGER] = "trigger_monitor",
+    [WAKEUP_AB_TEST] = "ab_test",
+};
+static const char *power_lock_names[POWER_LOCK_COUNT] = {
+    [POWER_LOCK_USB] = "usb",
+    [POWER_LOCK_WEB] = "web",
+};
+static esp_pm_lock_handle_t power_locks[POWER_LOCK_COUNT];
+static wakeup_stats_t wakeups[WAKEUP_TASK_COUNT];
+static portMUX_TYPE wakeups_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void power_init(void) {
+#ifdef CONFIG_PM_ENABLE
+  esp_pm_config_t pm_config = {
+      .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+      .min_freq_mhz = POWER_MIN_FREQ_MHZ,
+      .light_sleep_enable = false,
+  };
+  esp_err_t err = esp_pm_configure(&pm_config);
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG_POWER, "Power management not configured: %s",
+             esp_err_to_name(err));
+    return;
+  }
+  for (int i = 0; i < POWER_LOCK_COUNT; i++) {
+    ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0,
+                                       power_lock_names[i], &power_locks[i]));
+  }
+  ESP_LOGI(TAG_POWER, "CPU clock scaled between %d and %d MHz.",
+           POWER_MIN_FREQ_MHZ, CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ);
+#endif  // CONFIG_PM_ENABLE
+}
+
+void power_acquire(power_lock_t lock) {
+  if (power_locks[lock] != NULL) esp_pm_lock_acquire(power_locks[lock]);
+}
+
+void power_release(power_lock_t lock) {
+  if (power_locks[lock] != NULL) esp_pm_lock_release(power_locks[lock]);
+}
+
+void wakeup_record(wakeup_task_t task, bool idle) {
+  taskENTER_CRITICAL(&wakeups_lock);
+  wakeups[task].wakeups++;
+  if (idle) wakeups[task].idle++;
+  taskEXIT_CRITICAL(&wakeups_lock);
+}
+
+void wakeup_stats(wakeup_stats_t *stats) {
+  taskENTER_CRITICAL(&wakeups_lock);
+  for (int i = 0; i < WAKEUP_TASK_COUNT; i++) stats[i] = wakeups[i];
+  taskEXIT_CRITICAL(&wakeups_lock);
+}
+
+const char *wakeup_task_name(wakeup_task_t task) {
+  return wakeup_task_names[task];
+}
@@ -0,0 +1,40 @@
+#ifndef POWER_H
+#define POWER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Tasks which count their wakeups.
+typedef enum {
+  WAKEUP_USB_DRIVER,
+  WAKEUP_TRIGGER,
+  WAKEUP_AB_TEST,
+  WAKEUP_TASK_COUNT
+} wakeup_task_t;
+
+typedef struct {
+  uint32_t wakeups;
+  // Timed out without anything to do.
+  uint32_t idle;
+} wakeup_stats_t;
+
+// Activities which need the full CPU clock.
+typedef enum {
+  POWER_LOCK_USB,
+  POWER_LOCK_WEB,
+  POWER_LOCK_COUNT
+} power_lock_t;
+
+// Scales the CPU clock down to 80 MHz while no lock is held and skips
+// ticks while idle. Light sleep stays off, it would stop the USB host.
+void power_init(void);
+// Counted, every acquire needs a release.
+void power_acquire(power_lock_t lock);
+void power_release(power_lock_t lock);
+
+void wakeup_record(wakeup_task_t task, bool idle);
+// Copies WAKEUP_TASK_COUNT entries.
+void wakeup_stats(wakeup_stats_t *stats);
+const char *wakeup_task_name(wakeup_task_t task);
+
+#endif  // POWER_H
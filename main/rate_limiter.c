@@ -0,0 +1,161 @@
+#include "rate_limiter.h"
+
+#include <string.h>
+
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+typedef struct {
+  // Zero for no limit.
+  uint16_t per_second;
+  uint16_t burst;
+  // Max commands waiting in the USB queue, which holds 10.
+  uint8_t max_queued;
+} origin_limit_t;
+
+// A slider sends about one command per round trip, far below the WebSocket
+// limit. The A/B tests send a few commands per switch. The trigger inputs
+// are local hardware whose preset must always land, like the firmware they
+// are never limited.
+static const origin_limit_t limits[] = {
+    [ORIGIN_FIRMWARE] = {0, 0, 0}, [ORIGIN_WEBSOCKET] = {20, 20, 4},
+    [ORIGIN_REST] = {5, 5, 2},     [ORIGIN_TRIGGER] = {0, 0, 0},
+    [ORIGIN_AB_TEST] = {10, 10, 4},
+};
+
+typedef struct {
+  bool used;
+  origin_stats_t stats;
+  // In thousandths of a command.
+  uint32_t tokens;
+  int64_t last_refill_us;
+} bucket_t;
+
+static bucket_t buckets[RATE_LIMIT_MAX_ORIGINS];
+static portMUX_TYPE buckets_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static bool same_origin(command_origin_t a, command_origin_t b) {
+  return a.type == b.type && a.id == b.id;
+}
+
+// Called with the lock held.
+static bucket_t *find_bucket(command_origin_t origin) {
+  for (int i = 0; i < RATE_LIMIT_MAX_ORIGINS; i++) {
+    if (buckets[i].used && same_origin(buckets[i].stats.origin, origin)) {
+      return &buckets[i];
+    }
+  }
+  return NULL;
+}
+
+// Called with the lock held. Replaces the least recently used origin
+// without queued commands if all buckets are taken.
+static bucket_t *add_bucket(command_origin_t origin, int64_t now) {
+  bucket_t *bucket = NULL;
+  for (int i = 0; i < RATE_LIMIT_MAX_ORIGINS; i++) {
+    if (!buckets[i].used) {
+      bucket = &buckets[i];
+      break;
+    }
+    if (buckets[i].stats.queued == 0 &&
+        (bucket == NULL ||
+         buckets[i].last_refill_us < bucket->last_refill_us)) {
+      bucket = &buckets[i];
+    }
+  }
+  if (bucket == NULL) return NULL;
+  memset(bucket, 0, sizeof(bucket_t));
+  bucket->used = true;
+  bucket->stats.origin = origin;
+  bucket->tokens = limits[origin.type].burst * 1000;
+  bucket->last_refill_us = now;
+  return bucket;
+}
+
+bool rate_limiter_admit(command_origin_t origin) {
+  const origin_limit_t *limit = &limits[origin.type];
+  int64_t now = esp_timer_get_time();
+  bool admitted = false;
+  taskENTER_CRITICAL(&buckets_lock);
+  bucket_t *bucket = find_bucket(origin);
+  if (bucket == NULL) bucket = add_bucket(origin, now);
+  if (bucket == NULL) {
+    // Every origin has commands waiting, only unlimited ones get in.
+    taskEXIT_CRITICAL(&buckets_lock);
+    return limit->per_second == 0;
+  }
+  if (limit->per_second == 0) {
+    admitted = true;
+  } else {
+    uint64_t refill =
+        (uint64_t)(now - bucket->last_refill_us) * limit->per_second / 1000;
+    uint32_t max_tokens = limit->burst * 1000;
+    bucket->tokens = bucket->tokens + refill > max_tokens
+                         ? max_tokens
+                         : bucket->tokens + (uint32_t)refill;
+    admitted =
+        bucket->tokens >= 1000 && bucket->stats.queued < limit->max_queued;
+    if (admitted) bucket->tokens -= 1000;
+  }
+  bucket->last_refill_us = now;
+  if (admitted) {
+    bucket->stats.accepted++;
+  } else {
+    bucket->stats.throttled++;
+  }
+  taskEXIT_CRITICAL(&buckets_lock);
+  return admitted;
+}
+
+void rate_limiter_queued(command_origin_t origin) {
+  taskENTER_CRITICAL(&buckets_lock);
+  bucket_t *bucket = find_bucket(origin);
+  if (bucket != NULL) bucket->stats.queued++;
+  taskEXIT_CRITICAL(&buckets_lock);
+}
+
+void rate_limiter_dequeued(command_origin_t origin) {
+  taskENTER_CRITICAL(&buckets_lock);
+  bucket_t *bucket = find_bucket(origin);
+  if (bucket != NULL && bucket->stats.queued > 0) bucket->stats.queued--;
+  taskEXIT_CRITICAL(&buckets_lock);
+}
+
+void rate_limiter_clear_queued(void) {
+  taskENTER_CRITICAL(&buckets_lock);
+  for (int i = 0; i < RATE_LIMIT_MAX_ORIGINS; i++) buckets[i].stats.queued = 0;
+  taskEXIT_CRITICAL(&buckets_lock);
+}
+
+void rate_limiter_forget(command_origin_t origin) {
+  taskENTER_CRITICAL(&buckets_lock);
+  bucket_t *bucket = find_bucket(origin);
+  if (bucket != NULL) bucket->used = false;
+  taskEXIT_CRITICAL(&buckets_lock);
+}
+
+int rate_limiter_stats(origin_stats_t *stats) {
+  int count = 0;
+  taskENTER_CRITICAL(&buckets_lock);
+  for (int i = 0; i < RATE_LIMIT_MAX_ORIGINS; i++) {
+    if (buckets[i].used) stats[count++] = buckets[i].stats;
+  }
+  taskEXIT_CRITICAL(&buckets_lock);
+  return count;
+}
+
+const char *command_origin_name(command_origin_type_t type) {
+  switch (type) {
+    case ORIGIN_FIRMWARE:
+      return "firmware";
+    case ORIGIN_WEBSOCKET:
+      return "websocket";
+    case ORIGIN_REST:
+      return "rest";
+    case ORIGIN_TRIGGER:
+      return "trigger";
+    case ORIGIN_AB_TEST:
+      return "ab_test";
+  }
+  return "unknown";
+}
@@ -0,0 +1,35 @@
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "usb_driver.h"
+
+// Origins tracked at once, the least recently used one is replaced.
+#define RATE_LIMIT_MAX_ORIGINS 12
+
+typedef struct {
+  command_origin_t origin;
+  uint32_t accepted;
+  uint32_t throttled;
+  // Commands of this origin waiting in the USB queue.
+  uint8_t queued;
+} origin_stats_t;
+
+// Takes a token from the origin's bucket. False if the bucket is empty or
+// the origin already has its share of the USB queue waiting.
+bool rate_limiter_admit(command_origin_t origin);
+// Tracks the origin's share of the USB queue.
+void rate_limiter_queued(command_origin_t origin);
+void rate_limiter_dequeued(command_origin_t origin);
+// The USB queue was reset.
+void rate_limiter_clear_queued(void);
+// Drops the bucket of a closed WebSocket.
+void rate_limiter_forget(command_origin_t origin);
+
+// Copies the tracked origins, returns their number.
+int rate_limiter_stats(origin_stats_t *stats);
+const char *command_origin_name(command_origin_type_t type);
+
+#endif  // RATE_LIMITER_H
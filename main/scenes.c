@@ -0,0 +1,133 @@
+#include "scenes.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "nvs.h"
+
+#define SCENES_NVS_NAMESPACE "scenes"
+
+static const char *TAG_SCENES = "SCENES";
+// Empty name marks a free slot.
+static scene_t scenes[MAX_SCENES];
+static SemaphoreHandle_t scenes_mutex;
+static StaticSemaphore_t scenes_mutex_buffer;
+
+static void scene_key(int index, char *key, size_t len) {
+  snprintf(key, len, "scene%d", index);
+}
+
+// Called with the mutex held.
+static esp_err_t store_scene(int index) {
+  nvs_handle_t nvs;
+  esp_err_t err = nvs_open(SCENES_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+  if (err != ESP_OK) return err;
+  char key[NVS_KEY_NAME_MAX_SIZE];
+  scene_key(index, key, sizeof(key));
+  if (scenes[index].name[0] != '\0') {
+    err = nvs_set_blob(nvs, key, &scenes[index], sizeof(scene_t));
+  } else {
+    err = nvs_erase_key(nvs, key);
+    if (err == ESP_ERR_NVS_NOT_FOUND) err = ESP_OK;
+  }
+  if (err == ESP_OK) err = nvs_commit(nvs);
+  nvs_close(nvs);
+  return err;
+}
+
+// Called with the mutex held.
+static int find_scene(const char *name) {
+  for (int i = 0; i < MAX_SCENES; i++) {
+    if (scenes[i].name[0] != '\0' && strcmp(scenes[i].name, name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void scenes_init(void) {
+  scenes_mutex = xSemaphoreCreateMutexStatic(&scenes_mutex_buffer);
+  memset(scenes, 0, sizeof(scenes));
+  nvs_handle_t nvs;
+  if (nvs_open(SCENES_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) return;
+  int count = 0;
+  for (int i = 0; i < MAX_SCENES; i++) {
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    scene_key(i, key, sizeof(key));
+    size_t len = sizeof(scene_t);
+    // Scenes stored before they were validated might never be recalled.
+    if (nvs_get_blob(nvs, key, &scenes[i], &len) != ESP_OK ||
+        len != sizeof(scene_t) || !is_valid_state_delta(&scenes[i].delta)) {
+      memset(&scenes[i], 0, sizeof(scene_t));
+      continue;
+    }
+    scenes[i].name[SCENE_NAME_MAX_LEN - 1] = '\0';
+    count++;
+  }
+  nvs_close(nvs);
+  ESP_LOGI(TAG_SCENES, "Loaded %d scenes.", count);
+}
+
+esp_err_t scenes_save(const scene_t *scene) {
+  if (scene->name[0] == '\0' || !is_valid_state_delta(&scene->delta)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  xSemaphoreTake(scenes_mutex, portMAX_DELAY);
+  int index = find_scene(scene->name);
+  for (int i = 0; i < MAX_SCENES && index < 0; i++) {
+    if (scenes[i].name[0] == '\0') index = i;
+  }
+  if (index < 0) {
+    xSemaphoreGive(scenes_mutex);
+    return ESP_ERR_NO_MEM;
+  }
+  scenes[index] = *scene;
+  scenes[index].name[SCENE_NAME_MAX_LEN - 1] = '\0';
+  esp_err_t err = store_scene(index);
+  xSemaphoreGive(scenes_mutex);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG_SCENES, "Storing scene %s failed: %s", scene->name,
+             esp_err_to_name(err));
+  }
+  return err;
+}
+
+esp_err_t scenes_delete(const char *name) {
+  xSemaphoreTake(scenes_mutex, portMAX_DELAY);
+  int index = find_scene(name);
+  esp_err_t err = ESP_ERR_NOT_FOUND;
+  if (index >= 0) {
+    memset(&scenes[index], 0, sizeof(scene_t));
+    err = store_scene(index);
+  }
+  xSemaphoreGive(scenes_mutex);
+  return err;
+}
+
+bool scenes_find(const char *name, scene_t *scene) {
+  xSemaphoreTake(scenes_mutex, portMAX_DELAY);
+  int index = find_scene(name);
+  if (index >= 0) *scene = scenes[index];
+  xSemaphoreGive(scenes_mutex);
+  return index >= 0;
+}
+
+bool scenes_get(int index, scene_t *scene) {
+  if (index < 0 || index >= MAX_SCENES) return false;
+  xSemaphoreTake(scenes_mutex, portMAX_DELAY);
+  *scene = scenes[index];
+  xSemaphoreGive(scenes_mutex);
+  return scene->name[0] != '\0';
+}
+
+esp_err_t scenes_recall(const char *name, command_origin_t origin,
+                        command_result_t *result) {
+  scene_t scene;
+  if (!scenes_find(name, &scene)) return ESP_ERR_NOT_FOUND;
+  ESP_LOGI(TAG_SCENES, "Recalling scene %s.", name);
+  *result = enqueue_state_delta(&scene.delta, origin);
+  return ESP_OK;
+}
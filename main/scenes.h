@@ -0,0 +1,33 @@
+#ifndef SCENES_H
+#define SCENES_H
+
+#include <stdbool.h>
+
+#include <esp_err.h>
+
+#include "usb_driver.h"
+
+#define MAX_SCENES 8
+#define SCENE_NAME_MAX_LEN 24
+
+// Named set of amp settings, recalled with a single packet.
+typedef struct {
+  char name[SCENE_NAME_MAX_LEN];
+  state_delta_t delta;
+} scene_t;
+
+// Loads the scenes from NVS, nvs_flash_init must have been called.
+void scenes_init(void);
+
+// Replaces a scene with the same name.
+esp_err_t scenes_save(const scene_t *scene);
+esp_err_t scenes_delete(const char *name);
+bool scenes_find(const char *name, scene_t *scene);
+// For listing, false if the slot is empty.
+bool scenes_get(int index, scene_t *scene);
+
+// ESP_ERR_NOT_FOUND for unknown names.
+esp_err_t scenes_recall(const char *name, command_origin_t origin,
+                        command_result_t *result);
+
+#endif  // SCENES_H
@@ -0,0 +1,83 @@
+#include "state_bus.h"
+
+#include "esp_log.h"
+#include "freertos/queue.h"
+
+typedef struct {
+  QueueHandle_t queue;
+  StaticQueue_t queue_buffer;
+  uint8_t queue_storage[STATE_BUS_QUEUE_LENGTH * sizeof(state_event_t)];
+  // Merged into the next received event.
+  uint16_t missed;
+  uint32_t missed_version;
+  state_subscriber_stats_t stats;
+} subscriber_t;
+
+static const char *TAG_BUS = "STATE_BUS";
+static subscriber_t subscribers[STATE_BUS_MAX_SUBSCRIBERS];
+static int subscriber_count = 0;
+static portMUX_TYPE bus_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void state_bus_init(void) { subscriber_count = 0; }
+
+int state_bus_subscribe(const char *name) {
+  taskENTER_CRITICAL(&bus_lock);
+  if (subscriber_count == STATE_BUS_MAX_SUBSCRIBERS) {
+    taskEXIT_CRITICAL(&bus_lock);
+    ESP_LOGE(TAG_BUS, "No subscriber slot left for %s.", name);
+    return -1;
+  }
+  int id = subscriber_count;
+  subscriber_t *subscriber = &subscribers[id];
+  subscriber->queue =
+      xQueueCreateStatic(STATE_BUS_QUEUE_LENGTH, sizeof(state_event_t),
+                         subscriber->queue_storage, &subscriber->queue_buffer);
+  subscriber->missed = 0;
+  subscriber->stats = (state_subscriber_stats_t){.name = name};
+  // Published only once the subscriber is complete.
+  subscriber_count++;
+  taskEXIT_CRITICAL(&bus_lock);
+  return id;
+}
+
+bool state_bus_receive(int subscriber, state_event_t *event, TickType_t wait) {
+  subscriber_t *sub = &subscribers[subscriber];
+  if (xQueueReceive(sub->queue, event, wait) != pdTRUE) return false;
+  taskENTER_CRITICAL(&bus_lock);
+  if (sub->missed) {
+    event->changed |= sub->missed;
+    event->version = sub->missed_version;
+    sub->missed = 0;
+  }
+  taskEXIT_CRITICAL(&bus_lock);
+  return true;
+}
+
+void state_bus_publish(uint16_t changed, uint32_t version) {
+  if (changed == 0) return;
+  state_event_t event = {.changed = changed, .version = version};
+  int count = subscriber_count;
+  for (int i = 0; i < count; i++) {
+    subscriber_t *sub = &subscribers[i];
+    bool sent = xQueueSend(sub->queue, &event, 0) == pdTRUE;
+    taskENTER_CRITICAL(&bus_lock);
+    if (sent) {
+      sub->stats.events++;
+    } else {
+      // The queued events are older, the subscriber reads the latest state
+      // with the last one of them anyway.
+      sub->missed |= changed;
+      sub->missed_version = version;
+      sub->stats.coalesced++;
+    }
+    taskEXIT_CRITICAL(&bus_lock);
+  }
+}
+
+int state_bus_stats(state_subscriber_stats_t *stats) {
+  taskENTER_CRITICAL(&bus_lock);
+  int count = subscriber_count;
+  for (int i = 0; i < count; i++) stats[i] = subscribers[i].stats;
+  taskEXIT_CRITICAL(&bus_lock);
+  return count;
+}
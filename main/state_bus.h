@@ -0,0 +1,52 @@
+#ifndef STATE_BUS_H
+#define STATE_BUS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+
+#define STATE_BUS_MAX_SUBSCRIBERS 4
+#define STATE_BUS_QUEUE_LENGTH 8
+
+// Fields of the published state which changed.
+#define STATE_FIELD_PRESET (1 << 0)
+#define STATE_FIELD_VOLUME (1 << 1)
+#define STATE_FIELD_MUTE (1 << 2)
+#define STATE_FIELD_CURRENT_SOURCE (1 << 3)
+#define STATE_FIELD_PRESET_SOURCE (1 << 4)
+#define STATE_FIELD_EQ (1 << 5)
+#define STATE_FIELD_FILTER_NAME (1 << 6)
+#define STATE_FIELD_ACKS (1 << 7)
+// The amp was disconnected, all fields were cleared.
+#define STATE_FIELD_CONNECTION (1 << 8)
+
+typedef struct {
+  uint16_t changed;
+  // Version of the state after the change.
+  uint32_t version;
+} state_event_t;
+
+typedef struct {
+  const char *name;
+  uint32_t events;
+  // Events merged into a later one because the queue was full.
+  uint32_t coalesced;
+} state_subscriber_stats_t;
+
+void state_bus_init(void);
+
+// Returns the subscriber id, -1 if all are taken. Subscribe before the
+// driver starts to not miss the first state.
+int state_bus_subscribe(const char *name);
+// Waits for the next event. Events which didn't fit into the queue are
+// merged into it, so no changed field is lost.
+bool state_bus_receive(int subscriber, state_event_t *event, TickType_t wait);
+
+// Never blocks, safe to call from USB callbacks.
+void state_bus_publish(uint16_t changed, uint32_t version);
+
+// Copies the subscriber stats, returns their number.
+int state_bus_stats(state_subscriber_stats_t *stats);
+
+#endif  // STATE_BUS_H
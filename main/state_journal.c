@@ -0,0 +1,154 @@
+#include "state_journal.h"
+
+#include <string.h>
+
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+static journal_entry_t journal[JOURNAL_SIZE];
+// Index of the next entry to write, the oldest once the ring is full.
+static int journal_head = 0;
+static int journal_count = 0;
+// Version of the state before the oldest entry in the ring.
+static uint32_t base_version = 0;
+static uint32_t last_version = 0;
+static bool has_baseline = false;
+static journal_entry_t last_state;
+static command_tag_t last_acks[NUM_CONTROL_ACTIONS];
+static char last_filter_name[FILTER_NAME_MAX_LEN];
+static uint32_t epoch;
+static SemaphoreHandle_t journal_mutex;
+static StaticSemaphore_t journal_mutex_buffer;
+
+void state_journal_init(void) {
+  journal_mutex = xSemaphoreCreateMutexStatic(&journal_mutex_buffer);
+  epoch = esp_random();
+}
+
+uint32_t state_journal_epoch(void) { return epoch; }
+
+static void fill_entry(journal_entry_t *entry, const state_t *state) {
+  entry->version = state->version;
+  entry->preset = state->preset;
+  entry->is_muted = state->is_muted;
+  entry->current_source = state->current_source;
+  entry->volume_centi_db = (int16_t)(state->volume_db * 100.0f);
+  for (int i = 0; i < 3; i++) {
+    entry->preset_source[i] = state->preset_source[i];
+    entry->is_eq_on[i] = state->is_eq_on[i];
+  }
+}
+
+// Action of the changed field whose confirmed tag moved, if any.
+static command_tag_t find_origin(const state_t *state, uint8_t changed) {
+  const command_tag_t none = {0};
+  for (int i = 0; i < NUM_CONTROL_ACTIONS; i++) {
+    uint8_t field = 0;
+    switch ((control_action_type_t)i) {
+      case ACTION_SET_PRESET:
+        field = JOURNAL_PRESET;
+        break;
+      case ACTION_SET_VOLUME:
+        field = JOURNAL_VOLUME;
+        break;
+      case ACTION_SET_MUTE:
+        field = JOURNAL_MUTE;
+        break;
+      case ACTION_SET_SOURCE_P1:
+      case ACTION_SET_SOURCE_P2:
+      case ACTION_SET_SOURCE_P3:
+        field = JOURNAL_PRESET_SOURCE;
+        break;
+      case ACTION_SET_EQ_P1:
+      case ACTION_SET_EQ_P2:
+      case ACTION_SET_EQ_P3:
+        field = JOURNAL_EQ;
+        break;
+    }
+    if ((changed & field) && state->acks[i].client != 0 &&
+        memcmp(&state->acks[i], &last_acks[i], sizeof(command_tag_t))) {
+      return state->acks[i];
+    }
+  }
+  return none;
+}
+
+void state_journal_record(const state_t *state) {
+  journal_entry_t entry = {0};
+  fill_entry(&entry, state);
+  entry.time_us = esp_timer_get_time();
+  char filter_name[FILTER_NAME_MAX_LEN];
+  get_filter_name(filter_name);
+
+  xSemaphoreTake(journal_mutex, portMAX_DELAY);
+  if (!has_baseline) {
+    has_baseline = true;
+    base_version = state->version;
+  } else if (state->version != last_version) {
+    if (entry.preset != last_state.preset) entry.changed |= JOURNAL_PRESET;
+    if (entry.volume_centi_db != last_state.volume_centi_db) {
+      entry.changed |= JOURNAL_VOLUME;
+    }
+    if (entry.is_muted != last_state.is_muted) entry.changed |= JOURNAL_MUTE;
+    if (entry.current_source != last_state.current_source) {
+      entry.changed |= JOURNAL_CURRENT_SOURCE;
+    }
+    if (memcmp(entry.preset_source, last_state.preset_source, 3)) {
+      entry.changed |= JOURNAL_PRESET_SOURCE;
+    }
+    if (memcmp(entry.is_eq_on, last_state.is_eq_on, sizeof(entry.is_eq_on))) {
+      entry.changed |= JOURNAL_EQ;
+    }
+    if (strcmp(filter_name, last_filter_name) != 0) {
+      entry.changed |= JOURNAL_FILTER_NAME;
+    }
+  }
+  // Versions which only changed acks are left out.
+  if (entry.changed) {
+    entry.by = find_origin(state, entry.changed);
+    if (journal_count == JOURNAL_SIZE) {
+      base_version = journal[journal_head].version;
+    } else {
+      journal_count++;
+    }
+    journal[journal_head] = entry;
+    journal_head = (journal_head + 1) % JOURNAL_SIZE;
+  }
+  last_version = state->version;
+  last_state = entry;
+  memcpy(last_acks, state->acks, sizeof(last_acks));
+  strcpy(last_filter_name, filter_name);
+  xSemaphoreGive(journal_mutex);
+}
+
+// Called with the mutex held.
+static int copy_entries(uint32_t since, journal_entry_t *entries) {
+  int count = 0;
+  int oldest = (journal_head - journal_count + JOURNAL_SIZE) % JOURNAL_SIZE;
+  for (int i = 0; i < journal_count; i++) {
+    const journal_entry_t *entry = &journal[(oldest + i) % JOURNAL_SIZE];
+    if (entry->version > since) entries[count++] = *entry;
+  }
+  return count;
+}
+
+int state_journal_since(uint32_t since_epoch, uint32_t since,
+                        journal_entry_t *entries) {
+  int count = -1;
+  xSemaphoreTake(journal_mutex, portMAX_DELAY);
+  if (since_epoch == epoch && has_baseline && since >= base_version &&
+      since <= last_version) {
+    count = copy_entries(since, entries);
+  }
+  xSemaphoreGive(journal_mutex);
+  return count;
+}
+
+int state_journal_entries(journal_entry_t *entries) {
+  xSemaphoreTake(journal_mutex, portMAX_DELAY);
+  int count = copy_entries(0, entries);
+  xSemaphoreGive(journal_mutex);
+  return count;
+}
@@ -0,0 +1,50 @@
+#ifndef STATE_JOURNAL_H
+#define STATE_JOURNAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "usb_driver.h"
+
+#define JOURNAL_SIZE 64
+
+// Fields of a journal entry which changed with it.
+#define JOURNAL_PRESET (1 << 0)
+#define JOURNAL_VOLUME (1 << 1)
+#define JOURNAL_MUTE (1 << 2)
+#define JOURNAL_CURRENT_SOURCE (1 << 3)
+#define JOURNAL_PRESET_SOURCE (1 << 4)
+#define JOURNAL_EQ (1 << 5)
+#define JOURNAL_FILTER_NAME (1 << 6)
+
+typedef struct {
+  uint32_t version;
+  int64_t time_us;
+  uint8_t changed;
+  // Client command which caused the change, zero if it came from the
+  // firmware or the amp itself.
+  command_tag_t by;
+  // The whole state after the change.
+  uint8_t preset;
+  bool is_muted;
+  uint8_t current_source;
+  int16_t volume_centi_db;
+  uint8_t preset_source[3];
+  bool is_eq_on[3];
+} journal_entry_t;
+
+void state_journal_init(void);
+// Appends an entry if the state differs from the last recorded one.
+void state_journal_record(const state_t *state);
+
+// Copies the entries newer than `since` in order. Returns the number of
+// entries, or -1 if some of them were already overwritten or `since` is
+// from another boot.
+int state_journal_since(uint32_t epoch, uint32_t since,
+                        journal_entry_t *entries);
+// Copies all entries in order, returns their number.
+int state_journal_entries(journal_entry_t *entries);
+// Random per boot, versions restart with every boot.
+uint32_t state_journal_epoch(void);
+
+#endif  // STATE_JOURNAL_H
@@ -0,0 +1,111 @@
+#include "trigger_sequencer.h"
+
+#include <string.h>
+
+void trigger_sequencer_init(trigger_sequencer_t *sequencer) {
+  memset(sequencer, 0, sizeof(trigger_sequencer_t));
+}
+
+static trigger_output_t output(trigger_event_t event, uint8_t preset) {
+  trigger_output_t out = {.event = event, .preset = preset};
+  return out;
+}
+
+static trigger_output_t step_no_trigger(trigger_sequencer_t *sequencer,
+                                        const trigger_input_t *input) {
+  sequencer->waiting_for_usb = false;
+  if (!input->relay_on) {
+    sequencer->current_preset = 0;
+    sequencer->power_off_pending = false;
+    return output(TRIGGER_EVENT_NONE, 0);
+  }
+  if (!sequencer->power_off_pending) {
+    sequencer->power_off_pending = true;
+    sequencer->no_trigger_since_ms = input->now_ms;
+    return output(TRIGGER_EVENT_POWER_OFF_SCHEDULED, 0);
+  }
+  if (input->now_ms - sequencer->no_trigger_since_ms <=
+      TRIGGER_POWER_OFF_DELAY_MS) {
+    return output(TRIGGER_EVENT_NONE, 0);
+  }
+  sequencer->power_off_pending = false;
+  sequencer->current_preset = 0;
+  sequencer->has_powered_off = true;
+  sequencer->last_power_off_ms = input->now_ms;
+  return output(TRIGGER_EVENT_POWER_OFF, 0);
+}
+
+trigger_output_t trigger_sequencer_step(trigger_sequencer_t *sequencer,
+                                        const trigger_input_t *input) {
+  if (input->trigger_preset == 0) return step_no_trigger(sequencer, input);
+
+  // Any trigger cancels a scheduled power off, a later one starts over.
+  sequencer->power_off_pending = false;
+  if (!input->relay_on) {
+    if (sequencer->has_powered_off &&
+        input->now_ms - sequencer->last_power_off_ms <=
+            TRIGGER_POWER_OFF_COOLDOWN_MS) {
+      return output(TRIGGER_EVENT_COOLDOWN, 0);
+    }
+    // The amp starts with its own preset.
+    sequencer->current_preset = 0;
+    sequencer->waiting_for_usb = true;
+    sequencer->usb_wait_since_ms = input->now_ms;
+    return output(TRIGGER_EVENT_POWER_ON, 0);
+  }
+  if (sequencer->waiting_for_usb) {
+    if (input->usb_connected) {
+      sequencer->waiting_for_usb = false;
+      return output(TRIGGER_EVENT_USB_CONNECTED, 0);
+    }
+    if (input->now_ms - sequencer->usb_wait_since_ms < TRIGGER_USB_WAIT_MS) {
+      return output(TRIGGER_EVENT_NONE, 0);
+    }
+    // Still send the preset, the driver keeps it until the amp shows up.
+    sequencer->waiting_for_usb = false;
+    return output(TRIGGER_EVENT_USB_TIMEOUT, 0);
+  }
+  if (input->trigger_preset != sequencer->current_preset) {
+    return output(TRIGGER_EVENT_SET_PRESET, input->trigger_preset);
+  }
+  return output(TRIGGER_EVENT_NONE, 0);
+}
+
+static uint32_t remaining_ms(uint32_t now_ms, uint32_t since_ms,
+                             uint32_t duration_ms) {
+  uint32_t elapsed_ms = now_ms - since_ms;
+  return elapsed_ms >= duration_ms ? 0 : duration_ms - elapsed_ms;
+}
+
+uint32_t trigger_sequencer_next_step_ms(const trigger_sequencer_t *sequencer,
+                                        const trigger_input_t *input) {
+  // Both delays end once more than their duration passed.
+  if (sequencer->power_off_pending) {
+    return remaining_ms(input->now_ms, sequencer->no_trigger_since_ms,
+                        TRIGGER_POWER_OFF_DELAY_MS + 1);
+  }
+  if (sequencer->waiting_for_usb) return TRIGGER_USB_POLL_MS;
+  if (input->trigger_preset != 0 && !input->relay_on &&
+      sequencer->has_powered_off) {
+    return remaining_ms(input->now_ms, sequencer->last_power_off_ms,
+                        TRIGGER_POWER_OFF_COOLDOWN_MS + 1);
+  }
+  return TRIGGER_NO_DEADLINE;
+}
+
+uint32_t trigger_sequencer_wait_ms(const trigger_sequencer_t *sequencer,
+                                   const trigger_input_t *input,
+                                   trigger_event_t event, bool retry) {
+  // Events change the state, the next step may have another one.
+  if (event != TRIGGER_EVENT_NONE && event != TRIGGER_EVENT_COOLDOWN &&
+      !retry) {
+    return 0;
+  }
+  uint32_t next_ms = trigger_sequencer_next_step_ms(sequencer, input);
+  return retry && next_ms > TRIGGER_RETRY_MS ? TRIGGER_RETRY_MS : next_ms;
+}
+
+void trigger_sequencer_preset_sent(trigger_sequencer_t *sequencer,
+                                   uint8_t preset) {
+  sequencer->current_preset = preset;
+}
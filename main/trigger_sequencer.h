@@ -0,0 +1,82 @@
+#ifndef TRIGGER_SEQUENCER_H
+#define TRIGGER_SEQUENCER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Keep the amp on for this long after the last trigger went away.
+#define TRIGGER_POWER_OFF_DELAY_MS 10000
+// Min time between turning the amp off and on again.
+#define TRIGGER_POWER_OFF_COOLDOWN_MS 10000
+// Max time to wait for the amp to enumerate after turning it on.
+#define TRIGGER_USB_WAIT_MS 10000
+// The USB connection isn't signaled, it is checked this often while waiting.
+#define TRIGGER_USB_POLL_MS 100
+// Retry interval for a preset the driver couldn't queue.
+#define TRIGGER_RETRY_MS 100
+// Returned by trigger_sequencer_next_step_ms if only an input change needs
+// a step.
+#define TRIGGER_NO_DEADLINE UINT32_MAX
+
+// Power sequencing of the trigger inputs, without any IO or RTOS calls so
+// it can be run under any clock. The caller samples the inputs, applies
+// the returned event and reports which presets were sent.
+typedef struct {
+  // Wraps around, only differences are used.
+  uint32_t now_ms;
+  // Active trigger, 0 if none.
+  uint8_t trigger_preset;
+  bool relay_on;
+  bool usb_connected;
+} trigger_input_t;
+
+typedef enum {
+  TRIGGER_EVENT_NONE,
+  TRIGGER_EVENT_POWER_OFF_SCHEDULED,
+  // Turn the relay off.
+  TRIGGER_EVENT_POWER_OFF,
+  // A trigger is present but the amp was turned off too recently.
+  TRIGGER_EVENT_COOLDOWN,
+  // Turn the relay on.
+  TRIGGER_EVENT_POWER_ON,
+  TRIGGER_EVENT_USB_CONNECTED,
+  TRIGGER_EVENT_USB_TIMEOUT,
+  // Send the preset, then call trigger_sequencer_preset_sent.
+  TRIGGER_EVENT_SET_PRESET,
+} trigger_event_t;
+
+typedef struct {
+  trigger_event_t event;
+  uint8_t preset;
+} trigger_output_t;
+
+typedef struct {
+  // Last preset sent to the amp, 0 if none since power on.
+  uint8_t current_preset;
+  bool power_off_pending;
+  uint32_t no_trigger_since_ms;
+  bool has_powered_off;
+  uint32_t last_power_off_ms;
+  bool waiting_for_usb;
+  uint32_t usb_wait_since_ms;
+} trigger_sequencer_t;
+
+void trigger_sequencer_init(trigger_sequencer_t *sequencer);
+trigger_output_t trigger_sequencer_step(trigger_sequencer_t *sequencer,
+                                        const trigger_input_t *input);
+// Time until a step is due without any input change, for the delays and
+// timeouts. Call after a step which returned TRIGGER_EVENT_NONE or
+// TRIGGER_EVENT_COOLDOWN, any other event needs the next step right away.
+uint32_t trigger_sequencer_next_step_ms(const trigger_sequencer_t *sequencer,
+                                        const trigger_input_t *input);
+// Time to wait after applying the event of a step, 0 if the next step is
+// due right away. retry if the preset of TRIGGER_EVENT_SET_PRESET wasn't
+// queued.
+uint32_t trigger_sequencer_wait_ms(const trigger_sequencer_t *sequencer,
+                                   const trigger_input_t *input,
+                                   trigger_event_t event, bool retry);
+// The preset was accepted by the driver, it is not sent again.
+void trigger_sequencer_preset_sent(trigger_sequencer_t *sequencer,
+                                   uint8_t preset);
+
+#endif  // TRIGGER_SEQUENCER_H
@@ -0,0 +1,128 @@
+#include "ui_files.h"
+
+#include <string.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "esp_spiffs.h"
+
+// Two HTTP workers and httpd itself serving, one upload.
+#define UI_FILES_MAX_OPEN 4
+#define UI_PATH_LEN 32
+
+static const char *TAG_UI = "UI_FILES";
+static const char *ui_file_names[] = {"index.html", "index.css", "index.js",
+                                      "favicon.ico"};
+static bool mounted = false;
+static ui_files_stats_t stats = {0};
+
+// Length of the name without .gz if it is one of the UI files, 0 otherwise.
+static size_t base_name_len(const char *name) {
+  size_t len = strlen(name);
+  if (len > 3 && strcmp(name + len - 3, ".gz") == 0) len -= 3;
+  for (int i = 0; i < sizeof(ui_file_names) / sizeof(ui_file_names[0]);
+       i++) {
+    if (strlen(ui_file_names[i]) == len &&
+        strncmp(ui_file_names[i], name, len) == 0) {
+      return len;
+    }
+  }
+  return 0;
+}
+
+static void file_path(char *path, const char *name, size_t name_len,
+                      const char *suffix) {
+  snprintf(path, UI_PATH_LEN, UI_FILES_BASE_PATH "/%.*s%s", (int)name_len,
+           name, suffix);
+}
+
+esp_err_t ui_files_mount(void) {
+  esp_vfs_spiffs_conf_t conf = {.base_path = UI_FILES_BASE_PATH,
+                                .partition_label = UI_FILES_PARTITION,
+                                .max_files = UI_FILES_MAX_OPEN,
+                                .format_if_mount_failed = true};
+  esp_err_t err = esp_vfs_spiffs_register(&conf);
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG_UI, "No UI partition (%s), serving the embedded UI.",
+             esp_err_to_name(err));
+    return err;
+  }
+  mounted = true;
+  size_t total = 0;
+  size_t used = 0;
+  esp_spiffs_info(UI_FILES_PARTITION, &total, &used);
+  ESP_LOGI(TAG_UI, "UI partition mounted, %d of %d bytes used.", used, total);
+  return ESP_OK;
+}
+
+FILE *ui_files_open(const char *name, bool accept_gzip, bool *is_gzip) {
+  if (!mounted) return NULL;
+  char path[UI_PATH_LEN];
+  size_t len = strlen(name);
+  // The other variant is still served, the embedded copy might be from
+  // another version than the rest of the stored UI.
+  const char *suffixes[] = {".gz", ""};
+  FILE *file = NULL;
+  for (int i = 0; i < 2 && file == NULL; i++) {
+    const char *suffix = suffixes[accept_gzip ? i : 1 - i];
+    file_path(path, name, len, suffix);
+    file = fopen(path, "r");
+    *is_gzip = file != NULL && suffix[0] != '\0';
+  }
+  if (file != NULL) {
+    stats.from_flash++;
+    if (*is_gzip) stats.gzipped++;
+  }
+  return file;
+}
+
+FILE *ui_files_begin_upload(const char *name) {
+  size_t len = base_name_len(name);
+  if (!mounted || len == 0) return NULL;
+  char path[UI_PATH_LEN];
+  file_path(path, name, strlen(name), ".tmp");
+  return fopen(path, "w");
+}
+
+esp_err_t ui_files_finish_upload(const char *name, FILE *file,
+                                 bool complete) {
+  char tmp_path[UI_PATH_LEN];
+  char path[UI_PATH_LEN];
+  size_t len = strlen(name);
+  file_path(tmp_path, name, len, ".tmp");
+  file_path(path, name, len, "");
+  if (fclose(file) != 0) complete = false;
+  if (!complete) {
+    unlink(tmp_path);
+    return ESP_FAIL;
+  }
+  // Both variants go, a stale one could be preferred over the upload.
+  ui_files_delete(name);
+  if (rename(tmp_path, path) != 0) {
+    unlink(tmp_path);
+    return ESP_FAIL;
+  }
+  stats.uploads++;
+  ESP_LOGI(TAG_UI, "Stored %s.", path);
+  return ESP_OK;
+}
+
+esp_err_t ui_files_delete(const char *name) {
+  size_t len = base_name_len(name);
+  if (!mounted || len == 0) return ESP_ERR_NOT_FOUND;
+  char path[UI_PATH_LEN];
+  file_path(path, name, len, "");
+  unlink(path);
+  file_path(path, name, len, ".gz");
+  unlink(path);
+  return ESP_OK;
+}
+
+void ui_files_stats(ui_files_stats_t *result) {
+  *result = stats;
+  result->mounted = mounted;
+  if (mounted) {
+    esp_spiffs_info(UI_FILES_PARTITION, &result->total_bytes,
+                    &result->used_bytes);
+  }
+}
@@ -0,0 +1,43 @@
+#ifndef UI_FILES_H
+#define UI_FILES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <esp_err.h>
+
+// Web UI files on the "ui" SPIFFS partition, which replace the copies
+// embedded in the firmware. Either plain or gzipped, e.g. index.js.gz.
+#define UI_FILES_PARTITION "ui"
+#define UI_FILES_BASE_PATH "/ui"
+
+typedef struct {
+  bool mounted;
+  size_t total_bytes;
+  size_t used_bytes;
+  uint32_t from_flash;
+  uint32_t gzipped;
+  uint32_t uploads;
+} ui_files_stats_t;
+
+// Mounts the partition, the embedded UI is served if it is missing.
+esp_err_t ui_files_mount(void);
+
+// Opens the stored file for reading, preferring the gzipped one if the
+// client accepts it. If only the other variant is stored, that one is
+// opened. NULL if neither is stored, use the embedded copy then.
+FILE *ui_files_open(const char *name, bool accept_gzip, bool *is_gzip);
+
+// Uploads go to a temporary file, which replaces the stored one only once
+// complete. name is one of the UI files, with or without .gz.
+FILE *ui_files_begin_upload(const char *name);
+// Stores the upload if complete, otherwise drops it.
+esp_err_t ui_files_finish_upload(const char *name, FILE *file, bool complete);
+// Removes both variants, the embedded copy is served again.
+esp_err_t ui_files_delete(const char *name);
+
+void ui_files_stats(ui_files_stats_t *stats);
+
+#endif  // UI_FILES_H
@@ -3,7 +3,13 @@
 #include <stdbool.h>
 #include <string.h>
 
+#include "benchmark.h"
+#include "boot_profile.h"
+#include "power.h"
+#include "rate_limiter.h"
+#include "state_bus.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
 #include "freertos/task.h"
@@ -23,13 +29,39 @@
 #define PACKET_SIZE 64
 
 #define COMMAND_QUEUE_LENGTH 10
+#define PRIORITY_QUEUE_LENGTH 4
+
+// Retry opening a flaky enumeration with exponential backoff.
+#define OPEN_MAX_ATTEMPTS 6
+#define OPEN_RETRY_BASE_MS 100
+#define OPEN_RETRY_MAX_MS 3200
+// Max time to wait for canceled transfers to return on close.
+#define CANCEL_TIMEOUT_MS 500
+// The state is requested again to catch changes from the IR remote or front
+// panel. Fast after activity, then doubling up to the idle interval while
+// nothing changes.
+#define REFRESH_FAST_MS 250
+#define REFRESH_IDLE_MS 10000
+// Sent fields the amp didn't echo yet are kept in the intended state for
+// at most this long, then the amp's value wins. Pending intents expire the
+// same way.
+#define INTENDED_HOLD_MS 1000
+// Max time the driver task waits for USB events. Only a safety net, the
+// task wakes up for its deadlines and new commands unblock it.
+#define EVENT_TIMEOUT_MS 10000
+// Preallocated OUT transfers, all may be in flight at once. Packets are built
+// from the intended state, so they don't revert each other. The last one is
+// reserved for the priority lane: the endpoint sends in order, so a mute
+// waits behind at most OUT_MAX_IN_FLIGHT - 1 transfers.
+#define OUT_MAX_IN_FLIGHT 2
+// An OUT transfer not completed in time is canceled.
+#define OUT_TRANSFER_DEADLINE_MS 250
+
+#define IN_ENDPOINT 0x81
+#define OUT_ENDPOINT 0x01
 
 static const char *TAG = "CLASS-DRIVER";
-static SemaphoreHandle_t hypex_state_updated;
 
-// Transfer semaphore
-static StaticSemaphore_t usb_out_transfer_sem_buffer;
-static SemaphoreHandle_t usb_out_transfer_sem;
 static StaticSemaphore_t poll_callback_sem_buffer;
 static SemaphoreHandle_t poll_callback_pending;
 
@@ -37,59 +69,364 @@ static SemaphoreHandle_t poll_callback_pending;
 static SemaphoreHandle_t state_cache_mutex;
 static StaticSemaphore_t state_cache_mutex_buffer;
 static uint8_t state_cache[PACKET_SIZE] = {0x00};
+static uint32_t state_version = 0;
+// Last received state with the fields of commands sent since applied. New
+// packets are built from it, so back-to-back commands don't revert each
+// other before the amp echoes them. Guarded by state_cache_mutex.
+static uint8_t intended_state[PACKET_SIZE] = {0x00};
+// Actions sent but not answered by the amp yet, with their values.
+static uint16_t intended_held = 0;
+static int8_t intended_value[NUM_CONTROL_ACTIONS];
+static int64_t intended_sent_us[NUM_CONTROL_ACTIONS];
+// The amp answers set packets and state requests in order, each with its
+// state. A held field is released by the answer to its packet or a later
+// one, an older state may have the same value by chance.
+static uint32_t state_packets_sent = 0;
+static uint32_t state_answers_received = 0;
+static uint32_t intended_answer[NUM_CONTROL_ACTIONS];
 static SemaphoreHandle_t filter_name_mutex;
 static StaticSemaphore_t filter_name_mutex_buffer;
-static char filter_name[FILTER_NAME_MAX_LEN];
+// Filter names per preset, kept across reconnects. Only the name of the
+// active preset can be requested, so the others are filled in as they get
+// selected.
+static char filter_names[3][FILTER_NAME_MAX_LEN];
+// Set if the name might be outdated because another preset's name changed.
+static bool filter_name_stale[3] = {false};
+static volatile bool filter_name_refresh_pending = false;
+// Preset the last name request was sent for, 0 if none is outstanding.
+static volatile uint8_t filter_name_requested_preset = 0;
+
+// Last requested value per action which the amp didn't confirm yet. These
+// are replayed after a reconnect instead of being lost.
+static bool intent_pending[NUM_CONTROL_ACTIONS] = {false};
+static int8_t intent_value[NUM_CONTROL_ACTIONS];
+static command_tag_t intent_tag[NUM_CONTROL_ACTIONS];
+// When the intent was last sent to the amp, -1 while it waits to be sent.
+static int64_t intent_sent_us[NUM_CONTROL_ACTIONS];
+// Tag of the last intent the amp confirmed, echoed in the state.
+static command_tag_t confirmed_tag[NUM_CONTROL_ACTIONS];
+static volatile bool replay_pending = false;
+// Last state delta until the amp confirmed all of its actions.
+static state_delta_t pending_delta = {0};
+static int64_t pending_delta_us;
+static portMUX_TYPE intent_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static usb_stats_t usb_stats = {.last_resync_us = -1,
+                                .max_resync_us = -1,
+                                .refresh_interval_ms = REFRESH_IDLE_MS};
+static int64_t attach_time_us = -1;
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
 
 #define ACTION_OPEN_DEV (1 << 0)
 #define ACTION_TRANSFER (1 << 1)
 #define ACTION_CLOSE_DEV (1 << 2)
 #define ACTION_POLL (1 << 3)
 #define ACTION_GET_STATE (1 << 4)
-#define ACTION_GET_FILTER_NAME (1 << 5)
 
 typedef struct {
   uint32_t actions;
   uint8_t dev_addr;
+  uint8_t open_attempts;
+  TickType_t open_retry_at;
   usb_host_client_handle_t client_hdl;
   usb_device_handle_t dev_hdl;
-  usb_transfer_t *out_transfer;
   usb_transfer_t *in_transfer;
 } class_driver_t;
 
 static const char *TAG_DRIVER = "DRIVER";
 static volatile bool device_is_connected = false;
 
+// Only used by the driver task and the transfer callbacks it runs.
+typedef struct {
+  usb_transfer_t *transfer;
+  bool in_flight;
+  // Set once its cancellation is requested, until the callback.
+  bool canceled;
+  int64_t submitted_us;
+  // The amp answers the packet with its state.
+  bool answered;
+} out_slot_t;
+static out_slot_t out_pool[OUT_MAX_IN_FLIGHT];
+static int out_in_flight = 0;
+// Start of the current period with transfers in flight.
+static int64_t out_busy_since_us;
+
+// Refresh schedule, only used by the driver task and its callbacks.
+// -1 until the first state after opening the device.
+static int64_t next_refresh_us = -1;
+static uint32_t refresh_interval_ms = REFRESH_IDLE_MS;
+static bool refresh_outstanding = false;
+static int64_t last_state_us;
+
+typedef struct {
+  // A single command is a delta with one action.
+  state_delta_t delta;
+  int64_t queued_us;
+  command_origin_t origin;
+  // Order in which the commands were queued, a mute may overtake others.
+  uint32_t generation;
+} queued_command_t;
+
+static uint32_t last_generation = 0;
+// Generation of the last sent command per action. An older command which
+// was overtaken doesn't change the action anymore.
+static uint32_t sent_generation[NUM_CONTROL_ACTIONS] = {0};
+
+// Two lanes, commands in the priority lane overtake everything which is
+// still waiting in the normal one.
 static StaticQueue_t command_queue_buffer;
-uint8_t ucQueueStorageArea[COMMAND_QUEUE_LENGTH * sizeof(control_action_t)];
-QueueHandle_t command_queue;
+static uint8_t command_queue_storage[COMMAND_QUEUE_LENGTH *
+                                     sizeof(queued_command_t)];
+static QueueHandle_t command_queue;
+static StaticQueue_t priority_queue_buffer;
+static uint8_t priority_queue_storage[PRIORITY_QUEUE_LENGTH *
+                                      sizeof(queued_command_t)];
+static QueueHandle_t priority_queue;
+// Set once the client is registered, used to wake the driver task.
+static usb_host_client_handle_t client_hdl = NULL;
 
 bool is_device_connected(void) { return device_is_connected; }
 
-static void cache_hypex_state_buffer(uint8_t *data) {
-  ESP_LOGI(TAG_DRIVER, "********** Received state data **********");
-  ESP_LOG_BUFFER_HEX(TAG_DRIVER, data, PACKET_SIZE);
-  bool state_changed = false;
-  if (xSemaphoreTake(state_cache_mutex, portMAX_DELAY) == pdTRUE) {
-    if (memcmp(data, state_cache, 64) != 0) {
-      state_changed = true;
-      memcpy(state_cache, data, 64);
+void get_usb_stats(usb_stats_t *stats) {
+  taskENTER_CRITICAL(&stats_lock);
+  memcpy(stats, &usb_stats, sizeof(usb_stats_t));
+  taskEXIT_CRITICAL(&stats_lock);
+}
+
+static bool state_confirms(const uint8_t *state, int action, int8_t value) {
+  switch ((control_action_type_t)action) {
+    case ACTION_SET_PRESET:
+      return state[2] == value;
+    case ACTION_SET_VOLUME:
+      return (int16_t)((state[4] << 8) | state[3]) == value * 100;
+    case ACTION_SET_MUTE:
+      return ((state[6] & 0x80) != 0) == (value != 0);
+    case ACTION_SET_SOURCE_P1:
+    case ACTION_SET_SOURCE_P2:
+    case ACTION_SET_SOURCE_P3:
+      return (state[12 + action - ACTION_SET_SOURCE_P1] & 0x0F) == value;
+    case ACTION_SET_EQ_P1:
+    case ACTION_SET_EQ_P2:
+    case ACTION_SET_EQ_P3:
+      return ((state[12 + action - ACTION_SET_EQ_P1] & 0x10) != 0) ==
+             (value != 0);
+  }
+  return false;
+}
+
+// Only muting is urgent. Unmuting keeps its place behind queued preset
+// changes, otherwise it could make a switch audible.
+static bool is_priority_command(control_action_t command) {
+  return command.action == ACTION_SET_MUTE && command.value != 0;
+}
+
+static uint32_t next_generation(void) {
+  taskENTER_CRITICAL(&intent_lock);
+  uint32_t generation = ++last_generation;
+  taskEXIT_CRITICAL(&intent_lock);
+  return generation;
+}
+
+static BaseType_t queue_command(control_action_t command) {
+  queued_command_t queued = {.delta.actions = 1 << command.action,
+                             .queued_us = esp_timer_get_time(),
+                             .origin = command.origin,
+                             .generation = next_generation()};
+  queued.delta.values[command.action] = command.value;
+  bool priority = is_priority_command(command);
+  BaseType_t status =
+      xQueueSend(priority ? priority_queue : command_queue, &queued, 0);
+  if (status != pdPASS) return status;
+  rate_limiter_queued(command.origin);
+  // Don't wait for the event timeout of the driver task.
+  if (client_hdl != NULL) usb_host_client_unblock(client_hdl);
+  return status;
+}
+
+static UBaseType_t commands_waiting(void) {
+  return uxQueueMessagesWaiting(priority_queue) +
+         uxQueueMessagesWaiting(command_queue);
+}
+
+// An intent as it was before a command replaced it.
+typedef struct {
+  bool pending;
+  int8_t value;
+  command_tag_t tag;
+  int64_t sent_us;
+} intent_backup_t;
+
+// Recorded before the command is queued, the driver task may send it and
+// get the amp's echo before the caller continues. Returns the old intent.
+static intent_backup_t record_intent(control_action_t command) {
+  int i = command.action;
+  taskENTER_CRITICAL(&intent_lock);
+  intent_backup_t backup = {.pending = intent_pending[i],
+                            .value = intent_value[i],
+                            .tag = intent_tag[i],
+                            .sent_us = intent_sent_us[i]};
+  intent_pending[i] = true;
+  intent_value[i] = command.value;
+  intent_tag[i] = command.tag;
+  intent_sent_us[i] = -1;
+  taskEXIT_CRITICAL(&intent_lock);
+  return backup;
+}
+
+// Puts back the intent of a command which couldn't be queued.
+static void restore_intent(int action, intent_backup_t backup) {
+  taskENTER_CRITICAL(&intent_lock);
+  intent_pending[action] = backup.pending;
+  intent_value[action] = backup.value;
+  intent_tag[action] = backup.tag;
+  intent_sent_us[action] = backup.sent_us;
+  taskEXIT_CRITICAL(&intent_lock);
+}
+
+// Called once the actions were queued or deferred. A preset change resets the
+// volume, replaying an older volume command after it would undo that.
+static void drop_superseded_intents(uint32_t actions) {
+#ifdef PRESET_CHANGE_RESET_VOLUME_DB
+  bool resets_volume = (actions & (1 << ACTION_SET_PRESET)) &&
+                       !(actions & (1 << ACTION_SET_VOLUME));
+  if (!resets_volume) return;
+  taskENTER_CRITICAL(&intent_lock);
+  intent_pending[ACTION_SET_VOLUME] = false;
+  taskEXIT_CRITICAL(&intent_lock);
+#endif  // PRESET_CHANGE_RESET_VOLUME_DB
+}
+
+// Returns true if a confirmed tag changed. An intent the amp didn't confirm
+// in time after it was sent is dropped, a later command may have changed
+// the field again. Otherwise it would keep the refresh fast and be replayed
+// on the next reconnect.
+static bool confirm_intents(const uint8_t *state) {
+  bool acks_changed = false;
+  uint32_t expired = 0;
+  int64_t now = esp_timer_get_time();
+  taskENTER_CRITICAL(&intent_lock);
+  for (int i = 0; i < NUM_CONTROL_ACTIONS; i++) {
+    if (!intent_pending[i]) continue;
+    if (state_confirms(state, i, intent_value[i])) {
+      intent_pending[i] = false;
+      if (memcmp(&confirmed_tag[i], &intent_tag[i], sizeof(command_tag_t))) {
+        confirmed_tag[i] = intent_tag[i];
+        acks_changed = true;
+      }
+    } else if (intent_sent_us[i] >= 0 &&
+               now - intent_sent_us[i] > (int64_t)INTENDED_HOLD_MS * 1000) {
+      intent_pending[i] = false;
+      // The delta can't be confirmed anymore.
+      if (pending_delta.actions & (1 << i)) pending_delta.actions = 0;
+      expired++;
     }
-    xSemaphoreGive(state_cache_mutex);
   }
-  if (state_changed) {
-    xSemaphoreGive(hypex_state_updated);
+  taskEXIT_CRITICAL(&intent_lock);
+  if (expired) {
+    ESP_LOGW(TAG_DRIVER, "%lu commands not confirmed in time, dropped.",
+             (unsigned long)expired);
+    taskENTER_CRITICAL(&stats_lock);
+    usb_stats.intents_expired += expired;
+    taskEXIT_CRITICAL(&stats_lock);
+  }
+  return acks_changed;
+}
+
+static void check_delta_confirmed(const uint8_t *state) {
+  taskENTER_CRITICAL(&intent_lock);
+  bool confirmed = pending_delta.actions != 0;
+  for (int i = 0; i < NUM_CONTROL_ACTIONS && confirmed; i++) {
+    if (pending_delta.actions & (1 << i)) {
+      confirmed = state_confirms(state, i, pending_delta.values[i]);
+    }
+  }
+  if (confirmed) pending_delta.actions = 0;
+  int64_t latency_us = esp_timer_get_time() - pending_delta_us;
+  taskEXIT_CRITICAL(&intent_lock);
+  if (!confirmed) return;
+  taskENTER_CRITICAL(&stats_lock);
+  usb_stats.deltas_confirmed++;
+  usb_stats.last_delta_latency_us = latency_us;
+  if (latency_us > usb_stats.max_delta_latency_us) {
+    usb_stats.max_delta_latency_us = latency_us;
+  }
+  taskEXIT_CRITICAL(&stats_lock);
+  ESP_LOGI(TAG_DRIVER, "State delta confirmed after %lld ms",
+           latency_us / 1000);
+}
+
+static void record_resync(void) {
+  if (attach_time_us < 0) return;
+  int64_t resync_us = esp_timer_get_time() - attach_time_us;
+  attach_time_us = -1;
+  taskENTER_CRITICAL(&stats_lock);
+  usb_stats.last_resync_us = resync_us;
+  if (resync_us > usb_stats.max_resync_us) usb_stats.max_resync_us = resync_us;
+  taskEXIT_CRITICAL(&stats_lock);
+  ESP_LOGI(TAG_DRIVER, "Resynced %lld ms after attach", resync_us / 1000);
+}
+
+static bool intents_open(void) {
+  taskENTER_CRITICAL(&intent_lock);
+  bool open = pending_delta.actions != 0;
+  for (int i = 0; i < NUM_CONTROL_ACTIONS; i++) {
+    if (intent_pending[i]) open = true;
   }
+  taskEXIT_CRITICAL(&intent_lock);
+  return open;
 }
 
-void read_hypex_state_buffer(uint8_t *data) {
+static void schedule_refresh(uint32_t interval_ms) {
+  refresh_interval_ms = interval_ms;
+  next_refresh_us = esp_timer_get_time() + (int64_t)interval_ms * 1000;
+  taskENTER_CRITICAL(&stats_lock);
+  usb_stats.refresh_interval_ms = interval_ms;
+  taskEXIT_CRITICAL(&stats_lock);
+}
+
+// Stays fast while the state changes or doesn't match the commands sent,
+// otherwise backs off.
+static void update_refresh_schedule(bool state_changed) {
+  bool mismatch = intents_open();
+  if (refresh_outstanding && state_changed && !mismatch) {
+    // Changed outside of the web interface.
+    taskENTER_CRITICAL(&stats_lock);
+    usb_stats.refresh_changes++;
+    taskEXIT_CRITICAL(&stats_lock);
+  }
+  refresh_outstanding = false;
+  last_state_us = esp_timer_get_time();
+  if (state_changed || mismatch) {
+    schedule_refresh(REFRESH_FAST_MS);
+  } else {
+    uint32_t interval_ms = refresh_interval_ms * 2;
+    schedule_refresh(interval_ms > REFRESH_IDLE_MS ? REFRESH_IDLE_MS
+                                                   : interval_ms);
+  }
+}
+
+static void record_refresh_staleness(int64_t staleness_us) {
+  static const uint32_t bounds_ms[] = REFRESH_STALENESS_BOUNDS_MS;
+  int bucket = 0;
+  while (bucket < REFRESH_STALENESS_BUCKETS - 1 &&
+         staleness_us >= (int64_t)bounds_ms[bucket] * 1000) {
+    bucket++;
+  }
+  taskENTER_CRITICAL(&stats_lock);
+  usb_stats.refreshes++;
+  usb_stats.refresh_staleness[bucket]++;
+  if (staleness_us > usb_stats.max_refresh_staleness_us) {
+    usb_stats.max_refresh_staleness_us = staleness_us;
+  }
+  taskEXIT_CRITICAL(&stats_lock);
+}
+
+// Turns a received state into the base of a packet to send.
+static void sanitize_state_packet(const uint8_t *state, uint8_t *data) {
   // Set packages for the current settings are only first 32 bytes.
   // FYI: DIM state of display is not in the first 32!
   memset(data, 0x00, PACKET_SIZE);
-  if (xSemaphoreTake(state_cache_mutex, portMAX_DELAY) == pdTRUE) {
-    memcpy(data, state_cache, 32);
-    xSemaphoreGive(state_cache_mutex);
-  }
+  memcpy(data, state, 32);
   // The amp is responding the current source here but if we set it here the
   // command is rejected.
   data[1] = 0x00;
@@ -99,6 +436,134 @@ void read_hypex_state_buffer(uint8_t *data) {
   data[26] = 0x00;
 }
 
+// Copies the bytes or bits of one action's field.
+static void copy_field(uint8_t *dst, const uint8_t *src, int action) {
+  switch ((control_action_type_t)action) {
+    case ACTION_SET_PRESET:
+      dst[2] = src[2];
+#ifdef PRESET_CHANGE_RESET_VOLUME_DB
+      // The preset change also reset the volume.
+      dst[3] = src[3];
+      dst[4] = src[4];
+#endif  // PRESET_CHANGE_RESET_VOLUME_DB
+      break;
+    case ACTION_SET_VOLUME:
+      dst[3] = src[3];
+      dst[4] = src[4];
+      break;
+    case ACTION_SET_MUTE:
+      dst[6] = (dst[6] & ~0x80) | (src[6] & 0x80);
+      break;
+    case ACTION_SET_SOURCE_P1:
+    case ACTION_SET_SOURCE_P2:
+    case ACTION_SET_SOURCE_P3: {
+      int i = 12 + action - ACTION_SET_SOURCE_P1;
+      dst[i] = (dst[i] & 0xF0) | (src[i] & 0x0F);
+      break;
+    }
+    case ACTION_SET_EQ_P1:
+    case ACTION_SET_EQ_P2:
+    case ACTION_SET_EQ_P3: {
+      int i = 12 + action - ACTION_SET_EQ_P1;
+      dst[i] = (dst[i] & ~0x10) | (src[i] & 0x10);
+      break;
+    }
+  }
+}
+
+// Rebuilds the intended state from a received one, keeping the fields of
+// commands the amp didn't echo yet. Called with state_cache_mutex held.
+static void reconcile_intended_state(const uint8_t *state) {
+  uint8_t reconciled[PACKET_SIZE];
+  sanitize_state_packet(state, reconciled);
+  int64_t now = esp_timer_get_time();
+  uint32_t held = 0;
+  for (int i = 0; i < NUM_CONTROL_ACTIONS; i++) {
+    if (!(intended_held & (1 << i))) continue;
+    // Otherwise the amp didn't take the value, its state wins.
+    bool answered =
+        (int32_t)(state_answers_received - intended_answer[i]) >= 0;
+    if (answered ||
+        now - intended_sent_us[i] > (int64_t)INTENDED_HOLD_MS * 1000) {
+      intended_held &= ~(1 << i);
+      continue;
+    }
+    copy_field(reconciled, intended_state, i);
+    held++;
+  }
+  memcpy(intended_state, reconciled, PACKET_SIZE);
+  if (held == 0) return;
+  taskENTER_CRITICAL(&stats_lock);
+  usb_stats.intended_fields_held += held;
+  taskEXIT_CRITICAL(&stats_lock);
+}
+
+// Fields of the published state which differ, other bytes are ignored.
+static uint16_t changed_fields(const uint8_t *old, const uint8_t *new) {
+  uint16_t changed = 0;
+  if (old[2] != new[2]) changed |= STATE_FIELD_PRESET;
+  if (old[3] != new[3] || old[4] != new[4]) changed |= STATE_FIELD_VOLUME;
+  if ((old[6] ^ new[6]) & 0x80) changed |= STATE_FIELD_MUTE;
+  if (old[50] != new[50]) changed |= STATE_FIELD_CURRENT_SOURCE;
+  for (int i = 12; i <= 14; i++) {
+    if ((old[i] ^ new[i]) & 0x0F) changed |= STATE_FIELD_PRESET_SOURCE;
+    if ((old[i] ^ new[i]) & 0x10) changed |= STATE_FIELD_EQ;
+  }
+  return changed;
+}
+
+// Bumps the version for a change outside of the state cache.
+static void publish_change(uint16_t changed) {
+  xSemaphoreTake(state_cache_mutex, portMAX_DELAY);
+  uint32_t version = ++state_version;
+  xSemaphoreGive(state_cache_mutex);
+  state_bus_publish(changed, version);
+}
+
+// Cached names are shown right away, only fetch missing or stale ones.
+static void request_filter_name_if_needed(uint8_t preset) {
+  if (preset < 1 || preset > 3) return;
+  xSemaphoreTake(filter_name_mutex, portMAX_DELAY);
+  if (filter_names[preset - 1][0] == '\0' || filter_name_stale[preset - 1]) {
+    filter_name_refresh_pending = true;
+  }
+  xSemaphoreGive(filter_name_mutex);
+}
+
+static void cache_hypex_state_buffer(const uint8_t *data) {
+  ESP_LOGI(TAG_DRIVER, "********** Received state data **********");
+  ESP_LOG_BUFFER_HEX(TAG_DRIVER, data, PACKET_SIZE);
+  uint16_t changed = 0;
+  uint32_t version = 0;
+  if (xSemaphoreTake(state_cache_mutex, portMAX_DELAY) == pdTRUE) {
+    changed = changed_fields(state_cache, data);
+    memcpy(state_cache, data, 64);
+    state_answers_received++;
+    if (changed) state_version++;
+    version = state_version;
+    reconcile_intended_state(data);
+    xSemaphoreGive(state_cache_mutex);
+  }
+  // Before the replay, the pending intents are still to be sent.
+  if (!replay_pending && confirm_intents(data)) {
+    // The acks are published with the state.
+    if (!changed) {
+      xSemaphoreTake(state_cache_mutex, portMAX_DELAY);
+      version = ++state_version;
+      xSemaphoreGive(state_cache_mutex);
+    }
+    changed |= STATE_FIELD_ACKS;
+  }
+  if (!replay_pending) check_delta_confirmed(data);
+  record_resync();
+  update_refresh_schedule(changed != 0);
+  if (changed & STATE_FIELD_PRESET) request_filter_name_if_needed(data[2]);
+  if (changed) {
+    boot_mark(BOOT_AMP_STATE_RECEIVED);
+    state_bus_publish(changed, version);
+  }
+}
+
 void get_state(state_t *state) {
   if (xSemaphoreTake(state_cache_mutex, portMAX_DELAY) == pdTRUE) {
     state->preset = state_cache[2];
@@ -112,30 +577,84 @@ void get_state(state_t *state) {
     state->is_eq_on[0] = (state_cache[12] & 0x10) ? true : false;
     state->is_eq_on[1] = (state_cache[13] & 0x10) ? true : false;
     state->is_eq_on[2] = (state_cache[14] & 0x10) ? true : false;
+    taskENTER_CRITICAL(&intent_lock);
+    memcpy(state->acks, confirmed_tag, sizeof(confirmed_tag));
+    taskEXIT_CRITICAL(&intent_lock);
+    state->version = state_version;
     xSemaphoreGive(state_cache_mutex);
   }
 }
 
+static uint8_t get_cached_preset(void) {
+  xSemaphoreTake(state_cache_mutex, portMAX_DELAY);
+  uint8_t preset = state_cache[2];
+  xSemaphoreGive(state_cache_mutex);
+  return preset;
+}
+
 void get_filter_name(char *name) {
+  uint8_t preset = get_cached_preset();
+  if (!device_is_connected || preset < 1 || preset > 3) {
+    name[0] = '\0';
+    return;
+  }
   xSemaphoreTake(filter_name_mutex, portMAX_DELAY);
-  strcpy(name, filter_name);
+  strcpy(name, filter_names[preset - 1]);
   xSemaphoreGive(filter_name_mutex);
 }
 
 static void cache_filter_name(const uint8_t *data) {
+  // The amp answers with the name of the active preset. If it changed since
+  // the request, the name can't be told apart from the other preset's.
+  uint8_t preset = filter_name_requested_preset;
+  filter_name_requested_preset = 0;
+  uint8_t cached_preset = get_cached_preset();
+  if (preset < 1 || preset > 3 || preset != cached_preset) {
+    ESP_LOGW(TAG_DRIVER, "Ignoring filter name requested for preset %d.",
+             preset);
+    request_filter_name_if_needed(cached_preset);
+    return;
+  }
+  char name[FILTER_NAME_MAX_LEN];
+  strncpy(name, (const char *)&data[2], FILTER_NAME_MAX_LEN - 1);
+  name[FILTER_NAME_MAX_LEN - 1] = '\0';
+
+  bool name_changed = false;
   xSemaphoreTake(filter_name_mutex, portMAX_DELAY);
-  strncpy(filter_name, (const char *)&data[2], FILTER_NAME_MAX_LEN - 1);
-  filter_name[FILTER_NAME_MAX_LEN - 1] = '\0';
+  char *cached_name = filter_names[preset - 1];
+  if (strcmp(name, cached_name) != 0) {
+    name_changed = true;
+    if (cached_name[0] != '\0') {
+      // Filters were reprogrammed, the other names might be outdated too.
+      for (int i = 0; i < 3; i++) filter_name_stale[i] = true;
+    }
+    strcpy(cached_name, name);
+  }
+  filter_name_stale[preset - 1] = false;
   xSemaphoreGive(filter_name_mutex);
+  // The filter name is part of the published state.
+  if (name_changed) publish_change(STATE_FIELD_FILTER_NAME);
 }
 
 static void clear_caches(void) {
+  static const uint8_t cleared[PACKET_SIZE] = {0x00};
   xSemaphoreTake(state_cache_mutex, portMAX_DELAY);
+  uint16_t changed =
+      changed_fields(state_cache, cleared) | STATE_FIELD_CONNECTION;
   memset(state_cache, 0x00, PACKET_SIZE);
+  memset(intended_state, 0x00, PACKET_SIZE);
+  intended_held = 0;
+  state_packets_sent = 0;
+  state_answers_received = 0;
+  uint32_t version = ++state_version;
   xSemaphoreGive(state_cache_mutex);
+  state_bus_publish(changed, version);
+  // Filter names are kept, they are refreshed once the amp is back.
   xSemaphoreTake(filter_name_mutex, portMAX_DELAY);
-  memset(filter_name, 0x00, PACKET_SIZE);
+  for (int i = 0; i < 3; i++) filter_name_stale[i] = true;
   xSemaphoreGive(filter_name_mutex);
+  filter_name_refresh_pending = false;
+  filter_name_requested_preset = 0;
 }
 
 static void set_volume_in_packet(uint8_t *paket, int8_t db_value) {
@@ -167,66 +686,164 @@ static void in_transfer_callback(usb_transfer_t *transfer) {
   xSemaphoreGive(poll_callback_pending);
 }
 
+static void release_out_slot(out_slot_t *slot) {
+  int64_t now = esp_timer_get_time();
+  int64_t latency_us = now - slot->submitted_us;
+  slot->in_flight = false;
+  out_in_flight--;
+  taskENTER_CRITICAL(&stats_lock);
+  if (latency_us > usb_stats.max_out_latency_us) {
+    usb_stats.max_out_latency_us = latency_us;
+  }
+  if (out_in_flight == 0) usb_stats.out_busy_us += now - out_busy_since_us;
+  taskEXIT_CRITICAL(&stats_lock);
+  if (out_in_flight == 0) power_release(POWER_LOCK_USB);
+}
+
 static void out_transfer_callback(usb_transfer_t *transfer) {
   ESP_LOGI(TAG_DRIVER, "Received OUT transfer callback");
-  if (transfer->status == USB_TRANSFER_STATUS_COMPLETED) {
+  bool completed = transfer->status == USB_TRANSFER_STATUS_COMPLETED;
+  if (completed) {
     ESP_LOGI(TAG_DRIVER,
              "Ack for sending (%d bytes):", transfer->actual_num_bytes);
   } else {
     ESP_LOGW(TAG_DRIVER, "Command error status: %d.", transfer->status);
   }
-  xSemaphoreGive(usb_out_transfer_sem);
+  out_slot_t *slot = (out_slot_t *)transfer->context;
+  if (!completed && slot->answered) {
+    // Never reaches the amp, the later answers count on.
+    xSemaphoreTake(state_cache_mutex, portMAX_DELAY);
+    state_answers_received++;
+    xSemaphoreGive(state_cache_mutex);
+  }
+  release_out_slot(slot);
+  taskENTER_CRITICAL(&stats_lock);
+  if (completed) {
+    usb_stats.out_completed++;
+  } else {
+    usb_stats.out_failed++;
+  }
+  taskEXIT_CRITICAL(&stats_lock);
 }
 
-static esp_err_t send_single_command(class_driver_t *driver_obj) {
+static bool out_slot_available(bool priority) {
+  return out_in_flight < (priority ? OUT_MAX_IN_FLIGHT : OUT_MAX_IN_FLIGHT - 1);
+}
+
+// Copies the packet into a free transfer of the pool and submits it.
+static esp_err_t send_single_command(class_driver_t *driver_obj,
+                                     const uint8_t *packet) {
   ESP_LOGI(TAG_DRIVER, "Sending data:");
-  ESP_LOG_BUFFER_HEX(TAG_DRIVER, driver_obj->out_transfer->data_buffer,
-                     PACKET_SIZE);
+  ESP_LOG_BUFFER_HEX(TAG_DRIVER, packet, PACKET_SIZE);
 #ifdef TEST_MODE
-  cache_hypex_state_buffer(driver_obj->out_transfer->data_buffer);
+  cache_hypex_state_buffer(packet);
 #endif  // TEST_MODE
 
-  if (!device_is_connected) {  // TODO remove as I now have the
-                               // class_driver_t *driver_obj?
+  if (!device_is_connected) {
     ESP_LOGE(TAG_DRIVER, "Not connected.");
-    // TODO have own error class?
     return ESP_ERR_NOT_FOUND;
   }
 
-  esp_err_t err = usb_host_transfer_submit(driver_obj->out_transfer);
+  out_slot_t *slot = NULL;
+  for (int i = 0; i < OUT_MAX_IN_FLIGHT && slot == NULL; i++) {
+    if (!out_pool[i].in_flight) slot = &out_pool[i];
+  }
+  if (slot == NULL) {
+    ESP_LOGE(TAG_DRIVER, "No free OUT transfer.");
+    return ESP_ERR_NO_MEM;
+  }
+
+  memcpy(slot->transfer->data_buffer, packet, PACKET_SIZE);
+  slot->transfer->device_handle = driver_obj->dev_hdl;
+  slot->submitted_us = esp_timer_get_time();
+  esp_err_t err = usb_host_transfer_submit(slot->transfer);
   if (err != ESP_OK) {
     ESP_LOGE(TAG_DRIVER, "Transfer failed.");
     return err;
   }
+  // Owned by the USB stack until its callback.
+  slot->in_flight = true;
+  slot->canceled = false;
+  slot->answered = packet[0] == 0x05 || packet[0] == 0x06;
+  if (slot->answered) state_packets_sent++;
+  if (out_in_flight++ == 0) {
+    out_busy_since_us = slot->submitted_us;
+    power_acquire(POWER_LOCK_USB);
+  }
+  taskENTER_CRITICAL(&stats_lock);
+  usb_stats.out_submitted++;
+  if (out_in_flight > usb_stats.max_out_in_flight) {
+    usb_stats.max_out_in_flight = out_in_flight;
+  }
+  taskEXIT_CRITICAL(&stats_lock);
+  return ESP_OK;
+}
 
-  // TODO maybe don't sleep?
-  // Sleep until transfer completed
-  // if (xSemaphoreTake(usb_out_transfer_sem, portMAX_DELAY) != pdTRUE) {
-  //   ESP_LOGE(TAG_DRIVER, "*** Transfer timed out:");
-  //   ESP_LOG_BUFFER_HEX(TAG_DRIVER, hid_paket, paket_size);
-  //   ESP_LOGE(TAG_DRIVER, " *** Transfer timed out");
+// Cancels all OUT transfers if one missed its deadline. Their callbacks
+// return the slots. The amp state is refreshed to see what arrived.
+static void cancel_expired_out_transfers(class_driver_t *driver_obj) {
+  int64_t now = esp_timer_get_time();
+  int expired = 0;
+  for (int i = 0; i < OUT_MAX_IN_FLIGHT; i++) {
+    if (out_pool[i].in_flight && !out_pool[i].canceled &&
+        now - out_pool[i].submitted_us >=
+            (int64_t)OUT_TRANSFER_DEADLINE_MS * 1000) {
+      expired++;
+    }
+  }
+  if (expired == 0) return;
+  // The flush cancels every transfer queued on the endpoint.
+  for (int i = 0; i < OUT_MAX_IN_FLIGHT; i++) {
+    if (out_pool[i].in_flight) out_pool[i].canceled = true;
+  }
+  ESP_LOGW(TAG_DRIVER, "%d OUT transfers missed their deadline, canceling.",
+           expired);
+  usb_host_endpoint_halt(driver_obj->dev_hdl, OUT_ENDPOINT);
+  usb_host_endpoint_flush(driver_obj->dev_hdl, OUT_ENDPOINT);
+  usb_host_endpoint_clear(driver_obj->dev_hdl, OUT_ENDPOINT);
+  taskENTER_CRITICAL(&stats_lock);
+  usb_stats.out_timeouts += expired;
+  taskEXIT_CRITICAL(&stats_lock);
+  if (next_refresh_us >= 0) schedule_refresh(REFRESH_FAST_MS);
+}
 
-  //   xSemaphoreGive(usb_out_transfer_sem);
-  //   return ESP_ERR_TIMEOUT;
-  // }
-  return ESP_OK;
+static command_result_t count_command_result(command_result_t result) {
+  taskENTER_CRITICAL(&stats_lock);
+  switch (result) {
+    case COMMAND_QUEUED:
+      usb_stats.commands_queued++;
+      break;
+    case COMMAND_DEFERRED:
+      usb_stats.commands_deferred++;
+      break;
+    case COMMAND_REJECTED:
+      usb_stats.commands_rejected++;
+      break;
+    case COMMAND_BUSY:
+      usb_stats.commands_busy++;
+      break;
+    case COMMAND_THROTTLED:
+      usb_stats.commands_throttled++;
+      break;
+  }
+  taskEXIT_CRITICAL(&stats_lock);
+  return result;
 }
 
-void enqueue_command(control_action_t command) {
-  // Validation
+static bool is_valid_command(control_action_t command) {
   switch (command.action) {
     case ACTION_SET_PRESET:
       if (command.value < 1 || command.value > 3) {
         ESP_LOGE(TAG, "Invalid preset value %d. Must be between 1 and 3.",
                  command.value);
-        return;
+        return false;
       }
       break;
     case ACTION_SET_VOLUME:
       if (command.value < MIN_VOLUME || command.value > MAX_VOLUME) {
         ESP_LOGE(TAG, "Invalid volume value %d. Must be between %d and %d.",
                  command.value, MIN_VOLUME, MAX_VOLUME);
-        return;
+        return false;
       }
       break;
     case ACTION_SET_SOURCE_P1:
@@ -241,7 +858,7 @@ void enqueue_command(control_action_t command) {
       // SOURCTE_EXT   = 7
       if (command.value < 0 || command.value > 7 || command.value == 3) {
         ESP_LOGE(TAG, "Invalid source value %d.", command.value);
-        return;
+        return false;
       }
       break;
     case ACTION_SET_MUTE:
@@ -251,116 +868,239 @@ void enqueue_command(control_action_t command) {
       // No validation needed
       break;
   }
+  return true;
+}
 
-  BaseType_t status = xQueueSend(command_queue, &command, portMAX_DELAY);
-  if (status != pdPASS) {
-    ESP_LOGE(TAG_DRIVER, "Failed to add command %d to the queue.",
-             command.action);
-  } else {
-    ESP_LOGI(TAG_DRIVER, "Added command %d to the queue.", command.action);
+command_result_t enqueue_command(control_action_t command) {
+  if (!is_valid_command(command)) {
+    return count_command_result(COMMAND_REJECTED);
+  }
+  if (!rate_limiter_admit(command.origin)) {
+    ESP_LOGW(TAG_DRIVER, "Throttling command %d of %s origin.", command.action,
+             command_origin_name(command.origin.type));
+    return count_command_result(COMMAND_THROTTLED);
   }
-}
 
-static void set_preset(class_driver_t *driver_obj, int8_t preset) {
-  read_hypex_state_buffer(driver_obj->out_transfer->data_buffer);
+  if (!device_is_connected) {
+    // Replayed as pending intent once the amp is connected.
+    ESP_LOGI(TAG_DRIVER, "Not connected, deferring command %d.",
+             command.action);
+    record_intent(command);
+    drop_superseded_intents(1 << command.action);
+    return count_command_result(COMMAND_DEFERRED);
+  }
 
-  driver_obj->out_transfer->data_buffer[2] = preset;
-#ifdef PRESET_CHANGE_RESET_VOLUME_DB
-  set_volume_in_packet(driver_obj->out_transfer->data_buffer,
-                       PRESET_CHANGE_RESET_VOLUME_DB);
-#endif  // PRESET_CHANGE_RESET_VOLUME_DB
-  send_single_command(driver_obj);
+  intent_backup_t replaced = record_intent(command);
+  // Don't wait for space, a stalled USB side must not block the callers.
+  BaseType_t status = queue_command(command);
+  if (status != pdPASS) {
+    restore_intent(command.action, replaced);
+    ESP_LOGW(TAG_DRIVER, "Queue full, rejecting command %d.", command.action);
+    return count_command_result(COMMAND_BUSY);
+  }
+  drop_superseded_intents(1 << command.action);
+  ESP_LOGI(TAG_DRIVER, "Added command %d to the queue.", command.action);
+  return count_command_result(COMMAND_QUEUED);
 }
 
-static void set_volume(class_driver_t *driver_obj, float volume_db) {
-  read_hypex_state_buffer(driver_obj->out_transfer->data_buffer);
-
-  set_volume_in_packet(driver_obj->out_transfer->data_buffer, volume_db);
-  send_single_command(driver_obj);
+bool is_valid_state_delta(const state_delta_t *delta) {
+  if (delta->actions == 0 || delta->actions >> NUM_CONTROL_ACTIONS) {
+    return false;
+  }
+  for (int i = 0; i < NUM_CONTROL_ACTIONS; i++) {
+    control_action_t command = {.action = i, .value = delta->values[i]};
+    if (delta->actions & (1 << i) && !is_valid_command(command)) return false;
+  }
+  return true;
 }
 
-static void set_mute(class_driver_t *driver_obj, bool mute) {
-  read_hypex_state_buffer(driver_obj->out_transfer->data_buffer);
-
-  // Mute bit is (Byte 6, Bit 7)
-  uint8_t mask = (1 << 7);
-  if (mute) {
-    driver_obj->out_transfer->data_buffer[6] |= mask;
-  } else {
-    driver_obj->out_transfer->data_buffer[6] &= ~mask;
+command_result_t enqueue_state_delta(const state_delta_t *delta,
+                                     command_origin_t origin) {
+  if (!is_valid_state_delta(delta)) {
+    return count_command_result(COMMAND_REJECTED);
+  }
+  if (!rate_limiter_admit(origin)) {
+    ESP_LOGW(TAG_DRIVER, "Throttling state delta of %s origin.",
+             command_origin_name(origin.type));
+    return count_command_result(COMMAND_THROTTLED);
   }
 
-  send_single_command(driver_obj);
+  // Each action is confirmed and replayed on its own.
+  intent_backup_t replaced[NUM_CONTROL_ACTIONS];
+  for (int i = 0; i < NUM_CONTROL_ACTIONS; i++) {
+    if (!(delta->actions & (1 << i))) continue;
+    control_action_t command = {.action = i, .value = delta->values[i]};
+    replaced[i] = record_intent(command);
+  }
+  taskENTER_CRITICAL(&intent_lock);
+  state_delta_t replaced_delta = pending_delta;
+  int64_t replaced_delta_us = pending_delta_us;
+  pending_delta = *delta;
+  pending_delta_us = esp_timer_get_time();
+  taskEXIT_CRITICAL(&intent_lock);
+
+  command_result_t result = COMMAND_DEFERRED;
+  if (device_is_connected) {
+    queued_command_t queued = {.delta = *delta,
+                               .queued_us = esp_timer_get_time(),
+                               .origin = origin,
+                               .generation = next_generation()};
+    if (xQueueSend(command_queue, &queued, 0) != pdPASS) {
+      for (int i = 0; i < NUM_CONTROL_ACTIONS; i++) {
+        if (delta->actions & (1 << i)) restore_intent(i, replaced[i]);
+      }
+      taskENTER_CRITICAL(&intent_lock);
+      pending_delta = replaced_delta;
+      pending_delta_us = replaced_delta_us;
+      taskEXIT_CRITICAL(&intent_lock);
+      ESP_LOGW(TAG_DRIVER, "Queue full, rejecting state delta.");
+      return count_command_result(COMMAND_BUSY);
+    }
+    rate_limiter_queued(origin);
+    if (client_hdl != NULL) usb_host_client_unblock(client_hdl);
+    result = COMMAND_QUEUED;
+  }
+  drop_superseded_intents(delta->actions);
+  ESP_LOGI(TAG_DRIVER, "State delta 0x%x %s.", delta->actions,
+           result == COMMAND_QUEUED ? "queued" : "deferred");
+  return count_command_result(result);
 }
 
-static void set_source(class_driver_t *driver_obj, preset_t preset,
-                       uint8_t preset_source) {
-  assert(preset >= 1 && preset <= 3);
-  read_hypex_state_buffer(driver_obj->out_transfer->data_buffer);
-  driver_obj->out_transfer->data_buffer[11 + (uint8_t)preset] =
-      (driver_obj->out_transfer->data_buffer[11 + (uint8_t)preset] & 0xF0) |
-      (uint8_t)(preset_source & 0x0F);
-
-  send_single_command(driver_obj);
+static void write_action(uint8_t *packet, control_action_t command) {
+  switch (command.action) {
+    case ACTION_SET_PRESET:
+      packet[2] = command.value;
+#ifdef PRESET_CHANGE_RESET_VOLUME_DB
+      set_volume_in_packet(packet, PRESET_CHANGE_RESET_VOLUME_DB);
+#endif  // PRESET_CHANGE_RESET_VOLUME_DB
+      break;
+    case ACTION_SET_VOLUME:
+      set_volume_in_packet(packet, command.value);
+      break;
+    case ACTION_SET_MUTE:
+      // Mute bit is (Byte 6, Bit 7)
+      if (command.value) {
+        packet[6] |= 0x80;
+      } else {
+        packet[6] &= ~0x80;
+      }
+      break;
+    case ACTION_SET_SOURCE_P1:
+    case ACTION_SET_SOURCE_P2:
+    case ACTION_SET_SOURCE_P3: {
+      uint8_t *byte = &packet[12 + command.action - ACTION_SET_SOURCE_P1];
+      *byte = (*byte & 0xF0) | (uint8_t)(command.value & 0x0F);
+      break;
+    }
+    case ACTION_SET_EQ_P1:
+    case ACTION_SET_EQ_P2:
+    case ACTION_SET_EQ_P3: {
+      uint8_t *byte = &packet[12 + command.action - ACTION_SET_EQ_P1];
+      if (command.value) {
+        *byte |= 0x10;
+      } else {
+        *byte &= ~0x10;
+      }
+      break;
+    }
+  }
 }
 
-static void set_eq(class_driver_t *driver_obj, preset_t preset, bool enable) {
-  assert(preset >= 1 && preset <= 3);
-  read_hypex_state_buffer(driver_obj->out_transfer->data_buffer);
+static void record_priority_latency(int64_t queued_us) {
+  int64_t latency_us = esp_timer_get_time() - queued_us;
+  taskENTER_CRITICAL(&stats_lock);
+  usb_stats.priority_commands++;
+  usb_stats.last_priority_latency_us = latency_us;
+  if (latency_us > usb_stats.max_priority_latency_us) {
+    usb_stats.max_priority_latency_us = latency_us;
+  }
+  taskEXIT_CRITICAL(&stats_lock);
+}
 
-  uint8_t mask = (1 << 4);
+// All actions of the delta go out in one packet.
+static void encode_delta(uint8_t *packet, const state_delta_t *delta) {
+  xSemaphoreTake(state_cache_mutex, portMAX_DELAY);
+  memcpy(packet, intended_state, PACKET_SIZE);
+  xSemaphoreGive(state_cache_mutex);
+  for (int i = 0; i < NUM_CONTROL_ACTIONS; i++) {
+    if (!(delta->actions & (1 << i))) continue;
+    control_action_t command = {.action = i, .value = delta->values[i]};
+    write_action(packet, command);
+  }
+}
 
-  if (enable) {
-    driver_obj->out_transfer->data_buffer[11 + (uint8_t)preset] |= mask;
-  } else {
-    driver_obj->out_transfer->data_buffer[11 + (uint8_t)preset] &= ~mask;
+// The next packet builds on the sent one, whether or not the amp echoed it.
+static void record_sent_delta(const uint8_t *packet,
+                              const state_delta_t *delta) {
+  int64_t now = esp_timer_get_time();
+  xSemaphoreTake(state_cache_mutex, portMAX_DELAY);
+  memcpy(intended_state, packet, PACKET_SIZE);
+  for (int i = 0; i < NUM_CONTROL_ACTIONS; i++) {
+    if (!(delta->actions & (1 << i))) continue;
+    intended_held |= 1 << i;
+    intended_value[i] = delta->values[i];
+    intended_sent_us[i] = now;
+    intended_answer[i] = state_packets_sent;
   }
+  xSemaphoreGive(state_cache_mutex);
+  taskENTER_CRITICAL(&intent_lock);
+  for (int i = 0; i < NUM_CONTROL_ACTIONS; i++) {
+    if (delta->actions & (1 << i) && intent_pending[i] &&
+        intent_value[i] == delta->values[i]) {
+      intent_sent_us[i] = now;
+    }
+  }
+  taskEXIT_CRITICAL(&intent_lock);
+}
 
-  send_single_command(driver_obj);
+#ifdef CONTROL_PATH_BENCHMARK
+void benchmark_encode_packet(uint8_t *packet, const state_delta_t *delta) {
+  encode_delta(packet, delta);
 }
+#endif  // CONTROL_PATH_BENCHMARK
 
 static void action_execute_command(class_driver_t *driver_obj) {
-  control_action_t command;
-  BaseType_t status = xQueueReceive(command_queue, &command, portMAX_DELAY);
-  if (status != pdPASS) {
+  queued_command_t queued;
+  bool priority = xQueueReceive(priority_queue, &queued, 0) == pdPASS;
+  if (!priority && xQueueReceive(command_queue, &queued, 0) != pdPASS) {
     ESP_LOGE(TAG_DRIVER, "Failed to get command from queue");
     return;
   }
+  rate_limiter_dequeued(queued.origin);
+  // A mute which overtook this command already sent a newer value.
+  for (int i = 0; i < NUM_CONTROL_ACTIONS; i++) {
+    if (queued.delta.actions & (1 << i) &&
+        (int32_t)(queued.generation - sent_generation[i]) < 0) {
+      ESP_LOGI(TAG_DRIVER, "Dropping overtaken command %d.", i);
+      queued.delta.actions &= ~(1 << i);
+    }
+  }
+  if (queued.delta.actions == 0) {
+    // No transfer callback wakes the task for the next command.
+    if (commands_waiting() > 0) usb_host_client_unblock(client_hdl);
+    return;
+  }
 
   ESP_LOGI(TAG_DRIVER,
            "************** Executing command from queue **************");
-  ESP_LOGI(TAG_DRIVER, "Command: %d with value: %d", command.action,
-           command.value);
-
-  switch (command.action) {
-    case ACTION_SET_PRESET:
-      set_preset(driver_obj, command.value);
-      break;
-    case ACTION_SET_VOLUME:
-      set_volume(driver_obj, command.value);
-      break;
-    case ACTION_SET_SOURCE_P1:
-      set_source(driver_obj, PRESET_1, command.value);
-      break;
-    case ACTION_SET_SOURCE_P2:
-      set_source(driver_obj, PRESET_2, command.value);
-      break;
-    case ACTION_SET_SOURCE_P3:
-      set_source(driver_obj, PRESET_3, command.value);
-      break;
-    case ACTION_SET_MUTE:
-      set_mute(driver_obj, command.value);
-      break;
-    case ACTION_SET_EQ_P1:
-      set_eq(driver_obj, PRESET_1, command.value);
-      break;
-    case ACTION_SET_EQ_P2:
-      set_eq(driver_obj, PRESET_2, command.value);
-      break;
-    case ACTION_SET_EQ_P3:
-      set_eq(driver_obj, PRESET_3, command.value);
-      break;
+  for (int i = 0; i < NUM_CONTROL_ACTIONS; i++) {
+    if (!(queued.delta.actions & (1 << i))) continue;
+    ESP_LOGI(TAG_DRIVER, "Command: %d with value: %d", i,
+             queued.delta.values[i]);
   }
+  uint8_t packet[PACKET_SIZE];
+  encode_delta(packet, &queued.delta);
+  if (send_single_command(driver_obj, packet) == ESP_OK) {
+    record_sent_delta(packet, &queued.delta);
+    for (int i = 0; i < NUM_CONTROL_ACTIONS; i++) {
+      if (queued.delta.actions & (1 << i)) {
+        sent_generation[i] = queued.generation;
+      }
+    }
+  }
+  if (priority) record_priority_latency(queued.queued_us);
+  // Catch an echo which doesn't match.
+  if (next_refresh_us >= 0) schedule_refresh(REFRESH_FAST_MS);
   ESP_LOGI(TAG_DRIVER,
            "************* Finished executing command from queue *************");
 }
@@ -374,6 +1114,9 @@ static void client_event_cb(const usb_host_client_event_msg_t *event_msg,
     case USB_HOST_CLIENT_EVENT_NEW_DEV:
       driver_obj->actions = ACTION_OPEN_DEV;
       driver_obj->dev_addr = event_msg->new_dev.address;
+      driver_obj->open_attempts = 0;
+      driver_obj->open_retry_at = xTaskGetTickCount();
+      attach_time_us = esp_timer_get_time();
       break;
     case USB_HOST_CLIENT_EVENT_DEV_GONE:
       driver_obj->actions = ACTION_CLOSE_DEV;
@@ -385,67 +1128,214 @@ static void client_event_cb(const usb_host_client_event_msg_t *event_msg,
 
 static void action_request_initial_state(class_driver_t *driver_obj) {
   ESP_LOGI(TAG, "Requesting initial state");
-  memset(driver_obj->out_transfer->data_buffer, 0x00, PACKET_SIZE);
-  driver_obj->out_transfer->data_buffer[0] = 0x06;
-  driver_obj->out_transfer->data_buffer[1] = 0x02;
-  send_single_command(driver_obj);
+  // Asked again if the amp doesn't answer.
+  last_state_us = esp_timer_get_time();
+  schedule_refresh(REFRESH_IDLE_MS);
+  uint8_t packet[PACKET_SIZE] = {0x06, 0x02};
+  send_single_command(driver_obj, packet);
+}
+
+static bool refresh_due(void) {
+  return next_refresh_us >= 0 && esp_timer_get_time() >= next_refresh_us;
+}
+
+static void action_refresh_state(class_driver_t *driver_obj) {
+  ESP_LOGI(TAG, "Refreshing state");
+  record_refresh_staleness(esp_timer_get_time() - last_state_us);
+  refresh_outstanding = true;
+  // Retried after the same interval if the amp doesn't answer.
+  schedule_refresh(refresh_interval_ms);
+  uint8_t packet[PACKET_SIZE] = {0x06, 0x02};
+  send_single_command(driver_obj, packet);
+}
+
+// Wakes up in time for the next refresh, OUT transfer deadline or attempt to
+// open the device.
+static TickType_t event_timeout(const class_driver_t *driver_obj) {
+  // Nothing signals the state request after opening the device.
+  if (driver_obj->actions & ACTION_GET_STATE) return 0;
+  TickType_t max_ticks = pdMS_TO_TICKS(EVENT_TIMEOUT_MS);
+  if (driver_obj->actions & ACTION_OPEN_DEV) {
+    int32_t open_in_ticks =
+        (int32_t)(driver_obj->open_retry_at - xTaskGetTickCount());
+    if (open_in_ticks <= 0) return 1;
+    if (open_in_ticks < max_ticks) max_ticks = open_in_ticks;
+  }
+  int64_t wake_us = next_refresh_us;
+  for (int i = 0; i < OUT_MAX_IN_FLIGHT; i++) {
+    if (!out_pool[i].in_flight || out_pool[i].canceled) continue;
+    int64_t deadline_us =
+        out_pool[i].submitted_us + (int64_t)OUT_TRANSFER_DEADLINE_MS * 1000;
+    if (wake_us < 0 || deadline_us < wake_us) wake_us = deadline_us;
+  }
+  if (wake_us < 0) return max_ticks;
+  int64_t wait_ms = (wake_us - esp_timer_get_time()) / 1000;
+  if (wait_ms <= 0) return 1;
+  TickType_t ticks = pdMS_TO_TICKS(wait_ms) + 1;
+  return ticks < max_ticks ? ticks : max_ticks;
 }
 
 static void action_request_filter_name(class_driver_t *driver_obj) {
-  memset(driver_obj->out_transfer->data_buffer, 0x00, PACKET_SIZE);
-  driver_obj->out_transfer->data_buffer[0] = 0x03;
-  driver_obj->out_transfer->data_buffer[1] = 0x08;
-  send_single_command(driver_obj);
+  ESP_LOGI(TAG, "Requesting filter name");
+  // Packets are handled in order, the amp answers for the preset of the
+  // packets sent before.
+  xSemaphoreTake(state_cache_mutex, portMAX_DELAY);
+  filter_name_requested_preset = intended_state[2];
+  xSemaphoreGive(state_cache_mutex);
+  uint8_t packet[PACKET_SIZE] = {0x03, 0x08};
+  send_single_command(driver_obj, packet);
 }
 
-static void action_open_dev(class_driver_t *driver_obj) {
+static esp_err_t action_open_dev(class_driver_t *driver_obj) {
   ESP_LOGI(TAG, "Opening device at address %d", driver_obj->dev_addr);
-  ESP_ERROR_CHECK(usb_host_device_open(
-      driver_obj->client_hdl, driver_obj->dev_addr, &driver_obj->dev_hdl));
-  ESP_ERROR_CHECK(usb_host_interface_claim(driver_obj->client_hdl,
-                                           driver_obj->dev_hdl, 0, 0));
+  esp_err_t err = usb_host_device_open(
+      driver_obj->client_hdl, driver_obj->dev_addr, &driver_obj->dev_hdl);
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "Opening device failed: %s", esp_err_to_name(err));
+    driver_obj->dev_hdl = NULL;
+    return err;
+  }
+  err = usb_host_interface_claim(driver_obj->client_hdl, driver_obj->dev_hdl,
+                                 0, 0);
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "Claiming interface failed: %s", esp_err_to_name(err));
+    usb_host_device_close(driver_obj->client_hdl, driver_obj->dev_hdl);
+    driver_obj->dev_hdl = NULL;
+    return err;
+  }
   driver_obj->in_transfer->device_handle = driver_obj->dev_hdl;
-  driver_obj->out_transfer->device_handle = driver_obj->dev_hdl;
   device_is_connected = true;
+  boot_mark(BOOT_USB_DEVICE_OPENED);
+  // Unconfirmed commands are sent again once the amp state is known.
+  taskENTER_CRITICAL(&intent_lock);
+  for (int i = 0; i < NUM_CONTROL_ACTIONS; i++) {
+    if (intent_pending[i]) replay_pending = true;
+    // Their deadlines start over with the replay.
+    intent_sent_us[i] = -1;
+  }
+  taskEXIT_CRITICAL(&intent_lock);
+  taskENTER_CRITICAL(&stats_lock);
+  usb_stats.reconnects++;
+  taskEXIT_CRITICAL(&stats_lock);
+  return ESP_OK;
+}
+
+static void schedule_open_retry(class_driver_t *driver_obj) {
+  driver_obj->open_attempts++;
+  if (driver_obj->open_attempts >= OPEN_MAX_ATTEMPTS) {
+    ESP_LOGE(TAG, "Giving up opening device after %d attempts.",
+             driver_obj->open_attempts);
+    driver_obj->actions = 0;
+    attach_time_us = -1;
+    taskENTER_CRITICAL(&stats_lock);
+    usb_stats.open_failures++;
+    taskEXIT_CRITICAL(&stats_lock);
+    return;
+  }
+  uint32_t delay_ms = OPEN_RETRY_BASE_MS << (driver_obj->open_attempts - 1);
+  if (delay_ms > OPEN_RETRY_MAX_MS) delay_ms = OPEN_RETRY_MAX_MS;
+  ESP_LOGW(TAG, "Retrying to open device in %lu ms.", (unsigned long)delay_ms);
+  driver_obj->open_retry_at = xTaskGetTickCount() + pdMS_TO_TICKS(delay_ms);
+  taskENTER_CRITICAL(&stats_lock);
+  usb_stats.open_retries++;
+  taskEXIT_CRITICAL(&stats_lock);
+}
+
+// Enqueues the commands lost by the last disconnect. Called from the driver
+// task, so it must not block on its own queue.
+static void action_replay_intents(void) {
+  replay_pending = false;
+  for (int i = 0; i < NUM_CONTROL_ACTIONS; i++) {
+    taskENTER_CRITICAL(&intent_lock);
+    bool pending = intent_pending[i];
+    control_action_t command = {
+        .action = i, .value = intent_value[i], .tag = intent_tag[i]};
+    taskEXIT_CRITICAL(&intent_lock);
+    if (!pending) continue;
+    if (queue_command(command) != pdPASS) {
+      ESP_LOGW(TAG_DRIVER, "Queue full, not replaying command %d.", i);
+      continue;
+    }
+    ESP_LOGI(TAG_DRIVER, "Replaying command %d with value %d.", i,
+             command.value);
+    taskENTER_CRITICAL(&stats_lock);
+    usb_stats.replayed_commands++;
+    taskEXIT_CRITICAL(&stats_lock);
+  }
+}
+
+// Halts and flushes both endpoints so transfers still owned by the USB stack
+// come back as canceled before the interface is released.
+static void cancel_transfers(class_driver_t *driver_obj) {
+  const uint8_t endpoints[] = {IN_ENDPOINT, OUT_ENDPOINT};
+  for (int i = 0; i < 2; i++) {
+    usb_host_endpoint_halt(driver_obj->dev_hdl, endpoints[i]);
+    usb_host_endpoint_flush(driver_obj->dev_hdl, endpoints[i]);
+  }
+  TickType_t start = xTaskGetTickCount();
+  while ((uxSemaphoreGetCount(poll_callback_pending) == 0 ||
+          out_in_flight > 0) &&
+         xTaskGetTickCount() - start < pdMS_TO_TICKS(CANCEL_TIMEOUT_MS)) {
+    usb_host_client_handle_events(driver_obj->client_hdl, pdMS_TO_TICKS(10));
+  }
+  if (uxSemaphoreGetCount(poll_callback_pending) == 0 || out_in_flight > 0) {
+    ESP_LOGW(TAG, "Transfers still pending after cancel.");
+  }
+  for (int i = 0; i < 2; i++) {
+    usb_host_endpoint_clear(driver_obj->dev_hdl, endpoints[i]);
+  }
 }
 
 static void action_close_dev(class_driver_t *driver_obj) {
   device_is_connected = false;
-  // Remove pending commands
+  replay_pending = false;
+  attach_time_us = -1;
+  next_refresh_us = -1;
+  refresh_outstanding = false;
+  // Queued commands are kept as pending intents and replayed on reconnect.
+  xQueueReset(priority_queue);
   xQueueReset(command_queue);
-  // Close device
-  ESP_LOGI(TAG, "Closing device at address %d", driver_obj->dev_addr);
-  usb_host_interface_release(driver_obj->client_hdl, driver_obj->dev_hdl, 0);
-
-  usb_host_device_close(driver_obj->client_hdl, driver_obj->dev_hdl);
+  rate_limiter_clear_queued();
+  // Cleared before the events handled while canceling, a new device reported
+  // there sets its own address.
+  uint8_t dev_addr = driver_obj->dev_addr;
+  driver_obj->dev_addr = 0;
+  if (driver_obj->dev_hdl != NULL) {
+    // Close device
+    ESP_LOGI(TAG, "Closing device at address %d", dev_addr);
+    cancel_transfers(driver_obj);
+    usb_host_interface_release(driver_obj->client_hdl, driver_obj->dev_hdl,
+                               0);
+    usb_host_device_close(driver_obj->client_hdl, driver_obj->dev_hdl);
+  }
   clear_caches();
   driver_obj->dev_hdl = NULL;
-  driver_obj->dev_addr = 0;
-  driver_obj->actions = 0;
-  xSemaphoreGive(hypex_state_updated);
 }
 
-void usb_driver_task(void *arg) {
-  ESP_LOGI(TAG_DRIVER, "  ************** Staring USB driver **************");
-  // Initialize static structures
+void usb_driver_init(void) {
+  // Initialize static structures, before any task can enqueue commands or
+  // read the state.
   command_queue =
-      xQueueCreateStatic(COMMAND_QUEUE_LENGTH, sizeof(control_action_t),
-                         ucQueueStorageArea, &command_queue_buffer);
-  if (command_queue == 0) {
+      xQueueCreateStatic(COMMAND_QUEUE_LENGTH, sizeof(queued_command_t),
+                         command_queue_storage, &command_queue_buffer);
+  priority_queue =
+      xQueueCreateStatic(PRIORITY_QUEUE_LENGTH, sizeof(queued_command_t),
+                         priority_queue_storage, &priority_queue_buffer);
+  if (command_queue == 0 || priority_queue == 0) {
     ESP_LOGE(TAG_DRIVER, "Failed to create xQueue.");
   }
   state_cache_mutex = xSemaphoreCreateMutexStatic(&state_cache_mutex_buffer);
   filter_name_mutex = xSemaphoreCreateMutexStatic(&filter_name_mutex_buffer);
-  usb_out_transfer_sem =
-      xSemaphoreCreateBinaryStatic(&usb_out_transfer_sem_buffer);
   poll_callback_pending =
       xSemaphoreCreateBinaryStatic(&poll_callback_sem_buffer);
 
   // Negate the semaphore so we can ensure we only have one pending in
   // connection
   xSemaphoreGive(poll_callback_pending);
+}
 
-  hypex_state_updated = (SemaphoreHandle_t)arg;
+void usb_driver_task(void *arg) {
+  ESP_LOGI(TAG_DRIVER, "  ************** Staring USB driver **************");
 
   class_driver_t driver_obj = {0};
 
@@ -463,46 +1353,81 @@ void usb_driver_task(void *arg) {
   };
   ESP_ERROR_CHECK(
       usb_host_client_register(&client_config, &driver_obj.client_hdl));
-  // OUT transfer
-  ESP_ERROR_CHECK(
-      usb_host_transfer_alloc(PACKET_SIZE, 0, &driver_obj.out_transfer));
-  driver_obj.out_transfer->bEndpointAddress = 0x01;  // OUT
-  driver_obj.out_transfer->callback = out_transfer_callback;
-  driver_obj.out_transfer->context = NULL;
-  driver_obj.out_transfer->num_bytes = PACKET_SIZE;
+  client_hdl = driver_obj.client_hdl;
+  // OUT transfers
+  for (int i = 0; i < OUT_MAX_IN_FLIGHT; i++) {
+    ESP_ERROR_CHECK(
+        usb_host_transfer_alloc(PACKET_SIZE, 0, &out_pool[i].transfer));
+    out_pool[i].transfer->bEndpointAddress = OUT_ENDPOINT;
+    out_pool[i].transfer->callback = out_transfer_callback;
+    out_pool[i].transfer->context = &out_pool[i];
+    out_pool[i].transfer->num_bytes = PACKET_SIZE;
+  }
 
   // IN transfer
   ESP_ERROR_CHECK(
       usb_host_transfer_alloc(PACKET_SIZE, 0, &driver_obj.in_transfer));
-  driver_obj.in_transfer->bEndpointAddress = 0x81;  // IN
+  driver_obj.in_transfer->bEndpointAddress = IN_ENDPOINT;
   driver_obj.in_transfer->callback = in_transfer_callback;
   driver_obj.in_transfer->context = NULL;
   driver_obj.in_transfer->num_bytes = PACKET_SIZE;
 
   while (1) {
-    usb_host_client_handle_events(driver_obj.client_hdl, 100);
+    esp_err_t events = usb_host_client_handle_events(
+        driver_obj.client_hdl, event_timeout(&driver_obj));
+    if (out_in_flight > 0) cancel_expired_out_transfers(&driver_obj);
+    bool acted = true;
 
     // Only one action before polling
     if (driver_obj.actions & ACTION_OPEN_DEV) {
-      action_open_dev(&driver_obj);
-      driver_obj.actions = ACTION_GET_STATE | ACTION_POLL;
+      if ((int32_t)(xTaskGetTickCount() - driver_obj.open_retry_at) >= 0) {
+        if (action_open_dev(&driver_obj) == ESP_OK) {
+          driver_obj.actions = ACTION_GET_STATE | ACTION_POLL;
+        } else {
+          schedule_open_retry(&driver_obj);
+        }
+      }
     } else if (driver_obj.actions & ACTION_CLOSE_DEV) {
       action_close_dev(&driver_obj);
-      driver_obj.actions = 0;
+      // Keep a new device reported while closing.
+      driver_obj.actions &= ACTION_OPEN_DEV;
       // break;
+    } else if (driver_obj.actions & ACTION_TRANSFER && replay_pending &&
+               attach_time_us < 0) {
+      // Amp state received after the reconnect.
+      action_replay_intents();
     } else if (driver_obj.actions & ACTION_GET_STATE) {
+      // The filter name is requested once the state reports the preset.
       action_request_initial_state(&driver_obj);
-      driver_obj.actions = ACTION_GET_FILTER_NAME | ACTION_POLL;
-    } else if (driver_obj.actions & ACTION_GET_FILTER_NAME) {
-      action_request_filter_name(&driver_obj);
       driver_obj.actions = ACTION_TRANSFER | ACTION_POLL;
     } else if (driver_obj.actions & ACTION_TRANSFER &&
-               uxQueueMessagesWaiting(command_queue) > 0) {
-      ESP_LOGI(TAG, "Messages waiting %d",
-               uxQueueMessagesWaiting(command_queue));
+               uxQueueMessagesWaiting(priority_queue) > 0 &&
+               out_slot_available(true)) {
+      // Overtakes everything, only the transfers in flight are ahead.
+      action_execute_command(&driver_obj);
+    } else if (driver_obj.actions & ACTION_TRANSFER &&
+               !out_slot_available(false)) {
+      // Wait for a callback, the last slot is kept for a mute.
+      acted = false;
+    } else if (driver_obj.actions & ACTION_TRANSFER && commands_waiting() > 0) {
+      ESP_LOGI(TAG, "Messages waiting %d", commands_waiting());
 
       action_execute_command(&driver_obj);
+    } else if (driver_obj.actions & ACTION_TRANSFER &&
+               filter_name_refresh_pending) {
+      // Only once no user command is waiting.
+      filter_name_refresh_pending = false;
+      action_request_filter_name(&driver_obj);
+#ifndef TEST_MODE
+    } else if (driver_obj.actions & ACTION_TRANSFER && device_is_connected &&
+               refresh_due()) {
+      // Lowest priority, user commands and replays go first.
+      action_refresh_state(&driver_obj);
+#endif  // TEST_MODE
+    } else {
+      acted = false;
     }
+    wakeup_record(WAKEUP_USB_DRIVER, events == ESP_ERR_TIMEOUT && !acted);
 
     // Always poll if initalized and no pending poll
     if (driver_obj.actions & ACTION_POLL) {
@@ -515,7 +1440,9 @@ void usb_driver_task(void *arg) {
       }
     }
   }
-  usb_host_transfer_free(driver_obj.out_transfer);
+  for (int i = 0; i < OUT_MAX_IN_FLIGHT; i++) {
+    usb_host_transfer_free(out_pool[i].transfer);
+  }
   usb_host_transfer_free(driver_obj.in_transfer);
   usb_host_client_deregister(driver_obj.client_hdl);
 }
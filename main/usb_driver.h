@@ -24,15 +24,6 @@ typedef enum {
   PRESET_3 = 3
 } preset_t;
 
-typedef struct {
-  preset_t preset;
-  float volume_db;
-  bool is_muted;
-  input_source_t current_source;
-  input_source_t preset_source[3];
-  bool is_eq_on[3];
-} state_t;
-
 typedef enum {
   ACTION_SET_PRESET,
   ACTION_SET_VOLUME,
@@ -45,17 +36,140 @@ typedef enum {
   ACTION_SET_EQ_P3,
 } control_action_type_t;
 
+#define NUM_CONTROL_ACTIONS (ACTION_SET_EQ_P3 + 1)
+
+// Identifies a client's command in the state once the amp confirmed it.
+// Zero for commands of the firmware itself.
+typedef struct {
+  uint32_t client;
+  uint32_t seq;
+} command_tag_t;
+
+// Where a command came from, each origin is rate limited on its own.
+typedef enum {
+  // Replays and other commands of the driver itself, never limited.
+  ORIGIN_FIRMWARE,
+  ORIGIN_WEBSOCKET,
+  ORIGIN_REST,
+  ORIGIN_TRIGGER,
+  ORIGIN_AB_TEST,
+} command_origin_type_t;
+
+typedef struct {
+  command_origin_type_t type;
+  // Socket of a WebSocket client, otherwise zero.
+  int id;
+} command_origin_t;
+
 typedef struct {
   control_action_type_t action;
   int8_t value;
+  command_tag_t tag;
+  command_origin_t origin;
 } control_action_t;
 
+// Several actions which are sent to the amp in a single packet.
+typedef struct {
+  // Bit (1 << action) for each action to apply.
+  uint16_t actions;
+  int8_t values[NUM_CONTROL_ACTIONS];
+} state_delta_t;
+
+typedef struct {
+  preset_t preset;
+  float volume_db;
+  bool is_muted;
+  input_source_t current_source;
+  input_source_t preset_source[3];
+  bool is_eq_on[3];
+  // Last command per action which the amp confirmed.
+  command_tag_t acks[NUM_CONTROL_ACTIONS];
+  // Incremented whenever the cached state, filter name or acks change.
+  uint32_t version;
+} state_t;
+
+typedef enum {
+  COMMAND_QUEUED,
+  // Amp not connected, sent once it is.
+  COMMAND_DEFERRED,
+  // Invalid value.
+  COMMAND_REJECTED,
+  // Queue full, the caller may try again later.
+  COMMAND_BUSY,
+  // The origin sent too many commands, the caller may try again later.
+  COMMAND_THROTTLED,
+} command_result_t;
+
+// Upper bounds of the staleness histogram, the last bucket is unbounded.
+#define REFRESH_STALENESS_BOUNDS_MS {500, 1000, 2500, 5000, 10000}
+#define REFRESH_STALENESS_BUCKETS 6
+
+typedef struct {
+  uint32_t commands_queued;
+  uint32_t commands_deferred;
+  uint32_t commands_rejected;
+  uint32_t commands_busy;
+  uint32_t commands_throttled;
+  uint32_t reconnects;
+  uint32_t open_retries;
+  uint32_t open_failures;
+  uint32_t replayed_commands;
+  // Sent commands the amp state never confirmed in time.
+  uint32_t intents_expired;
+  // Mute commands, from enqueue until their transfer is submitted.
+  uint32_t priority_commands;
+  int64_t last_priority_latency_us;
+  int64_t max_priority_latency_us;
+  // State deltas, from enqueue until the amp state matches all actions.
+  uint32_t deltas_confirmed;
+  int64_t last_delta_latency_us;
+  int64_t max_delta_latency_us;
+  // From USB attach to the first amp state, -1 if not synced yet.
+  int64_t last_resync_us;
+  int64_t max_resync_us;
+  // Status requests to catch changes from the IR remote or front panel.
+  uint32_t refreshes;
+  // Refreshes whose reply changed the state without a pending command.
+  uint32_t refresh_changes;
+  uint32_t refresh_interval_ms;
+  // Age of the cached state when a refresh was sent.
+  uint32_t refresh_staleness[REFRESH_STALENESS_BUCKETS];
+  int64_t max_refresh_staleness_us;
+  // Fields of sent commands kept over an older value in a received state.
+  uint32_t intended_fields_held;
+  // OUT transfers, canceled ones count as failed as well as timed out.
+  uint32_t out_submitted;
+  uint32_t out_completed;
+  uint32_t out_failed;
+  uint32_t out_timeouts;
+  uint32_t max_out_in_flight;
+  int64_t max_out_latency_us;
+  // Total time with at least one OUT transfer in flight.
+  int64_t out_busy_us;
+} usb_stats_t;
+
+// In bytes. The driver task peaks at 3072 bytes in the host tests, with
+// log lines formatted as at the device's INFO level. Half of that again
+// is kept for the device's compiler, its register windows and the
+// interrupt frame on the task's stack, rounded up to 1 KB. The host tests
+// fail if the peak outgrows this.
+#define USB_DRIVER_TASK_STACK_SIZE 5120
+#define USB_DRIVER_TASK_STACK_HEADROOM(peak) ((peak) * 3 / 2)
+
+void usb_driver_init(void);
 void usb_driver_task(void *arg);
 
-void enqueue_command(control_action_t command);
+// Never blocks, safe to call from the httpd task.
+command_result_t enqueue_command(control_action_t command);
+command_result_t enqueue_state_delta(const state_delta_t *delta,
+                                     command_origin_t origin);
+// False if the delta has no or unknown actions, or a value the amp would
+// reject.
+bool is_valid_state_delta(const state_delta_t *delta);
 
 void get_state(state_t *state);
 void get_filter_name(char *name);
 bool is_device_connected(void);
+void get_usb_stats(usb_stats_t *stats);
 
 #endif  // USB_DRIVER_H
\ No newline at end of file
@@ -1,22 +1,98 @@
 #include "web_server.h"
 
+#include <limits.h>
+#include <stdatomic.h>
 #include <unistd.h>
 
 #include "cJSON.h"
 #include "esp_event.h"
+#include "esp_heap_caps.h"
 #include "esp_http_server.h"
 #include "esp_log.h"
 #include "esp_random.h"
+#include "esp_timer.h"
 #include "esp_wifi.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "mdns.h"
+#include "nvs.h"
 #include "nvs_flash.h"
+#include "abx_test.h"
+#include "benchmark.h"
+#include "boot_profile.h"
+#include "json_arena.h"
+#include "memory_budget.h"
+#include "power.h"
+#include "rate_limiter.h"
+#include "scenes.h"
 #include "secrets.h"
+#include "state_bus.h"
+#include "state_journal.h"
+#include "ui_files.h"
 #include "usb_driver.h"
 
 #define MDNS_HOST_NAME "amp"  // amp.local
-#define MAX_CLIENTS 7         // Should Max(CONFIG_LWIP_MAX_SOCKETS-3)
+#define MAX_CLIENTS 7         // Clients on /ws, allowed to send commands.
+#define MAX_SUBSCRIBERS 32    // Read-only clients on /ws/subscribe.
+// Should be Max(CONFIG_LWIP_MAX_SOCKETS-3), leaves room for page loads.
+#define MAX_OPEN_SOCKETS (MAX_CLIENTS + MAX_SUBSCRIBERS + 4)
+
+// Broadcast latency is tracked per number of receiving clients.
+#define BROADCAST_BUCKETS 4
+// Upper bounds of the broadcast latency histogram in us, for the p95 and
+// p99. The last bucket is unbounded.
+#define BROADCAST_LATENCY_BOUNDS_US \
+  {500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 250000}
+#define BROADCAST_LATENCY_BUCKETS 10
+
+// Frames are taken from a static pool, the heap is only used if all of them
+// are still in flight.
+#define FRAME_POOL_SIZE 6
+#define FRAME_PAYLOAD_SIZE 1024
+#define MAX_WS_MESSAGE_LEN 512
+
+// Clients are pinged every interval and evicted if nothing, not even a pong,
+// arrived within the timeout. A full server also evicts the client which
+// missed the most recent ping to make room for a new one.
+#define WS_PING_INTERVAL_MS 5000
+#define WS_PING_TIMEOUT_MS 15000
+#define WS_SUSPECT_AFTER_MS (WS_PING_INTERVAL_MS + 2000)
+// Consecutive failed sends before a client is evicted.
+#define WS_MAX_SEND_FAILURES 3
+
+// Work taken off the httpd task. WebSocket messages go to a single worker,
+// so each client's commands keep their order, and the clients take turns.
+// Slow HTTP responses go to a small pool.
+#define WS_WORK_QUEUE_LENGTH 8
+// Slots of the WebSocket work queue which subscriber reads can't take, so a
+// flood of them never turns a command away.
+#define WS_WORK_CLIENT_RESERVE 4
+#define HTTP_WORKER_COUNT 2
+#define HTTP_WORK_QUEUE_LENGTH 4
+// Not measured yet, the host tests have no HTTP server: see "Task stacks"
+// in README.md.
+#define WS_WORKER_STACK_SIZE 4096
+#define HTTP_WORKER_STACK_SIZE 4096
+#define AB_TEST_TASK_STACK_SIZE 4096
+#define WEB_WORKER_PRIORITY 5
+// Buckets of the WebSocket message latency histogram, see /metrics.
+#define WS_LATENCY_BUCKETS 4
+
+// UI files from flash are streamed through a buffer of this size.
+#define UI_CHUNK_SIZE 1024
+
+// Consecutive receive timeouts after which an upload is aborted.
+#define UI_UPLOAD_MAX_TIMEOUTS 3
+
+// Keeps the latest WebSocket messages received from clients, served as JSON
+// lines at /ws/trace to be replayed with tools/ws_replay.py.
+// #define WS_TRAFFIC_RECORDER
+#define TRACE_ENTRIES 256
+#define TRACE_MESSAGE_LEN 96
+
+// Channel and BSSID of the last AP, skips the scan on the next boot.
+#define WIFI_NVS_NAMESPACE "wifi"
+#define WIFI_NVS_KEY_LAST_AP "last_ap"
 
 typedef struct {
   uint8_t preset_a;
@@ -30,17 +106,189 @@ typedef struct {
   bool is_finished;
 } ab_test_state_t;
 
+// One serialized message, shared by every client it is sent to. Returned to
+// the pool once the last pending send released it.
+typedef struct {
+  atomic_uint refs;
+  bool pooled;
+  int64_t created_us;
+  size_t len;
+  char payload[FRAME_PAYLOAD_SIZE];
+} ws_frame_t;
+
+typedef struct {
+  uint8_t bssid[6];
+  uint8_t channel;
+} wifi_ap_cache_t;
+
+typedef struct {
+  int fd;  // 0 if free
+  int64_t last_seen_us;
+  uint8_t send_failures;
+} ws_slot_t;
+
+typedef struct {
+  uint32_t pings;
+  uint32_t timeouts;
+  uint32_t send_failures;
+  // Evicted as suspected zombie for a new connection.
+  uint32_t replaced;
+  // Slots of sockets httpd had already closed.
+  uint32_t stale;
+} eviction_stats_t;
+
+typedef struct {
+  uint32_t frames;
+  uint32_t sends;
+  uint32_t send_errors;
+  int64_t total_us;
+  int64_t max_us;
+  uint32_t latency_buckets[BROADCAST_LATENCY_BUCKETS];
+} broadcast_stats_t;
+
+typedef struct {
+  int sockfd;
+  bool read_only;
+  int64_t received_us;
+  char message[MAX_WS_MESSAGE_LEN + 1];
+} ws_work_t;
+
+typedef enum {
+  WS_WORK_FREE,
+  // Waiting for the worker.
+  WS_WORK_READY,
+  // Being worked off.
+  WS_WORK_BUSY,
+} ws_work_state_t;
+
+typedef struct {
+  // Copy of the request from httpd_req_async_handler_begin.
+  httpd_req_t *req;
+  esp_err_t (*handler)(httpd_req_t *req);
+} http_work_t;
+
+// Sent from the httpd task, so replies of workers don't interleave with
+// broadcasts on the same socket.
+typedef struct {
+  int sockfd;
+  // Either a shared frame or the text following the struct.
+  ws_frame_t *frame;
+  size_t len;
+  char text[];
+} ws_reply_t;
+
+typedef struct {
+  uint32_t messages;
+  // Queue full, answered with busy.
+  uint32_t dropped;
+  // Subscriber messages over their share of the queue, also answered busy.
+  uint32_t subscriber_dropped;
+  // From receiving a message until it was handled.
+  uint32_t buckets[WS_LATENCY_BUCKETS];
+  int64_t max_wait_us;
+  int64_t max_us;
+  // HTTP requests handled by a worker or, with all busy, by httpd itself.
+  uint32_t http_deferred;
+  uint32_t http_inline;
+} worker_stats_t;
+
+#ifdef WS_TRAFFIC_RECORDER
+typedef struct {
+  uint32_t at_ms;
+  int sockfd;
+  // Longer messages are cut, the replay skips them.
+  bool truncated;
+  char message[TRACE_MESSAGE_LEN + 1];
+} trace_entry_t;
+#endif  // WS_TRAFFIC_RECORDER
+
 static const char *TAG_WEB = "WEB_SERVER";
+static ws_frame_t frame_pool[FRAME_POOL_SIZE];
+static atomic_uint frame_pool_misses = 0;
+// cJSON trees for outgoing state and incoming commands never hit the heap.
+static uint8_t state_arena_buffer[2048];
+static json_arena_t state_arena =
+    JSON_ARENA_INIT("state", state_arena_buffer);
+static uint8_t command_arena_buffer[1024];
+static json_arena_t command_arena =
+    JSON_ARENA_INIT("command", command_arena_buffer);
+static wifi_ap_cache_t wifi_ap_cache = {0};
+static bool wifi_fast_connect = false;
+// Only used by the httpd task.
+static char ws_message_buffer[MAX_WS_MESSAGE_LEN + 1];
+// Only used by the httpd task.
+static ws_work_t ws_incoming;
+// Messages for the worker. Not a FIFO: a flooding client must only delay
+// the others' messages by one of its own each.
+static ws_work_t ws_work[WS_WORK_QUEUE_LENGTH];
+static ws_work_state_t ws_work_states[WS_WORK_QUEUE_LENGTH];
+// Arrival order, a client's messages are worked off oldest first.
+static uint32_t ws_work_order[WS_WORK_QUEUE_LENGTH];
+static uint32_t ws_work_received = 0;
+// Socket of the message worked off last, the next client after it is next.
+static int ws_work_last_sockfd = -1;
+static portMUX_TYPE ws_work_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t ws_worker;
+static QueueHandle_t http_work_queue;
+static StaticQueue_t http_work_queue_buffer;
+static uint8_t
+    http_work_queue_storage[HTTP_WORK_QUEUE_LENGTH * sizeof(http_work_t)];
+static TaskHandle_t http_workers[HTTP_WORKER_COUNT];
+static StackType_t ws_worker_stack[WS_WORKER_STACK_SIZE];
+static StaticTask_t ws_worker_buffer;
+static StackType_t
+    http_worker_stacks[HTTP_WORKER_COUNT][HTTP_WORKER_STACK_SIZE];
+static StaticTask_t http_worker_buffers[HTTP_WORKER_COUNT];
+static worker_stats_t worker_stats = {0};
+#ifdef WS_TRAFFIC_RECORDER
+// Ring of the latest messages, only used by the httpd task.
+static trace_entry_t trace_entries[TRACE_ENTRIES];
+static uint32_t trace_next = 0;
+static uint32_t trace_recorded = 0;
+#endif  // WS_TRAFFIC_RECORDER
+static const int ws_latency_bucket_ms[WS_LATENCY_BUCKETS - 1] = {5, 20, 100};
 static httpd_handle_t server = NULL;
-static int client_fds[MAX_CLIENTS] = {0};
-static char filter_name[FILTER_NAME_MAX_LEN];
+// Slots are only accessed from the httpd task.
+static ws_slot_t client_slots[MAX_CLIENTS] = {0};
+static ws_slot_t subscriber_slots[MAX_SUBSCRIBERS] = {0};
+static eviction_stats_t eviction_stats = {0};
+// Shared by the WebSocket worker and the journal handler.
+static journal_entry_t journal_entries[JOURNAL_SIZE];
+static SemaphoreHandle_t journal_mutex;
+static StaticSemaphore_t journal_mutex_buffer;
+static esp_timer_handle_t ping_timer;
+// Only accessed from the httpd task.
+static broadcast_stats_t broadcast_stats[BROADCAST_BUCKETS] = {0};
+static const int broadcast_bucket_limits[BROADCAST_BUCKETS] = {4, 16, 32,
+                                                               INT_MAX};
+static const int broadcast_latency_bounds_us[] =
+    BROADCAST_LATENCY_BOUNDS_US;
+
+// Latest full state message, answers get_state without serializing again.
+static ws_frame_t *snapshot = NULL;
+static uint32_t snapshot_state_version = 0;
+static uint32_t snapshot_ab_version = 0;
+static SemaphoreHandle_t snapshot_mutex;
+static StaticSemaphore_t snapshot_mutex_buffer;
+// Bumped on every A/B test change, these are not part of the amp state.
+static atomic_uint ab_test_version = 0;
+// Version shown while an ABX test is blind. It only counts the broadcast
+// changes, the skipped ones would show as gaps.
+static atomic_uint blind_version = 0;
+// Only accessed from the WebSocket worker.
+static uint32_t snapshot_hits = 0;
+static uint32_t snapshot_misses = 0;
 
 static volatile bool test_mode_enabled = false;
 static ab_test_state_t ab_test_state = {0};
 static ab_test_config_t ab_test_config = {0};
 static SemaphoreHandle_t ab_test_mutex;
 static StaticSemaphore_t ab_test_mutex_buffer;
+// Created with the first test and kept, waiting for the next one.
 static TaskHandle_t ab_test_task_handle = NULL;
+static StackType_t ab_test_task_stack[AB_TEST_TASK_STACK_SIZE];
+static StaticTask_t ab_test_task_buffer;
+static bool ab_test_active = false;
 
 extern const uint8_t index_html_start[] asm("_binary_index_html_start");
 extern const uint8_t index_html_end[] asm("_binary_index_html_end");
@@ -51,38 +299,312 @@ extern const uint8_t index_js_end[] asm("_binary_index_js_end");
 extern const uint8_t favicon_ico_start[] asm("_binary_favicon_ico_start");
 extern const uint8_t favicon_ico_end[] asm("_binary_favicon_ico_end");
 
-void send_to_clients(cJSON *root) {
-  char *json_string = cJSON_PrintUnformatted(root);
-  // Log the JSON string
-  ESP_LOGI(TAG_WEB, "%s", json_string);
+static ws_frame_t *ws_frame_alloc(void) {
+  for (int i = 0; i < FRAME_POOL_SIZE; i++) {
+    unsigned int unused = 0;
+    if (atomic_compare_exchange_strong(&frame_pool[i].refs, &unused, 1)) {
+      frame_pool[i].pooled = true;
+      return &frame_pool[i];
+    }
+  }
+  atomic_fetch_add(&frame_pool_misses, 1);
+  ws_frame_t *frame = malloc(sizeof(ws_frame_t));
+  if (frame == NULL) return NULL;
+  atomic_init(&frame->refs, 1);
+  frame->pooled = false;
+  return frame;
+}
 
+static void ws_frame_unref(ws_frame_t *frame) {
+  if (frame->pooled) {
+    atomic_fetch_sub(&frame->refs, 1);
+  } else if (atomic_fetch_sub(&frame->refs, 1) == 1) {
+    free(frame);
+  }
+}
+
+static ws_frame_t *ws_frame_create(cJSON *root) {
+  ws_frame_t *frame = ws_frame_alloc();
+  if (frame == NULL) return NULL;
+  if (!cJSON_PrintPreallocated(root, frame->payload, FRAME_PAYLOAD_SIZE,
+                               false)) {
+    ws_frame_unref(frame);
+    return NULL;
+  }
+  frame->created_us = esp_timer_get_time();
+  frame->len = strlen(frame->payload);
+  return frame;
+}
+
+static esp_err_t ws_frame_send(int sockfd, const ws_frame_t *frame) {
   httpd_ws_frame_t ws_pkt;
   memset(&ws_pkt, 0, sizeof(httpd_ws_frame_t));
-  ws_pkt.payload = (uint8_t *)json_string;
-  ws_pkt.len = strlen(json_string);
+  ws_pkt.payload = (uint8_t *)frame->payload;
+  ws_pkt.len = frame->len;
   ws_pkt.type = HTTPD_WS_TYPE_TEXT;
+  return httpd_ws_send_frame_async(server, sockfd, &ws_pkt);
+}
+
+static void record_broadcast(int receivers, int errors, int64_t latency_us) {
+  int bucket = 0;
+  while (receivers > broadcast_bucket_limits[bucket]) bucket++;
+  broadcast_stats_t *stats = &broadcast_stats[bucket];
+  stats->frames++;
+  stats->sends += receivers;
+  stats->send_errors += errors;
+  stats->total_us += latency_us;
+  if (latency_us > stats->max_us) stats->max_us = latency_us;
+  int latency_bucket = 0;
+  while (latency_bucket < BROADCAST_LATENCY_BUCKETS - 1 &&
+         latency_us >= broadcast_latency_bounds_us[latency_bucket]) {
+    latency_bucket++;
+  }
+  stats->latency_buckets[latency_bucket]++;
+}
+
+// Upper bound of the histogram bucket the percentile falls in, at most the
+// maximum.
+static int64_t broadcast_percentile_us(const broadcast_stats_t *stats,
+                                       int percent) {
+  if (stats->frames == 0) return 0;
+  uint32_t rank = ((uint64_t)stats->frames * percent + 99) / 100;
+  uint32_t count = 0;
+  for (int i = 0; i < BROADCAST_LATENCY_BUCKETS - 1; i++) {
+    count += stats->latency_buckets[i];
+    if (count >= rank) {
+      return broadcast_latency_bounds_us[i] < stats->max_us
+                 ? broadcast_latency_bounds_us[i]
+                 : stats->max_us;
+    }
+  }
+  return stats->max_us;
+}
+
+static ws_slot_t *find_slot(int sockfd) {
   for (int i = 0; i < MAX_CLIENTS; i++) {
-    if (client_fds[i] != 0) {
-      httpd_ws_send_frame_async(server, client_fds[i], &ws_pkt);
+    if (client_slots[i].fd == sockfd) return &client_slots[i];
+  }
+  for (int i = 0; i < MAX_SUBSCRIBERS; i++) {
+    if (subscriber_slots[i].fd == sockfd) return &subscriber_slots[i];
+  }
+  return NULL;
+}
+
+// Frees the slot right away, httpd closes the socket later.
+static void evict_slot(ws_slot_t *slot, const char *reason) {
+  ESP_LOGW(TAG_WEB, "Evicting client #%d: %s", slot->fd, reason);
+  httpd_sess_trigger_close(server, slot->fd);
+  slot->fd = 0;
+}
+
+// False if the slot was freed because httpd no longer knows the socket.
+static bool check_slot(ws_slot_t *slot) {
+  if (httpd_ws_get_fd_info(server, slot->fd) == HTTPD_WS_CLIENT_WEBSOCKET) {
+    return true;
+  }
+  ESP_LOGW(TAG_WEB, "Reclaiming slot of closed socket #%d", slot->fd);
+  slot->fd = 0;
+  eviction_stats.stale++;
+  return false;
+}
+
+static void record_send(ws_slot_t *slot, esp_err_t err) {
+  if (err == ESP_OK) {
+    slot->send_failures = 0;
+  } else if (++slot->send_failures >= WS_MAX_SEND_FAILURES) {
+    eviction_stats.send_failures++;
+    evict_slot(slot, "sends keep failing");
+  }
+}
+
+static void ping_slots(ws_slot_t *slots, int count, int64_t now) {
+  httpd_ws_frame_t ping = {.type = HTTPD_WS_TYPE_PING};
+  for (int i = 0; i < count; i++) {
+    ws_slot_t *slot = &slots[i];
+    if (slot->fd == 0 || !check_slot(slot)) continue;
+    if (now - slot->last_seen_us > WS_PING_TIMEOUT_MS * 1000LL) {
+      eviction_stats.timeouts++;
+      evict_slot(slot, "ping timeout");
+      continue;
     }
+    eviction_stats.pings++;
+    record_send(slot, httpd_ws_send_frame_async(server, slot->fd, &ping));
   }
-  free(json_string);
 }
 
-void notify_state_changed(const state_t *state) {
-  if (!server) return;
+static void ping_work(void *arg) {
+  int64_t now = esp_timer_get_time();
+  ping_slots(client_slots, MAX_CLIENTS, now);
+  ping_slots(subscriber_slots, MAX_SUBSCRIBERS, now);
+}
+
+static void ping_timer_cb(void *arg) {
+  if (server != NULL) httpd_queue_work(server, ping_work, NULL);
+}
+
+static int send_to_slots(ws_slot_t *slots, int count, ws_frame_t *frame,
+                         int *errors) {
+  int receivers = 0;
+  for (int i = 0; i < count; i++) {
+    if (slots[i].fd == 0) continue;
+    receivers++;
+    esp_err_t err = ws_frame_send(slots[i].fd, frame);
+    if (err != ESP_OK) (*errors)++;
+    record_send(&slots[i], err);
+  }
+  return receivers;
+}
 
+// Runs on the httpd task, so the client lists can't change underneath.
+static void broadcast_work(void *arg) {
+  ws_frame_t *frame = (ws_frame_t *)arg;
+  int errors = 0;
+  int receivers = send_to_slots(client_slots, MAX_CLIENTS, frame, &errors) +
+                  send_to_slots(subscriber_slots, MAX_SUBSCRIBERS, frame,
+                                &errors);
+  if (receivers > 0) {
+    record_broadcast(receivers, errors,
+                     esp_timer_get_time() - frame->created_us);
+  }
+  ws_frame_unref(frame);
+}
+
+// Takes over the reference to the frame.
+void send_to_clients(ws_frame_t *frame) {
+  ESP_LOGI(TAG_WEB, "%s", frame->payload);
+  if (httpd_queue_work(server, broadcast_work, frame) != ESP_OK) {
+    ESP_LOGE(TAG_WEB, "Failed to queue broadcast.");
+    ws_frame_unref(frame);
+  }
+}
+
+static const char *abx_selection_name(abx_selection_t selection) {
+  switch (selection) {
+    case ABX_SELECT_A:
+      return "A";
+    case ABX_SELECT_B:
+      return "B";
+    case ABX_SELECT_X:
+      return "X";
+  }
+  return "";
+}
+
+static bool parse_abx_selection(const cJSON *value_json,
+                                abx_selection_t *selection) {
+  if (!cJSON_IsString(value_json)) return false;
+  if (strcmp(value_json->valuestring, "A") == 0) {
+    *selection = ABX_SELECT_A;
+  } else if (strcmp(value_json->valuestring, "B") == 0) {
+    *selection = ABX_SELECT_B;
+  } else if (strcmp(value_json->valuestring, "X") == 0) {
+    *selection = ABX_SELECT_X;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+typedef struct {
+  const char *name;
+  control_action_type_t action;
+  bool is_bool;
+} amp_command_t;
+
+// WebSocket actions which are passed on to the amp.
+static const amp_command_t amp_commands[NUM_CONTROL_ACTIONS] = {
+    {"set_preset", ACTION_SET_PRESET, false},
+    {"set_volume", ACTION_SET_VOLUME, false},
+    {"set_source_p1", ACTION_SET_SOURCE_P1, false},
+    {"set_source_p2", ACTION_SET_SOURCE_P2, false},
+    {"set_source_p3", ACTION_SET_SOURCE_P3, false},
+    {"set_mute", ACTION_SET_MUTE, true},
+    {"set_eq_p1", ACTION_SET_EQ_P1, true},
+    {"set_eq_p2", ACTION_SET_EQ_P2, true},
+    {"set_eq_p3", ACTION_SET_EQ_P3, true},
+};
+
+static const amp_command_t *find_amp_command(const char *name) {
+  for (int i = 0; i < NUM_CONTROL_ACTIONS; i++) {
+    if (strcmp(amp_commands[i].name, name) == 0) return &amp_commands[i];
+  }
+  return NULL;
+}
+
+static cJSON *build_scenes_json(void) {
+  cJSON *root = cJSON_CreateObject();
+  cJSON *scenes_json = cJSON_AddArrayToObject(root, "scenes");
+  scene_t scene;
+  for (int i = 0; i < MAX_SCENES; i++) {
+    if (!scenes_get(i, &scene)) continue;
+    cJSON *scene_json = cJSON_CreateObject();
+    cJSON_AddStringToObject(scene_json, "name", scene.name);
+    cJSON *actions_json = cJSON_AddObjectToObject(scene_json, "actions");
+    for (int j = 0; j < NUM_CONTROL_ACTIONS; j++) {
+      const amp_command_t *command = &amp_commands[j];
+      if (!(scene.delta.actions & (1 << command->action))) continue;
+      int8_t value = scene.delta.values[command->action];
+      if (command->is_bool) {
+        cJSON_AddBoolToObject(actions_json, command->name, value);
+      } else {
+        cJSON_AddNumberToObject(actions_json, command->name, value);
+      }
+    }
+    cJSON_AddItemToArray(scenes_json, scene_json);
+  }
+  return root;
+}
+
+// {"name": "TV", "actions": {"set_preset": 2, "set_volume": -30}}
+static bool parse_scene(const cJSON *value_json, scene_t *scene) {
+  memset(scene, 0, sizeof(scene_t));
+  cJSON *name_json = cJSON_GetObjectItem(value_json, "name");
+  cJSON *actions_json = cJSON_GetObjectItem(value_json, "actions");
+  if (!cJSON_IsString(name_json) || !cJSON_IsObject(actions_json)) {
+    return false;
+  }
+  strncpy(scene->name, name_json->valuestring, SCENE_NAME_MAX_LEN - 1);
+  for (int i = 0; i < NUM_CONTROL_ACTIONS; i++) {
+    const amp_command_t *command = &amp_commands[i];
+    cJSON *action_json = cJSON_GetObjectItem(actions_json, command->name);
+    if (action_json == NULL) continue;
+    // Checked before the cast, 300 must not become a valid volume.
+    if (!command->is_bool &&
+        (!cJSON_IsNumber(action_json) || action_json->valueint < INT8_MIN ||
+         action_json->valueint > INT8_MAX)) {
+      return false;
+    }
+    scene->delta.actions |= 1 << command->action;
+    scene->delta.values[command->action] =
+        command->is_bool ? (int8_t)cJSON_IsTrue(action_json)
+                         : (int8_t)action_json->valueint;
+  }
+  // Same checks as for the commands, an invalid scene is never stored.
+  return is_valid_state_delta(&scene->delta);
+}
+
+static cJSON *build_state_json(const state_t *state) {
   cJSON *root = cJSON_CreateObject();
   // cJSON_AddBoolToObject(root, "test_mode_enabled", test_mode_enabled);
+  abx_status_t abx_status;
+  abx_get_status(&abx_status);
 
   // Amp state
   if (state != NULL) {
     cJSON *amp_state_json = cJSON_CreateObject();
-    cJSON_AddNumberToObject(amp_state_json, "preset", state->preset);
+    // During an ABX test nothing may tell which preset is playing.
+    if (!abx_status.is_running) {
+      cJSON_AddNumberToObject(amp_state_json, "preset", state->preset);
+      cJSON_AddNumberToObject(amp_state_json, "current_source",
+                              state->current_source);
+    }
+    // Lets a client resume from here after a reconnect.
+    cJSON_AddNumberToObject(amp_state_json, "epoch", state_journal_epoch());
+    cJSON_AddNumberToObject(
+        amp_state_json, "version",
+        abx_status.is_running ? atomic_load(&blind_version) : state->version);
     cJSON_AddNumberToObject(amp_state_json, "volume_db", state->volume_db);
     cJSON_AddBoolToObject(amp_state_json, "is_muted", state->is_muted);
-    cJSON_AddNumberToObject(amp_state_json, "current_source",
-                            state->current_source);
     cJSON *source_array = cJSON_CreateArray();
     for (int i = 0; i < 3; i++) {
       cJSON_AddItemToArray(source_array,
@@ -94,11 +616,41 @@ void notify_state_changed(const state_t *state) {
       cJSON_AddItemToArray(eq_on_array, cJSON_CreateBool(state->is_eq_on[i]));
     }
     cJSON_AddItemToObject(amp_state_json, "eq_on", eq_on_array);
-    get_filter_name(&filter_name[0]);
-    cJSON_AddStringToObject(amp_state_json, "filter_name", filter_name);
+    if (!abx_status.is_running) {
+      char filter_name[FILTER_NAME_MAX_LEN];
+      get_filter_name(&filter_name[0]);
+      cJSON_AddStringToObject(amp_state_json, "filter_name", filter_name);
+    }
+    // [client, seq] of the last confirmed client command per action.
+    cJSON *acks_json = cJSON_AddObjectToObject(amp_state_json, "acks");
+    for (int i = 0; i < NUM_CONTROL_ACTIONS; i++) {
+      const command_tag_t *ack = &state->acks[amp_commands[i].action];
+      if (ack->client == 0) continue;
+      cJSON *ack_json = cJSON_CreateArray();
+      cJSON_AddItemToArray(ack_json, cJSON_CreateNumber(ack->client));
+      cJSON_AddItemToArray(ack_json, cJSON_CreateNumber(ack->seq));
+      cJSON_AddItemToObject(acks_json, amp_commands[i].name, ack_json);
+    }
     cJSON_AddItemToObject(root, "amp_state", amp_state_json);
   }
 
+  // ABX Test Status
+  if (abx_status.is_active) {
+    cJSON *abx_json = cJSON_AddObjectToObject(root, "abx_test");
+    cJSON_AddBoolToObject(abx_json, "is_running", abx_status.is_running);
+    cJSON_AddBoolToObject(abx_json, "is_finished", abx_status.is_finished);
+    cJSON_AddNumberToObject(abx_json, "preset_a", abx_status.preset_a);
+    cJSON_AddNumberToObject(abx_json, "preset_b", abx_status.preset_b);
+    cJSON_AddStringToObject(abx_json, "selected",
+                            abx_selection_name(abx_status.selected));
+    cJSON_AddNumberToObject(abx_json, "trials", abx_status.trials);
+    cJSON_AddNumberToObject(abx_json, "iteration", abx_status.iteration);
+    if (abx_status.is_finished) {
+      cJSON_AddNumberToObject(abx_json, "correct", abx_status.correct);
+      cJSON_AddNumberToObject(abx_json, "p_value", abx_status.p_value);
+    }
+  }
+
   // A/B Test Status
   if (test_mode_enabled) {
     cJSON *ab_test_json = cJSON_CreateObject();
@@ -112,8 +664,118 @@ void notify_state_changed(const state_t *state) {
     cJSON_AddItemToObject(root, "ab_test", ab_test_json);
   }
 
-  send_to_clients(root);
+  return root;
+}
+
+static ws_frame_t *serialize_state(const state_t *state) {
+  json_arena_take(&state_arena);
+  cJSON *root = build_state_json(state);
+  ws_frame_t *frame = ws_frame_create(root);
   cJSON_Delete(root);
+  json_arena_release(&state_arena);
+  return frame;
+}
+
+#ifdef CONTROL_PATH_BENCHMARK
+size_t benchmark_serialize_state(const state_t *state) {
+  ws_frame_t *frame = serialize_state(state);
+  if (frame == NULL) return 0;
+  size_t len = frame->len;
+  ws_frame_unref(frame);
+  return len;
+}
+
+// Same steps as the WebSocket handler up to the driver call.
+bool benchmark_parse_command(const char *message) {
+  json_arena_take(&command_arena);
+  cJSON *root = cJSON_Parse(message);
+  cJSON *action_json = cJSON_GetObjectItem(root, "action");
+  bool found = cJSON_IsString(action_json) &&
+               find_amp_command(action_json->valuestring) != NULL &&
+               cJSON_GetObjectItem(root, "value") != NULL;
+  cJSON_Delete(root);
+  json_arena_release(&command_arena);
+  return found;
+}
+#endif  // CONTROL_PATH_BENCHMARK
+
+static void store_snapshot(ws_frame_t *frame, uint32_t state_version,
+                           uint32_t ab_version) {
+  atomic_fetch_add(&frame->refs, 1);
+  xSemaphoreTake(snapshot_mutex, portMAX_DELAY);
+  ws_frame_t *old_frame = snapshot;
+  // Don't let a late get_state replace a newer broadcast.
+  if (old_frame != NULL &&
+      (int32_t)(state_version - snapshot_state_version) < 0) {
+    old_frame = frame;
+  } else {
+    snapshot = frame;
+    snapshot_state_version = state_version;
+    snapshot_ab_version = ab_version;
+  }
+  xSemaphoreGive(snapshot_mutex);
+  if (old_frame != NULL) ws_frame_unref(old_frame);
+}
+
+// Returns a reference to a frame with the full current state, only
+// serialized again if the state changed since the last one.
+static ws_frame_t *get_snapshot(void) {
+  state_t current_state;
+  get_state(&current_state);
+  uint32_t ab_version = atomic_load(&ab_test_version);
+
+  ws_frame_t *frame = NULL;
+  xSemaphoreTake(snapshot_mutex, portMAX_DELAY);
+  if (snapshot != NULL && snapshot_state_version == current_state.version &&
+      snapshot_ab_version == ab_version) {
+    frame = snapshot;
+    atomic_fetch_add(&frame->refs, 1);
+  }
+  xSemaphoreGive(snapshot_mutex);
+  if (frame != NULL) {
+    snapshot_hits++;
+    return frame;
+  }
+
+  snapshot_misses++;
+  frame = serialize_state(&current_state);
+  if (frame != NULL) {
+    store_snapshot(frame, current_state.version, ab_version);
+  }
+  return frame;
+}
+
+void notify_state_changed(const state_t *state) {
+  if (state != NULL) state_journal_record(state);
+  if (!server) return;
+
+  if (state == NULL) {
+    // A/B test changed, the cached snapshot is outdated.
+    atomic_fetch_add(&ab_test_version, 1);
+  }
+  uint32_t ab_version = atomic_load(&ab_test_version);
+  // Serialize once, the frame is shared by all clients.
+  ws_frame_t *frame = serialize_state(state);
+  if (frame == NULL) {
+    ESP_LOGE(TAG_WEB, "Failed to serialize state.");
+    return;
+  }
+  if (state != NULL) {
+    store_snapshot(frame, state->version, ab_version);
+  }
+  send_to_clients(frame);
+}
+
+bool notify_state_event(const state_t *state, uint16_t changed) {
+  if (abx_is_blind()) {
+    if (!(changed & ~ABX_HIDDEN_FIELDS)) {
+      state_journal_record(state);
+      return false;
+    }
+    atomic_fetch_add(&blind_version, 1);
+  }
+  notify_state_changed(state);
+  return true;
 }
 
 void enable_test_mode(bool enable) {
@@ -122,17 +784,24 @@ void enable_test_mode(bool enable) {
   notify_state_changed(NULL);
 }
 
-static void ab_test_task(void *arg) {
+// Only for tasks which may wait, the A/B sequence must not lose an unmute.
+static void enqueue_command_waiting(control_action_t cmd) {
+  cmd.origin.type = ORIGIN_AB_TEST;
+  command_result_t result;
+  while ((result = enqueue_command(cmd)) == COMMAND_BUSY ||
+         result == COMMAND_THROTTLED) {
+    vTaskDelay(pdMS_TO_TICKS(50));
+  }
+}
+
+static void run_ab_test(void) {
   ESP_LOGI(TAG_WEB, "A/B Test Task gestartet.");
   TickType_t test_start_time = xTaskGetTickCount();
   TickType_t next_switch_time = test_start_time;
 
   bool switch_preset = false;
-  control_action_t switch_preset_cmd;
-  switch_preset_cmd.action = ACTION_SET_PRESET;
-
-  control_action_t mute_cmd;
-  mute_cmd.action = ACTION_SET_MUTE;
+  control_action_t switch_preset_cmd = {.action = ACTION_SET_PRESET};
+  control_action_t mute_cmd = {.action = ACTION_SET_MUTE};
 
   xSemaphoreTake(ab_test_mutex, portMAX_DELAY);
 
@@ -145,15 +814,19 @@ static void ab_test_task(void *arg) {
   xSemaphoreGive(ab_test_mutex);
   enable_test_mode(true);
 
-  enqueue_command(switch_preset_cmd);
+  enqueue_command_waiting(switch_preset_cmd);
 
+  TickType_t wait = 0;
   while (1) {
+    // Sleeps until the next switch, stop_ab_test wakes it early.
+    bool notified = ulTaskNotifyTake(pdTRUE, wait) > 0;
+    bool switch_due = switch_preset;
     if (switch_preset) {
       // Unmute and switch, mute is used to hide switching between presets with
       // and without FIR
       mute_cmd.value = 0;
-      enqueue_command(mute_cmd);
-      enqueue_command(switch_preset_cmd);
+      enqueue_command_waiting(mute_cmd);
+      enqueue_command_waiting(switch_preset_cmd);
       switch_preset = false;
     }
 
@@ -168,7 +841,9 @@ static void ab_test_task(void *arg) {
     }
 
     // Maybe switch presets
-    if (xTaskGetTickCount() >= next_switch_time) {
+    TickType_t now = xTaskGetTickCount();
+    if ((int32_t)(now - next_switch_time) >= 0) {
+      switch_due = true;
       switch_preset_cmd.value = (esp_random() % 2 == 0)
                                     ? ab_test_config.preset_a
                                     : ab_test_config.preset_b;
@@ -177,7 +852,7 @@ static void ab_test_task(void *arg) {
       uint32_t delay_s = ab_test_config.min_time_s +
                          (esp_random() % (ab_test_config.max_time_s -
                                           ab_test_config.min_time_s + 1));
-      next_switch_time = xTaskGetTickCount() + pdMS_TO_TICKS(delay_s * 1000);
+      next_switch_time = now + pdMS_TO_TICKS(delay_s * 1000);
       ESP_LOGI(TAG_WEB, "A/B: Change to preset %d. Next change in  %lx s",
                switch_preset_cmd.value, delay_s);
     }
@@ -187,28 +862,48 @@ static void ab_test_task(void *arg) {
       // Muting to mask switching between presets with and without FIR, actual
       // switch on the next iteration.
       mute_cmd.value = 1;
-      enqueue_command(mute_cmd);
+      enqueue_command_waiting(mute_cmd);
     }
-    vTaskDelay(pdMS_TO_TICKS(1000));  // Check every second
+    wakeup_record(WAKEUP_AB_TEST, !notified && !switch_due);
+    // The mute gets a second before the switch.
+    wait = switch_preset ? pdMS_TO_TICKS(1000)
+                         : next_switch_time - xTaskGetTickCount();
+    if ((int32_t)wait < 0) wait = 0;
   }
   ESP_LOGI(TAG_WEB, "A/B Test Task beendet.");
-  ab_test_task_handle = NULL;
-  vTaskDelete(NULL);
+}
+
+static void ab_test_task(void *arg) {
+  while (1) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    run_ab_test();
+    xSemaphoreTake(ab_test_mutex, portMAX_DELAY);
+    // A stop after the test ended must not start the next one.
+    ulTaskNotifyTake(pdTRUE, 0);
+    ab_test_active = false;
+    xSemaphoreGive(ab_test_mutex);
+  }
 }
 
 void start_ab_test(ab_test_config_t *cfg) {
   if (xSemaphoreTake(ab_test_mutex, pdMS_TO_TICKS(50)) != pdTRUE) return;
-  if (ab_test_task_handle != NULL) {
+  if (ab_test_active) {
     ESP_LOGI(TAG_WEB, "A/B Test already running");
     xSemaphoreGive(ab_test_mutex);
     return;
   }
   memcpy(&ab_test_config, cfg, sizeof(ab_test_config_t));
+  ab_test_active = true;
+  if (ab_test_task_handle == NULL) {
+    ab_test_task_handle = xTaskCreateStaticPinnedToCore(
+        ab_test_task, "ab_test_task", AB_TEST_TASK_STACK_SIZE, NULL, 3,
+        ab_test_task_stack, &ab_test_task_buffer, 1);
+    assert(ab_test_task_handle != NULL);
+    memory_budget_add_task(ab_test_task_handle, AB_TEST_TASK_STACK_SIZE);
+  }
   xSemaphoreGive(ab_test_mutex);
   ESP_LOGI(TAG_WEB, "Starting ab test");
-  BaseType_t task_created = xTaskCreatePinnedToCore(
-      ab_test_task, "ab_test_task", 4096, NULL, 3, &ab_test_task_handle, 1);
-  assert(task_created == pdTRUE);
+  xTaskNotifyGive(ab_test_task_handle);
 }
 
 void reset_test(void) {
@@ -224,41 +919,352 @@ void stop_ab_test(void) {
   xSemaphoreTake(ab_test_mutex, portMAX_DELAY);
   ab_test_state.is_running = false;
   ab_test_state.is_finished = true;
+  if (ab_test_active) xTaskNotifyGive(ab_test_task_handle);
   xSemaphoreGive(ab_test_mutex);
   notify_state_changed(NULL);
 }
 
-static void send_state() {
-  state_t current_state;
-  get_state(&current_state);
-  notify_state_changed(&current_state);
+// Answers only the requesting client.
+static const char *command_result_name(command_result_t result) {
+  switch (result) {
+    case COMMAND_QUEUED:
+      return "queued";
+    case COMMAND_DEFERRED:
+      return "deferred";
+    case COMMAND_REJECTED:
+      return "rejected";
+    case COMMAND_BUSY:
+      return "busy";
+    case COMMAND_THROTTLED:
+      return "throttled";
+  }
+  return "unknown";
+}
+
+static void reply_work(void *arg) {
+  ws_reply_t *reply = (ws_reply_t *)arg;
+  esp_err_t err;
+  if (reply->frame != NULL) {
+    err = ws_frame_send(reply->sockfd, reply->frame);
+    ws_frame_unref(reply->frame);
+  } else {
+    httpd_ws_frame_t ws_pkt;
+    memset(&ws_pkt, 0, sizeof(httpd_ws_frame_t));
+    ws_pkt.payload = (uint8_t *)reply->text;
+    ws_pkt.len = reply->len;
+    ws_pkt.type = HTTPD_WS_TYPE_TEXT;
+    err = httpd_ws_send_frame_async(server, reply->sockfd, &ws_pkt);
+  }
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG_WEB, "Failed to reply to client #%d", reply->sockfd);
+  }
+  free(reply);
 }
 
+// Takes over the reference to the frame, if any, otherwise copies the text.
+static void queue_reply(int sockfd, ws_frame_t *frame, const char *text,
+                        size_t len) {
+  ws_reply_t *reply = malloc(sizeof(ws_reply_t) + (frame ? 0 : len));
+  if (reply == NULL) {
+    if (frame != NULL) ws_frame_unref(frame);
+    return;
+  }
+  reply->sockfd = sockfd;
+  reply->frame = frame;
+  reply->len = len;
+  if (frame == NULL) memcpy(reply->text, text, len);
+  if (httpd_queue_work(server, reply_work, reply) != ESP_OK) {
+    ESP_LOGE(TAG_WEB, "Failed to queue reply.");
+    if (frame != NULL) ws_frame_unref(frame);
+    free(reply);
+  }
+}
+
+// Only the sender learns that its command was not queued right away, the
+// state broadcast tells everyone else what actually happened.
+static void send_command_result(int sockfd, const char *action,
+                                command_result_t result) {
+  char reply[96];
+  int len = snprintf(reply, sizeof(reply),
+                     "{\"command_result\":{\"action\":\"%.40s\","
+                     "\"result\":\"%s\"}}",
+                     action, command_result_name(result));
+  queue_reply(sockfd, NULL, reply, len);
+}
+
+static void send_json(int sockfd, cJSON *root) {
+  char *json_string = cJSON_PrintUnformatted(root);
+  cJSON_Delete(root);
+  if (json_string == NULL) return;
+  queue_reply(sockfd, NULL, json_string, strlen(json_string));
+  cJSON_free(json_string);
+}
+
+static void send_scenes(int sockfd) { send_json(sockfd, build_scenes_json()); }
+
+// Only the changed fields, in the format of amp_state.
+static cJSON *build_journal_entry_json(const journal_entry_t *entry) {
+  cJSON *entry_json = cJSON_CreateObject();
+  cJSON_AddNumberToObject(entry_json, "version", entry->version);
+  cJSON_AddNumberToObject(entry_json, "time_ms", entry->time_us / 1000);
+  if (entry->by.client != 0) {
+    cJSON *by_json = cJSON_AddArrayToObject(entry_json, "by");
+    cJSON_AddItemToArray(by_json, cJSON_CreateNumber(entry->by.client));
+    cJSON_AddItemToArray(by_json, cJSON_CreateNumber(entry->by.seq));
+  }
+  cJSON *amp_json = cJSON_AddObjectToObject(entry_json, "amp_state");
+  if (entry->changed & JOURNAL_PRESET) {
+    cJSON_AddNumberToObject(amp_json, "preset", entry->preset);
+  }
+  if (entry->changed & JOURNAL_VOLUME) {
+    cJSON_AddNumberToObject(amp_json, "volume_db",
+                            entry->volume_centi_db / 100.0);
+  }
+  if (entry->changed & JOURNAL_MUTE) {
+    cJSON_AddBoolToObject(amp_json, "is_muted", entry->is_muted);
+  }
+  if (entry->changed & JOURNAL_CURRENT_SOURCE) {
+    cJSON_AddNumberToObject(amp_json, "current_source", entry->current_source);
+  }
+  if (entry->changed & JOURNAL_PRESET_SOURCE) {
+    cJSON *source_array = cJSON_AddArrayToObject(amp_json, "preset_source");
+    for (int i = 0; i < 3; i++) {
+      cJSON_AddItemToArray(source_array,
+                           cJSON_CreateNumber(entry->preset_source[i]));
+    }
+  }
+  if (entry->changed & JOURNAL_EQ) {
+    cJSON *eq_on_array = cJSON_AddArrayToObject(amp_json, "eq_on");
+    for (int i = 0; i < 3; i++) {
+      cJSON_AddItemToArray(eq_on_array, cJSON_CreateBool(entry->is_eq_on[i]));
+    }
+  }
+  if (entry->changed & JOURNAL_FILTER_NAME) {
+    // Names are not journaled, the current one is the latest anyway.
+    char filter_name[FILTER_NAME_MAX_LEN];
+    get_filter_name(filter_name);
+    cJSON_AddStringToObject(amp_json, "filter_name", filter_name);
+  }
+  return entry_json;
+}
+
+static cJSON *build_journal_json(int count) {
+  cJSON *root = cJSON_CreateObject();
+  cJSON *journal_json = cJSON_AddObjectToObject(root, "journal");
+  cJSON_AddNumberToObject(journal_json, "epoch", state_journal_epoch());
+  cJSON *entries_json = cJSON_AddArrayToObject(journal_json, "entries");
+  for (int i = 0; i < count; i++) {
+    cJSON_AddItemToArray(entries_json,
+                         build_journal_entry_json(&journal_entries[i]));
+  }
+  return root;
+}
+
+static void send_state(int sockfd) {
+  ws_frame_t *frame = get_snapshot();
+  if (frame == NULL) {
+    ESP_LOGE(TAG_WEB, "Failed to serialize state.");
+    return;
+  }
+  queue_reply(sockfd, frame, NULL, 0);
+}
+
+// Sends the changes since the client's version, or the full state if they
+// aged out. Tests are not journaled, while one is active the full state is
+// sent, which also hides the preset during ABX.
+static void send_resume(int sockfd, const cJSON *value_json) {
+  cJSON *epoch_json = cJSON_GetObjectItem(value_json, "epoch");
+  cJSON *version_json = cJSON_GetObjectItem(value_json, "version");
+  abx_status_t abx_status;
+  abx_get_status(&abx_status);
+  int count = -1;
+  xSemaphoreTake(journal_mutex, portMAX_DELAY);
+  if (cJSON_IsNumber(epoch_json) && cJSON_IsNumber(version_json) &&
+      !test_mode_enabled && !abx_status.is_active) {
+    count = state_journal_since((uint32_t)epoch_json->valuedouble,
+                                (uint32_t)version_json->valuedouble,
+                                journal_entries);
+  }
+  cJSON *root = count < 0 ? NULL : build_journal_json(count);
+  xSemaphoreGive(journal_mutex);
+  if (root == NULL) {
+    send_state(sockfd);
+    return;
+  }
+  send_json(sockfd, root);
+}
+
+static int add_client(ws_slot_t *slots, int max_clients, int sockfd) {
+  int64_t now = esp_timer_get_time();
+  int slot = -1;
+  int stalest = -1;
+  for (int i = 0; i < max_clients && slot < 0; i++) {
+    if (slots[i].fd == 0 || !check_slot(&slots[i])) {
+      slot = i;
+    } else if (stalest < 0 ||
+               slots[i].last_seen_us < slots[stalest].last_seen_us) {
+      stalest = i;
+    }
+  }
+  // Full, a client which missed the last ping is most likely gone.
+  if (slot < 0 && stalest >= 0 &&
+      now - slots[stalest].last_seen_us > WS_SUSPECT_AFTER_MS * 1000LL) {
+    eviction_stats.replaced++;
+    evict_slot(&slots[stalest], "no pong, making room");
+    slot = stalest;
+  }
+  if (slot < 0) return -1;
+  slots[slot].fd = sockfd;
+  slots[slot].last_seen_us = now;
+  slots[slot].send_failures = 0;
+  return slot;
+}
+
+// Control frames are passed to the handler to see pongs, so pings and
+// closes have to be answered here.
+static esp_err_t handle_control_frame(httpd_req_t *req,
+                                      httpd_ws_frame_t *ws_pkt) {
+  if (ws_pkt->len > 0) {
+    ws_pkt->payload = (uint8_t *)ws_message_buffer;
+    esp_err_t ret = httpd_ws_recv_frame(req, ws_pkt, ws_pkt->len);
+    if (ret != ESP_OK) return ret;
+  }
+  switch (ws_pkt->type) {
+    case HTTPD_WS_TYPE_PING:
+      ws_pkt->type = HTTPD_WS_TYPE_PONG;
+      return httpd_ws_send_frame(req, ws_pkt);
+    case HTTPD_WS_TYPE_CLOSE:
+      ws_pkt->len = 0;
+      ws_pkt->payload = NULL;
+      return httpd_ws_send_frame(req, ws_pkt);
+    default:
+      return ESP_OK;
+  }
+}
+
+static int ws_work_free(void) {
+  int count = 0;
+  taskENTER_CRITICAL(&ws_work_lock);
+  for (int i = 0; i < WS_WORK_QUEUE_LENGTH; i++) {
+    if (ws_work_states[i] == WS_WORK_FREE) count++;
+  }
+  taskEXIT_CRITICAL(&ws_work_lock);
+  return count;
+}
+
+// Only called by the httpd task, a free slot stays free until it is put.
+static bool ws_work_put(const ws_work_t *work) {
+  int slot = -1;
+  taskENTER_CRITICAL(&ws_work_lock);
+  for (int i = 0; i < WS_WORK_QUEUE_LENGTH && slot < 0; i++) {
+    if (ws_work_states[i] == WS_WORK_FREE) slot = i;
+  }
+  taskEXIT_CRITICAL(&ws_work_lock);
+  if (slot < 0) return false;
+  // Copied outside the lock, the worker doesn't look at free slots.
+  ws_work[slot] = *work;
+  taskENTER_CRITICAL(&ws_work_lock);
+  ws_work_order[slot] = ws_work_received++;
+  ws_work_states[slot] = WS_WORK_READY;
+  taskEXIT_CRITICAL(&ws_work_lock);
+  xTaskNotifyGive(ws_worker);
+  return true;
+}
+
+// Whether slot a is worked off before slot b: the next socket after the one
+// served last, wrapping around, then the oldest message of that socket.
+static bool ws_work_before(int a, int b) {
+  unsigned turn_a = (unsigned)(ws_work[a].sockfd - ws_work_last_sockfd - 1);
+  unsigned turn_b = (unsigned)(ws_work[b].sockfd - ws_work_last_sockfd - 1);
+  if (turn_a != turn_b) return turn_a < turn_b;
+  return (int32_t)(ws_work_order[a] - ws_work_order[b]) < 0;
+}
+
+// Blocks until a message is ready, ws_work_done() frees it again.
+static ws_work_t *ws_work_take(void) {
+  // One notification per message put.
+  ulTaskNotifyTake(pdFALSE, portMAX_DELAY);
+  int next = -1;
+  taskENTER_CRITICAL(&ws_work_lock);
+  for (int i = 0; i < WS_WORK_QUEUE_LENGTH; i++) {
+    if (ws_work_states[i] != WS_WORK_READY) continue;
+    if (next < 0 || ws_work_before(i, next)) next = i;
+  }
+  if (next >= 0) {
+    ws_work_states[next] = WS_WORK_BUSY;
+    ws_work_last_sockfd = ws_work[next].sockfd;
+  }
+  taskEXIT_CRITICAL(&ws_work_lock);
+  return next >= 0 ? &ws_work[next] : NULL;
+}
+
+static void ws_work_done(ws_work_t *work) {
+  taskENTER_CRITICAL(&ws_work_lock);
+  ws_work_states[work - ws_work] = WS_WORK_FREE;
+  taskEXIT_CRITICAL(&ws_work_lock);
+}
+
+#ifdef WS_TRAFFIC_RECORDER
+static void record_trace(const ws_work_t *work, size_t len) {
+  trace_entry_t *entry = &trace_entries[trace_next];
+  entry->at_ms = (uint32_t)(work->received_us / 1000);
+  entry->sockfd = work->sockfd;
+  entry->truncated = len > TRACE_MESSAGE_LEN;
+  strncpy(entry->message, work->message, TRACE_MESSAGE_LEN);
+  entry->message[TRACE_MESSAGE_LEN] = '\0';
+  trace_next = (trace_next + 1) % TRACE_ENTRIES;
+  trace_recorded++;
+}
+
+// One JSON object per line, oldest first. Not deferred to a worker, it
+// reads the ring without a lock.
+static esp_err_t trace_get_handler(httpd_req_t *req) {
+  uint32_t count =
+      trace_recorded < TRACE_ENTRIES ? trace_recorded : TRACE_ENTRIES;
+  uint32_t first = (trace_next + TRACE_ENTRIES - count) % TRACE_ENTRIES;
+  httpd_resp_set_type(req, "application/x-ndjson");
+  for (uint32_t i = 0; i < count; i++) {
+    const trace_entry_t *entry = &trace_entries[(first + i) % TRACE_ENTRIES];
+    cJSON *entry_json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(entry_json, "t_ms", entry->at_ms);
+    cJSON_AddNumberToObject(entry_json, "client", entry->sockfd);
+    cJSON_AddStringToObject(entry_json, "message", entry->message);
+    if (entry->truncated) {
+      cJSON_AddBoolToObject(entry_json, "truncated", true);
+    }
+    char *line = cJSON_PrintUnformatted(entry_json);
+    cJSON_Delete(entry_json);
+    if (line == NULL) break;
+    esp_err_t err = httpd_resp_sendstr_chunk(req, line);
+    if (err == ESP_OK) err = httpd_resp_sendstr_chunk(req, "\n");
+    cJSON_free(line);
+    if (err != ESP_OK) return err;
+  }
+  return httpd_resp_sendstr_chunk(req, NULL);
+}
+#endif  // WS_TRAFFIC_RECORDER
+
 static esp_err_t websocket_handler(httpd_req_t *req) {
+  // Subscribers are read-only and only receive state updates.
+  bool read_only = req->user_ctx != NULL;
   if (req->method == HTTP_GET) {
     int sockfd = httpd_req_to_sockfd(req);
-    int free_slot = -1;
-
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-      if (client_fds[i] == 0) {
-        free_slot = i;
-        break;
-      }
-    }
+    int slot = read_only
+                   ? add_client(subscriber_slots, MAX_SUBSCRIBERS, sockfd)
+                   : add_client(client_slots, MAX_CLIENTS, sockfd);
 
-    if (free_slot == -1) {
-      ESP_LOGE(
-          TAG_WEB,
-          "Maximum number of clients (%d) reached. Rejecting new connection.",
-          MAX_CLIENTS);
+    if (slot == -1) {
+      ESP_LOGE(TAG_WEB,
+               "Maximum number of %s (%d) reached. Rejecting new connection.",
+               read_only ? "subscribers" : "clients",
+               read_only ? MAX_SUBSCRIBERS : MAX_CLIENTS);
       close(sockfd);
       return ESP_FAIL;
     }
 
-    ESP_LOGI(TAG_WEB,
-             "New client connected, socket fd: %d, assigned to slot %d", sockfd,
-             free_slot);
-    client_fds[free_slot] = sockfd;
+    ESP_LOGI(TAG_WEB, "New %s connected, socket fd: %d, assigned to slot %d",
+             read_only ? "subscriber" : "client", sockfd, slot);
+    boot_mark(BOOT_FIRST_WS_CLIENT);
 
     // sendState();
 
@@ -270,23 +1276,77 @@ static esp_err_t websocket_handler(httpd_req_t *req) {
   ws_pkt.type = HTTPD_WS_TYPE_TEXT;
   esp_err_t ret = httpd_ws_recv_frame(req, &ws_pkt, 0);
   if (ret != ESP_OK) return ret;
-  uint8_t *buf = calloc(1, ws_pkt.len + 1);
-  ws_pkt.payload = buf;
+  ws_slot_t *slot = find_slot(httpd_req_to_sockfd(req));
+  if (slot != NULL) slot->last_seen_us = esp_timer_get_time();
+  if (ws_pkt.type != HTTPD_WS_TYPE_TEXT) {
+    return handle_control_frame(req, &ws_pkt);
+  }
+  if (ws_pkt.len > MAX_WS_MESSAGE_LEN) {
+    ESP_LOGE(TAG_WEB, "Message of %d bytes too long.", ws_pkt.len);
+    return ESP_FAIL;
+  }
+  ws_pkt.payload = (uint8_t *)ws_incoming.message;
   ret = httpd_ws_recv_frame(req, &ws_pkt, ws_pkt.len);
-  if (ret != ESP_OK) {
-    free(buf);
-    return ret;
+  if (ret != ESP_OK) return ret;
+  ws_incoming.message[ws_pkt.len] = '\0';
+  ws_incoming.sockfd = httpd_req_to_sockfd(req);
+  ws_incoming.read_only = read_only;
+  ws_incoming.received_us = esp_timer_get_time();
+#ifdef WS_TRAFFIC_RECORDER
+  record_trace(&ws_incoming, ws_pkt.len);
+#endif  // WS_TRAFFIC_RECORDER
+  // Parsing and dispatch run on the worker, httpd keeps receiving. It is
+  // the only sender, the free space can't shrink before the send.
+  if (read_only && ws_work_free() <= WS_WORK_CLIENT_RESERVE) {
+    worker_stats.subscriber_dropped++;
+    send_command_result(ws_incoming.sockfd, "", COMMAND_BUSY);
+  } else if (!ws_work_put(&ws_incoming)) {
+    worker_stats.dropped++;
+    send_command_result(ws_incoming.sockfd, "", COMMAND_BUSY);
+  }
+  return ESP_OK;
+}
+
+static void record_ws_latency(const ws_work_t *work, int64_t started_us) {
+  int64_t now = esp_timer_get_time();
+  int64_t latency_us = now - work->received_us;
+  int bucket = 0;
+  while (bucket < WS_LATENCY_BUCKETS - 1 &&
+         latency_us >= ws_latency_bucket_ms[bucket] * 1000LL) {
+    bucket++;
+  }
+  worker_stats.messages++;
+  worker_stats.buckets[bucket]++;
+  if (latency_us > worker_stats.max_us) worker_stats.max_us = latency_us;
+  if (started_us - work->received_us > worker_stats.max_wait_us) {
+    worker_stats.max_wait_us = started_us - work->received_us;
   }
-  cJSON *root = cJSON_Parse((char *)ws_pkt.payload);
+}
+
+static void handle_ws_message(const ws_work_t *work) {
+  bool read_only = work->read_only;
+  int sockfd = work->sockfd;
+  json_arena_take(&command_arena);
+  cJSON *root = cJSON_Parse(work->message);
   if (root) {
     cJSON *action_json = cJSON_GetObjectItem(root, "action");
     cJSON *value_json = cJSON_GetObjectItem(root, "value");
-    if (action_json && value_json) {
-      control_action_t cmd;
+    if (action_json && value_json && cJSON_IsString(action_json)) {
+      control_action_t cmd = {0};
+      const command_origin_t origin = {.type = ORIGIN_WEBSOCKET,
+                                       .id = sockfd};
+      const amp_command_t *command;
+      command_result_t result = COMMAND_QUEUED;
 
       if (strcmp(action_json->valuestring, "get_state") == 0) {
-        send_state();
+        send_state(sockfd);
+      } else if (strcmp(action_json->valuestring, "resume") == 0) {
+        send_resume(sockfd, value_json);
+      } else if (read_only) {
+        ESP_LOGW(TAG_WEB, "Subscriber sent command %s, ignoring.",
+                 action_json->valuestring);
       } else if (strcmp(action_json->valuestring, "disable_test_mode") == 0) {
+        abx_reset();
         enable_test_mode(false);
       } else if (strcmp(action_json->valuestring, "start_test") == 0 &&
                  value_json) {
@@ -296,102 +1356,606 @@ static esp_err_t websocket_handler(httpd_req_t *req) {
         cfg.min_time_s = cJSON_GetObjectItem(value_json, "min_time")->valueint;
         cfg.max_time_s = cJSON_GetObjectItem(value_json, "max_time")->valueint;
         start_ab_test(&cfg);
+      } else if (strcmp(action_json->valuestring, "start_abx") == 0) {
+        cJSON *preset_a = cJSON_GetObjectItem(value_json, "preset_a");
+        cJSON *preset_b = cJSON_GetObjectItem(value_json, "preset_b");
+        cJSON *trials = cJSON_GetObjectItem(value_json, "trials");
+        if (cJSON_IsNumber(preset_a) && cJSON_IsNumber(preset_b) &&
+            cJSON_IsNumber(trials) && trials->valueint > 0) {
+          state_t current_state;
+          get_state(&current_state);
+          atomic_store(&blind_version, current_state.version);
+          abx_start(preset_a->valueint, preset_b->valueint, trials->valueint,
+                    cJSON_IsTrue(
+                        cJSON_GetObjectItem(value_json, "muted_switch")));
+        } else {
+          ESP_LOGE(TAG_WEB, "Invalid ABX config.");
+        }
+      } else if (strcmp(action_json->valuestring, "abx_select") == 0) {
+        abx_selection_t selection;
+        if (parse_abx_selection(value_json, &selection)) {
+          if (abx_select(selection) == ESP_ERR_TIMEOUT) {
+            result = COMMAND_BUSY;
+          }
+        }
+      } else if (strcmp(action_json->valuestring, "abx_answer") == 0) {
+        abx_selection_t x_is;
+        if (parse_abx_selection(value_json, &x_is)) {
+          abx_answer(x_is);
+        }
+      } else if (strcmp(action_json->valuestring, "stop_abx") == 0) {
+        abx_stop();
+      } else if (strcmp(action_json->valuestring, "get_scenes") == 0) {
+        send_scenes(sockfd);
+      } else if (strcmp(action_json->valuestring, "save_scene") == 0) {
+        scene_t scene;
+        if (!parse_scene(value_json, &scene) || scenes_save(&scene) != ESP_OK) {
+          result = COMMAND_REJECTED;
+        }
+        send_scenes(sockfd);
+      } else if (strcmp(action_json->valuestring, "delete_scene") == 0) {
+        if (cJSON_IsString(value_json)) scenes_delete(value_json->valuestring);
+        send_scenes(sockfd);
+      } else if (strcmp(action_json->valuestring, "recall_scene") == 0) {
+        if (!cJSON_IsString(value_json) ||
+            scenes_recall(value_json->valuestring, origin, &result) !=
+                ESP_OK) {
+          result = COMMAND_REJECTED;
+        }
+      } else if (strcmp(action_json->valuestring, "reset_abx") == 0) {
+        abx_reset();
       } else if (strcmp(action_json->valuestring, "stop_test") == 0) {
         stop_ab_test();
       } else if (strcmp(action_json->valuestring, "reset_test") == 0) {
         reset_test();
-      } else if (strcmp(action_json->valuestring, "set_preset") == 0) {
-        cmd.action = ACTION_SET_PRESET;
-        cmd.value = (int8_t)value_json->valueint;
-        enqueue_command(cmd);
-      } else if (strcmp(action_json->valuestring, "set_volume") == 0) {
-        cmd.action = ACTION_SET_VOLUME;
-        cmd.value = (int8_t)value_json->valueint;
-        enqueue_command(cmd);
-      } else if (strcmp(action_json->valuestring, "set_mute") == 0) {
-        cmd.action = ACTION_SET_MUTE;
-        cmd.value = (int8_t)cJSON_IsTrue(value_json);
-        enqueue_command(cmd);
-      } else if (strcmp(action_json->valuestring, "set_eq_p1") == 0) {
-        cmd.action = ACTION_SET_EQ_P1;
-        cmd.value = (int8_t)cJSON_IsTrue(value_json);
-        enqueue_command(cmd);
-      } else if (strcmp(action_json->valuestring, "set_eq_p2") == 0) {
-        cmd.action = ACTION_SET_EQ_P2;
-        cmd.value = (int8_t)cJSON_IsTrue(value_json);
-        enqueue_command(cmd);
-      } else if (strcmp(action_json->valuestring, "set_eq_p3") == 0) {
-        cmd.action = ACTION_SET_EQ_P3;
-        cmd.value = (int8_t)cJSON_IsTrue(value_json);
-        enqueue_command(cmd);
-      } else if (strcmp(action_json->valuestring, "set_source_p1") == 0) {
-        cmd.action = ACTION_SET_SOURCE_P1;
-        cmd.value = (int8_t)value_json->valueint;
-        enqueue_command(cmd);
-      } else if (strcmp(action_json->valuestring, "set_source_p2") == 0) {
-        cmd.action = ACTION_SET_SOURCE_P2;
-        cmd.value = (int8_t)value_json->valueint;
-        enqueue_command(cmd);
-      } else if (strcmp(action_json->valuestring, "set_source_p3") == 0) {
-        cmd.action = ACTION_SET_SOURCE_P3;
-        cmd.value = (int8_t)value_json->valueint;
-        enqueue_command(cmd);
+      } else if ((command = find_amp_command(action_json->valuestring))) {
+        cmd.action = command->action;
+        cmd.origin = origin;
+        cmd.value = command->is_bool ? (int8_t)cJSON_IsTrue(value_json)
+                                     : (int8_t)value_json->valueint;
+        // Optional, lets the client match the state echo.
+        cJSON *client_json = cJSON_GetObjectItem(root, "client");
+        cJSON *seq_json = cJSON_GetObjectItem(root, "seq");
+        cmd.tag.client = cJSON_IsNumber(client_json)
+                             ? (uint32_t)client_json->valuedouble
+                             : 0;
+        cmd.tag.seq =
+            cJSON_IsNumber(seq_json) ? (uint32_t)seq_json->valuedouble : 0;
+        result = enqueue_command(cmd);
       } else {
         ESP_LOGE(TAG_WEB, "Invaild command received: %s",
                  action_json->valuestring);
       }
+      if (result != COMMAND_QUEUED) {
+        send_command_result(sockfd, action_json->valuestring, result);
+      }
     }
     cJSON_Delete(root);
   }
-  free(buf);
-  return ret;
+  json_arena_release(&command_arena);
+}
+
+static void ws_worker_task(void *arg) {
+  while (1) {
+    ws_work_t *work = ws_work_take();
+    if (work == NULL) continue;
+    int64_t started_us = esp_timer_get_time();
+    // Full clock while a burst of messages is worked off.
+    power_acquire(POWER_LOCK_WEB);
+    handle_ws_message(work);
+    power_release(POWER_LOCK_WEB);
+    record_ws_latency(work, started_us);
+    ws_work_done(work);
+  }
+}
+
+static bool is_http_worker(void) {
+  TaskHandle_t current = xTaskGetCurrentTaskHandle();
+  for (int i = 0; i < HTTP_WORKER_COUNT; i++) {
+    if (http_workers[i] == current) return true;
+  }
+  return false;
+}
+
+// Hands the request to an HTTP worker. False if the caller is one already or
+// all of them are busy, then the request is handled right away.
+static bool defer_to_worker(httpd_req_t *req,
+                            esp_err_t (*handler)(httpd_req_t *req)) {
+  if (is_http_worker()) return false;
+  httpd_req_t *copy = NULL;
+  if (uxQueueSpacesAvailable(http_work_queue) == 0 ||
+      httpd_req_async_handler_begin(req, &copy) != ESP_OK) {
+    worker_stats.http_inline++;
+    return false;
+  }
+  http_work_t work = {.req = copy, .handler = handler};
+  if (xQueueSend(http_work_queue, &work, 0) != pdTRUE) {
+    httpd_req_async_handler_complete(copy);
+    worker_stats.http_inline++;
+    return false;
+  }
+  worker_stats.http_deferred++;
+  return true;
+}
+
+static void http_worker_task(void *arg) {
+  http_work_t work;
+  while (1) {
+    if (xQueueReceive(http_work_queue, &work, portMAX_DELAY) != pdTRUE) {
+      continue;
+    }
+    power_acquire(POWER_LOCK_WEB);
+    work.handler(work.req);
+    httpd_req_async_handler_complete(work.req);
+    power_release(POWER_LOCK_WEB);
+  }
+}
+
+static bool accepts_gzip(httpd_req_t *req) {
+  char accept_encoding[64];
+  return httpd_req_get_hdr_value_str(req, "Accept-Encoding", accept_encoding,
+                                     sizeof(accept_encoding)) == ESP_OK &&
+         strstr(accept_encoding, "gzip") != NULL;
+}
+
+// Streams the file from the UI partition if one was uploaded, otherwise
+// sends the embedded copy.
+static esp_err_t send_ui_file(httpd_req_t *req, const char *name,
+                              const char *type, const uint8_t *start,
+                              const uint8_t *end) {
+  httpd_resp_set_type(req, type);
+  bool is_gzip = false;
+  FILE *file = ui_files_open(name, accepts_gzip(req), &is_gzip);
+  if (file == NULL) {
+    return httpd_resp_send(req, (const char *)start, end - start - 1);
+  }
+  if (is_gzip) httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+  char chunk[UI_CHUNK_SIZE];
+  esp_err_t err = ESP_OK;
+  size_t len;
+  while (err == ESP_OK && (len = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    err = httpd_resp_send_chunk(req, chunk, len);
+  }
+  fclose(file);
+  if (err != ESP_OK) return err;
+  return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+// PUT /ui/index.js.gz stores a new UI file, DELETE /ui/index.js goes back
+// to the embedded one.
+static esp_err_t ui_file_put_handler(httpd_req_t *req) {
+  if (defer_to_worker(req, ui_file_put_handler)) return ESP_OK;
+  const char *name = req->uri + strlen(UI_FILES_BASE_PATH "/");
+  FILE *file = ui_files_begin_upload(name);
+  if (file == NULL) {
+    return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Not a UI file");
+  }
+  char chunk[UI_CHUNK_SIZE];
+  size_t remaining = req->content_len;
+  bool complete = true;
+  int timeouts = 0;
+  while (remaining > 0 && complete) {
+    int received = httpd_req_recv(
+        req, chunk, remaining < sizeof(chunk) ? remaining : sizeof(chunk));
+    // A stalled client must not keep the worker forever.
+    if (received == HTTPD_SOCK_ERR_TIMEOUT &&
+        ++timeouts < UI_UPLOAD_MAX_TIMEOUTS) {
+      continue;
+    }
+    if (received != HTTPD_SOCK_ERR_TIMEOUT) timeouts = 0;
+    complete = received > 0 && fwrite(chunk, 1, received, file) == received;
+    if (complete) remaining -= received;
+  }
+  esp_err_t err = ui_files_finish_upload(name, file, complete);
+  if (timeouts >= UI_UPLOAD_MAX_TIMEOUTS) {
+    ESP_LOGW(TAG_WEB, "UI file %s upload stalled, aborted.", name);
+    return httpd_resp_send_err(req, HTTPD_408_REQ_TIMEOUT, "Upload stalled");
+  }
+  if (err != ESP_OK) {
+    return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR,
+                               "Upload failed, partition full?");
+  }
+  ESP_LOGI(TAG_WEB, "UI file %s uploaded, %d bytes.", name,
+           (int)req->content_len);
+  return httpd_resp_sendstr(req, "OK");
+}
+
+static esp_err_t ui_file_delete_handler(httpd_req_t *req) {
+  const char *name = req->uri + strlen(UI_FILES_BASE_PATH "/");
+  if (ui_files_delete(name) != ESP_OK) {
+    return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Not a UI file");
+  }
+  return httpd_resp_sendstr(req, "OK");
 }
 
 static esp_err_t favicon_get_handler(httpd_req_t *req) {
+  if (defer_to_worker(req, favicon_get_handler)) return ESP_OK;
   ESP_LOGI(TAG_WEB, "Serving favicon");
-  httpd_resp_set_type(req, "image/x-icon");
-  return httpd_resp_send(req, (const char *)favicon_ico_start,
-                         favicon_ico_end - favicon_ico_start - 1);
+  return send_ui_file(req, "favicon.ico", "image/x-icon", favicon_ico_start,
+                      favicon_ico_end);
 }
 
 static esp_err_t root_get_handler(httpd_req_t *req) {
+  if (defer_to_worker(req, root_get_handler)) return ESP_OK;
   int sockfd = httpd_req_to_sockfd(req);
   ESP_LOGI(TAG_WEB, "Root html handler called. Client #%d connected", sockfd);
-  httpd_resp_set_type(req, "text/html");
-  return httpd_resp_send(req, (const char *)index_html_start,
-                         index_html_end - index_html_start - 1);
+  return send_ui_file(req, "index.html", "text/html", index_html_start,
+                      index_html_end);
 }
 static esp_err_t root_css_get_handler(httpd_req_t *req) {
+  if (defer_to_worker(req, root_css_get_handler)) return ESP_OK;
   int sockfd = httpd_req_to_sockfd(req);
   ESP_LOGI(TAG_WEB, "Root css handler called. Client #%d connected", sockfd);
-  httpd_resp_set_type(req, "text/css");
-  return httpd_resp_send(req, (const char *)index_css_start,
-                         index_css_end - index_css_start - 1);
+  return send_ui_file(req, "index.css", "text/css", index_css_start,
+                      index_css_end);
 }
 static esp_err_t root_js_get_handler(httpd_req_t *req) {
+  if (defer_to_worker(req, root_js_get_handler)) return ESP_OK;
   int sockfd = httpd_req_to_sockfd(req);
   ESP_LOGI(TAG_WEB, "Root js handler called. Client #%d connected", sockfd);
   ESP_LOGI(TAG_WEB, "Sending index.js");
-  httpd_resp_set_type(req, "application/javascript");
-  return httpd_resp_send(req, (const char *)index_js_start,
-                         index_js_end - index_js_start - 1);
+  return send_ui_file(req, "index.js", "application/javascript",
+                      index_js_start, index_js_end);
+}
+
+static esp_err_t scenes_get_handler(httpd_req_t *req) {
+  if (defer_to_worker(req, scenes_get_handler)) return ESP_OK;
+  cJSON *root = build_scenes_json();
+  char *json_string = cJSON_PrintUnformatted(root);
+  cJSON_Delete(root);
+  httpd_resp_set_type(req, "application/json");
+  esp_err_t ret = httpd_resp_sendstr(req, json_string);
+  cJSON_free(json_string);
+  return ret;
+}
+
+// POST /scenes/recall?name=TV, for home automation.
+static esp_err_t scene_recall_post_handler(httpd_req_t *req) {
+  char query[64];
+  char name[SCENE_NAME_MAX_LEN];
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK ||
+      httpd_query_key_value(query, "name", name, sizeof(name)) != ESP_OK) {
+    return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing name");
+  }
+  command_result_t result;
+  const command_origin_t origin = {.type = ORIGIN_REST};
+  if (scenes_recall(name, origin, &result) != ESP_OK) {
+    return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Unknown scene");
+  }
+  if (result == COMMAND_THROTTLED) {
+    httpd_resp_set_status(req, "429 Too Many Requests");
+  }
+  char reply[32];
+  snprintf(reply, sizeof(reply), "{\"result\":\"%s\"}",
+           command_result_name(result));
+  httpd_resp_set_type(req, "application/json");
+  return httpd_resp_sendstr(req, reply);
+}
+
+// Everything still in the journal, to debug who changed what and when.
+static esp_err_t journal_get_handler(httpd_req_t *req) {
+  if (defer_to_worker(req, journal_get_handler)) return ESP_OK;
+  if (abx_is_blind()) {
+    httpd_resp_set_status(req, "409 Conflict");
+    return httpd_resp_sendstr(req, "ABX test running");
+  }
+  xSemaphoreTake(journal_mutex, portMAX_DELAY);
+  cJSON *root = build_journal_json(state_journal_entries(journal_entries));
+  xSemaphoreGive(journal_mutex);
+  char *json_string = cJSON_PrintUnformatted(root);
+  cJSON_Delete(root);
+  httpd_resp_set_type(req, "application/json");
+  esp_err_t ret = httpd_resp_sendstr(req, json_string);
+  cJSON_free(json_string);
+  return ret;
+}
+
+static esp_err_t metrics_get_handler(httpd_req_t *req) {
+  if (defer_to_worker(req, metrics_get_handler)) return ESP_OK;
+  // The state bus and USB counters would tell whether X changed the preset.
+  if (abx_is_blind()) {
+    httpd_resp_set_status(req, "409 Conflict");
+    return httpd_resp_sendstr(req, "ABX test running");
+  }
+  cJSON *root = cJSON_CreateObject();
+  cJSON *ws_json = cJSON_AddObjectToObject(root, "websocket");
+  int clients = 0;
+  int subscribers = 0;
+  for (int i = 0; i < MAX_CLIENTS; i++) clients += client_slots[i].fd != 0;
+  for (int i = 0; i < MAX_SUBSCRIBERS; i++) {
+    subscribers += subscriber_slots[i].fd != 0;
+  }
+  cJSON_AddNumberToObject(ws_json, "clients", clients);
+  cJSON_AddNumberToObject(ws_json, "max_clients", MAX_CLIENTS);
+  cJSON_AddNumberToObject(ws_json, "subscribers", subscribers);
+  cJSON_AddNumberToObject(ws_json, "max_subscribers", MAX_SUBSCRIBERS);
+  cJSON_AddNumberToObject(ws_json, "pings", eviction_stats.pings);
+  cJSON *evicted_json = cJSON_AddObjectToObject(ws_json, "evicted");
+  cJSON_AddNumberToObject(evicted_json, "ping_timeout",
+                          eviction_stats.timeouts);
+  cJSON_AddNumberToObject(evicted_json, "send_failures",
+                          eviction_stats.send_failures);
+  cJSON_AddNumberToObject(evicted_json, "replaced", eviction_stats.replaced);
+  cJSON_AddNumberToObject(evicted_json, "stale", eviction_stats.stale);
+
+  cJSON *boot_json = cJSON_AddObjectToObject(root, "boot_ms");
+  for (int i = 0; i < BOOT_MILESTONE_COUNT; i++) {
+    int64_t us = boot_milestone_us(i);
+    cJSON_AddNumberToObject(boot_json, boot_milestone_name(i),
+                            us < 0 ? -1 : us / 1000.0);
+  }
+  cJSON_AddBoolToObject(boot_json, "wifi_fast_connect", wifi_fast_connect);
+
+  usb_stats_t usb_stats;
+  get_usb_stats(&usb_stats);
+  cJSON *usb_json = cJSON_AddObjectToObject(root, "usb");
+  cJSON_AddBoolToObject(usb_json, "connected", is_device_connected());
+  cJSON_AddNumberToObject(usb_json, "reconnects", usb_stats.reconnects);
+  cJSON_AddNumberToObject(usb_json, "open_retries", usb_stats.open_retries);
+  cJSON_AddNumberToObject(usb_json, "open_failures", usb_stats.open_failures);
+  cJSON_AddNumberToObject(usb_json, "replayed_commands",
+                          usb_stats.replayed_commands);
+  cJSON_AddNumberToObject(usb_json, "intents_expired",
+                          usb_stats.intents_expired);
+  cJSON *commands_json = cJSON_AddObjectToObject(usb_json, "commands");
+  cJSON_AddNumberToObject(commands_json, "queued", usb_stats.commands_queued);
+  cJSON_AddNumberToObject(commands_json, "deferred",
+                          usb_stats.commands_deferred);
+  cJSON_AddNumberToObject(commands_json, "rejected",
+                          usb_stats.commands_rejected);
+  cJSON_AddNumberToObject(commands_json, "busy", usb_stats.commands_busy);
+  cJSON_AddNumberToObject(commands_json, "throttled",
+                          usb_stats.commands_throttled);
+  cJSON_AddNumberToObject(commands_json, "priority",
+                          usb_stats.priority_commands);
+  cJSON_AddNumberToObject(
+      commands_json, "last_priority_latency_ms",
+      usb_stats.priority_commands ? usb_stats.last_priority_latency_us / 1000.0
+                                  : -1);
+  cJSON_AddNumberToObject(
+      commands_json, "max_priority_latency_ms",
+      usb_stats.priority_commands ? usb_stats.max_priority_latency_us / 1000.0
+                                  : -1);
+  cJSON *scenes_json = cJSON_AddObjectToObject(usb_json, "scene_recalls");
+  cJSON_AddNumberToObject(scenes_json, "confirmed", usb_stats.deltas_confirmed);
+  cJSON_AddNumberToObject(
+      scenes_json, "last_latency_ms",
+      usb_stats.deltas_confirmed ? usb_stats.last_delta_latency_us / 1000.0
+                                 : -1);
+  cJSON_AddNumberToObject(
+      scenes_json, "max_latency_ms",
+      usb_stats.deltas_confirmed ? usb_stats.max_delta_latency_us / 1000.0
+                                 : -1);
+  cJSON_AddNumberToObject(
+      usb_json, "last_resync_ms",
+      usb_stats.last_resync_us < 0 ? -1 : usb_stats.last_resync_us / 1000.0);
+  cJSON_AddNumberToObject(
+      usb_json, "max_resync_ms",
+      usb_stats.max_resync_us < 0 ? -1 : usb_stats.max_resync_us / 1000.0);
+  cJSON_AddNumberToObject(usb_json, "intended_fields_held",
+                          usb_stats.intended_fields_held);
+  cJSON *out_json = cJSON_AddObjectToObject(usb_json, "out_transfers");
+  cJSON_AddNumberToObject(out_json, "submitted", usb_stats.out_submitted);
+  cJSON_AddNumberToObject(out_json, "completed", usb_stats.out_completed);
+  cJSON_AddNumberToObject(out_json, "failed", usb_stats.out_failed);
+  cJSON_AddNumberToObject(out_json, "timeouts", usb_stats.out_timeouts);
+  cJSON_AddNumberToObject(out_json, "max_in_flight",
+                          usb_stats.max_out_in_flight);
+  cJSON_AddNumberToObject(out_json, "max_latency_ms",
+                          usb_stats.max_out_latency_us / 1000.0);
+  // Sustained rate while the link was busy.
+  cJSON_AddNumberToObject(
+      out_json, "per_second_busy",
+      usb_stats.out_busy_us > 0
+          ? usb_stats.out_completed * 1000000.0 / usb_stats.out_busy_us
+          : 0);
+  cJSON *refresh_json = cJSON_AddObjectToObject(usb_json, "state_refresh");
+  cJSON_AddNumberToObject(refresh_json, "count", usb_stats.refreshes);
+  cJSON_AddNumberToObject(refresh_json, "external_changes",
+                          usb_stats.refresh_changes);
+  cJSON_AddNumberToObject(refresh_json, "interval_ms",
+                          usb_stats.refresh_interval_ms);
+  cJSON_AddNumberToObject(refresh_json, "max_staleness_ms",
+                          usb_stats.max_refresh_staleness_us / 1000.0);
+  // Count per bucket, keyed by its upper bound.
+  static const uint32_t staleness_bounds_ms[] = REFRESH_STALENESS_BOUNDS_MS;
+  cJSON *staleness_json =
+      cJSON_AddObjectToObject(refresh_json, "staleness_ms");
+  for (int i = 0; i < REFRESH_STALENESS_BUCKETS; i++) {
+    char bound[12] = "inf";
+    if (i < REFRESH_STALENESS_BUCKETS - 1) {
+      snprintf(bound, sizeof(bound), "%lu",
+               (unsigned long)staleness_bounds_ms[i]);
+    }
+    cJSON_AddNumberToObject(staleness_json, bound,
+                            usb_stats.refresh_staleness[i]);
+  }
+
+  // Accepted and throttled commands per origin, sockets of closed
+  // WebSocket clients are dropped.
+  origin_stats_t origins[RATE_LIMIT_MAX_ORIGINS];
+  int origin_count = rate_limiter_stats(origins);
+  cJSON *origins_json = cJSON_AddArrayToObject(commands_json, "origins");
+  for (int i = 0; i < origin_count; i++) {
+    cJSON *origin_json = cJSON_CreateObject();
+    cJSON_AddStringToObject(origin_json, "type",
+                            command_origin_name(origins[i].origin.type));
+    if (origins[i].origin.type == ORIGIN_WEBSOCKET) {
+      cJSON_AddNumberToObject(origin_json, "socket", origins[i].origin.id);
+    }
+    cJSON_AddNumberToObject(origin_json, "accepted", origins[i].accepted);
+    cJSON_AddNumberToObject(origin_json, "throttled", origins[i].throttled);
+    cJSON_AddNumberToObject(origin_json, "queued", origins[i].queued);
+    cJSON_AddItemToArray(origins_json, origin_json);
+  }
+
+  state_subscriber_stats_t bus_stats[STATE_BUS_MAX_SUBSCRIBERS];
+  int bus_subscribers = state_bus_stats(bus_stats);
+  cJSON *bus_json = cJSON_AddObjectToObject(root, "state_bus");
+  for (int i = 0; i < bus_subscribers; i++) {
+    cJSON *subscriber_json =
+        cJSON_AddObjectToObject(bus_json, bus_stats[i].name);
+    cJSON_AddNumberToObject(subscriber_json, "events", bus_stats[i].events);
+    cJSON_AddNumberToObject(subscriber_json, "coalesced",
+                            bus_stats[i].coalesced);
+  }
+
+  cJSON *workers_json = cJSON_AddObjectToObject(root, "workers");
+  cJSON *ws_work_json = cJSON_AddObjectToObject(workers_json, "websocket");
+  cJSON_AddNumberToObject(ws_work_json, "messages", worker_stats.messages);
+  cJSON_AddNumberToObject(ws_work_json, "dropped", worker_stats.dropped);
+  cJSON_AddNumberToObject(ws_work_json, "subscriber_dropped",
+                          worker_stats.subscriber_dropped);
+  cJSON_AddNumberToObject(ws_work_json, "max_wait_ms",
+                          worker_stats.max_wait_us / 1000.0);
+  cJSON_AddNumberToObject(ws_work_json, "max_latency_ms",
+                          worker_stats.max_us / 1000.0);
+  cJSON *latency_json = cJSON_AddObjectToObject(ws_work_json, "latency_ms");
+  for (int i = 0; i < WS_LATENCY_BUCKETS; i++) {
+    char label[16];
+    if (i < WS_LATENCY_BUCKETS - 1) {
+      snprintf(label, sizeof(label), "<%d", ws_latency_bucket_ms[i]);
+    } else {
+      snprintf(label, sizeof(label), ">=%d", ws_latency_bucket_ms[i - 1]);
+    }
+    cJSON_AddNumberToObject(latency_json, label, worker_stats.buckets[i]);
+  }
+  cJSON *http_work_json = cJSON_AddObjectToObject(workers_json, "http");
+  cJSON_AddNumberToObject(http_work_json, "deferred",
+                          worker_stats.http_deferred);
+  cJSON_AddNumberToObject(http_work_json, "inline", worker_stats.http_inline);
+
+  // Wakeups per second are these over the uptime.
+  wakeup_stats_t wakeups[WAKEUP_TASK_COUNT];
+  wakeup_stats(wakeups);
+  cJSON *wakeups_json = cJSON_AddObjectToObject(root, "wakeups");
+  cJSON_AddNumberToObject(wakeups_json, "uptime_s",
+                          esp_timer_get_time() / 1000000);
+  for (int i = 0; i < WAKEUP_TASK_COUNT; i++) {
+    cJSON *wakeup_json =
+        cJSON_AddObjectToObject(wakeups_json, wakeup_task_name(i));
+    cJSON_AddNumberToObject(wakeup_json, "wakeups", wakeups[i].wakeups);
+    cJSON_AddNumberToObject(wakeup_json, "idle", wakeups[i].idle);
+  }
+
+  ui_files_stats_t ui_stats;
+  ui_files_stats(&ui_stats);
+  cJSON *ui_json = cJSON_AddObjectToObject(root, "ui_files");
+  cJSON_AddBoolToObject(ui_json, "mounted", ui_stats.mounted);
+  cJSON_AddNumberToObject(ui_json, "total_bytes", ui_stats.total_bytes);
+  cJSON_AddNumberToObject(ui_json, "used_bytes", ui_stats.used_bytes);
+  cJSON_AddNumberToObject(ui_json, "from_flash", ui_stats.from_flash);
+  cJSON_AddNumberToObject(ui_json, "gzipped", ui_stats.gzipped);
+  cJSON_AddNumberToObject(ui_json, "uploads", ui_stats.uploads);
+
+  cJSON *snapshot_json = cJSON_AddObjectToObject(root, "snapshot");
+  cJSON_AddNumberToObject(snapshot_json, "hits", snapshot_hits);
+  cJSON_AddNumberToObject(snapshot_json, "misses", snapshot_misses);
+
+  cJSON *memory_json = cJSON_AddObjectToObject(root, "memory");
+  size_t free_heap = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  size_t largest_block = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  cJSON_AddNumberToObject(memory_json, "free_heap", free_heap);
+  cJSON_AddNumberToObject(memory_json, "min_free_heap",
+                          heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT));
+  cJSON_AddNumberToObject(memory_json, "largest_free_block", largest_block);
+  // 0 if all free memory is one block.
+  cJSON_AddNumberToObject(
+      memory_json, "fragmentation",
+      free_heap ? 1.0 - (double)largest_block / free_heap : 0);
+  cJSON_AddNumberToObject(memory_json, "frame_pool_misses",
+                          atomic_load(&frame_pool_misses));
+  task_budget_t tasks[MEMORY_BUDGET_MAX_TASKS];
+  int task_count = memory_budget_tasks(tasks);
+  cJSON *tasks_json = cJSON_AddArrayToObject(memory_json, "tasks");
+  for (int i = 0; i < task_count; i++) {
+    cJSON *task_json = cJSON_CreateObject();
+    cJSON_AddStringToObject(task_json, "name", tasks[i].name);
+    cJSON_AddNumberToObject(task_json, "stack_size", tasks[i].stack_size);
+    cJSON_AddNumberToObject(task_json, "stack_peak", tasks[i].stack_peak);
+    cJSON_AddBoolToObject(task_json, "finished", tasks[i].finished);
+    cJSON_AddItemToArray(tasks_json, task_json);
+  }
+  const json_arena_t *json_arenas[] = {&state_arena, &command_arena};
+  for (int i = 0; i < 2; i++) {
+    cJSON *arena_json =
+        cJSON_AddObjectToObject(memory_json, json_arenas[i]->name);
+    cJSON_AddNumberToObject(arena_json, "size", json_arenas[i]->size);
+    cJSON_AddNumberToObject(arena_json, "peak", json_arenas[i]->peak);
+    cJSON_AddNumberToObject(arena_json, "overflows",
+                            json_arenas[i]->overflows);
+  }
+
+  cJSON *broadcast_json = cJSON_AddArrayToObject(root, "broadcast");
+  for (int i = 0; i < BROADCAST_BUCKETS; i++) {
+    const broadcast_stats_t *stats = &broadcast_stats[i];
+    cJSON *bucket_json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(bucket_json, "max_receivers",
+                            broadcast_bucket_limits[i] == INT_MAX
+                                ? -1
+                                : broadcast_bucket_limits[i]);
+    cJSON_AddNumberToObject(bucket_json, "frames", stats->frames);
+    cJSON_AddNumberToObject(bucket_json, "sends", stats->sends);
+    cJSON_AddNumberToObject(bucket_json, "send_errors", stats->send_errors);
+    cJSON_AddNumberToObject(
+        bucket_json, "avg_latency_us",
+        stats->frames ? (double)stats->total_us / stats->frames : 0);
+    cJSON_AddNumberToObject(bucket_json, "max_latency_us", stats->max_us);
+    cJSON_AddNumberToObject(bucket_json, "p95_latency_us",
+                            broadcast_percentile_us(stats, 95));
+    cJSON_AddNumberToObject(bucket_json, "p99_latency_us",
+                            broadcast_percentile_us(stats, 99));
+    cJSON *histogram_json = cJSON_AddObjectToObject(bucket_json, "latency_us");
+    for (int j = 0; j < BROADCAST_LATENCY_BUCKETS; j++) {
+      char label[16];
+      if (j < BROADCAST_LATENCY_BUCKETS - 1) {
+        snprintf(label, sizeof(label), "<%d", broadcast_latency_bounds_us[j]);
+      } else {
+        snprintf(label, sizeof(label), ">=%d",
+                 broadcast_latency_bounds_us[j - 1]);
+      }
+      cJSON_AddNumberToObject(histogram_json, label,
+                              stats->latency_buckets[j]);
+    }
+    cJSON_AddItemToArray(broadcast_json, bucket_json);
+  }
+
+  char *json_string = cJSON_PrintUnformatted(root);
+  cJSON_Delete(root);
+  httpd_resp_set_type(req, "application/json");
+  esp_err_t ret = httpd_resp_sendstr(req, json_string);
+  cJSON_free(json_string);
+  return ret;
+}
+
+static void remove_client(ws_slot_t *slots, int max_clients, int sockfd) {
+  for (int i = 0; i < max_clients; i++) {
+    if (slots[i].fd == sockfd) {
+      slots[i].fd = 0;  // Remove client from list
+      return;
+    }
+  }
 }
 
 static void client_disconnect_handler(void *arg, int sockfd) {
   ESP_LOGI(TAG_WEB, "Client #%d disconnected", sockfd);
   close(sockfd);
-  for (int i = 0; i < MAX_CLIENTS; i++) {
-    if (client_fds[i] == sockfd) {
-      client_fds[i] = 0;  // Remove client from list
-      break;
-    }
-  }
+  remove_client(client_slots, MAX_CLIENTS, sockfd);
+  remove_client(subscriber_slots, MAX_SUBSCRIBERS, sockfd);
+  const command_origin_t origin = {.type = ORIGIN_WEBSOCKET, .id = sockfd};
+  rate_limiter_forget(origin);
+}
+
+// Runs on the httpd task, its stack is allocated by the server.
+static void track_httpd_task(void *arg) {
+  memory_budget_add_task(xTaskGetCurrentTaskHandle(), (uint32_t)(size_t)arg);
 }
 
 static httpd_handle_t start_webserver(void) {
   httpd_handle_t server_handle = NULL;
   httpd_config_t config = HTTPD_DEFAULT_CONFIG();
-  config.max_open_sockets = MAX_CLIENTS;
+  config.max_open_sockets = MAX_OPEN_SOCKETS;
+  config.max_uri_handlers = 14;
   config.uri_match_fn = httpd_uri_match_wildcard;
   config.close_fn = client_disconnect_handler;
   config.lru_purge_enable = true;
@@ -399,12 +1963,42 @@ static httpd_handle_t start_webserver(void) {
   config.linger_timeout = 1;
 
   if (httpd_start(&server_handle, &config) == ESP_OK) {
+    httpd_queue_work(server_handle, track_httpd_task,
+                     (void *)config.stack_size);
     // web socket
     httpd_uri_t ws_uri = {.uri = "/ws",
                           .method = HTTP_GET,
                           .handler = websocket_handler,
-                          .is_websocket = true};
+                          .is_websocket = true,
+                          .handle_ws_control_frames = true};
     httpd_register_uri_handler(server_handle, &ws_uri);
+    httpd_uri_t ws_subscribe_uri = {.uri = "/ws/subscribe",
+                                    .method = HTTP_GET,
+                                    .handler = websocket_handler,
+                                    .user_ctx = (void *)true,
+                                    .is_websocket = true,
+                                    .handle_ws_control_frames = true};
+    httpd_register_uri_handler(server_handle, &ws_subscribe_uri);
+
+    httpd_uri_t metrics_uri = {.uri = "/metrics",
+                               .method = HTTP_GET,
+                               .handler = metrics_get_handler};
+    httpd_register_uri_handler(server_handle, &metrics_uri);
+    httpd_uri_t scenes_uri = {
+        .uri = "/scenes", .method = HTTP_GET, .handler = scenes_get_handler};
+    httpd_register_uri_handler(server_handle, &scenes_uri);
+    httpd_uri_t scene_recall_uri = {.uri = "/scenes/recall",
+                                    .method = HTTP_POST,
+                                    .handler = scene_recall_post_handler};
+    httpd_register_uri_handler(server_handle, &scene_recall_uri);
+    httpd_uri_t journal_uri = {
+        .uri = "/journal", .method = HTTP_GET, .handler = journal_get_handler};
+    httpd_register_uri_handler(server_handle, &journal_uri);
+#ifdef WS_TRAFFIC_RECORDER
+    httpd_uri_t trace_uri = {
+        .uri = "/ws/trace", .method = HTTP_GET, .handler = trace_get_handler};
+    httpd_register_uri_handler(server_handle, &trace_uri);
+#endif  // WS_TRAFFIC_RECORDER
 
     httpd_uri_t favicon_uri = {.uri = "/favicon.ico",
                                .method = HTTP_GET,
@@ -412,6 +2006,15 @@ static httpd_handle_t start_webserver(void) {
                                .user_ctx = NULL};
     httpd_register_uri_handler(server_handle, &favicon_uri);
 
+    httpd_uri_t ui_file_put_uri = {.uri = UI_FILES_BASE_PATH "/*",
+                                   .method = HTTP_PUT,
+                                   .handler = ui_file_put_handler};
+    httpd_register_uri_handler(server_handle, &ui_file_put_uri);
+    httpd_uri_t ui_file_delete_uri = {.uri = UI_FILES_BASE_PATH "/*",
+                                      .method = HTTP_DELETE,
+                                      .handler = ui_file_delete_handler};
+    httpd_register_uri_handler(server_handle, &ui_file_delete_uri);
+
     // root
     httpd_uri_t css_root = {.uri = "/index.css",
                             .method = HTTP_GET,
@@ -427,16 +2030,69 @@ static httpd_handle_t start_webserver(void) {
   return server_handle;
 }
 
+static bool load_wifi_ap_cache(wifi_ap_cache_t *ap) {
+  nvs_handle_t nvs;
+  if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) return false;
+  size_t len = sizeof(wifi_ap_cache_t);
+  esp_err_t err = nvs_get_blob(nvs, WIFI_NVS_KEY_LAST_AP, ap, &len);
+  nvs_close(nvs);
+  return err == ESP_OK && len == sizeof(wifi_ap_cache_t) && ap->channel != 0;
+}
+
+static void store_wifi_ap_cache(const wifi_ap_cache_t *ap) {
+  nvs_handle_t nvs;
+  if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) return;
+  if (ap != NULL) {
+    nvs_set_blob(nvs, WIFI_NVS_KEY_LAST_AP, ap, sizeof(wifi_ap_cache_t));
+  } else {
+    nvs_erase_key(nvs, WIFI_NVS_KEY_LAST_AP);
+  }
+  nvs_commit(nvs);
+  nvs_close(nvs);
+}
+
+static void set_wifi_config(const wifi_ap_cache_t *ap) {
+  wifi_config_t wifi_config = {};
+  strcpy((char *)wifi_config.sta.ssid, WIFI_SSID);
+  strcpy((char *)wifi_config.sta.password, WIFI_PASS);
+  if (ap != NULL) {
+    wifi_config.sta.bssid_set = true;
+    memcpy(wifi_config.sta.bssid, ap->bssid, sizeof(ap->bssid));
+    wifi_config.sta.channel = ap->channel;
+  }
+  ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
+}
+
 static void wifi_event_handler(void *arg, esp_event_base_t event_base,
                                int32_t event_id, void *event_data) {
-  if (event_id == WIFI_EVENT_STA_START)
+  if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
+    boot_mark(BOOT_WIFI_STARTED);
     esp_wifi_connect();
-  else if (event_id == WIFI_EVENT_STA_DISCONNECTED) {
+  } else if (event_base == WIFI_EVENT &&
+             event_id == WIFI_EVENT_STA_CONNECTED) {
+    boot_mark(BOOT_WIFI_CONNECTED);
+    wifi_event_sta_connected_t *e = (wifi_event_sta_connected_t *)event_data;
+    if (e->channel != wifi_ap_cache.channel ||
+        memcmp(e->bssid, wifi_ap_cache.bssid, sizeof(e->bssid)) != 0) {
+      memcpy(wifi_ap_cache.bssid, e->bssid, sizeof(e->bssid));
+      wifi_ap_cache.channel = e->channel;
+      store_wifi_ap_cache(&wifi_ap_cache);
+    }
+  } else if (event_base == WIFI_EVENT &&
+             event_id == WIFI_EVENT_STA_DISCONNECTED) {
+    if (wifi_fast_connect && boot_milestone_us(BOOT_WIFI_CONNECTED) < 0) {
+      // Cached AP is gone, fall back to a full scan.
+      ESP_LOGW(TAG_WEB, "Fast connect failed, scanning.");
+      wifi_fast_connect = false;
+      memset(&wifi_ap_cache, 0, sizeof(wifi_ap_cache_t));
+      store_wifi_ap_cache(NULL);
+      set_wifi_config(NULL);
+    }
     esp_wifi_connect();
-  } else if (event_id == IP_EVENT_STA_GOT_IP) {
+  } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
     ip_event_got_ip_t *e = (ip_event_got_ip_t *)event_data;
     ESP_LOGI(TAG_WEB, "got ip:" IPSTR, IP2STR(&e->ip_info.ip));
-    if (server == NULL) server = start_webserver();
+    boot_mark(BOOT_GOT_IP);
   }
 }
 
@@ -455,11 +2111,35 @@ void start_mdns_service() {
   ESP_LOGI(TAG_WEB, "MDNS started, address: %s.local", MDNS_HOST_NAME);
 }
 
+static void start_workers(void) {
+  http_work_queue =
+      xQueueCreateStatic(HTTP_WORK_QUEUE_LENGTH, sizeof(http_work_t),
+                         http_work_queue_storage, &http_work_queue_buffer);
+  ws_worker =
+      xTaskCreateStatic(ws_worker_task, "ws_worker", WS_WORKER_STACK_SIZE,
+                        NULL, WEB_WORKER_PRIORITY, ws_worker_stack,
+                        &ws_worker_buffer);
+  memory_budget_add_task(ws_worker, WS_WORKER_STACK_SIZE);
+  for (int i = 0; i < HTTP_WORKER_COUNT; i++) {
+    http_workers[i] = xTaskCreateStatic(
+        http_worker_task, "http_worker", HTTP_WORKER_STACK_SIZE, NULL,
+        WEB_WORKER_PRIORITY, http_worker_stacks[i], &http_worker_buffers[i]);
+    memory_budget_add_task(http_workers[i], HTTP_WORKER_STACK_SIZE);
+  }
+}
+
 void web_server_task(void *arg) {
+  // Added here, the task may end before its creator gets to it.
+  memory_budget_add_task(xTaskGetCurrentTaskHandle(),
+                         WEB_SERVER_TASK_STACK_SIZE);
   ab_test_mutex = xSemaphoreCreateMutexStatic(&ab_test_mutex_buffer);
+  snapshot_mutex = xSemaphoreCreateMutexStatic(&snapshot_mutex_buffer);
+  journal_mutex = xSemaphoreCreateMutexStatic(&journal_mutex_buffer);
+  json_arena_init(&state_arena);
+  json_arena_init(&command_arena);
+  abx_init();
   memset(&ab_test_state, 0, sizeof(ab_test_state_t));
 
-  ESP_ERROR_CHECK(nvs_flash_init());
   ESP_ERROR_CHECK(esp_netif_init());
   ESP_ERROR_CHECK(esp_event_loop_create_default());
   esp_netif_create_default_wifi_sta();
@@ -469,12 +2149,26 @@ void web_server_task(void *arg) {
                                              &wifi_event_handler, NULL));
   ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP,
                                              &wifi_event_handler, NULL));
-  wifi_config_t wifi_config = {};
-  strcpy((char *)wifi_config.sta.ssid, WIFI_SSID);
-  strcpy((char *)wifi_config.sta.password, WIFI_PASS);
   ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-  ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
+  wifi_fast_connect = load_wifi_ap_cache(&wifi_ap_cache);
+  ESP_LOGI(TAG_WEB, "Connecting to WiFi%s",
+           wifi_fast_connect ? " using cached AP" : "");
+  set_wifi_config(wifi_fast_connect ? &wifi_ap_cache : NULL);
   ESP_ERROR_CHECK(esp_wifi_start());
+
+  ui_files_mount();
+  start_workers();
+  // The server listens on any address, no need to wait for the IP.
+  server = start_webserver();
+  if (server != NULL) {
+    boot_mark(BOOT_HTTP_SERVER_STARTED);
+    const esp_timer_create_args_t ping_timer_args = {
+        .callback = ping_timer_cb, .name = "ws_ping"};
+    ESP_ERROR_CHECK(esp_timer_create(&ping_timer_args, &ping_timer));
+    ESP_ERROR_CHECK(
+        esp_timer_start_periodic(ping_timer, WS_PING_INTERVAL_MS * 1000));
+  }
   start_mdns_service();
+  memory_budget_task_done();
   vTaskDelete(NULL);
 }
\ No newline at end of file
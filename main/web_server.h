@@ -1,10 +1,18 @@
 #ifndef WEB_SERVER_H
 #define WEB_SERVER_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "usb_driver.h"
 
+// In bytes, the task ends once the server is running.
+#define WEB_SERVER_TASK_STACK_SIZE 4096
 
 void web_server_task(void *arg);
 void notify_state_changed(const state_t *state);
+// Broadcasts a state change published on the state bus. False if it was
+// held back for the ABX test.
+bool notify_state_event(const state_t *state, uint16_t changed);
 
 #endif  // WEB_SERVER_H
\ No newline at end of file
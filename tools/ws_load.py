@@ -0,0 +1,313 @@
+#!/usr/bin/env python3
+"""Measures state broadcasts to 4, 16 and 32 read-only subscribers.
+
+Connects the subscribers to /ws/subscribe and sends volume commands from one
+control client on /ws, one round per subscriber count:
+
+    pip install websockets
+    tools/ws_load.py --host amp.local --subscribers 4 16 32
+
+The commands alternate between the amp's volume and 1 dB less, the volume is
+restored after each round. A command counts as received by a subscriber once
+it got a state which acknowledges the command or a later one. Reported per
+round, with the broadcast latency /metrics measured on the firmware:
+
+  latency  send until the first subscriber received the command's state
+  spread   first until the last subscriber received it
+
+A round fails if the p95 latency or spread is over --max-latency-ms or
+--max-spread-ms, a command wasn't acknowledged, a subscriber missed the last
+state or disconnected, not all subscribers were accepted as such, or sends of
+broadcasts failed or evicted clients during the round.
+
+It needs the amp's ESP32, the host tests have no HTTP server to run it
+against. Without a device, tools/ws_replay.py --host-replay replays commands
+through the driver, but there are no broadcasts to measure.
+
+--upload measures the upload throughput of a UI file before the rounds, e.g.
+main/index.js. It is PUT to /ui/ and deleted again, so the embedded copy is
+served afterwards. Compare it across lwIP window settings in sdkconfig.
+"""
+
+import argparse
+import asyncio
+import json
+import os
+import random
+import sys
+import time
+import urllib.request
+
+import websockets
+
+from ws_replay import percentile
+
+
+class Subscriber:
+    def __init__(self, client_id):
+        self.client_id = client_id
+        # [(time received, seq)] whenever the acknowledged seq of the control
+        # client grew.
+        self.receipts = []
+        self.got_state = asyncio.Event()
+
+    def received(self, seq):
+        """Time this subscriber got seq or a later one, None if never."""
+        for t, acked in self.receipts:
+            if acked >= seq:
+                return t
+        return None
+
+    async def run(self, ws, stop):
+        await ws.send(json.dumps({"action": "get_state", "value": 0}))
+        while not stop.is_set():
+            try:
+                text = await asyncio.wait_for(ws.recv(), 0.5)
+            except asyncio.TimeoutError:
+                continue
+            now = time.monotonic()
+            try:
+                message = json.loads(text)
+            except ValueError:
+                continue
+            if "amp_state" not in message:
+                continue
+            self.got_state.set()
+            ack = message["amp_state"].get("acks", {}).get("set_volume")
+            if ack is None or ack[0] != self.client_id:
+                continue
+            if not self.receipts or ack[1] > self.receipts[-1][1]:
+                self.receipts.append((now, ack[1]))
+
+
+def fetch_metrics(host):
+    with urllib.request.urlopen(f"http://{host}/metrics", timeout=5) as r:
+        return json.load(r)
+
+
+def bucket_of(metrics, receivers):
+    """The broadcast bucket /metrics counts broadcasts to receivers in."""
+    for bucket in metrics["broadcast"]:
+        if bucket["max_receivers"] < 0 or receivers <= bucket["max_receivers"]:
+            return bucket
+    return metrics["broadcast"][-1]
+
+
+def round_percentile_us(b0, b1, p):
+    """The firmware's broadcast latency percentile between two /metrics.
+
+    The upper bound of its histogram bucket, at most the maximum since boot.
+    """
+    counts = [(label, n - b0["latency_us"].get(label, 0))
+              for label, n in b1["latency_us"].items()]
+    rank = -(-sum(n for _, n in counts) * p // 100)
+    seen = 0
+    for label, n in counts:
+        seen += n
+        if seen >= rank and label.startswith("<"):
+            return min(int(label[1:]), b1["max_latency_us"])
+    return b1["max_latency_us"]
+
+
+def upload(host, path):
+    """Returns the KiB/s of a PUT of the file to /ui/, then deletes it."""
+    with open(path, "rb") as f:
+        data = f.read()
+    url = f"http://{host}/ui/{os.path.basename(path)}"
+    request = urllib.request.Request(url, data=data, method="PUT")
+    start = time.monotonic()
+    with urllib.request.urlopen(request, timeout=60) as r:
+        r.read()
+    elapsed = time.monotonic() - start
+    request = urllib.request.Request(url, method="DELETE")
+    with urllib.request.urlopen(request, timeout=5) as r:
+        r.read()
+    return len(data) / 1024 / elapsed
+
+
+def errors_of(metrics):
+    return (sum(b["send_errors"] for b in metrics["broadcast"])
+            + sum(metrics["websocket"]["evicted"].values()))
+
+
+class Control:
+    """The control client, sends the commands and counts their results."""
+
+    def __init__(self, client_id):
+        self.client_id = client_id
+        self.volume = None
+        self.results = {}
+        self.got_state = asyncio.Event()
+
+    async def receive(self, ws):
+        async for text in ws:
+            try:
+                message = json.loads(text)
+            except ValueError:
+                continue
+            amp_state = message.get("amp_state")
+            if amp_state is not None and self.volume is None:
+                self.volume = round(amp_state["volume_db"])
+                self.got_state.set()
+            result = message.get("command_result")
+            if result is not None:
+                name = result.get("result", "unknown")
+                self.results[name] = self.results.get(name, 0) + 1
+
+    async def send(self, ws, args):
+        """Returns the send time of each seq."""
+        await ws.send(json.dumps({"action": "get_state", "value": 0}))
+        await asyncio.wait_for(self.got_state.wait(), args.timeout)
+        # Even seqs set the amp's volume, the round ends where it started.
+        values = (self.volume, max(self.volume - 1, -99))
+        sent = {}
+        for seq in range(1, args.commands + 1):
+            sent[seq] = time.monotonic()
+            await ws.send(json.dumps({"action": "set_volume",
+                                      "value": values[seq % 2],
+                                      "client": self.client_id, "seq": seq}))
+            await asyncio.sleep(args.interval)
+        return sent
+
+
+async def run_round(args, count):
+    """Returns the reasons the round failed."""
+    failures = []
+    client_id = random.randint(1, 0xFFFFFFFE)
+    before = await asyncio.to_thread(fetch_metrics, args.host)
+    subscribers = [Subscriber(client_id) for _ in range(count)]
+    stop = asyncio.Event()
+    sockets = [await websockets.connect(f"ws://{args.host}/ws/subscribe")
+               for _ in subscribers]
+    tasks = [asyncio.create_task(s.run(ws, stop))
+             for s, ws in zip(subscribers, sockets)]
+    await asyncio.wait_for(
+        asyncio.gather(*(s.got_state.wait() for s in subscribers)),
+        args.timeout)
+
+    control = Control(client_id)
+    async with websockets.connect(f"ws://{args.host}/ws") as ws:
+        receiver = asyncio.create_task(control.receive(ws))
+        sent = await control.send(ws, args)
+        # Give the last state time to reach every subscriber.
+        deadline = time.monotonic() + args.timeout
+        while (time.monotonic() < deadline and
+               any(s.received(args.commands) is None for s in subscribers)):
+            await asyncio.sleep(0.05)
+        # Taken before anyone disconnects, closing isn't an error.
+        after = await asyncio.to_thread(fetch_metrics, args.host)
+        if args.commands % 2:
+            await ws.send(json.dumps({"action": "set_volume",
+                                      "value": control.volume}))
+        receiver.cancel()
+    stop.set()
+    disconnects = [r for r in await asyncio.gather(*tasks,
+                                                   return_exceptions=True)
+                   if isinstance(r, Exception)]
+    for ws in sockets:
+        await ws.close()
+
+    latencies = []
+    spreads = []
+    unacked = 0
+    for seq, t in sent.items():
+        times = [s.received(seq) for s in subscribers]
+        times = [r for r in times if r is not None]
+        if not times:
+            unacked += 1
+            continue
+        latencies.append(min(times) - t)
+        spreads.append(max(times) - min(times))
+    missed = sum(s.received(args.commands) is None for s in subscribers)
+
+    answered = ", ".join(f"{name} {n}"
+                         for name, n in sorted(control.results.items()))
+    print(f"{count} subscribers: {len(sent)} commands, {unacked} not "
+          f"acknowledged" + (f", answered {answered}" if answered else ""))
+    for name, values in (("latency", latencies), ("spread", spreads)):
+        if values:
+            print(f"  {name} ms: p50 {percentile(values, 50) * 1000:.1f}, "
+                  f"p95 {percentile(values, 95) * 1000:.1f}, "
+                  f"max {max(values) * 1000:.1f}")
+    b0 = bucket_of(before, count + 1)
+    b1 = bucket_of(after, count + 1)
+    frames = b1["frames"] - b0["frames"]
+    if frames:
+        total_us = (b1["avg_latency_us"] * b1["frames"]
+                    - b0["avg_latency_us"] * b0["frames"])
+        limit = b1["max_receivers"]
+        receivers = f"up to {limit}" if limit >= 0 else "over 32"
+        p95 = round_percentile_us(b0, b1, 95)
+        p99 = round_percentile_us(b0, b1, 99)
+        print(f"  firmware, {receivers} receivers: {frames} broadcasts, "
+              f"avg {total_us / frames / 1000:.1f} ms, "
+              f"p95 {p95 / 1000:.1f}, p99 {p99 / 1000:.1f}, "
+              f"max since boot {b1['max_latency_us'] / 1000:.1f} ms")
+
+    if unacked:
+        failures.append(f"{unacked} commands not acknowledged")
+    if latencies and percentile(latencies, 95) * 1000 > args.max_latency_ms:
+        failures.append(f"p95 latency over {args.max_latency_ms} ms")
+    if spreads and percentile(spreads, 95) * 1000 > args.max_spread_ms:
+        failures.append(f"p95 spread over {args.max_spread_ms} ms")
+    if missed:
+        failures.append(f"{missed} subscribers missed the last state")
+    if disconnects:
+        failures.append(f"{len(disconnects)} subscribers disconnected")
+    if after["websocket"]["subscribers"] < count:
+        failures.append(f"only {after['websocket']['subscribers']} "
+                        f"subscribers accepted")
+    errors = errors_of(after) - errors_of(before)
+    if errors:
+        failures.append(f"{errors} broadcast send errors or evictions")
+    return failures
+
+
+async def load(args):
+    failed = False
+    if args.upload:
+        try:
+            rate = await asyncio.to_thread(upload, args.host, args.upload)
+            print(f"upload of {args.upload}: {rate:.0f} KiB/s")
+            if rate < args.min_upload_kib_s:
+                print(f"  FAIL upload below {args.min_upload_kib_s} KiB/s")
+                failed = True
+        except Exception as error:
+            print(f"  FAIL upload failed: {error!r}")
+            failed = True
+    for count in args.subscribers:
+        try:
+            failures = await run_round(args, count)
+        except Exception as error:
+            failures = [f"round failed: {error!r}"]
+        for failure in failures:
+            print(f"  FAIL {failure}")
+        failed = failed or bool(failures)
+    print("FAILED" if failed else "PASS")
+    return 1 if failed else 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--host", default="amp.local")
+    parser.add_argument("--subscribers", type=int, nargs="+",
+                        default=[4, 16, 32],
+                        help="subscribers per round, the firmware accepts 32")
+    parser.add_argument("--commands", type=int, default=100,
+                        help="volume commands per round")
+    parser.add_argument("--interval", type=float, default=0.1,
+                        help="seconds between commands, 20/s are allowed")
+    parser.add_argument("--timeout", type=float, default=5)
+    parser.add_argument("--max-latency-ms", type=float, default=250)
+    parser.add_argument("--max-spread-ms", type=float, default=100)
+    parser.add_argument("--upload", metavar="FILE",
+                        help="UI file to time an upload with first")
+    parser.add_argument("--min-upload-kib-s", type=float, default=0)
+    args = parser.parse_args()
+    if args.interval < 0.05:
+        parser.error("--interval below 0.05 s is throttled")
+    return asyncio.run(load(args))
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,315 @@
+#!/usr/bin/env python3
+"""Replays WebSocket traffic recorded by the firmware against an amp.
+
+Enable WS_TRAFFIC_RECORDER in main/web_server.c, reproduce the problem in the
+UI and download the trace:
+
+    curl http://amp.local/ws/trace > trace.ndjson
+
+Then replay it, here 10 times faster with 4 copies of the recorded clients:
+
+    pip install websockets
+    tools/ws_replay.py trace.ndjson --host amp.local --speed 10 --clients 4
+
+Without an amp, --host-replay feeds the set_* commands of the trace to the
+driver's enqueue path instead, with the simulated amp of host_test behind it:
+
+    cmake -S host_test -B build/host_test
+    cmake --build build/host_test --target trace_replay
+    tools/ws_replay.py trace.ndjson --host-replay build/host_test/trace_replay
+
+There is no WebSocket server in between, other messages are skipped and
+there is no broadcast lag.
+
+Every recorded client is replayed on its own connection, the firmware accepts
+7 at once. set_* commands get a fresh client id and sequence number, like the
+UI sends them, and count as confirmed once a state broadcast acknowledges
+them. Reported are:
+
+  latency    send until the acknowledging broadcast arrived
+  dropped    answered with busy, throttled or rejected
+  superseded another client's command for the same action came later
+  lost       no answer within --timeout
+  lag        per broadcast, how much later a client got it than the first
+"""
+
+import argparse
+import asyncio
+import json
+import random
+import subprocess
+import sys
+import time
+
+try:
+    import websockets
+except ImportError:
+    # Only needed to replay against an amp.
+    websockets = None
+
+
+class Stats:
+    def __init__(self):
+        self.sent = 0
+        self.latencies = []
+        self.dropped = {}
+        self.superseded = 0
+        self.lost = 0
+        self.lags = []
+        # State version -> time the first client received it.
+        self.first_seen = {}
+
+
+class Client:
+    def __init__(self, stats, entries, start, t0, speed, timeout):
+        self.stats = stats
+        self.entries = entries
+        self.start = start
+        self.t0 = t0
+        self.speed = speed
+        self.timeout = timeout
+        self.client_id = random.randint(1, 0xFFFFFFFE)
+        self.seq = 0
+        # Action -> [(seq, sent at, ack when sent)], oldest first.
+        self.pending = {}
+        # Action -> latest [client, seq] acknowledged by the amp.
+        self.acks = {}
+        self.got_state = asyncio.Event()
+
+    def track(self, action, seq, now):
+        """Waits for the acknowledgement of a sent set_* command."""
+        self.pending.setdefault(action, []).append(
+            (seq, now, self.acks.get(action)))
+
+    def on_state(self, amp_state, now):
+        version = amp_state.get("version")
+        first = self.stats.first_seen.setdefault(version, now)
+        if first != now:
+            self.stats.lags.append(now - first)
+        for action, ack in amp_state.get("acks", {}).items():
+            self.acks[action] = ack
+            client, seq = ack
+            waiting = self.pending.get(action, [])
+            if client == self.client_id:
+                while waiting and waiting[0][0] <= seq:
+                    self.stats.latencies.append(now - waiting.pop(0)[1])
+                continue
+            # Another client's command came after the waiting ones.
+            while waiting and waiting[0][2] != ack:
+                waiting.pop(0)
+                self.stats.superseded += 1
+
+    def on_result(self, result):
+        waiting = self.pending.get(result.get("action"), [])
+        if waiting:
+            waiting.pop()
+        name = result.get("result", "unknown")
+        self.stats.dropped[name] = self.stats.dropped.get(name, 0) + 1
+
+    async def receive(self, ws):
+        async for text in ws:
+            now = time.monotonic()
+            try:
+                message = json.loads(text)
+            except ValueError:
+                continue
+            if "amp_state" in message:
+                self.on_state(message["amp_state"], now)
+                self.got_state.set()
+            if "command_result" in message:
+                self.on_result(message["command_result"])
+
+    def expire(self, now):
+        for waiting in self.pending.values():
+            while waiting and now - waiting[0][1] > self.timeout:
+                waiting.pop(0)
+                self.stats.lost += 1
+
+    async def run(self, url):
+        async with websockets.connect(url) as ws:
+            receiver = asyncio.create_task(self.receive(ws))
+            await ws.send(json.dumps({"action": "get_state", "value": 0}))
+            await asyncio.wait_for(self.got_state.wait(), self.timeout)
+            for t_ms, message in self.entries:
+                due = self.start + (t_ms - self.t0) / 1000 / self.speed
+                await asyncio.sleep(max(0, due - time.monotonic()))
+                action = message.get("action", "")
+                if action.startswith("set_"):
+                    self.seq += 1
+                    message = dict(message, client=self.client_id,
+                                   seq=self.seq)
+                    self.track(action, self.seq, time.monotonic())
+                await ws.send(json.dumps(message))
+                self.stats.sent += 1
+                self.expire(time.monotonic())
+            # Give the last commands time to be acknowledged.
+            deadline = time.monotonic() + self.timeout
+            while any(self.pending.values()) and time.monotonic() < deadline:
+                await asyncio.sleep(0.05)
+            self.expire(float("inf"))
+            receiver.cancel()
+
+
+def load_trace(path):
+    """Returns the messages per recorded client and the first timestamp."""
+    clients = {}
+    skipped = 0
+    with open(path) as f:
+        for line in f:
+            if not line.strip():
+                continue
+            entry = json.loads(line)
+            try:
+                message = json.loads(entry["message"])
+            except ValueError:
+                message = None
+            if entry.get("truncated") or not isinstance(message, dict):
+                skipped += 1
+                continue
+            clients.setdefault(entry["client"], []).append(
+                (entry["t_ms"], message))
+    if skipped:
+        print(f"skipped {skipped} truncated or invalid messages")
+    t0 = min(entries[0][0] for entries in clients.values())
+    return clients, t0
+
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+
+def report(stats, elapsed):
+    print(f"sent {stats.sent} messages in {elapsed:.1f} s")
+    confirmed = len(stats.latencies)
+    print(f"confirmed {confirmed}, superseded {stats.superseded}, "
+          f"lost {stats.lost}")
+    dropped = ", ".join(f"{name} {count}"
+                        for name, count in sorted(stats.dropped.items()))
+    print(f"dropped {sum(stats.dropped.values())}"
+          + (f" ({dropped})" if dropped else ""))
+    for name, values in (("latency", stats.latencies),
+                         ("broadcast lag", stats.lags)):
+        if not values:
+            continue
+        print(f"{name} ms: p50 {percentile(values, 50) * 1000:.1f}, "
+              f"p95 {percentile(values, 95) * 1000:.1f}, "
+              f"p99 {percentile(values, 99) * 1000:.1f}, "
+              f"max {max(values) * 1000:.1f}")
+
+
+def amp_value(value):
+    """The value as the WebSocket handler passes it to the driver."""
+    if isinstance(value, bool):
+        return int(value)
+    return int(value) if isinstance(value, (int, float)) else 0
+
+
+def host_replay(args):
+    """Replays the trace through host_test's trace_replay, see there."""
+    clients, t0 = load_trace(args.trace)
+    stats = Stats()
+    replays = [Client(stats, entries, 0, t0, args.speed, args.timeout)
+               for _ in range(args.clients) for entries in clients.values()]
+    # (due ms, origin id, client, seq, action, value) in the order sent.
+    commands = []
+    skipped = 0
+    for origin_id, client in enumerate(replays, 1):
+        for t_ms, message in client.entries:
+            action = message.get("action", "")
+            if not action.startswith("set_"):
+                skipped += 1
+                continue
+            client.seq += 1
+            commands.append(((t_ms - t0) / args.speed, origin_id, client,
+                             client.seq, action,
+                             amp_value(message.get("value"))))
+    commands.sort(key=lambda command: command[0])
+    if skipped:
+        print(f"skipped {skipped} messages the driver doesn't handle")
+    print(f"replaying {len(clients)} recorded clients x {args.clients} "
+          f"at {args.speed}x through {args.host_replay}")
+    lines = "".join(f"{due:.0f} {origin_id} {client.client_id} {seq} "
+                    f"{action} {value}\n"
+                    for due, origin_id, client, seq, action, value in commands)
+    process = subprocess.run(
+        [args.host_replay, str(int(args.timeout * 1000))], input=lines,
+        capture_output=True, text=True)
+    end = 0
+    for line in process.stdout.splitlines():
+        fields = line.split()
+        if not fields or fields[0] not in ("sent", "acks"):
+            print(line)
+            continue
+        now = int(fields[1]) / 1e6
+        end = max(end, now)
+        if fields[0] == "sent":
+            _, _, client, seq, action, _ = commands[int(fields[2]) - 1]
+            client.track(action, seq, now)
+            stats.sent += 1
+            if fields[3] != "queued":
+                client.on_result({"action": action, "result": fields[3]})
+            continue
+        acks = {}
+        for ack in fields[3:]:
+            action, tag = ack.split("=")
+            acks[action] = [int(n) for n in tag.split(",")]
+        for client in replays:
+            client.on_state({"version": int(fields[2]), "acks": acks}, now)
+    if process.returncode:
+        print(process.stderr, file=sys.stderr, end="")
+        print(f"trace_replay failed with {process.returncode}",
+              file=sys.stderr)
+        return 1
+    for client in replays:
+        client.expire(float("inf"))
+    report(stats, end)
+    return 1 if stats.lost else 0
+
+
+async def replay(args):
+    clients, t0 = load_trace(args.trace)
+    stats = Stats()
+    url = f"ws://{args.host}/ws"
+    # Leaves time to connect, all clients start replaying together.
+    start = time.monotonic() + 1
+    replays = [
+        Client(stats, entries, start, t0, args.speed, args.timeout)
+        for _ in range(args.clients) for entries in clients.values()
+    ]
+    print(f"replaying {len(clients)} recorded clients x {args.clients} "
+          f"at {args.speed}x against {url}")
+    results = await asyncio.gather(*(c.run(url) for c in replays),
+                                   return_exceptions=True)
+    failed = [r for r in results if isinstance(r, Exception)]
+    for error in failed:
+        print(f"client failed: {error!r}", file=sys.stderr)
+    report(stats, time.monotonic() - start)
+    return 1 if failed or stats.lost else 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("trace", help="JSON lines from /ws/trace")
+    parser.add_argument("--host", default="amp.local")
+    parser.add_argument("--host-replay", metavar="TRACE_REPLAY",
+                        help="host_test's trace_replay binary, replays "
+                        "without an amp")
+    parser.add_argument("--speed", type=float, default=1,
+                        help="1 to 100 times the recorded pace")
+    parser.add_argument("--clients", type=int, default=1,
+                        help="copies of the recorded clients to run at once")
+    parser.add_argument("--timeout", type=float, default=5,
+                        help="seconds until an unanswered command is lost")
+    args = parser.parse_args()
+    if not 1 <= args.speed <= 100:
+        parser.error("--speed must be between 1 and 100")
+    if args.host_replay:
+        return host_replay(args)
+    if websockets is None:
+        parser.error("replaying against an amp needs: pip install websockets")
+    return asyncio.run(replay(args))
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,255 @@
+#!/usr/bin/env python3
+"""Soaks the WebSocket and HTTP server of the firmware with commands.
+
+Runs control clients and read-only subscribers against an amp for a long
+time and polls /metrics, here for an hour:
+
+    pip install websockets
+    tools/ws_soak.py --host amp.local --duration 3600
+
+Each control client sends set_volume at --rate, alternating between the
+amp's volume and 1 dB less, and restores it at the end. Unplug the amp's USB
+cable for a while during the run to stall the USB side: commands are then
+answered with deferred or busy, and the server has to stay responsive. The
+run fails if:
+
+  lost        a command got neither an ack nor a command_result in --timeout
+  metrics     /metrics failed or took longer than --max-metrics-ms
+  frame pool  frame_pool_misses grew after --warmup
+  heap        min_free_heap dropped by more than --heap-slack bytes after
+              --warmup, memory leaks or fragments
+  disconnect  a client lost its connection
+"""
+
+import argparse
+import asyncio
+import json
+import random
+import sys
+import time
+import urllib.request
+
+import websockets
+
+
+class Stats:
+    def __init__(self):
+        self.sent = 0
+        self.acked = 0
+        self.superseded = 0
+        self.lost = 0
+        self.results = {}
+        self.states = 0
+        # (seconds into the run, ms to answer, memory of /metrics or None)
+        self.samples = []
+
+
+class ControlClient:
+    def __init__(self, stats, args, stop_at):
+        self.stats = stats
+        self.args = args
+        self.stop_at = stop_at
+        self.client_id = random.randint(1, 0xFFFFFFFE)
+        self.seq = 0
+        # [(seq, sent at, ack when sent)], oldest first.
+        self.pending = []
+        self.ack = None
+        self.volume = None
+        self.got_state = asyncio.Event()
+
+    def on_state(self, amp_state):
+        if self.volume is None and "volume_db" in amp_state:
+            self.volume = round(amp_state["volume_db"])
+        ack = amp_state.get("acks", {}).get("set_volume")
+        if ack is None or ack == self.ack:
+            return
+        self.ack = ack
+        client, seq = ack
+        if client == self.client_id:
+            while self.pending and self.pending[0][0] <= seq:
+                self.pending.pop(0)
+                self.stats.acked += 1
+            return
+        # Another client's command came after the waiting ones.
+        while self.pending and self.pending[0][2] != ack:
+            self.pending.pop(0)
+            self.stats.superseded += 1
+
+    def on_result(self, result):
+        # Busy replies of a full work queue don't name the action.
+        if self.pending:
+            self.pending.pop()
+        name = result.get("result", "unknown")
+        self.stats.results[name] = self.stats.results.get(name, 0) + 1
+
+    async def receive(self, ws):
+        async for text in ws:
+            try:
+                message = json.loads(text)
+            except ValueError:
+                continue
+            if "amp_state" in message:
+                self.on_state(message["amp_state"])
+                self.got_state.set()
+            if "command_result" in message:
+                self.on_result(message["command_result"])
+
+    def expire(self, now):
+        while self.pending and now - self.pending[0][1] > self.args.timeout:
+            self.pending.pop(0)
+            self.stats.lost += 1
+
+    async def send_volume(self, ws, value):
+        self.seq += 1
+        self.pending.append((self.seq, time.monotonic(), self.ack))
+        await ws.send(json.dumps({"action": "set_volume", "value": value,
+                                  "client": self.client_id,
+                                  "seq": self.seq}))
+        self.stats.sent += 1
+
+    async def run(self, url):
+        async with websockets.connect(url) as ws:
+            receiver = asyncio.create_task(self.receive(ws))
+            await ws.send(json.dumps({"action": "get_state", "value": 0}))
+            await asyncio.wait_for(self.got_state.wait(), self.args.timeout)
+            volume = self.volume if self.volume is not None else -40
+            values = (volume, max(volume - 1, -99))
+            while time.monotonic() < self.stop_at:
+                await self.send_volume(ws, values[self.seq % 2])
+                self.expire(time.monotonic())
+                await asyncio.sleep(1 / self.args.rate)
+            await self.send_volume(ws, volume)
+            # Give the last commands time to be answered.
+            deadline = time.monotonic() + self.args.timeout
+            while self.pending and time.monotonic() < deadline:
+                await asyncio.sleep(0.05)
+            self.expire(float("inf"))
+            receiver.cancel()
+
+
+async def subscribe(stats, url, stop_at, timeout):
+    async with websockets.connect(url) as ws:
+        await ws.send(json.dumps({"action": "get_state", "value": 0}))
+        while time.monotonic() < stop_at:
+            try:
+                text = await asyncio.wait_for(ws.recv(), timeout)
+            except asyncio.TimeoutError:
+                # Nothing changed, the pings keep the connection.
+                continue
+            if "amp_state" in text:
+                stats.states += 1
+
+
+def fetch_metrics(url, timeout):
+    with urllib.request.urlopen(url, timeout=timeout) as response:
+        return json.load(response)
+
+
+async def poll_metrics(stats, args, start, stop_at):
+    url = f"http://{args.host}/metrics"
+    while time.monotonic() < stop_at:
+        t = time.monotonic()
+        try:
+            metrics = await asyncio.to_thread(fetch_metrics, url,
+                                              args.max_metrics_ms / 1000 * 5)
+            memory = metrics["memory"]
+        except Exception as error:
+            print(f"metrics failed: {error!r}", file=sys.stderr)
+            memory = None
+        ms = (time.monotonic() - t) * 1000
+        stats.samples.append((t - start, ms, memory))
+        if memory is not None:
+            print(f"{t - start:7.0f} s  metrics {ms:5.0f} ms  "
+                  f"free {memory['free_heap']}  "
+                  f"min free {memory['min_free_heap']}  "
+                  f"frame pool misses {memory['frame_pool_misses']}  "
+                  f"sent {stats.sent}  lost {stats.lost}")
+        await asyncio.sleep(max(0, t + args.poll - time.monotonic()))
+
+
+def check(stats, args):
+    """Returns the reasons the run failed."""
+    failures = []
+    if stats.lost:
+        failures.append(f"{stats.lost} commands lost")
+    slow = [s for s in stats.samples if s[2] is None
+            or s[1] > args.max_metrics_ms]
+    if slow:
+        failures.append(f"/metrics failed or slow {len(slow)} times, "
+                        f"max {max(s[1] for s in slow):.0f} ms")
+    after = [s[2] for s in stats.samples
+             if s[0] >= args.warmup and s[2] is not None]
+    if len(after) < 2:
+        failures.append("too few /metrics samples after the warmup")
+        return failures
+    misses = after[-1]["frame_pool_misses"] - after[0]["frame_pool_misses"]
+    if misses:
+        failures.append(f"frame pool missed {misses} times after the warmup")
+    heap_drop = after[0]["min_free_heap"] - after[-1]["min_free_heap"]
+    if heap_drop > args.heap_slack:
+        failures.append(f"min free heap dropped {heap_drop} bytes after the "
+                        f"warmup")
+    return failures
+
+
+async def soak(args):
+    start = time.monotonic()
+    stop_at = start + args.duration
+    stats = Stats()
+    controls = [ControlClient(stats, args, stop_at)
+                for _ in range(args.clients)]
+    print(f"{args.clients} control clients at {args.rate} commands/s and "
+          f"{args.subscribers} subscribers for {args.duration} s against "
+          f"{args.host}")
+    tasks = [c.run(f"ws://{args.host}/ws") for c in controls]
+    tasks += [subscribe(stats, f"ws://{args.host}/ws/subscribe", stop_at,
+                        args.timeout) for _ in range(args.subscribers)]
+    tasks.append(poll_metrics(stats, args, start, stop_at))
+    results = await asyncio.gather(*tasks, return_exceptions=True)
+    failures = check(stats, args)
+    disconnects = [r for r in results if isinstance(r, Exception)]
+    for error in disconnects:
+        print(f"client failed: {error!r}", file=sys.stderr)
+    if disconnects:
+        failures.append(f"{len(disconnects)} clients disconnected")
+
+    answered = ", ".join(f"{name} {count}"
+                         for name, count in sorted(stats.results.items()))
+    print(f"sent {stats.sent}, acked {stats.acked}, superseded "
+          f"{stats.superseded}, lost {stats.lost}"
+          + (f", answered {answered}" if answered else ""))
+    print(f"subscribers got {stats.states} states")
+    for failure in failures:
+        print(f"FAIL {failure}")
+    print("PASS" if not failures else "FAILED")
+    return 1 if failures else 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--host", default="amp.local")
+    parser.add_argument("--duration", type=float, default=1800,
+                        help="seconds to run")
+    parser.add_argument("--clients", type=int, default=4,
+                        help="control clients, the firmware accepts 7")
+    parser.add_argument("--subscribers", type=int, default=8)
+    parser.add_argument("--rate", type=float, default=10,
+                        help="commands/s per control client, 20 are allowed")
+    parser.add_argument("--timeout", type=float, default=5,
+                        help="seconds until an unanswered command is lost")
+    parser.add_argument("--poll", type=float, default=10,
+                        help="seconds between /metrics requests")
+    parser.add_argument("--warmup", type=float, default=120,
+                        help="seconds before heap and frame pool must be "
+                             "stable")
+    parser.add_argument("--max-metrics-ms", type=float, default=1000)
+    parser.add_argument("--heap-slack", type=int, default=4096,
+                        help="bytes min_free_heap may drop after the warmup")
+    args = parser.parse_args()
+    if args.duration <= args.warmup + 2 * args.poll:
+        parser.error("--duration must leave two polls after the warmup")
+    return asyncio.run(soak(args))
+
+
+if __name__ == "__main__":
+    sys.exit(main())